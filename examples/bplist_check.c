@@ -0,0 +1,276 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+// Copyright 2012 Google Inc. wrightt@google.com
+
+//
+// Checks that our bplist_writer writes the same bytes as libplist's
+// plist_to_bin, for the _rpc_forwardSocketData: dict that rpc writes and
+// the WIRFinalMessageKey and WIRPartialMessageKey dicts that webinspector
+// wraps it in, i.e. the packets that we send to the device.
+//
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <plist/plist.h>
+
+#include "ios-webkit-debug-proxy/webinspector.h"
+#include "rpc.h"
+
+#ifndef LIBPLIST_VERSION
+#define LIBPLIST_VERSION "unknown"
+#endif
+
+// As in webinspector.c, the max length of an rpc plist per packet
+#define MAX_RPC_LEN (8096 - 500)
+
+#define MAX_PACKETS 64
+
+static const size_t data_lengths[] = {0, 1, 14, 15, 255, 256, 7000,
+    MAX_RPC_LEN - 200, MAX_RPC_LEN, MAX_RPC_LEN + 1, 16000, 65535, 65536,
+    100000};
+
+static const uint32_t page_ids[] = {0, 1, 255, 256, 65535, 65536,
+    0xFFFFFFFF};
+
+// connection_id, app_id and sender_id, where equal strings are written once
+static const char *ids[][3] = {
+  {"4B2550E4-13D6-4902-A48E-B45D5B23215B", "com.apple.mobilesafari",
+    "C1EAD225-D6BC-44B9-9089-2D7CC2D2204C"},
+  {"4B2550E4-13D6-4902-A48E-B45D5B23215B", "PID:1",
+    "4B2550E4-13D6-4902-A48E-B45D5B23215B"},
+  {"", "WIRSenderKey", "_rpc_forwardSocketData:"},
+};
+
+struct my_packets {
+  char *packets[MAX_PACKETS];
+  size_t lengths[MAX_PACKETS];
+  size_t num_packets;
+};
+typedef struct my_packets *my_packets_t;
+
+void my_packets_clear(my_packets_t self) {
+  size_t i;
+  for (i = 0; i < self->num_packets; i++) {
+    free(self->packets[i]);
+  }
+  self->num_packets = 0;
+}
+
+int my_packets_add(my_packets_t self, const char *packet, size_t length) {
+  if (self->num_packets >= MAX_PACKETS) {
+    return -1;
+  }
+  char *copy = (char *)malloc(length);
+  if (!copy) {
+    return -1;
+  }
+  memcpy(copy, packet, length);
+  self->packets[self->num_packets] = copy;
+  self->lengths[self->num_packets++] = length;
+  return 0;
+}
+
+// Adds a bplist's packet, i.e. its 4-byte length then its bytes.
+int my_packets_add_bin(my_packets_t self, const char *bin, size_t length) {
+  char *packet = (char *)malloc(length + 4);
+  if (!packet) {
+    return -1;
+  }
+  packet[0] = ((length >> 24) & 0xFF);
+  packet[1] = ((length >> 16) & 0xFF);
+  packet[2] = ((length >> 8) & 0xFF);
+  packet[3] = (length & 0xFF);
+  memcpy(packet + 4, bin, length);
+  int ret = my_packets_add(self, packet, length + 4);
+  free(packet);
+  return ret;
+}
+
+// Adds what libplist alone would send for an rpc plist, i.e. the plist, or
+// its chunks, each wrapped in a plist.
+int my_packets_add_rpc_bin(my_packets_t self, const char *rpc_bin,
+    size_t rpc_len, bool partials_supported) {
+  if (!partials_supported) {
+    return my_packets_add_bin(self, rpc_bin, rpc_len);
+  }
+  size_t i;
+  for (i = 0; ; i += MAX_RPC_LEN) {
+    bool is_partial = (rpc_len - i > MAX_RPC_LEN);
+    plist_t wrapper = plist_new_dict();
+    plist_dict_set_item(wrapper,
+        (is_partial ? "WIRPartialMessageKey" : "WIRFinalMessageKey"),
+        plist_new_data(rpc_bin + i,
+          (is_partial ? MAX_RPC_LEN : rpc_len - i)));
+    char *bin = NULL;
+    uint32_t length = 0;
+    plist_to_bin(wrapper, &bin, &length);
+    plist_free(wrapper);
+    int ret = (bin ? my_packets_add_bin(self, bin, length) : -1);
+    free(bin);
+    if (ret || !is_partial) {
+      return ret;
+    }
+  }
+}
+
+// @result the index of the first packet that differs, or -1 if none do
+int my_packets_compare(my_packets_t self, my_packets_t other) {
+  size_t i;
+  for (i = 0; i < self->num_packets && i < other->num_packets; i++) {
+    if (self->lengths[i] != other->lengths[i] ||
+        memcmp(self->packets[i], other->packets[i], self->lengths[i])) {
+      return i;
+    }
+  }
+  return (self->num_packets == other->num_packets ? -1 : i);
+}
+
+//
+// rpc and wi callbacks:
+//
+
+// our state
+struct my_check_struct {
+  bool partials_supported;
+  wi_t wi;
+  // libplist's packets, and ours via rpc's send_bin and wi's send_plist
+  struct my_packets expected;
+  struct my_packets via_bin;
+  struct my_packets via_plist;
+  my_packets_t to_packets;
+};
+typedef struct my_check_struct *my_check_t;
+
+wi_status my_send_packet(wi_t wi, const char *packet, size_t length) {
+  my_check_t my = (my_check_t)wi->state;
+  return (my_packets_add(my->to_packets, packet, length) ? WI_ERROR :
+      WI_SUCCESS);
+}
+
+rpc_status my_send_bin(rpc_t rpc, char *buf, size_t length) {
+  my_check_t my = (my_check_t)rpc->state;
+  my->to_packets = &my->via_bin;
+  return (my->wi->send_bin(my->wi, buf, length) ? RPC_ERROR : RPC_SUCCESS);
+}
+
+// Called if there's no send_bin, i.e. with libplist's rpc_dict
+rpc_status my_send_plist(rpc_t rpc, plist_t rpc_dict) {
+  my_check_t my = (my_check_t)rpc->state;
+  char *rpc_bin = NULL;
+  uint32_t rpc_len = 0;
+  plist_to_bin(rpc_dict, &rpc_bin, &rpc_len);
+  if (!rpc_bin || my_packets_add_rpc_bin(&my->expected, rpc_bin, rpc_len,
+        my->partials_supported)) {
+    free(rpc_bin);
+    return RPC_ERROR;
+  }
+  free(rpc_bin);
+  my->to_packets = &my->via_plist;
+  return (my->wi->send_plist(my->wi, rpc_dict) ? RPC_ERROR : RPC_SUCCESS);
+}
+
+//
+// Main:
+//
+
+// @result 0 if our packets match libplist's, else -1
+int my_check(my_check_t my, rpc_t bin_rpc, rpc_t plist_rpc,
+    const char **id, uint32_t page_id, const char *data, size_t length) {
+  my_packets_clear(&my->expected);
+  my_packets_clear(&my->via_bin);
+  my_packets_clear(&my->via_plist);
+  if (bin_rpc->send_forwardSocketData(bin_rpc, id[0], id[1], page_id,
+        id[2], data, length) ||
+      plist_rpc->send_forwardSocketData(plist_rpc, id[0], id[1], page_id,
+        id[2], data, length)) {
+    fprintf(stderr, "Send failed\n");
+    return -1;
+  }
+  int i = my_packets_compare(&my->expected, &my->via_bin);
+  const char *name = "send_bin";
+  if (i < 0) {
+    i = my_packets_compare(&my->expected, &my->via_plist);
+    name = "send_plist";
+  }
+  if (i >= 0) {
+    fprintf(stderr, "%s packet %d differs from libplist's, for ids "
+        "\"%s\" \"%s\" \"%s\", page %u, %zd bytes of data, partials %s\n",
+        name, i, id[0], id[1], id[2], page_id, length,
+        (my->partials_supported ? "on" : "off"));
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  size_t max_length = 0;
+  size_t i;
+  for (i = 0; i < sizeof(data_lengths) / sizeof(data_lengths[0]); i++) {
+    max_length = (max_length < data_lengths[i] ? data_lengths[i] :
+        max_length);
+  }
+  char *data = (char *)malloc(max_length);
+  struct my_check_struct my;
+  memset(&my, 0, sizeof(my));
+  rpc_t bin_rpc = rpc_new();
+  rpc_t plist_rpc = rpc_new();
+  if (!data || !bin_rpc || !plist_rpc) {
+    return 1;
+  }
+  // any bytes, e.g. a deflated frame
+  for (i = 0; i < max_length; i++) {
+    data[i] = (char)(i * 2654435761u >> 24);
+  }
+  bin_rpc->state = &my;
+  bin_rpc->send_bin = my_send_bin;
+  bin_rpc->send_plist = my_send_plist;
+  bin_rpc->bin_head_length = WI_BIN_HEAD_LENGTH;
+  bin_rpc->bin_tail_length = WI_BIN_TAIL_LENGTH;
+  plist_rpc->state = &my;
+  plist_rpc->send_plist = my_send_plist;
+
+  int ret = 0;
+  size_t num_checks = 0;
+  int partials;
+  for (partials = 0; partials < 2 && !ret; partials++) {
+    my.partials_supported = partials;
+    my.wi = wi_new(partials);
+    if (!my.wi) {
+      ret = 1;
+      break;
+    }
+    my.wi->state = &my;
+    my.wi->send_packet = my_send_packet;
+    size_t j, k;
+    for (i = 0; i < sizeof(ids) / sizeof(ids[0]) && !ret; i++) {
+      for (j = 0; j < sizeof(page_ids) / sizeof(page_ids[0]) && !ret; j++) {
+        for (k = 0; k < sizeof(data_lengths) / sizeof(data_lengths[0]) &&
+            !ret; k++) {
+          ret = (my_check(&my, bin_rpc, plist_rpc, ids[i], page_ids[j],
+                data, data_lengths[k]) ? 1 : 0);
+          num_checks++;
+        }
+      }
+    }
+    wi_free(my.wi);
+  }
+  if (!ret) {
+    // e.g. in test-suite.log, since the layout that we match is libplist's
+    printf("%zd messages match libplist %s\n", num_checks,
+        LIBPLIST_VERSION);
+  }
+  my_packets_clear(&my.expected);
+  my_packets_clear(&my.via_bin);
+  my_packets_clear(&my.via_plist);
+  rpc_free(bin_rpc);
+  rpc_free(plist_rpc);
+  free(data);
+  return ret;
+}
@@ -0,0 +1,154 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+// Copyright 2012 Google Inc. wrightt@google.com
+
+//
+// A hash_table benchmark: ns per put, get and remove+put, for int and
+// string keys, at 10 to 100k entries, e.g.:
+//   ./ht_bench
+//   ./ht_bench 1000 50000
+//
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash_table.h"
+
+// Secs per row
+#define RUN_SECS 0.3
+
+// Max gets per round
+#define MAX_GETS 2000
+
+static int default_sizes[] = {10, 100, 1000, 10000, 100000, 0};
+
+static volatile void *sink;
+
+double my_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// @param keys 2n keys, the first n of which are put
+int my_run(bool is_str, int n, void **keys) {
+  double put_secs = 0;
+  double hit_secs = 0;
+  double miss_secs = 0;
+  double churn_secs = 0;
+  long num_puts = 0;
+  long num_gets = 0;
+  long num_churns = 0;
+  int m = (n < MAX_GETS ? n : MAX_GETS);
+  double start = my_now();
+  while (my_now() - start < RUN_SECS) {
+    ht_t ht = ht_new(is_str ? HT_STRING_KEYS : HT_INT_KEYS);
+    if (!ht) {
+      return -1;
+    }
+    int i;
+    int r;
+    double t0 = my_now();
+    for (i = 0; i < n; i++) {
+      ht_put(ht, keys[i], keys[i]);
+    }
+    double t1 = my_now();
+    // stride through the keys, so we don't just walk the table in order
+    for (r = 0; r < 4; r++) {
+      for (i = 0; i < m; i++) {
+        sink = ht_get_value(ht, keys[(i * 7919) % n]);
+      }
+    }
+    double t2 = my_now();
+    for (r = 0; r < 4; r++) {
+      for (i = 0; i < m; i++) {
+        sink = ht_get_value(ht, keys[n + (i * 7919) % n]);
+      }
+    }
+    double t3 = my_now();
+    for (i = 0; i < m; i++) {
+      void *key = keys[(i * 7919) % n];
+      ht_remove(ht, key);
+      ht_put(ht, key, key);
+    }
+    double t4 = my_now();
+    if (ht_size(ht) != (size_t)n) {
+      fprintf(stderr, "Expecting %d entries, not %zd\n", n, ht_size(ht));
+      ht_free(ht);
+      return -1;
+    }
+    ht_free(ht);
+    put_secs += t1 - t0;
+    hit_secs += t2 - t1;
+    miss_secs += t3 - t2;
+    churn_secs += t4 - t3;
+    num_puts += n;
+    num_gets += 4 * m;
+    num_churns += m;
+  }
+  printf("%-4s %7d %10.1f %10.1f %10.1f %10.1f\n", (is_str ? "str" : "int"),
+      n, put_secs / num_puts * 1e9, hit_secs / num_gets * 1e9,
+      miss_secs / num_gets * 1e9, churn_secs / num_churns * 1e9);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int *sizes = default_sizes;
+  if (argc > 1) {
+    sizes = (int *)calloc(argc, sizeof(int));
+    if (!sizes) {
+      return 1;
+    }
+    int i;
+    for (i = 1; i < argc; i++) {
+      sizes[i - 1] = atoi(argv[i]);
+    }
+  }
+  printf("%-4s %7s %10s %10s %10s %10s\n", "key", "n", "put ns", "hit ns",
+      "miss ns", "rm+put ns");
+  int ret = 0;
+  int is_str;
+  for (is_str = 0; is_str < 2 && !ret; is_str++) {
+    int *n;
+    for (n = sizes; *n > 0 && !ret; n++) {
+      void **keys = (void **)calloc(2 * *n, sizeof(void *));
+      if (!keys) {
+        ret = 1;
+        break;
+      }
+      int i;
+      for (i = 0; i < 2 * *n; i++) {
+        if (is_str) {
+          // like our device ids, which share no common prefix
+          char *key = (char *)malloc(48);
+          if (key) {
+            snprintf(key, 48, "%08x%032x", i * 2654435761u, i);
+          }
+          keys[i] = key;
+          ret = (key ? ret : 1);
+        } else {
+          // like our fds and page nums, which are sequential
+          keys[i] = (void *)(intptr_t)(i + 3);
+        }
+      }
+      if (!ret && my_run(is_str, *n, keys)) {
+        ret = 1;
+      }
+      for (i = 0; is_str && i < 2 * *n; i++) {
+        free(keys[i]);
+      }
+      free(keys);
+    }
+  }
+  if (sizes != default_sizes) {
+    free(sizes);
+  }
+  return ret;
+}
@@ -0,0 +1,124 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+// Copyright 2012 Google Inc. wrightt@google.com
+
+//
+// An rpc benchmark: _rpc_forwardSocketData: messages per second, from
+// rpc->send_forwardSocketData to a serialized packet with a no-op send, on
+// current and partial-capable devices, at typical CDP message sizes, e.g.:
+//   ./rpc_bench
+//   ./rpc_bench 100 20000
+//
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ios-webkit-debug-proxy/webinspector.h"
+#include "rpc.h"
+
+// Secs per row
+#define RUN_SECS 0.5
+
+static int default_sizes[] = {64, 256, 1024, 4096, 16384, 65536, 0};
+
+static size_t sent_length;
+
+double my_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+wi_status my_send_packet(wi_t wi, const char *packet, size_t length) {
+  sent_length += length;
+  return WI_SUCCESS;
+}
+
+rpc_status my_send_plist(rpc_t rpc, plist_t rpc_dict) {
+  wi_t wi = (wi_t)rpc->state;
+  return wi->send_plist(wi, rpc_dict);
+}
+
+rpc_status my_send_bin(rpc_t rpc, char *buf, size_t length) {
+  wi_t wi = (wi_t)rpc->state;
+  return wi->send_bin(wi, buf, length);
+}
+
+// @result msgs/s, or a negative number on error
+double my_run(bool partials_supported, size_t size) {
+  rpc_t rpc = rpc_new();
+  wi_t wi = wi_new(partials_supported);
+  char *data = (char *)malloc(size ? size : 1);
+  double ret = -1;
+  if (rpc && wi && data) {
+    wi->send_packet = my_send_packet;
+    rpc->state = wi;
+    rpc->send_plist = my_send_plist;
+    rpc->send_bin = my_send_bin;
+    rpc->bin_head_length = WI_BIN_HEAD_LENGTH;
+    rpc->bin_tail_length = WI_BIN_TAIL_LENGTH;
+    // a CDP message is JSON, i.e. ASCII
+    size_t i;
+    for (i = 0; i < size; i++) {
+      data[i] = 'a' + i % 26;
+    }
+    long num_msgs = 0;
+    double start = my_now();
+    double secs;
+    do {
+      for (i = 0; i < 100; i++) {
+        if (rpc->send_forwardSocketData(rpc,
+              "4B2550E4-13D6-4902-A48E-B45D5B23215B",
+              "com.apple.mobilesafari", 1,
+              "C1EAD225-D6BC-44B9-9089-2D7CC2D2204C", data, size)) {
+          break;
+        }
+      }
+      num_msgs += i;
+      secs = my_now() - start;
+    } while (i == 100 && secs < RUN_SECS);
+    ret = (i == 100 ? num_msgs / secs : -1);
+  }
+  free(data);
+  wi_free(wi);
+  rpc_free(rpc);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  int *sizes = default_sizes;
+  if (argc > 1) {
+    sizes = (int *)calloc(argc, sizeof(int));
+    if (!sizes) {
+      return 1;
+    }
+    int i;
+    for (i = 1; i < argc; i++) {
+      sizes[i - 1] = atoi(argv[i]);
+    }
+  }
+  printf("%8s %14s %14s\n", "payload", "current msgs/s",
+      "partial msgs/s");
+  int ret = 0;
+  int *size;
+  for (size = sizes; *size > 0; size++) {
+    double current = my_run(false, *size);
+    double partial = my_run(true, *size);
+    if (current < 0 || partial < 0) {
+      fprintf(stderr, "Send failed\n");
+      ret = 1;
+      break;
+    }
+    printf("%8d %14.0f %14.0f\n", *size, current, partial);
+  }
+  if (sizes != default_sizes) {
+    free(sizes);
+  }
+  return ret;
+}
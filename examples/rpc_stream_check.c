@@ -0,0 +1,441 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+// Copyright 2012 Google Inc. wrightt@google.com
+
+//
+// Fuzzes the receipt of _rpc_applicationSentData: messages, i.e. wi's
+// partial message reassembly, rpc's recv_partial streaming and its head
+// scan, recv_bin's gap check and bplist_reader, with random valid,
+// corrupted and truncated messages that arrive in random chunks.  Checks
+// that each valid message's data is received as sent, and that corrupted
+// ones are either rejected or, if they were streamed, aborted, e.g.:
+//   ./rpc_stream_check
+//   ./rpc_stream_check 5000 42
+//
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ios-webkit-debug-proxy/webinspector.h"
+#include "bplist_reader.h"
+#include "bplist_writer.h"
+#include "rpc.h"
+
+#define DEFAULT_NUM_MESSAGES 1000
+#define MAX_PARTS 20
+#define MAX_ID_LENGTH 64
+// more than the rest of an rpc_dict
+#define MAX_RPC_OVERHEAD 4096
+
+static const size_t data_lengths[] = {0, 1, 100, 5000, 20000, 100000};
+
+static uint64_t rand_state;
+
+uint32_t my_rand(uint32_t n) {
+  // xorshift64*, so runs are repeatable for a given seed
+  rand_state ^= rand_state >> 12;
+  rand_state ^= rand_state << 25;
+  rand_state ^= rand_state >> 27;
+  return (uint32_t)((rand_state * 2685821657736338717ULL) >> 32) % n;
+}
+
+// Writes a plist's packet, i.e. its 4-byte length then its bytes.
+// @result the packet, which the caller must free, or NULL
+char *my_write_packet(const struct bpw_node *nodes, size_t num_nodes,
+    size_t *to_length) {
+  struct bpw_plan plan;
+  if (bpw_plan(&plan, nodes, num_nodes)) {
+    return NULL;
+  }
+  char *packet = (char *)malloc(plan.length + 4);
+  if (packet) {
+    packet[0] = ((plan.length >> 24) & 0xFF);
+    packet[1] = ((plan.length >> 16) & 0xFF);
+    packet[2] = ((plan.length >> 8) & 0xFF);
+    packet[3] = (plan.length & 0xFF);
+    bpw_write(&plan, packet + 4);
+    *to_length = plan.length + 4;
+  }
+  return packet;
+}
+
+//
+// rpc and wi callbacks:
+//
+
+// our state, for the current message
+struct my_check_struct {
+  rpc_t rpc;
+  char app_id[MAX_ID_LENGTH];
+  char dest_id[MAX_ID_LENGTH];
+  char *data;  // that we've received
+  size_t length;
+  size_t max_length;  // i.e. the rpc_dict's length
+  bool is_fin;
+  bool is_streamed;  // by recv_partial
+  int num_messages;
+  int num_aborts;
+  int num_chunks;
+};
+typedef struct my_check_struct *my_check_t;
+
+rpc_status my_on_data(rpc_t rpc, const char *app_id, const char *dest_id,
+    bool is_fin, const char *data, size_t length) {
+  my_check_t my = (my_check_t)rpc->state;
+  if (my->is_fin || my->length + length > my->max_length) {
+    // more than we sent
+    my->num_messages = -1;
+    return RPC_ERROR;
+  }
+  if (!my->length) {
+    snprintf(my->app_id, MAX_ID_LENGTH, "%s", app_id);
+    snprintf(my->dest_id, MAX_ID_LENGTH, "%s", dest_id);
+  }
+  memcpy(my->data + my->length, data, length);
+  my->length += length;
+  my->is_fin = is_fin;
+  my->num_messages += is_fin;
+  return RPC_SUCCESS;
+}
+
+rpc_status my_on_applicationSentData(rpc_t rpc, const char *app_id,
+    const char *dest_id, const char *data, size_t length) {
+  return my_on_data(rpc, app_id, dest_id, true, data, length);
+}
+
+rpc_status my_on_applicationSentDataChunk(rpc_t rpc, const char *app_id,
+    const char *dest_id, bool is_fin, const char *data, size_t length) {
+  my_check_t my = (my_check_t)rpc->state;
+  my->num_chunks++;
+  return my_on_data(rpc, app_id, dest_id, is_fin, data, length);
+}
+
+rpc_status my_on_applicationSentDataAbort(rpc_t rpc, const char *app_id,
+    const char *dest_id) {
+  my_check_t my = (my_check_t)rpc->state;
+  my->num_aborts++;
+  return RPC_SUCCESS;
+}
+
+rpc_status my_rpc_on_error(rpc_t rpc, const char *format, ...) {
+  return RPC_ERROR;
+}
+
+wi_status my_wi_on_error(wi_t wi, const char *format, ...) {
+  return WI_ERROR;
+}
+
+wi_status my_recv_plist(wi_t wi, const plist_t rpc_dict) {
+  my_check_t my = (my_check_t)wi->state;
+  return my->rpc->recv_plist(my->rpc, rpc_dict);
+}
+
+wi_status my_recv_bin(wi_t wi, const char *const *segments,
+    const size_t *segment_lengths, size_t num_segments) {
+  my_check_t my = (my_check_t)wi->state;
+  return my->rpc->recv_bin(my->rpc, segments, segment_lengths,
+      num_segments);
+}
+
+wi_status my_recv_partial(wi_t wi, size_t rpc_offset, const char *rpc_bin,
+    size_t length, size_t *to_skip_offset, size_t *to_skip_length) {
+  my_check_t my = (my_check_t)wi->state;
+  rpc_status ret = my->rpc->recv_partial(my->rpc, rpc_offset, rpc_bin,
+      length, to_skip_offset, to_skip_length);
+  my->is_streamed |= (*to_skip_length > 0);
+  return ret;
+}
+
+//
+// Main:
+//
+
+// Writes a random _rpc_applicationSentData: rpc_dict, with its entries in
+// a random order, e.g. its app_id before or after its data.
+// @result the rpc_dict, which the caller must free, or NULL
+char *my_write_rpc(const char *app_id, const char *dest_id,
+    const char *data, size_t length, size_t *to_length) {
+  struct bpw_node args[4][2] = {
+    {BPW_KEY_NODE("WIRApplicationIdentifierKey"),
+      {BPW_STRING, app_id, strlen(app_id), 0}},
+    {BPW_KEY_NODE("WIRDestinationKey"),
+      {BPW_STRING, dest_id, strlen(dest_id), 0}},
+    {BPW_KEY_NODE("WIRMessageDataKey"), {BPW_DATA, data, length, 0}},
+    {BPW_KEY_NODE("WIRSenderKey"),
+      {BPW_STRING, "C1EAD225-D6BC-44B9-9089-2D7CC2D2204C",
+        my_rand(37), 0}},
+  };
+  size_t num_args = 3 + my_rand(2);
+  size_t order[4] = {0, 1, 2, 3};
+  size_t i;
+  for (i = num_args - 1; i > 0; i--) {
+    size_t j = my_rand(i + 1);
+    size_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+  struct bpw_node nodes[3 + 2 * 4 + 2];
+  size_t num_nodes = 0;
+  bool is_selector_first = my_rand(2);
+  nodes[num_nodes++] = (struct bpw_node){BPW_DICT, NULL, 2, 0};
+  for (i = 0; i < 2; i++) {
+    if (is_selector_first == !i) {
+      nodes[num_nodes++] = (struct bpw_node)BPW_KEY_NODE("__selector");
+      nodes[num_nodes++] = (struct bpw_node){BPW_STRING,
+        "_rpc_applicationSentData:", 25, 0};
+      continue;
+    }
+    nodes[num_nodes++] = (struct bpw_node)BPW_KEY_NODE("__argument");
+    nodes[num_nodes++] = (struct bpw_node){BPW_DICT, NULL, num_args, 0};
+    size_t j;
+    for (j = 0; j < num_args; j++) {
+      nodes[num_nodes++] = args[order[j]][0];
+      nodes[num_nodes++] = args[order[j]][1];
+    }
+  }
+  struct bpw_plan plan;
+  if (bpw_plan(&plan, nodes, num_nodes)) {
+    return NULL;
+  }
+  char *rpc_bin = (char *)malloc(plan.length);
+  if (rpc_bin) {
+    bpw_write(&plan, rpc_bin);
+    *to_length = plan.length;
+  }
+  return rpc_bin;
+}
+
+// Reads a possibly corrupt _rpc_applicationSentData: rpc_dict on its own,
+// as the expected result of streaming it.
+// @result 0 if it's valid, else -1
+int my_read_rpc(const char *rpc_bin, size_t length, char *to_dest_id,
+    size_t *to_offset, size_t *to_length) {
+  struct bpr_plist plist;
+  char selector[32];
+  uint64_t index;
+  uint64_t args;
+  if (bpr_open(&plist, rpc_bin, length) ||
+      bpr_dict_get(&plist, plist.root, "__selector", &index) ||
+      bpr_copy_string(&plist, index, selector, sizeof(selector)) ||
+      strcmp(selector, "_rpc_applicationSentData:") ||
+      bpr_dict_get(&plist, plist.root, "__argument", &args) ||
+      bpr_dict_get(&plist, args, "WIRDestinationKey", &index) ||
+      bpr_copy_string(&plist, index, to_dest_id, MAX_ID_LENGTH - 1) ||
+      bpr_dict_get(&plist, args, "WIRMessageDataKey", &index) ||
+      bpr_get_data(&plist, index, to_offset, to_length)) {
+    return -1;
+  }
+  return 0;
+}
+
+// Corrupts or truncates the rpc_dict, mostly in its head, where we scan it
+// before it's complete.
+// @result the new length
+size_t my_corrupt(char *rpc_bin, size_t length) {
+  int n = 1 + my_rand(3);
+  int i;
+  for (i = 0; i < n && length > 1; i++) {
+    if (!my_rand(4)) {
+      length = 1 + my_rand(length - 1);
+    } else {
+      size_t j = my_rand(my_rand(10) < 7 && length > 120 ? 120 : length);
+      rpc_bin[j] = (char)my_rand(256);
+    }
+  }
+  return length;
+}
+
+// Sends the rpc_dict as partial messages, in random chunks, each of which
+// is copied so a read past its end is caught by e.g. ASan.
+// @result 0 if wi accepted it, else -1
+int my_send_rpc(wi_t wi, const char *rpc_bin, size_t length) {
+  size_t cuts[MAX_PARTS + 1];
+  size_t num_parts = 1 + my_rand(MAX_PARTS);
+  size_t i;
+  cuts[0] = 0;
+  for (i = 1; i < num_parts; i++) {
+    cuts[i] = my_rand(length + 1);
+  }
+  cuts[num_parts] = length;
+  for (i = 1; i < num_parts; i++) {
+    size_t j;
+    for (j = i; j > 1 && cuts[j - 1] > cuts[j]; j--) {
+      size_t tmp = cuts[j];
+      cuts[j] = cuts[j - 1];
+      cuts[j - 1] = tmp;
+    }
+  }
+  for (i = 0; i < num_parts; i++) {
+    bool is_final = (i + 1 == num_parts);
+    struct bpw_node nodes[] = {
+      {BPW_DICT, NULL, 1, 0},
+      (is_final ? (struct bpw_node)BPW_KEY_NODE("WIRFinalMessageKey") :
+       (struct bpw_node)BPW_KEY_NODE("WIRPartialMessageKey")),
+      {BPW_DATA, rpc_bin + cuts[i], cuts[i + 1] - cuts[i], 0},
+    };
+    size_t packet_length;
+    char *packet = my_write_packet(nodes, 3, &packet_length);
+    if (!packet) {
+      return -1;
+    }
+    size_t j;
+    size_t max_chunk = (my_rand(2) ? 7 : 20000);
+    int ret = 0;
+    for (j = 0; j < packet_length && !ret; ) {
+      size_t n = 1 + my_rand(max_chunk);
+      n = (n < packet_length - j ? n : packet_length - j);
+      char *chunk = (char *)malloc(n);
+      if (!chunk) {
+        ret = -1;
+        break;
+      }
+      memcpy(chunk, packet + j, n);
+      ret = (wi->on_recv(wi, chunk, n) ? -1 : 0);
+      free(chunk);
+      j += n;
+    }
+    free(packet);
+    if (ret) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// @result 0 if ok, else -1
+int my_check(my_check_t my, const char *data, bool is_corrupt) {
+  char app_id[MAX_ID_LENGTH];
+  char dest_id[MAX_ID_LENGTH];
+  snprintf(app_id, MAX_ID_LENGTH, "PID:%u", 1 + my_rand(999));
+  snprintf(dest_id, MAX_ID_LENGTH, "D%06u", my_rand(1000000));
+  size_t length = data_lengths[my_rand(sizeof(data_lengths) /
+      sizeof(data_lengths[0]))];
+  size_t rpc_length;
+  char *rpc_bin = my_write_rpc(app_id, dest_id, data, length, &rpc_length);
+  if (!rpc_bin) {
+    fprintf(stderr, "Write failed\n");
+    return -1;
+  }
+  char expected_dest_id[MAX_ID_LENGTH];
+  size_t expected_offset = 0;
+  size_t expected_length = 0;
+  int expected = 0;
+  if (is_corrupt) {
+    rpc_length = my_corrupt(rpc_bin, rpc_length);
+    expected = my_read_rpc(rpc_bin, rpc_length, expected_dest_id,
+        &expected_offset, &expected_length);
+  }
+
+  // a new wi per message, so a corrupt one doesn't affect the next
+  wi_t wi = wi_new(true);
+  if (!wi) {
+    free(rpc_bin);
+    return -1;
+  }
+  wi->state = my;
+  wi->recv_plist = my_recv_plist;
+  wi->recv_bin = my_recv_bin;
+  wi->recv_partial = (my_rand(4) ? my_recv_partial : NULL);
+  wi->on_error = my_wi_on_error;
+  my->length = 0;
+  my->max_length = rpc_length;
+  my->is_fin = false;
+  my->is_streamed = false;
+  my->num_messages = 0;
+  int num_aborts = my->num_aborts;
+  int ret = my_send_rpc(wi, rpc_bin, rpc_length);
+  wi_free(wi);
+
+  bool is_aborted = (my->num_aborts != num_aborts);
+  if (my->num_messages < 0) {
+    free(rpc_bin);
+    fprintf(stderr, "Received more data than the %zd byte rpc_dict\n",
+        my->max_length);
+    return -1;
+  }
+  if (is_corrupt) {
+    // a streamed message must be aborted if it turns out to be invalid,
+    // else it must be what the corrupt rpc_dict says, e.g. if the
+    // corruption was in its data
+    bool is_ok = (!my->is_streamed || (ret ? is_aborted : !is_aborted &&
+          my->is_fin && !expected && my->length == expected_length &&
+          !memcmp(my->data, rpc_bin + expected_offset, expected_length) &&
+          !strcmp(my->dest_id, expected_dest_id)));
+    free(rpc_bin);
+    if (!is_ok) {
+      fprintf(stderr, "Corrupt streamed message was %s, with %zd bytes "
+          "of data received\n", (ret ? "not aborted" : "accepted"),
+          my->length);
+      return -1;
+    }
+    return 0;
+  }
+  free(rpc_bin);
+  if (ret || is_aborted || my->num_messages != 1 || my->length != length ||
+      memcmp(my->data, data, length) || strcmp(my->dest_id, dest_id) ||
+      (*my->app_id && strcmp(my->app_id, app_id))) {
+    fprintf(stderr, "Message with %zd bytes of data to %s %s was "
+        "received as %d message(s) with %zd bytes to %s %s%s\n",
+        length, app_id, dest_id, my->num_messages, my->length,
+        my->app_id, my->dest_id, (is_aborted ? ", aborted" : ""));
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  long num_messages = (argc > 1 ? atol(argv[1]) : DEFAULT_NUM_MESSAGES);
+  rand_state = (argc > 2 ? strtoull(argv[2], NULL, 0) : 1);
+  rand_state = (rand_state ? rand_state : 1);
+  struct my_check_struct my;
+  memset(&my, 0, sizeof(my));
+  size_t max_length = 0;
+  size_t i;
+  for (i = 0; i < sizeof(data_lengths) / sizeof(data_lengths[0]); i++) {
+    max_length = (max_length < data_lengths[i] ? data_lengths[i] :
+        max_length);
+  }
+  // any bytes, e.g. a deflated frame
+  char *data = (char *)malloc(max_length);
+  my.data = (char *)malloc(max_length + MAX_RPC_OVERHEAD);
+  my.rpc = rpc_new();
+  if (!data || !my.data || !my.rpc || num_messages < 0) {
+    return 1;
+  }
+  for (i = 0; i < max_length; i++) {
+    data[i] = (char)(i * 2654435761u >> 24);
+  }
+  my.rpc->state = &my;
+  my.rpc->on_applicationSentData = my_on_applicationSentData;
+  my.rpc->on_applicationSentDataChunk = my_on_applicationSentDataChunk;
+  my.rpc->on_applicationSentDataAbort = my_on_applicationSentDataAbort;
+  my.rpc->on_error = my_rpc_on_error;
+
+  int ret = 0;
+  long num_corrupt = 0;
+  long j;
+  for (j = 0; j < num_messages && !ret; j++) {
+    bool is_corrupt = (my_rand(10) < 3);
+    num_corrupt += is_corrupt;
+    ret = (my_check(&my, data, is_corrupt) ? 1 : 0);
+  }
+  if (!ret && num_messages >= DEFAULT_NUM_MESSAGES && !my.num_aborts) {
+    // otherwise we're not testing the abort path
+    fprintf(stderr, "No streamed messages were aborted\n");
+    ret = 1;
+  }
+  if (!ret) {
+    printf("%ld messages, %ld corrupt, %d data chunks, %d aborted\n",
+        num_messages, num_corrupt, my.num_chunks, my.num_aborts);
+  }
+  rpc_free(my.rpc);
+  free(my.data);
+  free(data);
+  return ret;
+}
@@ -0,0 +1,135 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+// Copyright 2012 Google Inc. wrightt@google.com
+
+//
+// A socket_manager benchmark: the cost of one sm->select with N idle fds,
+// for each backend, e.g.:
+//   ./sm_bench
+//   ./sm_bench epoll 100 1000 10000
+//
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "ios-webkit-debug-proxy/socket_manager.h"
+
+#define NUM_ITERATIONS 20000
+
+static const char *backends[] = {"select", "epoll", "epoll-et", "io_uring",
+    NULL};
+static int default_fd_counts[] = {100, 500, 1000, 10000, 0};
+
+sm_status my_on_close(sm_t sm, int fd, void *value, bool is_server) {
+  return SM_SUCCESS;
+}
+
+double my_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// @result the us per select, or a negative number if we can't add n fds
+double my_run(enum sm_backend_type backend, int n) {
+  sm_t sm = sm_new_with_backend(4096, backend);
+  if (!sm) {
+    return -1;
+  }
+  sm->on_close = my_on_close;
+  // each fd is a dup of one idle socket, so n fds fit in e.g. a 20000 fd
+  // limit, where n socketpairs wouldn't
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    sm_free(sm);
+    return -1;
+  }
+  int num_fds = 0;
+  double ret = -1;
+  static int value;
+  while (num_fds < n) {
+    int fd = dup(sv[0]);
+    if (fd < 0) {
+      break;
+    }
+    if (sm->add_fd(sm, fd, NULL, &value, false)) {
+      close(fd);
+      break;
+    }
+    num_fds++;
+  }
+  if (num_fds == n) {
+    int i;
+    for (i = 0; i < 100; i++) {
+      sm->select(sm, 0);  // warm up
+    }
+    double start = my_now();
+    for (i = 0; i < NUM_ITERATIONS; i++) {
+      sm->select(sm, 0);
+    }
+    ret = (my_now() - start) / NUM_ITERATIONS * 1e6;
+  }
+  sm->cleanup(sm);
+  sm_free(sm);
+  close(sv[0]);
+  close(sv[1]);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  // one fd per connection
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  const char **names = backends;
+  const char *one_name[2] = {NULL, NULL};
+  int *fd_counts = default_fd_counts;
+  if (argc > 1) {
+    one_name[0] = argv[1];
+    names = one_name;
+  }
+  if (argc > 2) {
+    fd_counts = (int *)calloc(argc - 1, sizeof(int));
+    if (!fd_counts) {
+      return 1;
+    }
+    int i;
+    for (i = 2; i < argc; i++) {
+      fd_counts[i - 2] = atoi(argv[i]);
+    }
+  }
+  printf("%-9s %7s %12s\n", "backend", "fds", "us/select");
+  const char **name;
+  for (name = names; *name; name++) {
+    enum sm_backend_type backend;
+    if (sm_parse_backend(*name, &backend)) {
+      printf("%-9s %7s %12s\n", *name, "", "unsupported");
+      continue;
+    }
+    int *n;
+    for (n = fd_counts; *n > 0; n++) {
+      double us = my_run(backend, *n);
+      if (us < 0) {
+        printf("%-9s %7d %12s\n", *name, *n, "failed");
+        break;
+      }
+      printf("%-9s %7d %12.2f\n", *name, *n, us);
+    }
+  }
+  if (fd_counts != default_fd_counts) {
+    free(fd_counts);
+  }
+  return 0;
+}
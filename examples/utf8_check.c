@@ -0,0 +1,234 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+// Copyright 2012 Google Inc. wrightt@google.com
+
+//
+// Checks that websocket's UTF-8 validators, i.e. ws_validate_utf8 and its
+// SSE4.1 and AVX2 block validators, agree with the validate_utf8 DFA, over
+// random valid, corrupted and truncated text that's split into random
+// fragments, e.g.:
+//   ./utf8_check
+//   ./utf8_check 100000 42
+//
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "validate_utf8.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MY_X86_SIMD
+#endif
+
+// websocket.c's validators, which aren't in websocket.h
+size_t ws_validate_utf8(unsigned int *state, const char *data,
+    size_t length);
+#ifdef MY_X86_SIMD
+bool ws_is_utf8_sse4(const unsigned char *s, size_t length);
+bool ws_is_utf8_avx2(const unsigned char *s, size_t length);
+#endif
+
+#define DEFAULT_NUM_INPUTS 20000
+#define MAX_LENGTH 4096
+#define MAX_FRAGMENTS 8
+
+// code points at the edges of each encoded length and of the surrogates
+static const uint32_t edge_cps[] = {0x0, 0x7F, 0x80, 0x7FF, 0x800, 0xFFF,
+    0x1000, 0xD7FF, 0xE000, 0xFFFD, 0xFFFF, 0x10000, 0x3FFFF, 0x40000,
+    0xFFFFF, 0x100000, 0x10FFFF};
+
+// bytes that a DFA is most likely to get wrong
+static const unsigned char edge_bytes[] = {0x00, 0x7F, 0x80, 0x8F, 0x90,
+    0x9F, 0xA0, 0xBF, 0xC0, 0xC1, 0xC2, 0xDF, 0xE0, 0xED, 0xEE, 0xEF, 0xF0,
+    0xF4, 0xF5, 0xF8, 0xFE, 0xFF};
+
+static uint64_t rand_state;
+
+uint32_t my_rand(uint32_t n) {
+  // xorshift64*, so runs are repeatable for a given seed
+  rand_state ^= rand_state >> 12;
+  rand_state ^= rand_state << 25;
+  rand_state ^= rand_state >> 27;
+  return (uint32_t)((rand_state * 2685821657736338717ULL) >> 32) % n;
+}
+
+size_t my_put_cp(unsigned char *s, uint32_t cp) {
+  if (cp < 0x80) {
+    s[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    s[0] = 0xC0 | (cp >> 6);
+    s[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  } else if (cp < 0x10000) {
+    s[0] = 0xE0 | (cp >> 12);
+    s[1] = 0x80 | ((cp >> 6) & 0x3F);
+    s[2] = 0x80 | (cp & 0x3F);
+    return 3;
+  }
+  s[0] = 0xF0 | (cp >> 18);
+  s[1] = 0x80 | ((cp >> 12) & 0x3F);
+  s[2] = 0x80 | ((cp >> 6) & 0x3F);
+  s[3] = 0x80 | (cp & 0x3F);
+  return 4;
+}
+
+uint32_t my_rand_cp() {
+  uint32_t cp;
+  switch (my_rand(6)) {
+    case 0:
+      return edge_cps[my_rand(sizeof(edge_cps) / sizeof(edge_cps[0]))];
+    case 1:
+      return 0x80 + my_rand(0x800 - 0x80);
+    case 2:
+      do {
+        cp = 0x800 + my_rand(0x10000 - 0x800);
+      } while (cp >= 0xD800 && cp <= 0xDFFF);
+      return cp;
+    case 3:
+      return 0x10000 + my_rand(0x110000 - 0x10000);
+    default:
+      // mostly ASCII, like JSON, so the SIMD ASCII fast paths run too
+      return 0x20 + my_rand(0x7F - 0x20);
+  }
+}
+
+// Writes valid text, then maybe corrupts it.
+// @result the length
+size_t my_rand_text(unsigned char *s) {
+  size_t max_length = (my_rand(4) ? 1 + my_rand(300) : MAX_LENGTH - 4);
+  size_t length = 0;
+  while (length + 4 <= max_length) {
+    length += my_put_cp(s + length, my_rand_cp());
+  }
+  if (length && my_rand(2)) {
+    int n = 1 + my_rand(3);
+    int i;
+    for (i = 0; i < n; i++) {
+      size_t j = my_rand(length);
+      switch (my_rand(4)) {
+        case 0:
+          s[j] = edge_bytes[my_rand(sizeof(edge_bytes) /
+              sizeof(edge_bytes[0]))];
+          break;
+        case 1:
+          s[j] ^= 1 << my_rand(8);
+          break;
+        case 2:
+          s[j] = my_rand(256);
+          break;
+        default:
+          // e.g. end mid-code point
+          length = j;
+          break;
+      }
+      if (!length) {
+        break;
+      }
+    }
+  }
+  return length;
+}
+
+// @result the offset of the first invalid byte, else length, like
+// ws_validate_utf8, with the DFA's state in *state
+size_t my_validate_dfa(unsigned int *state, const unsigned char *s,
+    size_t length) {
+  size_t i;
+  for (i = 0; i < length; i++) {
+    *state = validate_utf8[*state + s[i]];
+    if (*state == UTF8_INVALID) {
+      break;
+    }
+  }
+  return i;
+}
+
+// @result 0 if the validators agree with the DFA on s, else -1
+int my_check(const unsigned char *s, size_t length) {
+  unsigned int expected_state = UTF8_VALID;
+  size_t expected = my_validate_dfa(&expected_state, s, length);
+  bool is_valid = (expected == length && expected_state == UTF8_VALID);
+
+  // split at random offsets, as if into frames, or not at all
+  size_t splits[MAX_FRAGMENTS + 1];
+  size_t num_fragments = 1 + my_rand(MAX_FRAGMENTS);
+  size_t i;
+  splits[0] = 0;
+  for (i = 1; i < num_fragments; i++) {
+    splits[i] = my_rand(length + 1);
+  }
+  splits[num_fragments] = length;
+  for (i = 1; i < num_fragments; i++) {
+    size_t j;
+    for (j = i; j > 1 && splits[j - 1] > splits[j]; j--) {
+      size_t tmp = splits[j];
+      splits[j] = splits[j - 1];
+      splits[j - 1] = tmp;
+    }
+  }
+  unsigned int state = UTF8_VALID;
+  size_t actual = length;
+  for (i = 0; i < num_fragments; i++) {
+    size_t fragment_length = splits[i + 1] - splits[i];
+    size_t j = ws_validate_utf8(&state, (const char *)s + splits[i],
+        fragment_length);
+    if (j < fragment_length || state == UTF8_INVALID) {
+      actual = splits[i] + j;
+      break;
+    }
+  }
+  if (actual != expected || state != expected_state) {
+    fprintf(stderr, "ws_validate_utf8 returned %zd and state %u, but the "
+        "DFA returned %zd and state %u, for %zd bytes in %zd fragments\n",
+        actual, state, expected, expected_state, length, num_fragments);
+    return -1;
+  }
+
+#ifdef MY_X86_SIMD
+  if (__builtin_cpu_supports("sse4.1") &&
+      ws_is_utf8_sse4(s, length) != is_valid) {
+    fprintf(stderr, "ws_is_utf8_sse4 returned %s for %zd bytes\n",
+        (is_valid ? "false" : "true"), length);
+    return -1;
+  }
+  if (__builtin_cpu_supports("avx2") &&
+      ws_is_utf8_avx2(s, length) != is_valid) {
+    fprintf(stderr, "ws_is_utf8_avx2 returned %s for %zd bytes\n",
+        (is_valid ? "false" : "true"), length);
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  long num_inputs = (argc > 1 ? atol(argv[1]) : DEFAULT_NUM_INPUTS);
+  rand_state = (argc > 2 ? strtoull(argv[2], NULL, 0) : 1);
+  rand_state = (rand_state ? rand_state : 1);
+  unsigned char *s = (unsigned char *)malloc(MAX_LENGTH);
+  if (!s || num_inputs < 0) {
+    return 1;
+  }
+  long num_valid = 0;
+  long i;
+  for (i = 0; i < num_inputs; i++) {
+    size_t length = my_rand_text(s);
+    if (my_check(s, length)) {
+      free(s);
+      return 1;
+    }
+    unsigned int state = UTF8_VALID;
+    num_valid += (my_validate_dfa(&state, s, length) == length &&
+        state == UTF8_VALID);
+  }
+  printf("%ld inputs, %ld valid, match the DFA\n", num_inputs, num_valid);
+  free(s);
+  return 0;
+}
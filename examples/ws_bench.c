@@ -0,0 +1,172 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+// Copyright 2012 Google Inc. wrightt@google.com
+
+//
+// A websocket benchmark: ws->on_recv throughput for masked client frames,
+// i.e. unmasking, plus UTF-8 validation for text frames, fed in 64KB reads
+// like our socket_manager, e.g.:
+//   ./ws_bench            binary frames
+//   ./ws_bench text       ASCII text frames
+//   ./ws_bench utf8       multi-byte UTF-8 text frames
+//
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ios-webkit-debug-proxy/websocket.h"
+
+// Secs per frame size
+#define RUN_SECS 1.0
+
+// Bytes per on_recv
+#define READ_LENGTH 65536
+
+// Frame bytes per batch
+#define BATCH_LENGTH (4 << 20)
+
+static size_t frame_lengths[] = {64, 4096, 65536, 16 << 20, 0};
+
+static size_t recv_length;
+
+double my_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+ws_status my_send_data(ws_t ws, const char *data, size_t length) {
+  return WS_SUCCESS;
+}
+
+ws_status my_on_http_request(ws_t ws,
+    const char *method, const char *resource, const char *version,
+    const char *host, const char *headers, size_t headers_length,
+    bool is_websocket, bool *to_keep_alive) {
+  return WS_SUCCESS;
+}
+
+ws_status my_on_upgrade(ws_t ws,
+    const char *resource, const char *protocol,
+    int version, const char *sec_key) {
+  return ws->send_upgrade(ws);
+}
+
+ws_status my_on_frame(ws_t ws,
+    bool is_fin, ws_opcode opcode, bool is_masking,
+    const char *payload_data, size_t payload_length,
+    bool *to_keep) {
+  recv_length += payload_length;
+  *to_keep = false;
+  return WS_SUCCESS;
+}
+
+ws_t my_new_ws() {
+  ws_t ws = ws_new();
+  if (!ws) {
+    return NULL;
+  }
+  ws->send_data = my_send_data;
+  ws->on_http_request = my_on_http_request;
+  ws->on_upgrade = my_on_upgrade;
+  ws->on_frame = my_on_frame;
+  const char *request =
+    "GET /devtools/page/1 HTTP/1.1\r\n"
+    "Host: localhost:9222\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+  if (ws->on_recv(ws, request, strlen(request))) {
+    ws_free(ws);
+    return NULL;
+  }
+  return ws;
+}
+
+// Writes a masked frame, as a client would send it.
+// @result the frame's length
+size_t my_write_frame(char *buf, ws_opcode opcode, bool is_utf8,
+    size_t length) {
+  static const char mask[4] = {0x12, 0x34, 0x56, 0x78};
+  // 1, 2, 3 and 4 byte characters
+  static const char utf8[] = "a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80";
+  size_t n = 0;
+  buf[n++] = 0x80 | opcode;
+  if (length < 126) {
+    buf[n++] = 0x80 | length;
+  } else if (length < 65536) {
+    buf[n++] = 0x80 | 126;
+    buf[n++] = (length >> 8) & 0xFF;
+    buf[n++] = length & 0xFF;
+  } else {
+    buf[n++] = 0x80 | 127;
+    int i;
+    for (i = 7; i >= 0; i--) {
+      buf[n++] = (length >> (8 * i)) & 0xFF;
+    }
+  }
+  memcpy(buf + n, mask, 4);
+  n += 4;
+  size_t utf8_length = length - length % 10;
+  size_t i;
+  for (i = 0; i < length; i++) {
+    char c = (is_utf8 && i < utf8_length ? utf8[i % 10] : 'a' + i % 26);
+    buf[n + i] = c ^ mask[i & 3];
+  }
+  return n + length;
+}
+
+int main(int argc, char **argv) {
+  const char *mode = (argc > 1 ? argv[1] : "binary");
+  bool is_utf8 = !strcmp(mode, "utf8");
+  ws_opcode opcode = (!strcmp(mode, "binary") ? OPCODE_BINARY :
+      OPCODE_TEXT);
+  if (strcmp(mode, "binary") && strcmp(mode, "text") && !is_utf8) {
+    fprintf(stderr, "Usage: %s [binary|text|utf8]\n", argv[0]);
+    return 1;
+  }
+  printf("%-6s %10s %12s\n", mode, "frame", "MB/s");
+  size_t *length;
+  for (length = frame_lengths; *length; length++) {
+    size_t count = (*length >= BATCH_LENGTH ? 1 : BATCH_LENGTH / *length);
+    char *buf = (char *)malloc(count * (*length + 14));
+    ws_t ws = my_new_ws();
+    if (!buf || !ws) {
+      fprintf(stderr, "Setup failed\n");
+      return 1;
+    }
+    size_t buf_length = 0;
+    size_t i;
+    for (i = 0; i < count; i++) {
+      buf_length += my_write_frame(buf + buf_length, opcode, is_utf8,
+          *length);
+    }
+    recv_length = 0;
+    double start = my_now();
+    double secs;
+    do {
+      size_t offset;
+      for (offset = 0; offset < buf_length; offset += READ_LENGTH) {
+        size_t n = buf_length - offset;
+        if (ws->on_recv(ws, buf + offset, (n < READ_LENGTH ? n :
+                READ_LENGTH))) {
+          fprintf(stderr, "on_recv failed\n");
+          return 1;
+        }
+      }
+      secs = my_now() - start;
+    } while (secs < RUN_SECS);
+    printf("%-6s %10zd %12.0f\n", "", *length, recv_length / secs / 1e6);
+    ws_free(ws);
+    free(buf);
+  }
+  return 0;
+}
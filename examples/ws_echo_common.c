@@ -89,6 +89,8 @@ ws_status on_http_request(ws_t ws,
     char *data = create_root_response(((my_t)ws->state)->port, 3);
     ws_status ret = ws->send_data(ws, data, strlen(data));
     free(data);
+    // our response has no Content-Length, so close to end it
+    *to_keep_alive = false;
     return ret;
   }
   return WS_SUCCESS;
@@ -20,6 +20,11 @@ typedef uint8_t iwdp_status;
 #define IWDP_ERROR 1
 #define IWDP_SUCCESS 0
 
+// Our classes of fds, see set_fd_class
+#define IWDP_FD_DEVICE 1    // usbmuxd and the devices' inspectors
+#define IWDP_FD_CLIENT 2    // our listeners, and so their clients
+#define IWDP_FD_FRONTEND 3  // connects for static data, see connect
+
 
 struct iwdp_private;
 typedef struct iwdp_private *iwdp_private_t;
@@ -53,6 +58,31 @@ struct iwdp_struct {
   iwdp_status (*on_close)(iwdp_t self, int fd, void *value,
                           bool is_server);
 
+  // Handle an add_timer timeout.
+  // @param value the value from our add_timer call
+  iwdp_status (*on_timer)(iwdp_t self, int fd, void *value);
+
+  // Handle a connected fd from our connect call.
+  // @param value the value from our connect call
+  iwdp_status (*on_connect)(iwdp_t self, int fd, void *value);
+
+  // Attach or detach a device, e.g. one that another iwdp's dispatch found.
+  iwdp_status (*on_attach)(iwdp_t self, const char *device_id);
+  iwdp_status (*on_detach)(iwdp_t self, const char *device_id);
+
+  // Handle an attach_async result.
+  // @param wi_fd the attach fd, or -1 if it failed
+  // @result an error if wi_fd was not used, in which case the caller must
+  //   close it
+  iwdp_status (*on_attached)(iwdp_t self, const char *device_id, int wi_fd,
+                             const char *device_name, int device_os_version,
+                             void *ssl_session);
+
+  // Add another iwdp's device to our devices list, see publish.
+  iwdp_status (*on_publish)(iwdp_t self, const char *device_id,
+                            const char *device_name, int device_os_version,
+                            int port, bool is_attached);
+
   void *state;
   bool *is_debug;
 
@@ -72,6 +102,12 @@ struct iwdp_struct {
                 char **to_device_name, int *to_device_os_version,
                 void **to_ssl_session);
 
+  // Optional, runs attach on another thread, so a slow device handshake
+  // doesn't block our other devices and clients.  Its result, including the
+  // device name and os version, must be passed to on_attached.
+  // @result an error if it can't, in which case we call attach instead
+  iwdp_status (*attach_async)(iwdp_t iwdp, const char *device_id);
+
   // Select the port-scan range for the browser listener.
   // @param to_port preferred port, e.g. 9227.  If a device is re-attached
   //   then this will be set to the previously-selected port
@@ -84,19 +120,51 @@ struct iwdp_struct {
   // @param port e.g. 9222
   int (*listen)(iwdp_t self, int port);
 
-  // Connect to a host:port for static data.
+  // Start connecting to a host:port, e.g. for static data, and add the fd
+  // with the given value.  Sends are queued until on_connect, and a failed
+  // connect is reported via on_close.
   // @param hostname_with_port e.g. "chrome-devtools-frontend.appspot.com:8080"
-  int (*connect)(iwdp_t self, const char *hostname_with_port);
+  // @result the fd, or -1 for error
+  int (*connect)(iwdp_t self, const char *hostname_with_port, void *value);
 
   // Send bytes to fd.
   iwdp_status (*send)(iwdp_t self, int fd, const char *data, size_t length);
 
+  // Optional, sends a header and data to fd with a single gathered write.
+  // @param free_data if set, the data is sent by reference and passed to
+  //   free_data once it has been sent, otherwise any unsent data is copied
+  iwdp_status (*sendv)(iwdp_t self, int fd, const char *header,
+      size_t header_length, const char *data, size_t data_length,
+      void (*free_data)(void *data));
+
   // Add a fd that was returned from attach/listen/connect.
   iwdp_status (*add_fd)(iwdp_t self, int fd, void *ssl_session, void *value,
       bool is_server);
 
   iwdp_status (*remove_fd)(iwdp_t self, int fd);
 
+  // Optional, applies the socket options of an added fd's class, e.g.
+  // IWDP_FD_CLIENT, whose server fds pass it to their accepted fds.
+  iwdp_status (*set_fd_class)(iwdp_t self, int fd, int fd_class);
+
+  // Optional, schedules a one-shot on_timer call.
+  // @param fd an added fd, whose remove_fd cancels the timer, or -1
+  // @result timer id, or -1 for error
+  int (*add_timer)(iwdp_t self, int fd, unsigned int timeout_ms, void *value);
+
+  iwdp_status (*remove_timer)(iwdp_t self, int timer_id);
+
+  // Optional, passes our device listener's attach/detach events to another
+  // iwdp's on_attach/on_detach, e.g. on a worker thread, instead of
+  // attaching the devices ourselves.
+  iwdp_status (*dispatch)(iwdp_t self, const char *device_id, bool is_attach);
+
+  // Optional, reports our device ports to the dispatching iwdp's on_publish.
+  // @param port -1 if the device's port has been removed
+  iwdp_status (*publish)(iwdp_t self, const char *device_id,
+                         const char *device_name, int device_os_version,
+                         int port, bool is_attached);
+
 
   // For internal use only:
   iwdp_status (*on_error)(iwdp_t self, const char *format, ...);
@@ -3,7 +3,7 @@
 // Copyright 2012 Google Inc. wrightt@google.com
 
 //
-// A generic select-based socket manager.
+// A generic socket manager, with select, epoll and io_uring backends.
 //
 
 #ifndef SOCKET_SELECTOR_H
@@ -20,6 +20,7 @@ extern "C" {
 int sm_listen(int port);
 
 // Connect to a server, return the file descriptor (or -1 for error).
+// This blocks while it resolves and connects, see sm->connect.
 int sm_connect(const char *socket_addr);
 
 
@@ -31,11 +32,60 @@ typedef uint8_t sm_status;
 struct sm_private;
 typedef struct sm_private *sm_private_t;
 
+// Readiness backends, see sm_new_with_backend.
+enum sm_backend_type {
+  SM_BACKEND_DEFAULT,  // epoll if supported, otherwise select
+  SM_BACKEND_SELECT,   // limited to FD_SETSIZE fds
+  SM_BACKEND_EPOLL,    // level-triggered epoll
+  SM_BACKEND_EPOLL_ET, // edge-triggered epoll
+  SM_BACKEND_IO_URING, // submitted recv/send/accept, Linux 5.19+
+};
+
+// Parse a backend name, e.g. "epoll-et".
+// @result 0 if the name is a supported backend
+int sm_parse_backend(const char *name, enum sm_backend_type *to_backend);
+
 struct sm_struct;
 typedef struct sm_struct *sm_t;
+// @param buffer_length the initial recv length, which adapts to each fd's
+//   input, up to 256k
 sm_t sm_new(size_t buffer_length);
+// @result NULL if the backend is not supported on this platform
+sm_t sm_new_with_backend(size_t buffer_length, enum sm_backend_type backend);
 void sm_free(sm_t self);
 
+// @result the backend name, e.g. "select"
+const char *sm_backend_name(sm_t self);
+
+// A sendv segment.
+struct sm_iovec {
+  const char *data;
+  size_t length;
+  // If the send blocks then the unsent data is either queued by reference,
+  // in which case it must remain valid until sendv's release is called, or
+  // copied.
+  bool is_ref;
+};
+
+// Options for a class of fds, e.g. our clients, see set_class_options.
+struct sm_fd_options {
+  // TCP_NODELAY, so Nagle doesn't delay our small sends.  Ignored if it's
+  // not a TCP socket.
+  bool is_nodelay;
+  // Hold each fd's sends until the end of our select pass, then write them
+  // together, e.g. so a burst of small sends takes one write.  A send that
+  // would bring the held bytes to cork_length is written at once, after
+  // them, without being copied.
+  bool is_cork;
+  size_t cork_length;
+  // SO_SNDBUF and SO_RCVBUF, if non-zero
+  int send_buffer_length;
+  int recv_buffer_length;
+};
+
+// Max fd classes, see set_class_options
+#define SM_MAX_FD_CLASSES 8
+
 struct sm_struct {
 
   // Call these APIs:
@@ -51,6 +101,63 @@ struct sm_struct {
   sm_status (*send)(sm_t self, int fd, const char *data, size_t length,
       void* value);
 
+  // Like send, but gathers the segments into as few writes as possible,
+  // e.g. a single sendmsg, or SSL_write records of up to 16k.
+  // @param release optional, called with the value once all is_ref segments
+  //   are no longer needed, even if the send fails.
+  sm_status (*sendv)(sm_t self, int fd, const struct sm_iovec *iov,
+      size_t iov_count, void *value, void (*release)(void *value));
+
+  // Limit the sends that can block while receiving from fd:  once more than
+  // high_length bytes are blocked we stop receiving from fd, until they
+  // drain to low_length.  The defaults are 16k and 64k.
+  // @param fd the fd, or -1 to set the defaults for future add_fd calls
+  sm_status (*set_watermarks)(sm_t self, int fd, size_t low_length,
+      size_t high_length);
+
+  // Limit each turn of receiving from a ready fd to max_reads reads or
+  // max_length bytes, after which the other ready fds get their turns before
+  // it continues.  The defaults are 64 reads and 1M, and 0 is no limit.
+  sm_status (*set_recv_budget)(sm_t self, size_t max_length,
+      size_t max_reads);
+
+  // Set the options of a class of fds, which apply to its current and future
+  // fds.  Class 0, the default, has no options.
+  // @param fd_class 1 to SM_MAX_FD_CLASSES - 1
+  sm_status (*set_class_options)(sm_t self, int fd_class,
+      const struct sm_fd_options *options);
+
+  // Put an added fd in a class.  A server fd's accepted fds are in its class.
+  sm_status (*set_fd_class)(sm_t self, int fd, int fd_class);
+
+  // Schedule a one-shot on_timer call.
+  // @param fd an added fd whose remove_fd will cancel this timer, or -1
+  // @param timeout_ms rounded up to the timer resolution of 10ms
+  // @result a timer id, or -1 for error
+  int (*add_timer)(sm_t self, int fd, unsigned int timeout_ms, void *value);
+
+  // Cancel a timer, if it hasn't already expired.
+  sm_status (*remove_timer)(sm_t self, int timer_id);
+
+  // Queue a value for an on_post call by our select thread.  Unlike our other
+  // functions, this can be called from any thread.
+  // @result SM_SUCCESS if the value was queued, after which it belongs to
+  //   on_post, or SM_ERROR if it wasn't, e.g. out of memory, so the caller
+  //   still owns it.  Values that are still queued when the sm is free'd are
+  //   dropped without an on_post call.
+  sm_status (*post)(sm_t self, void *value);
+
+  // Start connecting to a "host:port" or "unix:path" and add its fd, without
+  // blocking, except on WIN32, where the lookup and connect still block.
+  // Sends are queued until on_connect.  If the connect fails or times out
+  // then the fd is removed, i.e. on_close.
+  // @param timeout_ms 0 for no timeout
+  // @result the fd, or -1 for error
+  int (*connect)(sm_t self, const char *socket_addr, unsigned int timeout_ms,
+      void *value);
+
+  // Wait up to timeout_secs, or until the next timer, for I/O.
+  // @result -1 if there are no fds and no on_post callback
   int (*select)(sm_t self, int timeout_secs);
 
   sm_status (*cleanup)(sm_t self);
@@ -66,6 +173,7 @@ struct sm_struct {
                          int server_fd, void *server_value,
                          int fd, void **to_value);
 
+  // @param buf the sent data, or NULL if it wasn't a single buffer
   sm_status (*on_sent)(sm_t self, int fd, void *value,
                        const char *buf, ssize_t length);
 
@@ -74,6 +182,15 @@ struct sm_struct {
 
   sm_status (*on_close)(sm_t self, int fd, void *value, bool is_server);
 
+  // @param fd the add_timer fd, which is removed if this returns an error
+  sm_status (*on_timer)(sm_t self, int timer_id, int fd, void *value);
+
+  // Optional, handles a value from post, in post order.
+  void (*on_post)(sm_t self, void *value);
+
+  // Optional, called once a connect's fd is connected.
+  sm_status (*on_connect)(sm_t self, int fd, void *value);
+
   // For internal use only:
   sm_private_t private_state;
 };
@@ -22,6 +22,12 @@ typedef uint8_t wi_status;
 #define WI_ERROR 1
 #define WI_SUCCESS 0
 
+// The space that send_bin needs before and after a serialized rpc_dict, to
+// frame it in place, i.e. the packet's length header and, if partials are
+// supported, the plist that wraps it.
+#define WI_BIN_HEAD_LENGTH 40
+#define WI_BIN_TAIL_LENGTH 38
+
 
 // Create a webinspector connection.
 //
@@ -63,6 +69,11 @@ struct wi_struct {
     // Calls send_packet with the serialized rpc packet(s).
     wi_status (*send_plist)(wi_t self, const plist_t rpc_dict);
 
+    // Like send_plist, but for an rpc_dict that's already serialized, at
+    // buf + WI_BIN_HEAD_LENGTH and followed by WI_BIN_TAIL_LENGTH free bytes.
+    // Takes ownership of the buf.
+    wi_status (*send_bin)(wi_t self, char *buf, size_t length);
+
     // Optional state for use in your callbacks.
     void *state;
     bool *is_debug;
@@ -74,9 +85,31 @@ struct wi_struct {
     // Send a serialized rpc (full or partial).
     wi_status (*send_packet)(wi_t self, const char *packet, size_t length);
 
+    // Optional, sends a packet's 4-byte length header and data with a single
+    // gathered write.  Takes ownership of the data, which must be free'd once
+    // it has been sent.
+    wi_status (*send_packetv)(wi_t self, const char *header,
+        size_t header_length, char *data, size_t data_length);
+
     // Receive a deserialized full rpc.
     wi_status (*recv_plist)(wi_t self, const plist_t rpc_dict);
 
+    // Optional, receives a full rpc as its serialized plist, instead of
+    // calling recv_plist, e.g. to read it without building a plist.  An rpc
+    // that was received as partial messages is split into segments, which
+    // are only valid during this call.
+    wi_status (*recv_bin)(wi_t self, const char *const *segments,
+        const size_t *segment_lengths, size_t num_segments);
+
+    // Optional, with recv_bin, is called with each partial message's part of
+    // the rpc as it arrives, e.g. to stream it.  It returns the part's bytes
+    // that it has consumed as to_skip_offset and to_skip_length, which we
+    // don't keep, so recv_bin's segments have a NULL gap in their place.
+    // @param rpc_offset the part's offset in the rpc, 0 for a new rpc
+    wi_status (*recv_partial)(wi_t self, size_t rpc_offset,
+        const char *rpc_bin, size_t length,
+        size_t *to_skip_offset, size_t *to_skip_length);
+
     // For internal use only:
     wi_status (*on_error)(wi_t self, const char *format, ...);
     wi_private_t private_state;
@@ -35,6 +35,21 @@ typedef uint8_t ws_status;
 #define WS_ERROR 1
 #define WS_SUCCESS 0
 
+// Which text frames to validate as UTF-8
+typedef uint8_t ws_utf8_check;
+#define WS_UTF8_CHECK_RECV 0x1
+#define WS_UTF8_CHECK_SEND 0x2
+
+// Payload byte counts of the data frames, before and after
+// permessage-deflate, e.g. for the compression ratio
+struct ws_deflate_stats {
+  bool is_enabled;  // negotiated by send_upgrade
+  uint64_t sent_raw_length;
+  uint64_t sent_wire_length;
+  uint64_t recv_raw_length;
+  uint64_t recv_wire_length;
+};
+
 
 struct ws_struct;
 typedef struct ws_struct *ws_t;
@@ -65,9 +80,39 @@ struct ws_struct {
   ws_status (*send_close)(ws_t self, ws_close close_code,
           const char *reason);
 
+  void (*get_deflate_stats)(ws_t self, struct ws_deflate_stats *to_stats);
+
+  // Called from on_http_request, e.g. before an asynchronous response, to
+  // discard the rest of the input instead of parsing more requests, until
+  // the connection is closed.  A websocket request then skips on_upgrade.
+  void (*discard_requests)(ws_t self);
+
   void *state;
   bool *is_debug;
 
+  // Defaults to both, but e.g. a proxy can skip validating text that it
+  // relays from a trusted peer.
+  ws_utf8_check utf8_check;
+
+  // Enables permessage-deflate, if the client offers it, with our max
+  // LZ77 window bits (9..15) for both directions.  Defaults to 0, off.
+  uint8_t deflate_window_bits;
+  // Compress each message on its own, which saves our deflate state
+  // between messages but compresses worse.
+  bool deflate_no_context_takeover;
+  // Min payload length of a message to compress, e.g. skip tiny messages.
+  size_t deflate_min_length;
+
+  // Max HTTP requests per keep-alive connection, or 0 for no limit.
+  unsigned int max_http_requests;
+
+  // Max payload length of a received data frame, and of a received
+  // message after inflating it, or 0 for no limit.  A larger frame or
+  // message is closed with CLOSE_SIZE_ERROR as soon as its header (or
+  // inflated data) shows it's too long, before we buffer it.
+  size_t max_frame_length;
+  size_t max_message_length;
+
   //
   // Set these callbacks:
   //
@@ -75,6 +120,16 @@ struct ws_struct {
   ws_status (*send_data)(ws_t self,
           const char *data, size_t length);
 
+  // Optional, sends an unmasked frame's header and payload with a single
+  // gathered write, instead of copying them into one send_data buffer.
+  ws_status (*send_datav)(ws_t self,
+          const char *header, size_t header_length,
+          const char *payload, size_t payload_length);
+
+  // The *to_keep_alive is initially true if the client asked for a
+  // persistent connection, e.g. HTTP/1.1, so the response should say
+  // "Connection: keep-alive" and have a Content-Length.  Set it to false
+  // to close the connection after the response.
   ws_status (*on_http_request)(ws_t self,
           const char *method, const char *resource, const char *version,
           const char *host, const char *headers, size_t headers_length,
@@ -89,6 +144,14 @@ struct ws_struct {
           const char *payload_data, size_t payload_length,
           bool *to_keep);
 
+  // Optional, receives data frames as they arrive, instead of "on_frame"
+  // buffering each frame (and, if kept, each message) in memory.  Each call
+  // passes the next unmasked and inflated part of the message, and is_fin
+  // is set on its last part.  Control frames still go to "on_frame".
+  ws_status (*on_frame_chunk)(ws_t self,
+          bool is_fin, ws_opcode opcode, bool is_masking,
+          const char *payload_data, size_t payload_length);
+
   // For internal use only:
   ws_status (*on_error)(ws_t self, const char *format, ...);
   ws_private_t private_state;
@@ -0,0 +1,376 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+// Copyright 2014 Google Inc. wrightt@google.com
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "bplist_reader.h"
+
+
+#define BPR_MAGIC "bplist00"
+#define BPR_TRAILER_LENGTH 32
+
+const char *bpr_get_bytes(const struct bpr_plist *plist, size_t offset,
+    size_t length, size_t *to_length) {
+  if (!plist->segments) {
+    *to_length = length;
+    return plist->buf + offset;
+  }
+  size_t i;
+  for (i = 0; i < plist->num_segments; i++) {
+    size_t segment_length = plist->segment_lengths[i];
+    if (offset < segment_length) {
+      size_t avail = segment_length - offset;
+      *to_length = (length < avail ? length : avail);
+      const char *segment = plist->segments[i];
+      return (segment ? segment + offset : NULL);
+    }
+    offset -= segment_length;
+  }
+  *to_length = 0;
+  return NULL;
+}
+
+// copy bytes that may span segments, which the caller has bounds-checked
+static void bpr_copy(const struct bpr_plist *plist, size_t offset,
+    char *to_buf, size_t length) {
+  while (length) {
+    size_t n;
+    const char *s = bpr_get_bytes(plist, offset, length, &n);
+    if (s) {
+      memcpy(to_buf, s, n);
+    } else {
+      memset(to_buf, 0, n);  // a gap
+    }
+    to_buf += n;
+    offset += n;
+    length -= n;
+  }
+}
+
+// The functions below take an is_segmented arg, which is always a constant
+// and, with BPR_INLINE, lets the compiler specialize them for our common
+// contiguous plists.  Otherwise every read would branch on, and be sized
+// for, the rare segmented case.
+#define BPR_INLINE inline __attribute__((always_inline))
+
+// @param tmp at least length bytes, for bytes that span segments
+// @result the bytes at the offset
+static inline const char *bpr_bytes(const struct bpr_plist *plist,
+    bool is_segmented, size_t offset, size_t length, char *tmp) {
+  if (!is_segmented) {
+    return plist->buf + offset;
+  }
+  bpr_copy(plist, offset, tmp, length);
+  return tmp;
+}
+
+// compare bytes that may span segments with a string
+static inline int bpr_compare(const struct bpr_plist *plist,
+    bool is_segmented, size_t offset, const char *s, size_t length) {
+  if (!is_segmented) {
+    return (memcmp(plist->buf + offset, s, length) ? -1 : 0);
+  }
+  while (length) {
+    size_t n;
+    const char *bytes = bpr_get_bytes(plist, offset, length, &n);
+    if (!bytes || memcmp(bytes, s, n)) {
+      return -1;
+    }
+    s += n;
+    offset += n;
+    length -= n;
+  }
+  return 0;
+}
+
+// read a big-endian int of the given size
+static uint64_t bpr_read_be(const char *s, uint8_t size) {
+  uint64_t ret = 0;
+  uint8_t i;
+  for (i = 0; i < size; i++) {
+    ret = (ret << 8) | (unsigned char)s[i];
+  }
+  return ret;
+}
+
+// read the trailer, once the buf or segments are set
+static int bpr_open_trailer(struct bpr_plist *plist) {
+  bool is_segmented = (plist->segments != NULL);
+  size_t length = plist->length;
+  if (length < BPR_MAGIC_LENGTH + BPR_TRAILER_LENGTH ||
+      bpr_compare(plist, is_segmented, 0, BPR_MAGIC, BPR_MAGIC_LENGTH)) {
+    return -1;
+  }
+  char tmp[BPR_TRAILER_LENGTH];
+  const char *trailer = bpr_bytes(plist, is_segmented,
+      length - BPR_TRAILER_LENGTH, BPR_TRAILER_LENGTH, tmp);
+  uint8_t offset_size = trailer[6];
+  uint8_t ref_size = trailer[7];
+  uint64_t num_objects = bpr_read_be(trailer + 8, 8);
+  uint64_t root = bpr_read_be(trailer + 16, 8);
+  uint64_t table_offset = bpr_read_be(trailer + 24, 8);
+  if (offset_size < 1 || offset_size > 8 || ref_size < 1 || ref_size > 8 ||
+      !num_objects || root >= num_objects ||
+      table_offset < BPR_MAGIC_LENGTH ||
+      table_offset > length - BPR_TRAILER_LENGTH ||
+      num_objects > (length - BPR_TRAILER_LENGTH - table_offset) /
+      offset_size) {
+    return -1;
+  }
+  plist->offset_size = offset_size;
+  plist->ref_size = ref_size;
+  plist->num_objects = num_objects;
+  plist->root = root;
+  plist->offset_table_offset = (size_t)table_offset;
+  return 0;
+}
+
+int bpr_open(struct bpr_plist *plist, const char *buf, size_t length) {
+  if (!plist || !buf) {
+    return -1;
+  }
+  memset(plist, 0, sizeof(struct bpr_plist));
+  plist->buf = buf;
+  plist->length = length;
+  return bpr_open_trailer(plist);
+}
+
+int bpr_open_segments(struct bpr_plist *plist, const char *const *segments,
+    const size_t *segment_lengths, size_t num_segments) {
+  if (!plist || !segments || !segment_lengths) {
+    return -1;
+  }
+  if (num_segments == 1) {
+    return bpr_open(plist, segments[0], segment_lengths[0]);
+  }
+  memset(plist, 0, sizeof(struct bpr_plist));
+  plist->segments = segments;
+  plist->segment_lengths = segment_lengths;
+  plist->num_segments = num_segments;
+  size_t i;
+  for (i = 0; i < num_segments; i++) {
+    plist->length += segment_lengths[i];
+  }
+  return bpr_open_trailer(plist);
+}
+
+int bpr_scan_object(const char *buf, size_t length, uint8_t ref_size,
+    uint8_t *to_type, size_t *to_marker_length, size_t *to_length) {
+  if (!length) {
+    return 1;
+  }
+  if (!ref_size) {
+    return -1;
+  }
+  uint8_t marker = (uint8_t)buf[0];
+  uint8_t type = marker >> 4;
+  uint64_t count = (marker & 0xF);
+  size_t marker_length = 1;
+  size_t item_size = 1;
+  bool has_count = true;  // else the count is its number of bytes
+  switch (type) {
+    case BPR_TYPE_SIMPLE:
+      count = 0;
+      has_count = false;
+      break;
+    case BPR_TYPE_UINT:
+    case BPR_TYPE_REAL:
+      if (count > 3) {
+        return -1;
+      }
+      count = 1 << count;
+      has_count = false;
+      break;
+    case BPR_TYPE_DATE:
+      count = 8;
+      has_count = false;
+      break;
+    case BPR_TYPE_UID:
+      count++;
+      has_count = false;
+      break;
+    case BPR_TYPE_UTF16:
+      item_size = 2;
+      break;
+    case BPR_TYPE_ARRAY:
+    case BPR_TYPE_SET:
+      item_size = ref_size;
+      break;
+    case BPR_TYPE_DICT:
+      item_size = 2 * ref_size;
+      break;
+    case BPR_TYPE_DATA:
+    case BPR_TYPE_STRING:
+      break;
+    default:
+      return -1;
+  }
+  if (has_count && count == 0xF) {
+    // the count is in the int object that follows the marker
+    if (length < 2) {
+      return 1;
+    }
+    uint8_t int_marker = (uint8_t)buf[1];
+    if ((int_marker >> 4) != BPR_TYPE_UINT || (int_marker & 0xF) > 3) {
+      return -1;
+    }
+    uint8_t size = 1 << (int_marker & 0xF);
+    marker_length = 2 + size;
+    if (length < marker_length) {
+      return 1;
+    }
+    count = bpr_read_be(buf + 2, size);
+  }
+  if (count > (SIZE_MAX - marker_length) / item_size) {
+    return -1;
+  }
+  *to_type = type;
+  *to_marker_length = marker_length;
+  *to_length = (size_t)count * item_size;
+  return 0;
+}
+
+// write a big-endian int of the given size
+static char *bpr_write_be(char *tail, uint64_t value, uint8_t size) {
+  uint8_t i;
+  for (i = size; i > 0; i--) {
+    *tail++ = (char)(value >> ((i - 1) * 8));
+  }
+  return tail;
+}
+
+int bpr_open_head(struct bpr_plist *plist, char *buf, size_t length,
+    const size_t *offsets, size_t num_objects, uint8_t ref_size) {
+  if (!buf || !offsets) {
+    return -1;
+  }
+  char *tail = buf + length;
+  size_t i;
+  for (i = 0; i < num_objects; i++) {
+    tail = bpr_write_be(tail, offsets[i], 8);
+  }
+  memset(tail, 0, 6);
+  tail += 6;
+  *tail++ = 8;  // offset size
+  *tail++ = ref_size;
+  tail = bpr_write_be(tail, num_objects, 8);
+  tail = bpr_write_be(tail, 0, 8);  // the root object
+  bpr_write_be(tail, length, 8);
+  return bpr_open(plist, buf, length + BPR_HEAD_ROOM(num_objects));
+}
+
+// Reads an object's marker, which is followed by an int object if its
+// length doesn't fit in the low nibble.
+// @param to_length its number of bytes, or of dict entries
+// @result the offset of its content, or 0 if it's not of the given type
+static BPR_INLINE size_t bpr_read_object(const struct bpr_plist *plist,
+    bool is_segmented, uint64_t index, uint8_t type, size_t *to_length) {
+  if (index >= plist->num_objects) {
+    return 0;
+  }
+  size_t end = plist->offset_table_offset;  // the objects end here
+  char tmp[8];
+  uint8_t offset_size = plist->offset_size;
+  uint64_t offset = bpr_read_be(bpr_bytes(plist, is_segmented,
+        end + index * offset_size, offset_size, tmp), offset_size);
+  if (offset < BPR_MAGIC_LENGTH || offset >= end) {
+    return 0;
+  }
+
+  uint8_t marker = *bpr_bytes(plist, is_segmented, offset++, 1, tmp);
+  if ((marker >> 4) != type) {
+    return 0;
+  }
+  uint64_t length = (marker & 0xF);
+  if (length == 0xF) {
+    if (offset >= end) {
+      return 0;
+    }
+    uint8_t int_marker = *bpr_bytes(plist, is_segmented, offset++, 1, tmp);
+    if ((int_marker >> 4) != BPR_TYPE_UINT || (int_marker & 0xF) > 3) {
+      return 0;
+    }
+    uint8_t size = 1 << (int_marker & 0xF);
+    if (end - offset < size) {
+      return 0;
+    }
+    length = bpr_read_be(bpr_bytes(plist, is_segmented, offset, size, tmp),
+        size);
+    offset += size;
+  }
+  size_t item_size = (type == BPR_TYPE_DICT ? 2 * plist->ref_size : 1);
+  if (length > (end - offset) / item_size) {
+    return 0;
+  }
+  *to_length = (size_t)length;
+  return (size_t)offset;
+}
+
+static BPR_INLINE int bpr_dict_get_in(const struct bpr_plist *plist,
+    bool is_segmented, uint64_t dict, const char *key, uint64_t *to_value) {
+  size_t num_entries;
+  size_t refs = bpr_read_object(plist, is_segmented, dict, BPR_TYPE_DICT,
+      &num_entries);
+  if (!refs || !key || !to_value) {
+    return -1;
+  }
+  // the key refs, then the value refs
+  uint8_t ref_size = plist->ref_size;
+  size_t key_length = strlen(key);
+  char tmp[8];
+  size_t i;
+  for (i = 0; i < num_entries; i++) {
+    size_t length;
+    size_t offset = bpr_read_object(plist, is_segmented,
+        bpr_read_be(bpr_bytes(plist, is_segmented, refs + i * ref_size,
+            ref_size, tmp), ref_size),
+        BPR_TYPE_STRING, &length);
+    if (offset && length == key_length &&
+        !bpr_compare(plist, is_segmented, offset, key, length)) {
+      *to_value = bpr_read_be(bpr_bytes(plist, is_segmented,
+            refs + (num_entries + i) * ref_size, ref_size, tmp), ref_size);
+      return (*to_value < plist->num_objects ? 0 : -1);
+    }
+  }
+  return -1;
+}
+
+int bpr_dict_get(const struct bpr_plist *plist, uint64_t dict,
+    const char *key, uint64_t *to_value) {
+  return (plist->segments ?
+      bpr_dict_get_in(plist, true, dict, key, to_value) :
+      bpr_dict_get_in(plist, false, dict, key, to_value));
+}
+
+int bpr_copy_string(const struct bpr_plist *plist, uint64_t index,
+    char *to_buf, size_t max_length) {
+  size_t length;
+  bool is_segmented = (plist->segments != NULL);
+  size_t offset = bpr_read_object(plist, is_segmented, index,
+      BPR_TYPE_STRING, &length);
+  if (!offset || length >= max_length) {
+    return -1;
+  }
+  const char *s = bpr_bytes(plist, is_segmented, offset, length, to_buf);
+  if (s != to_buf) {
+    memcpy(to_buf, s, length);
+  }
+  to_buf[length] = '\0';
+  return 0;
+}
+
+int bpr_get_data(const struct bpr_plist *plist, uint64_t index,
+    size_t *to_offset, size_t *to_length) {
+  size_t offset = bpr_read_object(plist, (plist->segments != NULL), index,
+      BPR_TYPE_DATA, to_length);
+  if (!offset) {
+    return -1;
+  }
+  *to_offset = offset;
+  return 0;
+}
@@ -0,0 +1,119 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+// Copyright 2014 Google Inc. wrightt@google.com
+
+//
+// A binary plist ("bplist00") reader for our hot-path rpc messages.
+//
+// Instead of building a tree of plist nodes, like libplist's plist_from_bin,
+// it looks up objects through the plist's offset table, and returns data as
+// slices of the caller's buffer.  Only the types that we need are supported,
+// i.e. dicts, ASCII strings and data.
+//
+// The plist can be split into segments, e.g. reassembled partial messages,
+// which are read as-is instead of being copied into one buffer, and its
+// objects can be scanned as they arrive, before it has an offset table.
+//
+
+#ifndef BPLIST_READER_H
+#define	BPLIST_READER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+// object types, i.e. the high nibble of an object's marker
+#define BPR_TYPE_SIMPLE 0x0  // null, bool or fill
+#define BPR_TYPE_UINT   0x1
+#define BPR_TYPE_REAL   0x2
+#define BPR_TYPE_DATE   0x3
+#define BPR_TYPE_DATA   0x4
+#define BPR_TYPE_STRING 0x5
+#define BPR_TYPE_UTF16  0x6
+#define BPR_TYPE_UID    0x8
+#define BPR_TYPE_ARRAY  0xA
+#define BPR_TYPE_SET    0xC
+#define BPR_TYPE_DICT   0xD
+
+// The objects follow the "bplist00" magic
+#define BPR_MAGIC_LENGTH 8
+
+struct bpr_plist {
+  const char *const *segments;  // or NULL if it's just the buf
+  const size_t *segment_lengths;
+  size_t num_segments;
+  const char *buf;
+  size_t length;  // of all segments
+  uint8_t offset_size;
+  uint8_t ref_size;
+  uint64_t num_objects;
+  uint64_t root;  // object index
+  size_t offset_table_offset;
+};
+
+// Reads the plist's trailer.  The buf must stay valid while we read it.
+// @result 0 if ok, else -1
+int bpr_open(struct bpr_plist *plist, const char *buf, size_t length);
+
+// Like bpr_open, but for a plist that's split into segments.  A NULL segment
+// is a gap, e.g. data that the caller has already consumed, which reads as
+// zeros.
+int bpr_open_segments(struct bpr_plist *plist, const char *const *segments,
+    const size_t *segment_lengths, size_t num_segments);
+
+// @param dict the dict's object index, e.g. plist->root
+// @param to_value the value's object index
+// @result 0 if found, else -1
+int bpr_dict_get(const struct bpr_plist *plist, uint64_t dict,
+    const char *key, uint64_t *to_value);
+
+// Copies an ASCII string, e.g. an id, and NUL-terminates it.
+// @result 0 if ok, else -1, e.g. a UTF-16 or too-long string
+int bpr_copy_string(const struct bpr_plist *plist, uint64_t index,
+    char *to_buf, size_t max_length);
+
+// @param to_offset the offset of its bytes, for bpr_get_bytes
+// @result 0 if ok, else -1
+int bpr_get_data(const struct bpr_plist *plist, uint64_t index,
+    size_t *to_offset, size_t *to_length);
+
+// @param offset e.g. from bpr_get_data, within the plist
+// @param length the number of bytes that we want
+// @param to_length the number of bytes at the result, which is less than the
+//   length if they continue in the next segment
+// @result the bytes at the offset
+const char *bpr_get_bytes(const struct bpr_plist *plist, size_t offset,
+    size_t length, size_t *to_length);
+
+// Scans the object at the buf, e.g. the next object of a plist that's still
+// arriving.  Its refs are assumed to be ref_size bytes, since that's in the
+// trailer.
+// @param to_marker_length the number of bytes of its marker
+// @param to_length the number of bytes of its content, which follows its
+//   marker
+// @result 0 if ok, 1 if the length is too short for its marker, or -1 if
+//   it's invalid
+int bpr_scan_object(const char *buf, size_t length, uint8_t ref_size,
+    uint8_t *to_type, size_t *to_marker_length, size_t *to_length);
+
+// The bytes that bpr_open_head needs after a plist's head
+#define BPR_HEAD_ROOM(num_objects) (8 * (num_objects) + 32)
+
+// Opens the head of a plist that's still arriving, i.e. its first
+// num_objects objects, e.g. as found by bpr_scan_object, with the first
+// object as its root.  Writes an offset table and trailer after the length
+// bytes of the buf, which must have BPR_HEAD_ROOM(num_objects) bytes free.
+// An object that doesn't fit in the head reads as invalid.
+// @result 0 if ok, else -1
+int bpr_open_head(struct bpr_plist *plist, char *buf, size_t length,
+    const size_t *offsets, size_t num_objects, uint8_t ref_size);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* BPLIST_READER_H */
@@ -0,0 +1,242 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+// Copyright 2014 Google Inc. wrightt@google.com
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "bplist_writer.h"
+
+
+#define BPW_MAGIC "bplist00"
+#define BPW_MAGIC_LENGTH 8
+#define BPW_TRAILER_LENGTH 32
+
+// object markers, whose low nibble is the size
+#define BPW_MARK_FALSE  0x08
+#define BPW_MARK_TRUE   0x09
+#define BPW_MARK_UINT   0x10
+#define BPW_MARK_DATA   0x40
+#define BPW_MARK_STRING 0x50
+#define BPW_MARK_DICT   0xD0
+
+// As libplist's get_needed_bytes, for ints, refs and offsets
+static uint8_t bpw_needed_bytes(uint64_t value) {
+  return (value <= 0xFF ? 1 : value <= 0xFFFF ? 2 :
+      value <= 0xFFFFFFFFULL ? 4 : 8);
+}
+
+static size_t bpw_int_length(uint64_t value) {
+  return 1 + bpw_needed_bytes(value);
+}
+
+// The marker of an object with this many bytes or dict entries, which is
+// followed by an int object if it doesn't fit in the low nibble
+static size_t bpw_marker_length(size_t length) {
+  return (length < 15 ? 1 : 1 + bpw_int_length(length));
+}
+
+static size_t bpw_object_length(const struct bpw_node *node,
+    uint8_t ref_size) {
+  switch (node->type) {
+    case BPW_DICT:
+      return bpw_marker_length(node->length) + 2 * node->length * ref_size;
+    case BPW_UINT:
+      return bpw_int_length(node->value);
+    case BPW_BOOL:
+      return 1;
+    default:
+      return bpw_marker_length(node->length) + node->length;
+  }
+}
+
+// @result the index after the node and, if it's a dict, its entries, or 0
+//   if the nodes are invalid
+static size_t bpw_skip(const struct bpw_node *nodes, size_t num_nodes,
+    size_t i) {
+  if (i >= num_nodes) {
+    return 0;
+  }
+  size_t j = i + 1;
+  if (nodes[i].type == BPW_DICT) {
+    size_t k;
+    for (k = 0; k < nodes[i].length; k++) {
+      if (j >= num_nodes || nodes[j].type != BPW_KEY) {
+        return 0;
+      }
+      j = bpw_skip(nodes, num_nodes, j + 1);
+      if (!j) {
+        return 0;
+      }
+    }
+  }
+  return j;
+}
+
+// As libplist's plist_data_compare, which decides which objects are only
+// written once
+static bool bpw_is_equal(const struct bpw_node *a, const struct bpw_node *b) {
+  if (a->type != b->type) {
+    return false;
+  }
+  switch (a->type) {
+    case BPW_KEY:
+    case BPW_STRING:
+      return (a->length == b->length &&
+          !memcmp(a->data, b->data, a->length));
+    case BPW_UINT:
+      return (a->value == b->value);
+    case BPW_BOOL:
+      return (!a->value == !b->value);
+    default:
+      // libplist hashes dicts and data by their address
+      return false;
+  }
+}
+
+int bpw_plan(struct bpw_plan *plan, const struct bpw_node *nodes,
+    size_t num_nodes) {
+  if (!plan || !nodes || !num_nodes || num_nodes > BPW_MAX_NODES ||
+      bpw_skip(nodes, num_nodes, 0) != num_nodes) {
+    return -1;
+  }
+  memset(plan, 0, sizeof(struct bpw_plan));
+  plan->nodes = nodes;
+  plan->num_nodes = num_nodes;
+
+  size_t num_objects = 0;
+  size_t i;
+  for (i = 0; i < num_nodes; i++) {
+    const struct bpw_node *node = nodes + i;
+    if (node->type == BPW_KEY || node->type == BPW_STRING) {
+      size_t j;
+      for (j = 0; j < node->length; j++) {
+        if ((unsigned char)node->data[j] >= 0x80) {
+          return -1;
+        }
+      }
+    } else if (node->type < BPW_DICT || node->type > BPW_DATA) {
+      return -1;
+    }
+    size_t j;
+    for (j = 0; j < i && !bpw_is_equal(nodes + j, node); j++) {
+    }
+    plan->refs[i] = (j < i ? plan->refs[j] : num_objects++);
+  }
+  plan->num_objects = num_objects;
+  plan->ref_size = bpw_needed_bytes(num_objects);
+
+  size_t length = BPW_MAGIC_LENGTH;
+  size_t next = 0;
+  for (i = 0; i < num_nodes; i++) {
+    if (plan->refs[i] == next) {
+      plan->offsets[next++] = length;
+      length += bpw_object_length(nodes + i, plan->ref_size);
+    }
+  }
+  plan->offset_table_offset = length;
+  plan->offset_size = bpw_needed_bytes(length);
+  plan->length = (length + num_objects * plan->offset_size +
+      BPW_TRAILER_LENGTH);
+  return 0;
+}
+
+size_t bpw_data_offset(const struct bpw_plan *plan, size_t node_index) {
+  const struct bpw_node *node = plan->nodes + node_index;
+  return (plan->offsets[plan->refs[node_index]] +
+      bpw_marker_length(node->length));
+}
+
+// write a big-endian int of the given size
+static char *bpw_write_be(char *tail, uint64_t value, uint8_t size) {
+  uint8_t i;
+  for (i = size; i > 0; i--) {
+    *tail++ = (char)(value >> ((i - 1) * 8));
+  }
+  return tail;
+}
+
+static char *bpw_write_int(char *tail, uint64_t value) {
+  uint8_t size = bpw_needed_bytes(value);
+  *tail++ = BPW_MARK_UINT | (size == 1 ? 0 : size == 2 ? 1 : size == 4 ? 2 :
+      3);
+  return bpw_write_be(tail, value, size);
+}
+
+static char *bpw_write_marker(char *tail, uint8_t mark, size_t length) {
+  *tail++ = mark | (length < 15 ? length : 0xF);
+  if (length >= 15) {
+    tail = bpw_write_int(tail, length);
+  }
+  return tail;
+}
+
+void bpw_write(const struct bpw_plan *plan, char *buf) {
+  const struct bpw_node *nodes = plan->nodes;
+  uint8_t ref_size = plan->ref_size;
+  memcpy(buf, BPW_MAGIC, BPW_MAGIC_LENGTH);
+  char *tail = buf + BPW_MAGIC_LENGTH;
+
+  size_t next = 0;
+  size_t i;
+  for (i = 0; i < plan->num_nodes; i++) {
+    if (plan->refs[i] != next) {
+      continue;  // already written
+    }
+    next++;
+    const struct bpw_node *node = nodes + i;
+    switch (node->type) {
+      case BPW_DICT:
+        {
+          // the key refs, then the value refs
+          tail = bpw_write_marker(tail, BPW_MARK_DICT, node->length);
+          char *value_tail = tail + node->length * ref_size;
+          size_t j = i + 1;
+          size_t k;
+          for (k = 0; k < node->length; k++) {
+            tail = bpw_write_be(tail, plan->refs[j], ref_size);
+            value_tail = bpw_write_be(value_tail, plan->refs[j + 1],
+                ref_size);
+            j = bpw_skip(nodes, plan->num_nodes, j + 1);
+          }
+          tail = value_tail;
+        }
+        break;
+      case BPW_UINT:
+        tail = bpw_write_int(tail, node->value);
+        break;
+      case BPW_BOOL:
+        *tail++ = (node->value ? BPW_MARK_TRUE : BPW_MARK_FALSE);
+        break;
+      case BPW_DATA:
+        tail = bpw_write_marker(tail, BPW_MARK_DATA, node->length);
+        if (tail != node->data) {
+          memcpy(tail, node->data, node->length);
+        }
+        tail += node->length;
+        break;
+      default:
+        // keys and strings are both ASCII strings
+        tail = bpw_write_marker(tail, BPW_MARK_STRING, node->length);
+        memcpy(tail, node->data, node->length);
+        tail += node->length;
+        break;
+    }
+  }
+
+  for (i = 0; i < plan->num_objects; i++) {
+    tail = bpw_write_be(tail, plan->offsets[i], plan->offset_size);
+  }
+
+  // trailer
+  memset(tail, 0, 6);
+  tail += 6;
+  *tail++ = plan->offset_size;
+  *tail++ = ref_size;
+  tail = bpw_write_be(tail, plan->num_objects, 8);
+  tail = bpw_write_be(tail, 0, 8);  // the root object
+  bpw_write_be(tail, plan->offset_table_offset, 8);
+}
@@ -0,0 +1,78 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+// Copyright 2014 Google Inc. wrightt@google.com
+
+//
+// A binary plist ("bplist00") writer for our hot-path rpc messages.
+//
+// It writes the same bytes as libplist's plist_to_bin, i.e. the objects in
+// depth-first order with each dict key before its value, equal keys and
+// strings written once, and the smallest int, ref and offset sizes, but
+// straight from the caller's values, without building plist nodes.
+//
+
+#ifndef BPLIST_WRITER_H
+#define	BPLIST_WRITER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+typedef uint8_t bpw_type;
+#define BPW_DICT   1
+#define BPW_KEY    2
+#define BPW_STRING 3
+#define BPW_UINT   4
+#define BPW_BOOL   5
+#define BPW_DATA   6
+
+// Max nodes per plist
+#define BPW_MAX_NODES 32
+
+// A plist node.  A dict is followed by its keys and values, in depth-first
+// order, e.g. {"a": 1} is:
+//   {BPW_DICT, NULL, 1}, {BPW_KEY, "a", 1}, {BPW_UINT, NULL, 0, 1}
+struct bpw_node {
+  bpw_type type;
+  const char *data;  // of a key, string or data
+  size_t length;     // of the data, or the number of dict entries
+  uint64_t value;    // of a uint or bool
+};
+
+// A constant key, whose length is computed at compile time
+#define BPW_KEY_NODE(key) {BPW_KEY, key, sizeof(key) - 1, 0}
+
+struct bpw_plan {
+  const struct bpw_node *nodes;
+  size_t num_nodes;
+  size_t refs[BPW_MAX_NODES];  // each node's object index
+  size_t offsets[BPW_MAX_NODES];  // each object's offset in the plist
+  size_t num_objects;
+  uint8_t ref_size;
+  uint8_t offset_size;
+  size_t offset_table_offset;
+  size_t length;  // of the plist
+};
+
+// Lays out the plist of the nodes, which must stay valid until bpw_write.
+// @result 0 if ok, or -1 if we can't write it, e.g. a non-ASCII string,
+//   which libplist writes as UTF-16
+int bpw_plan(struct bpw_plan *plan, const struct bpw_node *nodes,
+    size_t num_nodes);
+
+// @result the offset of a key's, string's or data's bytes in the plist
+size_t bpw_data_offset(const struct bpw_plan *plan, size_t node_index);
+
+// Writes plan->length bytes.  A data node whose bytes are already in place,
+// at buf + bpw_data_offset, isn't copied.
+void bpw_write(const struct bpw_plan *plan, char *buf);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* BPLIST_WRITER_H */
@@ -6,15 +6,252 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "char_buffer.h"
 
 #define MIN_LENGTH 1024
 
+// The pool's size classes are MIN_LENGTH << i, up to CB_POOL_MAX_CLASS, each
+// with a list of released buffers that are linked through their first bytes.
+// Each thread has its own lists and stats, so our event loops don't lock.
+#define CB_NUM_CLASSES 11
+
+struct cb_pool_block {
+  struct cb_pool_block *next;
+};
+
+static __thread struct cb_pool_block *cb_pool_lists[CB_NUM_CLASSES];
+static __thread struct cb_pool_stats cb_pool_stats;
+
+// @result the length of the buffer for this many bytes, i.e. its size class
+static size_t cb_pool_length(size_t needed) {
+  size_t length = MIN_LENGTH;
+  if (needed > CB_POOL_MAX_CLASS) {
+    return needed;
+  }
+  while (length < needed) {
+    length <<= 1;
+  }
+  return length;
+}
+
+// @param length a cb_pool_length
+static int cb_pool_class(size_t length) {
+  int i;
+  for (i = 0; i < CB_NUM_CLASSES; i++) {
+    if (length == ((size_t)MIN_LENGTH << i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void cb_pool_used(size_t length) {
+  cb_pool_stats.used_length += length;
+  if (cb_pool_stats.peak_used_length < cb_pool_stats.used_length) {
+    cb_pool_stats.peak_used_length = cb_pool_stats.used_length;
+  }
+}
+
+// A buffer from another thread's pool may be released into ours, so our
+// used_length can't go below zero
+static void cb_pool_unused(size_t length) {
+  cb_pool_stats.used_length -= (cb_pool_stats.used_length < length ?
+      cb_pool_stats.used_length : length);
+}
+
+// @param length a cb_pool_length
+static char *cb_pool_get(size_t length) {
+  int i = cb_pool_class(length);
+  struct cb_pool_block *block = (i < 0 ? NULL : cb_pool_lists[i]);
+  if (block) {
+    cb_pool_lists[i] = block->next;
+    cb_pool_stats.pooled_length -= length;
+    cb_pool_stats.num_reuses++;
+  } else {
+    block = (struct cb_pool_block *)malloc(length);
+    if (!block) {
+      return NULL;
+    }
+  }
+  cb_pool_stats.num_gets++;
+  cb_pool_used(length);
+  return (char *)block;
+}
+
+static void cb_pool_put(char *buf, size_t length) {
+  cb_pool_stats.num_puts++;
+  cb_pool_unused(length);
+  int i = cb_pool_class(length);
+  if (i < 0 || cb_pool_stats.pooled_length + length > CB_POOL_MAX_LENGTH) {
+    cb_pool_stats.num_frees++;
+    free(buf);
+    return;
+  }
+  struct cb_pool_block *block = (struct cb_pool_block *)buf;
+  block->next = cb_pool_lists[i];
+  cb_pool_lists[i] = block;
+  cb_pool_stats.pooled_length += length;
+}
+
+void cb_pool_get_stats(struct cb_pool_stats *to_stats) {
+  *to_stats = cb_pool_stats;
+}
+
+void cb_pool_trim() {
+  int i;
+  for (i = 0; i < CB_NUM_CLASSES; i++) {
+    while (cb_pool_lists[i]) {
+      struct cb_pool_block *block = cb_pool_lists[i];
+      cb_pool_lists[i] = block->next;
+      free(block);
+      cb_pool_stats.num_frees++;
+    }
+  }
+  cb_pool_stats.pooled_length = 0;
+}
+
+static size_t cb_ring_min_length() {
+  long page_length = -1;
+#ifdef HAVE_MEMFD_CREATE
+  page_length = sysconf(_SC_PAGESIZE);
+#endif
+  return (page_length > 0 ? (size_t)page_length : MIN_LENGTH);
+}
+
+// Maps a ring's memory twice in a row.
+// @result its begin, or NULL if that's not supported
+static char *cb_ring_map(size_t length) {
+  char *ret = NULL;
+#ifdef HAVE_MEMFD_CREATE
+  int fd = memfd_create("cb_ring", MFD_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (!ftruncate(fd, length)) {
+    // reserve both halves, then map the memory over each of them
+    char *begin = (char *)mmap(NULL, 2 * length, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (begin != MAP_FAILED) {
+      if (mmap(begin, length, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+          mmap(begin + length, length, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED) {
+        ret = begin;
+      } else {
+        munmap(begin, 2 * length);
+      }
+    }
+  }
+  close(fd);
+#endif
+  return ret;
+}
+
+static void cb_ring_unmap(cb_t self) {
+#ifdef HAVE_MEMFD_CREATE
+  munmap(self->begin, 2 * self->ring_length);
+#endif
+  cb_pool_unused(self->ring_length);
+  self->begin = NULL;
+  self->head = NULL;
+  self->tail = NULL;
+  self->end = NULL;
+  self->ring_length = 0;
+}
+
+// Once the head is in the second mapping, move both pointers back to the
+// same bytes in the first one, instead of moving the bytes.
+static void cb_ring_wrap(cb_t self) {
+  if (self->head >= self->begin + self->ring_length) {
+    self->head -= self->ring_length;
+    self->tail -= self->ring_length;
+  }
+  self->end = self->head + self->ring_length;
+}
+
+// Moves our bytes to a plain pooled buffer, with room for needed more.
+static int cb_ring_spill(cb_t self, size_t needed) {
+  size_t used = self->tail - self->head;
+  size_t length = cb_pool_length(used + needed);
+  char *new_begin = cb_pool_get(length);
+  if (!new_begin) {
+    perror("Unable to allocate buffer");
+    return -1;
+  }
+  if (used) {
+    memcpy(new_begin, self->head, used);
+  }
+  if (self->begin) {
+    cb_ring_unmap(self);
+  }
+  self->is_ring = false;
+  self->is_spilled = true;
+  self->begin = new_begin;
+  self->head = new_begin;
+  self->tail = new_begin + used;
+  self->end = new_begin + length;
+  return 0;
+}
+
+static int cb_ring_ensure_capacity(cb_t self, size_t needed) {
+  size_t used = self->tail - self->head;
+  size_t length = self->ring_length;
+  if (self->begin && needed <= length - used) {
+    if (!used) {
+      self->head = self->begin;
+      self->tail = self->begin;
+      self->end = self->begin + length;
+    }
+    return 0;
+  }
+  if (needed > SIZE_MAX / 4 - used) {
+    return -1;
+  }
+  // a multiple of the page size, which is a power of two
+  size_t new_length = (length ? 2 * length : cb_ring_min_length());
+  while (new_length < used + needed) {
+    new_length <<= 1;
+  }
+  if (new_length > CB_RING_MAX_LENGTH) {
+    // too big to keep mapped, so be a plain cb until we're shrunk
+    return cb_ring_spill(self, needed);
+  }
+  char *new_begin = cb_ring_map(new_length);
+  if (!new_begin) {
+    if (self->begin) {
+      perror("Unable to resize ring buffer");
+      return -1;
+    }
+    // not supported, so be a plain cb
+    self->is_ring = false;
+    return cb_ensure_capacity(self, needed);
+  }
+  if (used) {
+    memcpy(new_begin, self->head, used);
+  }
+  if (self->begin) {
+    cb_ring_unmap(self);
+  }
+  cb_pool_used(new_length);
+  self->begin = new_begin;
+  self->head = new_begin;
+  self->tail = new_begin + used;
+  self->end = new_begin + new_length;
+  self->ring_length = new_length;
+  return 0;
+}
+
 cb_t cb_new() {
   cb_t self = (cb_t)malloc(sizeof(struct cb_struct));
   if (self) {
@@ -23,10 +260,20 @@ cb_t cb_new() {
   return self;
 }
 
+cb_t cb_new_ring() {
+  cb_t self = cb_new();
+  if (self) {
+    self->is_ring = true;
+  }
+  return self;
+}
+
 void cb_free(cb_t self) {
   if (self) {
-    if (self->begin) {
-      free(self->begin);
+    if (self->is_ring && self->begin) {
+      cb_ring_unmap(self);
+    } else if (self->begin) {
+      cb_pool_put(self->begin, self->end - self->begin);
     }
     free(self);
   }
@@ -35,12 +282,39 @@ void cb_free(cb_t self) {
 void cb_clear(cb_t self) {
   self->head = self->begin;
   self->tail = self->begin;
+  if (self->is_ring) {
+    self->end = self->begin + self->ring_length;
+  }
+}
+
+void cb_shrink(cb_t self) {
+  if (!self->begin || self->head != self->tail || self->in_head) {
+    return;
+  }
+  if (self->is_ring) {
+    // at most CB_RING_MAX_LENGTH, which is cheaper to keep than to remap
+    return;
+  }
+  if (self->end - self->begin > CB_SHRINK_LENGTH) {
+    cb_pool_put(self->begin, self->end - self->begin);
+    self->begin = NULL;
+    self->head = NULL;
+    self->tail = NULL;
+    self->end = NULL;
+    if (self->is_spilled) {
+      self->is_ring = true;
+      self->is_spilled = false;
+    }
+  }
 }
 
 int cb_ensure_capacity(cb_t self, size_t needed) {
+  if (self->is_ring) {
+    return cb_ring_ensure_capacity(self, needed);
+  }
   if (!self->begin) {
-    size_t length = (needed > MIN_LENGTH ? needed : MIN_LENGTH);
-    self->begin = (char *)malloc(length * sizeof(char));
+    size_t length = cb_pool_length(needed);
+    self->begin = cb_pool_get(length);
     if (!self->begin) {
       perror("Unable to allocate buffer");
       return -1;
@@ -58,22 +332,33 @@ int cb_ensure_capacity(cb_t self, size_t needed) {
   size_t avail = self->end - self->tail;
   if (needed > avail) {
     size_t offset = self->head - self->begin;
-    if (offset) {
-      if (used) {
-        memmove(self->begin, self->head, used);
-      }
-      self->head = self->begin;
-      self->tail = self->begin + used;
-      avail += offset;
-    }
-    if (needed > avail) {
-      size_t length = self->end - self->begin;
+    size_t length = self->end - self->begin;
+    if (needed > avail + offset) {
       size_t new_length = used + needed;
       if (new_length < 1.5 * length) {
         new_length = 1.5 * length;
       }
-      char *new_begin = (char*)realloc(self->begin,
-          new_length * sizeof(char));
+      new_length = cb_pool_length(new_length);
+      char *new_begin;
+      if (length > CB_POOL_MAX_CLASS) {
+        // too big for the pool, so let realloc move it, or not
+        if (offset && used) {
+          memmove(self->begin, self->head, used);
+        }
+        self->head = self->begin;
+        self->tail = self->begin + used;
+        new_begin = (char*)realloc(self->begin, new_length * sizeof(char));
+        if (new_begin) {
+          cb_pool_unused(length);
+          cb_pool_used(new_length);
+        }
+      } else {
+        new_begin = cb_pool_get(new_length);
+        if (new_begin) {
+          memcpy(new_begin, self->head, used);
+          cb_pool_put(self->begin, length);
+        }
+      }
       if (!new_begin) {
         perror("Unable to resize buffer");
         return -1;
@@ -82,6 +367,12 @@ int cb_ensure_capacity(cb_t self, size_t needed) {
       self->head = new_begin;
       self->tail = new_begin + used;
       self->end = new_begin + new_length;
+    } else if (offset) {
+      if (used) {
+        memmove(self->begin, self->head, used);
+      }
+      self->head = self->begin;
+      self->tail = self->begin + used;
     }
   }
   return 0;
@@ -111,9 +402,12 @@ int cb_begin_input(cb_t self, const char *buf, ssize_t length) {
   return 0;
 }
 
+int cb_is_input_shared(cb_t self) {
+  return (!self->begin || self->in_tail != self->tail);
+}
+
 int cb_end_input(cb_t self) {
-  int did_share = (!self->begin || self->in_tail != self->tail);
-  if (did_share) {
+  if (cb_is_input_shared(self)) {
     size_t length = self->in_tail - self->in_head;
     if (length > 0) {
       // We used the input buf as-is, but some bytes remain, so save them
@@ -125,6 +419,9 @@ int cb_end_input(cb_t self) {
     }
   } else {
     self->head += self->in_head - self->head;
+    if (self->is_ring) {
+      cb_ring_wrap(self);
+    }
   }
   self->in_head = NULL;
   self->in_tail = NULL;
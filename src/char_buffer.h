@@ -10,6 +10,7 @@ extern "C" {
 #endif
 
 
+#include <stdbool.h>
 #include <stdlib.h>
 
 
@@ -21,17 +22,74 @@ struct cb_struct {
 
   const char *in_head;
   const char *in_tail;
+
+  bool is_ring;
+  size_t ring_length;  // of its memory, which is mapped twice from begin
+  bool is_spilled;  // a ring that's a plain cb until it's shrunk
 };
 typedef struct cb_struct *cb_t;
 
 cb_t cb_new();
 
+// Like cb_new, but for a stream that's consumed from the head as it's
+// appended to the tail, e.g. our receive loops.  Its buffer is a ring whose
+// memory is mapped twice in a row, so the bytes from head to tail are
+// contiguous even when they wrap around, and they're never moved to make
+// room.  Its end is always ring_length bytes after its head.  If we can't
+// map one, e.g. there's no memfd_create, then it's a plain cb.
+//
+// Remapping a ring is far slower than reusing a pooled buffer, so cb_shrink
+// doesn't unmap it, and instead a ring is never mapped bigger than
+// CB_RING_MAX_LENGTH.  If it needs to be, e.g. for one huge message, then
+// its bytes are moved to a plain pooled buffer, which cb_shrink releases
+// once the message is done.
+cb_t cb_new_ring();
+
+#define CB_RING_MAX_LENGTH (1 << 20)
+
 void cb_free(cb_t buffer);
 
 void cb_clear(cb_t buffer);
 
 int cb_ensure_capacity(cb_t self, size_t needed);
 
+// Returns the buffer to the pool if it's empty and bigger than
+// CB_SHRINK_LENGTH, e.g. once a big message is done, so it isn't pinned
+// until the cb is free'd.  A ring's mapping is kept, see cb_new_ring.
+void cb_shrink(cb_t self);
+
+#define CB_SHRINK_LENGTH (1 << 16)
+
+
+// Our buffers are allocated from a pool.  Buffers of up to CB_POOL_MAX_CLASS
+// bytes are sized to a power of two and, once released, are kept for reuse,
+// up to CB_POOL_MAX_LENGTH bytes in all.  Bigger buffers are malloc'd and
+// free'd as usual.
+//
+// Each thread has its own pool, e.g. each --workers event loop, so the
+// cb_pool_* calls below only see the calling thread's pool.  A cb should be
+// free'd on the thread that created it, and a thread should cb_pool_trim
+// before it exits, else its pooled buffers are leaked.  A cb that's free'd
+// on another thread is safe, but its buffer moves to that thread's pool.
+#define CB_POOL_MAX_CLASS (1 << 20)
+#define CB_POOL_MAX_LENGTH (1 << 23)
+
+struct cb_pool_stats {
+  size_t num_gets;     // buffers allocated
+  size_t num_reuses;   // of which were reused from the pool
+  size_t num_puts;     // buffers released
+  size_t num_frees;    // of which were free'd, e.g. the pool was full
+  size_t used_length;  // bytes in buffers that are in use
+  size_t peak_used_length;
+  size_t pooled_length;  // bytes in buffers that are kept for reuse
+};
+
+void cb_pool_get_stats(struct cb_pool_stats *to_stats);
+
+// Frees the calling thread's buffers that are kept for reuse, e.g. when
+// we're idle.
+void cb_pool_trim();
+
 // Instead of copying our input into our my->in, e.g.:
 //    cb_ensure_capacity(my->in, length);
 //    memcpy(my->in->tail, buf, length);
@@ -40,6 +98,10 @@ int cb_ensure_capacity(cb_t self, size_t needed);
 // "my->in_head".
 int cb_begin_input(cb_t self, const char *buf, ssize_t length);
 
+// @result true if the "in_head" points into the caller's buf, else it
+// points into our own buffer, which the caller may modify in place.
+int cb_is_input_shared(cb_t self);
+
 int cb_end_input(cb_t self);
 
 
@@ -335,7 +335,7 @@ dl_status dl_on_recv(dl_t self, const char *buf, ssize_t length) {
 dl_t dl_new() {
   dl_t self = (dl_t)malloc(sizeof(struct dl_struct));
   dl_private_t my = (dl_private_t)malloc(sizeof(struct dl_private));
-  cb_t in = cb_new();
+  cb_t in = cb_new_ring();
   ht_t d_ht = ht_new(HT_INT_KEYS);
   if (!self || !my || !in || !d_ht) {
     free(self);
@@ -1,9 +1,15 @@
-
 // Google BSD license https://developers.google.com/google-bsd-license
 // Copyright 2012 Google Inc. wrightt@google.com
 
 //
-// A basic hash table, could be easily enhanced...
+// An open-addressing hash table with linear probing.
+//
+// The capacity is a power of two, so a bucket is just (hash & mask), and
+// the table is rehashed into a new array whenever a put would push the
+// live+removed entries past 3/4 of the capacity.  Each entry caches its
+// hash, so a probe only calls on_cmp for likely matches.  Removed entries
+// leave a "tombstone" so later probes continue past them, and are purged
+// by the next rehash.  Reads never modify the table.
 //
 
 #ifdef HAVE_CONFIG_H
@@ -15,27 +21,50 @@
 
 #include "hash_table.h"
 
-// constant for now, but we could easily resize & rehash
-#define NUM_BUCKETS 3
+#define MIN_CAPACITY 8
 
 struct ht_entry_struct {
   intptr_t hc;
   void *key;
-  void *value;
-  ht_entry_t next;
+  void *value;  // NULL if empty, ht_tombstone if removed
 };
 
+// marks a removed entry
+static char ht_tombstone_value;
+#define HT_TOMBSTONE ((void *)&ht_tombstone_value)
 
+// Spread all the hash bits into the low bits that we mask, since int keys
+// (e.g. fds) and custom on_hash's are often sequential or aligned.
+static inline size_t ht_mix(intptr_t hc) {
+  uintptr_t h = (uintptr_t)hc;
+#if UINTPTR_MAX > 0xffffffffu
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+#else
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+#endif
+  return (size_t)h;
+}
+
+// FNV-1a
 intptr_t on_strhash(ht_t ht, const void *key) {
-  int hc = 0;
-  char *s = (char *)key;
+  uint64_t hc = 0xcbf29ce484222325ULL;
+  const unsigned char *s = (const unsigned char *)key;
   if (s) {
-    int ch;
+    unsigned char ch;
     while ((ch = *s++)) {
-      hc = ((hc << 5) + hc) ^ ch;
+      hc ^= ch;
+      hc *= 0x100000001b3ULL;
     }
   }
-  return hc;
+  return (intptr_t)hc;
 }
 intptr_t on_strcmp(ht_t ht, const void *key1, const void *key2) {
   if (key1 == key2 || !key1 || !key2) {
@@ -45,24 +74,17 @@ intptr_t on_strcmp(ht_t ht, const void *key1, const void *key2) {
 }
 
 void ht_clear(ht_t self) {
-  size_t i;
-  for (i = 0; i < self->num_buckets; i++) {
-    ht_entry_t curr = self->buckets[i];
-    while (curr) {
-      ht_entry_t next = curr->next;
-      memset(curr, 0, sizeof(struct ht_entry_struct));
-      free(curr);
-      self->num_keys--;
-      curr = next;
-    }
-    self->buckets[i] = NULL;
+  if (self->entries) {
+    memset(self->entries, 0,
+        self->capacity * sizeof(struct ht_entry_struct));
   }
+  self->num_keys = 0;
+  self->num_used = 0;
 }
 
 void ht_free(ht_t self) {
   if (self) {
-    ht_clear(self);
-    free(self->buckets);
+    free(self->entries);
     memset(self, 0, sizeof(struct ht_struct));
     free(self);
   }
@@ -71,10 +93,8 @@ void ht_free(ht_t self) {
 ht_t ht_new(enum ht_key_type type) {
   ht_t self = (ht_t)malloc(sizeof(struct ht_struct));
   if (self) {
+    // the entries are allocated by the first put
     memset(self, 0, sizeof(struct ht_struct));
-    self->num_buckets = NUM_BUCKETS;
-    self->buckets = (ht_entry_t *)calloc(self->num_buckets,
-        sizeof(ht_entry_t));
     if (type == HT_STRING_KEYS) {
       self->on_hash = on_strhash;
       self->on_cmp = on_strcmp;
@@ -87,46 +107,61 @@ size_t ht_size(ht_t self) {
   return self->num_keys;
 }
 
-void ht_find(ht_t self, const void *key, intptr_t *to_hc,
-    ht_entry_t **to_head, ht_entry_t *to_prev, ht_entry_t *to_curr) {
-  intptr_t hc = (self->on_hash ? self->on_hash(self, key) : (intptr_t)key);
-  ht_entry_t *head = self->buckets + (hc % self->num_buckets);
-  ht_entry_t prev = NULL;
-  ht_entry_t curr = *head;
-  for (; curr && !(curr->hc == hc &&
-      (self->on_cmp ? !self->on_cmp(self, curr->key, key) :
-       curr->key == key));
-      prev = curr, curr = curr->next) {
-  }
-  *to_head = head;
-  *to_prev = prev;
-  *to_curr = curr;
-  if (to_hc) {
-    *to_hc = hc;
-  }
-  // Instead of setting a "prev", we could set a "pointer-to-current":
-  //     pp = head if no prev else &prev->next
-  // which would (e.g.) simplify our caller's removal code from:
-  //     if (prev) prev->next = curr->next; else *head = curr->next;
-  // to:
-  //     *pp = curr->next;
-  // but I think the explicit prev is easier to understand.
+static inline intptr_t ht_hash(ht_t self, const void *key) {
+  return (self->on_hash ? self->on_hash(self, key) : (intptr_t)key);
+}
+
+// @result the live entry for the key, else NULL
+ht_entry_t ht_find(ht_t self, const void *key, intptr_t hc) {
+  if (!self->num_keys) {
+    return NULL;
+  }
+  size_t mask = self->capacity - 1;
+  size_t i = ht_mix(hc) & mask;
+  for (;; i = (i + 1) & mask) {
+    ht_entry_t curr = self->entries + i;
+    if (!curr->value) {
+      return NULL;
+    }
+    if (curr->hc == hc && curr->value != HT_TOMBSTONE &&
+        (self->on_cmp ? !self->on_cmp(self, curr->key, key) :
+         curr->key == key)) {
+      return curr;
+    }
+  }
+}
+
+// Move the live entries into a new array of the given capacity.
+int ht_rehash(ht_t self, size_t capacity) {
+  ht_entry_t entries = (ht_entry_t)calloc(capacity,
+      sizeof(struct ht_entry_struct));
+  if (!entries) {
+    return -1;
+  }
+  size_t mask = capacity - 1;
+  size_t i;
+  for (i = 0; i < self->capacity; i++) {
+    ht_entry_t curr = self->entries + i;
+    if (curr->value && curr->value != HT_TOMBSTONE) {
+      size_t j = ht_mix(curr->hc) & mask;
+      while (entries[j].value) {
+        j = (j + 1) & mask;
+      }
+      entries[j] = *curr;
+    }
+  }
+  free(self->entries);
+  self->entries = entries;
+  self->capacity = capacity;
+  self->num_used = self->num_keys;
+  return 0;
 }
 
 void *ht_get(ht_t self, const void *key, int want_key) {
-  ht_entry_t *head;
-  ht_entry_t prev;
-  ht_entry_t curr;
-  ht_find(self, key, NULL, &head, &prev, &curr);
+  ht_entry_t curr = ht_find(self, key, ht_hash(self, key));
   if (!curr) {
     return NULL;
   }
-  if (prev) {
-    // optional move-to-front
-    prev->next = curr->next;
-    curr->next = *head;
-    *head = curr;
-  }
   return (want_key ? curr->key : curr->value);
 }
 void *ht_get_key(ht_t self, const void *key) {
@@ -137,54 +172,58 @@ void *ht_get_value(ht_t self, const void *key) {
 }
 
 void *ht_remove(ht_t self, const void *key) {
-  ht_entry_t *head;
-  ht_entry_t prev;
-  ht_entry_t curr;
-  ht_find(self, key, NULL, &head, &prev, &curr);
-  void *ret = (curr ? curr->value : NULL);
-  if (curr) {
-    if (prev) {
-      prev->next = curr->next;
-    } else {
-      *head = curr->next;
-    }
-    free(curr);
-    self->num_keys--;
+  ht_entry_t curr = ht_find(self, key, ht_hash(self, key));
+  if (!curr) {
+    return NULL;
   }
+  void *ret = curr->value;
+  curr->key = NULL;
+  curr->value = HT_TOMBSTONE;
+  self->num_keys--;
   return ret;
 }
 
 void *ht_put(ht_t self, void *key, void *value) {
-  ht_entry_t *head;
-  ht_entry_t prev;
-  ht_entry_t curr;
-  intptr_t hc;
-  ht_find(self, key, &hc, &head, &prev, &curr);
-  void *ret = (curr ? curr->value : NULL);
+  intptr_t hc = ht_hash(self, key);
+  ht_entry_t curr = ht_find(self, key, hc);
   if (curr) {
+    void *ret = curr->value;
     if (value) {
       curr->value = value;
     } else {
-      if (prev) {
-        prev->next = curr->next;
-      } else {
-        *head = curr->next;
-      }
-      free(curr);
+      curr->key = NULL;
+      curr->value = HT_TOMBSTONE;
       self->num_keys--;
     }
-  } else if (value) {
-    curr = (ht_entry_t)malloc(sizeof(struct ht_entry_struct));
-    // if (!curr) ?
-    memset(curr, 0, sizeof(struct ht_entry_struct));
-    curr->hc = hc;
-    curr->key = key;
-    curr->value = value;
-    curr->next = *head;
-    *head = curr;
-    self->num_keys++;
+    return ret;
   }
-  return ret;
+  if (!value) {
+    return NULL;
+  }
+  if ((self->num_used + 1) * 4 > self->capacity * 3) {
+    // grow, or shrink, to at most half full, which also drops tombstones
+    size_t capacity = MIN_CAPACITY;
+    while (capacity < (self->num_keys + 1) * 2) {
+      capacity <<= 1;
+    }
+    if (ht_rehash(self, capacity)) {
+      return NULL;
+    }
+  }
+  size_t mask = self->capacity - 1;
+  size_t i = ht_mix(hc) & mask;
+  while (self->entries[i].value && self->entries[i].value != HT_TOMBSTONE) {
+    i = (i + 1) & mask;
+  }
+  curr = self->entries + i;
+  if (!curr->value) {
+    self->num_used++;
+  }
+  curr->hc = hc;
+  curr->key = key;
+  curr->value = value;
+  self->num_keys++;
+  return NULL;
 }
 
 void **ht_get_all(ht_t self, int want_key) {
@@ -192,9 +231,9 @@ void **ht_get_all(ht_t self, int want_key) {
   if (ret) {
     void **tail = ret;
     size_t i;
-    for (i = 0; i < self->num_buckets; i++) {
-      ht_entry_t curr;
-      for (curr = self->buckets[i]; curr; curr = curr->next) {
+    for (i = 0; i < self->capacity; i++) {
+      ht_entry_t curr = self->entries + i;
+      if (curr->value && curr->value != HT_TOMBSTONE) {
         *tail++ = (want_key ? curr->key : curr->value);
       }
     }
@@ -206,4 +245,41 @@ void **ht_keys(ht_t self) {
 }
 void **ht_values(ht_t self) {
   return ht_get_all(self, 0);
-}
\ No newline at end of file
+}
+
+bool ht_next(ht_t self, size_t *iter, void **to_key, void **to_value) {
+  if (!self) {
+    return false;
+  }
+  // removes only leave tombstones, so the entries don't move under us
+  size_t i;
+  for (i = *iter; i < self->capacity; i++) {
+    ht_entry_t curr = self->entries + i;
+    if (curr->value && curr->value != HT_TOMBSTONE) {
+      if (to_key) {
+        *to_key = curr->key;
+      }
+      if (to_value) {
+        *to_value = curr->value;
+      }
+      *iter = i + 1;
+      return true;
+    }
+  }
+  *iter = i;
+  return false;
+}
+
+int ht_foreach(ht_t self, int (*callback)(ht_t self, void *key, void *value,
+      void *arg), void *arg) {
+  size_t iter = 0;
+  void *key;
+  void *value;
+  while (ht_next(self, &iter, &key, &value)) {
+    int ret = callback(self, key, value, arg);
+    if (ret) {
+      return ret;
+    }
+  }
+  return 0;
+}
@@ -12,6 +12,8 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 // cast int to void*
@@ -50,6 +52,22 @@ void *ht_put(ht_t self, void *key, void *value);
 void **ht_keys(ht_t self);
 void **ht_values(ht_t self);
 
+// Iterate without allocating, e.g.:
+//     size_t iter = 0;
+//     void *key, *value;
+//     while (ht_next(ht, &iter, &key, &value)) { ... }
+// Removing entries, including the current one, is safe while iterating,
+// but putting a new key may resize the table.
+// @param to_key, to_value may be NULL
+// @result Returns false once past the last entry, or if self is NULL
+bool ht_next(ht_t self, size_t *iter, void **to_key, void **to_value);
+
+// Call the callback for each entry until it returns non-zero, with the same
+// rules as ht_next.
+// @result Returns the last callback result, else 0
+int ht_foreach(ht_t self, int (*callback)(ht_t self, void *key, void *value,
+      void *arg), void *arg);
+
 struct ht_struct {
   // Only need to set these if your using non-int keys:
   intptr_t (*on_hash)(ht_t self, const void *key);
@@ -57,8 +75,9 @@ struct ht_struct {
 
   // For internal use only:
   size_t num_keys;
-  ht_entry_t *buckets;
-  size_t num_buckets;
+  size_t num_used;  // num_keys plus removed entries, until the next rehash
+  ht_entry_t entries;
+  size_t capacity;  // a power of two, or 0 until the first put
 };
 
 
@@ -50,6 +50,19 @@ struct iwdp_private {
 #define TYPE_IWS   4
 #define TYPE_IFS   5
 
+// Close browser clients that don't send their HTTP request within this time
+#define IWDP_HANDSHAKE_TIMEOUT_MS 10000
+// Close idle keep-alive clients
+#define IWDP_IDLE_TIMEOUT_MS 60000
+// Close keep-alive clients after this many HTTP requests
+#define IWDP_MAX_HTTP_REQUESTS 1000
+// Close browser clients that send a larger DevTools message, which we'd
+// have to buffer in full to forward it to the device
+#define IWDP_MAX_MESSAGE_LENGTH (64 << 20)
+// Probe a silent inspector, then close it if the probe isn't answered
+#define IWDP_WI_IDLE_TIMEOUT_MS 30000
+#define IWDP_WI_PROBE_TIMEOUT_MS 10000
+
 /*!
  * Struct type id, for iwdp_on_recv/etc "switch" use.
  *
@@ -102,6 +115,12 @@ struct iwdp_iport_struct {
 
   // null if the device is detached
   iwdp_iwi_t iwi;
+
+  // set if another iwdp has attached this device, see on_publish
+  bool is_published;
+
+  // set while our attach_async is running, see iwdp_on_attached
+  bool is_attaching;
 };
 
 typedef struct iwdp_iport_struct *iwdp_iport_t;
@@ -129,10 +148,17 @@ struct iwdp_iwi_struct {
   uint32_t max_page_num; // > 0
   ht_t app_id_to_true;   // set of app_ids
   ht_t page_num_to_ipage;
+
+  // idle timer, see iwdp_iwi_timer
+  int timer_id;
+  bool is_active;   // recv'd since the timer was set
+  bool is_probing;  // sent a probe since the timer was set
 };
 
 iwdp_iwi_t iwdp_iwi_new(bool partials_supported, bool *is_debug);
 void iwdp_iwi_free(iwdp_iwi_t iwi);
+wi_status iwdp_send_packetv(wi_t wi, const char *header, size_t header_length,
+    char *data, size_t data_length);
 
 struct iwdp_ifs_struct;
 typedef struct iwdp_ifs_struct *iwdp_ifs_t;
@@ -166,10 +192,20 @@ struct iwdp_iws_struct {
 
   // set if the resource is /devtools/<non-page>
   iwdp_ifs_t ifs;
+
+  // handshake and idle timer, see iwdp_iws_timer
+  int timer_id;
+  bool is_active;    // recv'd since the timer was set
+  bool has_request;  // recv'd an HTTP request
+  bool is_keep_alive;  // keep the connection after our HTTP response
 };
 typedef struct iwdp_iws_struct *iwdp_iws_t;
 iwdp_iws_t iwdp_iws_new(bool *is_debug);
 void iwdp_iws_free(iwdp_iws_t iws);
+ws_status iwdp_send_datav(ws_t ws, const char *header, size_t header_length,
+    const char *payload, size_t payload_length);
+ws_status iwdp_send_http(ws_t ws, bool is_head, const char *status,
+    const char *resource, const char *content);
 
 /*!
  * Static file-system page request.
@@ -180,6 +216,7 @@ struct iwdp_ifs_struct {
 
   // static server
   int fs_fd;
+  bool is_connected;
 };
 
 iwdp_ifs_t iwdp_ifs_new();
@@ -206,6 +243,7 @@ struct iwdp_ipage_struct {
 
 iwdp_ipage_t iwdp_ipage_new();
 void iwdp_ipage_free(iwdp_ipage_t ipage);
+int iwdp_ipage_free_cb(ht_t ht, void *key, void *value, void *arg);
 int iwdp_ipage_cmp(const void *a, const void *b);
 char *iwdp_ipages_to_text(iwdp_ipage_t *ipages, bool want_json,
     const char *device_id, const char *device_name,
@@ -256,11 +294,12 @@ void iwdp_log_disconnect(iwdp_iport_t iport) {
   if (iport->iwi && iport->iwi->connected) {
     printf("Disconnected :%d from %s (%s)\n", iport->port,
         iport->device_name, iport->device_id);
-  } else {
+  } else if (iport->is_sticky || !iport->device_id ||
+      strcmp(iport->device_id, "SIMULATOR")) {
     printf("Unable to connect to %s (%s)\n  Please"
         " verify that Settings > Safari > Advanced > Web Inspector = ON\n",
         iport->device_name, iport->device_id);
-  }
+  } // else the simulator isn't running
 }
 
 
@@ -303,16 +342,13 @@ dl_status iwdp_listen(iwdp_t self, const char *device_id) {
     s_fd = self->listen(self, port);
   }
   if (s_fd < 0 && (min_port > 0 && max_port >= min_port)) {
-    iwdp_iport_t *iports = (iwdp_iport_t *)ht_values(iport_ht);
     int p;
     for (p = min_port; p <= max_port; p++) {
       bool is_taken = false;
-      iwdp_iport_t *ipp;
-      for (ipp = iports; *ipp; ipp++) {
-        if ((*ipp)->port == p) {
-          is_taken = true;
-          break;
-        }
+      size_t iter = 0;
+      void *value;
+      while (!is_taken && ht_next(iport_ht, &iter, NULL, &value)) {
+        is_taken = (((iwdp_iport_t)value)->port == p);
       }
       if (!is_taken && p != port) {
         s_fd = self->listen(self, p);
@@ -322,7 +358,6 @@ dl_status iwdp_listen(iwdp_t self, const char *device_id) {
         }
       }
     }
-    free(iports);
   }
   if (s_fd < 0) {
     return self->on_error(self, "Unable to bind %s on port %d-%d",
@@ -332,6 +367,9 @@ dl_status iwdp_listen(iwdp_t self, const char *device_id) {
   if (self->add_fd(self, s_fd, NULL, iport, true)) {
     return self->on_error(self, "add_fd s_fd=%d failed", s_fd);
   }
+  if (self->set_fd_class) {
+    self->set_fd_class(self, s_fd, IWDP_FD_CLIENT);
+  }
   iport->s_fd = s_fd;
   iport->port = port;
   if (!device_id) {
@@ -362,6 +400,9 @@ iwdp_status iwdp_start(iwdp_t self) {
   if (self->add_fd(self, dl_fd, NULL, idl, false)) {
     return self->on_error(self, "add_fd failed");
   }
+  if (self->set_fd_class) {
+    self->set_fd_class(self, dl_fd, IWDP_FD_DEVICE);
+  }
 
   dl_t dl = idl->dl;
   if (dl->start(dl)) {
@@ -387,10 +428,34 @@ dl_status iwdp_on_attach(dl_t dl, const char *device_id, int device_num) {
   if (!device_id) {
     return self->on_error(self, "Null device_id");
   }
+  if (self->dispatch) {
+    self->dispatch(self, device_id, true);
+    return DL_SUCCESS;
+  }
+  self->on_attach(self, device_id);
+  return DL_SUCCESS;
+}
+
+// Start inspecting an attached device, or connect to the simulator.
+// @param wi_fd our attach fd, or -1 if the attach failed
+// @param device_name ours to free
+// @result an error if wi_fd was not added, so the caller should close it
+iwdp_status iwdp_start_inspector(iwdp_t self, iwdp_iport_t iport, int wi_fd,
+    char *device_name, int device_os_version, void *ssl_session);
+
+// Keep this iport if its device is reattached, and publish it.
+void iwdp_iport_keep(iwdp_t self, iwdp_iport_t iport) {
+  iport->is_sticky = true;
+  if (self->publish) {
+    self->publish(self, iport->device_id, iport->device_name,
+        iport->device_os_version, iport->port, true);
+  }
+}
 
+iwdp_status iwdp_attach_device(iwdp_t self, const char *device_id) {
   if (iwdp_listen(self, device_id)) {
     // Couldn't bind browser port, or we're simply ignoring this device
-    return DL_SUCCESS;
+    return IWDP_SUCCESS;
   }
   iwdp_private_t my = self->private_state;
 
@@ -404,15 +469,64 @@ dl_status iwdp_on_attach(dl_t dl, const char *device_id, int device_num) {
   }
   if (iport->iwi) {
     self->on_error(self, "%s already on :%d", device_id, iport->port);
-    return DL_SUCCESS;
+    return IWDP_SUCCESS;
+  }
+  if (!strcmp(device_id, "SIMULATOR")) {
+    iwdp_start_inspector(self, iport, -1, NULL, 0, NULL);
+    return IWDP_SUCCESS;
   }
-  char *device_name = iport->device_name;
+  if (self->attach_async && !self->attach_async(self, device_id)) {
+    iport->is_attaching = true;
+    return IWDP_SUCCESS;  // see iwdp_on_attached
+  }
+  char *device_name = NULL;
   int device_os_version = 0;
-
-  // connect to inspector
-  int wi_fd;
   void *ssl_session = NULL;
+  int wi_fd = self->attach(self, device_id, NULL,
+      (iport->device_name ? NULL : &device_name), &device_os_version,
+      &ssl_session);
+  iwdp_start_inspector(self, iport, wi_fd, device_name, device_os_version,
+      ssl_session);
+  return IWDP_SUCCESS;
+}
+
+iwdp_status iwdp_on_attached(iwdp_t self, const char *device_id, int wi_fd,
+    const char *device_name, int device_os_version, void *ssl_session) {
+  iwdp_private_t my = self->private_state;
+  iwdp_iport_t iport = (iwdp_iport_t)ht_get_value(my->device_id_to_iport,
+      device_id);
+  if (!iport || !iport->is_attaching) {
+    return IWDP_ERROR;  // detached while we were attaching
+  }
+  iport->is_attaching = false;
+  return iwdp_start_inspector(self, iport, wi_fd,
+      (device_name ? strdup(device_name) : NULL), device_os_version,
+      ssl_session);
+}
+
+iwdp_status iwdp_start_inspector(iwdp_t self, iwdp_iport_t iport, int wi_fd,
+    char *device_name, int device_os_version, void *ssl_session) {
+  iwdp_private_t my = self->private_state;
+  const char *device_id = iport->device_id;
   bool is_sim = !strcmp(device_id, "SIMULATOR");
+  if (!is_sim && wi_fd < 0) {
+    free(device_name);
+    self->on_error(self, "Unable to attach %s inspector", device_id);
+    self->remove_fd(self, iport->s_fd);
+    return IWDP_ERROR;
+  }
+  if (!iport->device_name) {
+    iport->device_name = (device_name ? device_name : strdup(device_id));
+  } else {
+    free(device_name);
+  }
+  iport->device_os_version = device_os_version;
+  iwdp_iwi_t iwi = iwdp_iwi_new(!is_sim && device_os_version < 0xb0000,
+      self->is_debug);
+  iwi->iport = iport;
+  if (self->sendv) {
+    iwi->wi->send_packetv = iwdp_send_packetv;
+  }
   if (is_sim) {
     // TODO launch webinspectord
     // For now we'll assume Safari starts it for us.
@@ -421,47 +535,57 @@ dl_status iwdp_on_attach(dl_t dl, const char *device_id, int device_num) {
     //   com.apple.iPhoneSimulator:com.apple.webinspectord
     // so the launch is probably something like:
     //   xpc_connection_create[_mach_service](...webinspectord, ...)?
-    wi_fd = self->connect(self, my->sim_wi_socket_addr);
-  } else {
-    wi_fd = self->attach(self, device_id, NULL,
-      (device_name ? NULL : &device_name), &device_os_version, &ssl_session);
-  }
-  if (wi_fd < 0) {
-    self->remove_fd(self, iport->s_fd);
-    if (!is_sim) {
-      self->on_error(self, "Unable to attach %s inspector", device_id);
+    //
+    // Our reportIdentifier is queued until iwdp_on_connect.
+    wi_fd = self->connect(self, my->sim_wi_socket_addr, iwi);
+    if (wi_fd < 0) {
+      iwdp_iwi_free(iwi);
+      self->remove_fd(self, iport->s_fd);
+      return IWDP_SUCCESS;
     }
-    return DL_SUCCESS;
-  }
-  iport->device_name = (device_name ? device_name : strdup(device_id));
-  iport->device_os_version = device_os_version;
-  iwdp_iwi_t iwi = iwdp_iwi_new(!is_sim && device_os_version < 0xb0000,
-      self->is_debug);
-  iwi->iport = iport;
-  iport->iwi = iwi;
-  if (self->add_fd(self, wi_fd, ssl_session, iwi, false)) {
+  } else if (self->add_fd(self, wi_fd, ssl_session, iwi, false)) {
+    iwdp_iwi_free(iwi);
+    self->on_error(self, "add_fd wi_fd=%d failed", wi_fd);
     self->remove_fd(self, iport->s_fd);
-    return self->on_error(self, "add_fd wi_fd=%d failed", wi_fd);
+    return IWDP_ERROR;
   }
+  iport->iwi = iwi;
   iwi->wi_fd = wi_fd;
+  if (self->set_fd_class) {
+    self->set_fd_class(self, wi_fd, IWDP_FD_DEVICE);
+  }
 
   // start inspector
   rpc_new_uuid(&iwi->connection_id);
   rpc_t rpc = iwi->rpc;
   if (rpc->send_reportIdentifier(rpc, iwi->connection_id)) {
-    self->remove_fd(self, iport->s_fd);
     self->on_error(self, "Unable to report to inspector %s",
         device_id);
-    return DL_SUCCESS;
+    self->remove_fd(self, iport->s_fd);
+    return IWDP_SUCCESS;
   }
 
-  iport->is_sticky = true;
-  return DL_SUCCESS;
+  if (self->add_timer) {
+    iwi->timer_id = self->add_timer(self, wi_fd, IWDP_WI_IDLE_TIMEOUT_MS, iwi);
+  }
+
+  if (!is_sim) {
+    iwdp_iport_keep(self, iport);
+  } // else wait for iwdp_on_connect
+  return IWDP_SUCCESS;
 }
 
 dl_status iwdp_on_detach(dl_t dl, const char *device_id, int device_num) {
   iwdp_idl_t idl = (iwdp_idl_t)dl->state;
   iwdp_t self = idl->self;
+  if (self->dispatch) {
+    self->dispatch(self, device_id, false);
+    return DL_SUCCESS;
+  }
+  return self->on_detach(self, device_id);
+}
+
+iwdp_status iwdp_detach_device(iwdp_t self, const char *device_id) {
   iwdp_private_t my = self->private_state;
   iwdp_iport_t iport = (iwdp_iport_t)ht_get_value(my->device_id_to_iport,
       device_id);
@@ -471,6 +595,37 @@ dl_status iwdp_on_detach(dl_t dl, const char *device_id, int device_num) {
   return IWDP_SUCCESS;
 }
 
+iwdp_status iwdp_on_publish(iwdp_t self, const char *device_id,
+    const char *device_name, int device_os_version, int port,
+    bool is_attached) {
+  iwdp_private_t my = self->private_state;
+  ht_t iport_ht = my->device_id_to_iport;
+  iwdp_iport_t iport = (iwdp_iport_t)ht_get_value(iport_ht, device_id);
+  if (iport && iport->s_fd > 0) {
+    return self->on_error(self, "%s is also on :%d", device_id, iport->port);
+  }
+  if (port < 0) {
+    if (iport) {
+      ht_remove(iport_ht, device_id);
+      iwdp_iport_free(iport);
+    }
+    return IWDP_SUCCESS;
+  }
+  if (!iport) {
+    iport = iwdp_iport_new();
+    iport->device_id = strdup(device_id);
+    iport->s_fd = -1;
+    ht_put(iport_ht, iport->device_id, iport);
+  }
+  iport->self = self;
+  iport->port = port;
+  iwdp_update_string(&iport->device_name, device_name);
+  iport->device_os_version = device_os_version;
+  iport->is_published = is_attached;
+  return IWDP_SUCCESS;
+}
+
+
 //
 // socket I/O
 //
@@ -479,7 +634,14 @@ iwdp_status iwdp_iport_accept(iwdp_t self, iwdp_iport_t iport, int ws_fd,
     iwdp_iws_t *to_iws) {
   iwdp_iws_t iws = iwdp_iws_new(self->is_debug);
   iws->iport = iport;
+  if (self->sendv) {
+    iws->ws->send_datav = iwdp_send_datav;
+  }
   iws->ws_fd = ws_fd;
+  if (self->add_timer) {
+    // ws_fd isn't added until we return, so iwdp_iws_close cancels this
+    iws->timer_id = self->add_timer(self, -1, IWDP_HANDSHAKE_TIMEOUT_MS, iws);
+  }
   rpc_new_uuid(&iws->ws_id);
   ht_put(iport->ws_id_to_iws, iws->ws_id, iws);
   *to_iws = iws;
@@ -508,11 +670,13 @@ iwdp_status iwdp_on_recv(iwdp_t self, int fd, void *value,
       }
     case TYPE_IWI:
       {
+        ((iwdp_iwi_t)value)->is_active = true;
         wi_t wi = ((iwdp_iwi_t)value)->wi;
         return wi->on_recv(wi, buf, length);
       }
     case TYPE_IWS:
       {
+        ((iwdp_iws_t)value)->is_active = true;
         ws_t ws = ((iwdp_iws_t)value)->ws;
         return ws->on_recv(ws, buf, length);
       }
@@ -540,14 +704,14 @@ iwdp_status iwdp_iport_close(iwdp_t self, iwdp_iport_t iport) {
     return self->on_error(self, "Internal iport mismatch?");
   }
   // close clients
-  iwdp_iws_t *iwss = (iwdp_iws_t *)ht_values(iport->ws_id_to_iws);
-  iwdp_iws_t *iws;
-  for (iws = iwss; *iws; iws++) {
-    if ((*iws)->ws_fd > 0) {
-      self->remove_fd(self, (*iws)->ws_fd);
+  size_t iter = 0;
+  void *value;
+  while (ht_next(iport->ws_id_to_iws, &iter, NULL, &value)) {
+    iwdp_iws_t iws = (iwdp_iws_t)value;
+    if (iws->ws_fd > 0) {
+      self->remove_fd(self, iws->ws_fd);
     }
   }
-  free(iwss);
   ht_clear(iport->ws_id_to_iws);
   // close iwi
   iwdp_iwi_t iwi = iport->iwi;
@@ -559,6 +723,12 @@ iwdp_status iwdp_iport_close(iwdp_t self, iwdp_iport_t iport) {
       self->remove_fd(self, iwi->wi_fd);
     }
   }
+  iport->is_attaching = false;  // drop its result, see iwdp_on_attached
+  if (self->publish && device_id) {
+    self->publish(self, device_id, iport->device_name,
+        iport->device_os_version, (iport->is_sticky ? iport->port : -1),
+        false);
+  }
   if (iport->is_sticky) {
     // keep iport so we can restore the port if this device is reattached
     iport->s_fd = -1;
@@ -570,6 +740,9 @@ iwdp_status iwdp_iport_close(iwdp_t self, iwdp_iport_t iport) {
 }
 
 iwdp_status iwdp_iws_close(iwdp_t self, iwdp_iws_t iws) {
+  if (iws->timer_id > 0) {
+    self->remove_timer(self, iws->timer_id);
+  }
   // clear pointer to this iws
   iwdp_ipage_t ipage = iws->ipage;
   if (ipage) {
@@ -593,6 +766,18 @@ iwdp_status iwdp_iws_close(iwdp_t self, iwdp_iws_t iws) {
       self->remove_fd(self, ifs->fs_fd);
     } // else internal error?
   }
+  if (self->is_debug && *self->is_debug) {
+    struct ws_deflate_stats stats;
+    iws->ws->get_deflate_stats(iws->ws, &stats);
+    if (stats.is_enabled) {
+      printf("ws %s deflate: sent %llu/%llu, recv %llu/%llu bytes\n",
+          (iws->ws_id ? iws->ws_id : "?"),
+          (unsigned long long)stats.sent_wire_length,
+          (unsigned long long)stats.sent_raw_length,
+          (unsigned long long)stats.recv_wire_length,
+          (unsigned long long)stats.recv_raw_length);
+    }
+  }
   iwdp_iws_free(iws);
   return IWDP_SUCCESS;
 }
@@ -608,13 +793,8 @@ iwdp_status iwdp_iwi_close(iwdp_t self, iwdp_iwi_t iwi) {
   }
   // free pages
   ht_t ipage_ht = iwi->page_num_to_ipage;
-  iwdp_ipage_t *ipages = (iwdp_ipage_t *)ht_values(ipage_ht);
+  ht_foreach(ipage_ht, iwdp_ipage_free_cb, NULL);
   ht_clear(ipage_ht);
-  iwdp_ipage_t *ipp;
-  for (ipp = ipages; *ipp; ipp++) {
-    iwdp_ipage_free((iwdp_ipage_t)*ipp);
-  }
-  free(ipages);
   iwdp_iwi_free(iwi);
   // close browser listener, which will close all clients
   if (iport && iport->s_fd > 0) {
@@ -629,9 +809,15 @@ iwdp_status iwdp_ifs_close(iwdp_t self, iwdp_ifs_t ifs) {
   if (iws && iws->ifs == ifs) {
     iws->ifs = NULL;
   }
+  bool is_connected = ifs->is_connected;
   iwdp_ifs_free(ifs);
   // close client
   if (iws && iws->ws_fd > 0) {
+    iws->is_keep_alive = false;
+    if (!is_connected) {
+      iwdp_send_http(iws->ws, false, "500 Server Error", ".txt",
+          "Unable to connect to the frontend server");
+    }
     self->remove_fd(self, iws->ws_fd);
   }
   return IWDP_SUCCESS;
@@ -660,6 +846,96 @@ iwdp_status iwdp_on_close(iwdp_t self, int fd, void *value, bool is_server) {
   }
 }
 
+iwdp_status iwdp_on_connect(iwdp_t self, int fd, void *value) {
+  int type = ((iwdp_type_t)value)->type;
+  switch (type) {
+    case TYPE_IWI:
+      if (((iwdp_iwi_t)value)->iport) {
+        iwdp_iport_keep(self, ((iwdp_iwi_t)value)->iport);
+      }
+      return IWDP_SUCCESS;
+    case TYPE_IFS:
+      ((iwdp_ifs_t)value)->is_connected = true;
+      return IWDP_SUCCESS;
+    default:
+      return self->on_error(self, "Unknown connect type %d", type);
+  }
+}
+
+//
+// timers
+//
+
+iwdp_status iwdp_iws_timer(iwdp_t self, iwdp_iws_t iws) {
+  iws->timer_id = 0;
+  if (iws->has_request && (iws->is_active || iws->ifs)) {
+    // keep-alive client, or still proxying a static file
+    iws->is_active = false;
+    iws->timer_id = self->add_timer(self, iws->ws_fd, IWDP_IDLE_TIMEOUT_MS,
+        iws);
+    return IWDP_SUCCESS;
+  }
+  if (!iws->has_request) {
+    self->on_error(self, "Handshake timeout on :%d fd=%d",
+        (iws->iport ? iws->iport->port : -1), iws->ws_fd);
+  }
+  self->remove_fd(self, iws->ws_fd);
+  return IWDP_SUCCESS;
+}
+
+// Frees the buffers that our messages have left in the pool, since we run
+// for weeks and a big message shouldn't pin its buffers.
+void iwdp_trim_buffers(iwdp_t self) {
+  if (self->is_debug && *self->is_debug) {
+    struct cb_pool_stats stats;
+    cb_pool_get_stats(&stats);
+    printf("buffers: %zd bytes used (peak %zd), %zd pooled, "
+        "%zd of %zd reused, %zd free'd\n",
+        stats.used_length, stats.peak_used_length, stats.pooled_length,
+        stats.num_reuses, stats.num_gets, stats.num_frees);
+  }
+  cb_pool_trim();
+}
+
+iwdp_status iwdp_iwi_timer(iwdp_t self, iwdp_iwi_t iwi) {
+  iwi->timer_id = 0;
+  unsigned int timeout_ms = IWDP_WI_IDLE_TIMEOUT_MS;
+  if (iwi->is_active) {
+    iwi->is_active = false;
+    iwi->is_probing = false;
+  } else if (!iwi->is_probing) {
+    // we're idle
+    iwdp_trim_buffers(self);
+    // any traffic will do, so ask for something cheap
+    rpc_t rpc = iwi->rpc;
+    if (rpc->send_getConnectedApplications(rpc, iwi->connection_id)) {
+      self->remove_fd(self, iwi->wi_fd);
+      return IWDP_SUCCESS;
+    }
+    iwi->is_probing = true;
+    timeout_ms = IWDP_WI_PROBE_TIMEOUT_MS;
+  } else {
+    self->on_error(self, "Inspector timeout on :%d",
+        (iwi->iport ? iwi->iport->port : -1));
+    self->remove_fd(self, iwi->wi_fd);
+    return IWDP_SUCCESS;
+  }
+  iwi->timer_id = self->add_timer(self, iwi->wi_fd, timeout_ms, iwi);
+  return IWDP_SUCCESS;
+}
+
+iwdp_status iwdp_on_timer(iwdp_t self, int fd, void *value) {
+  int type = ((iwdp_type_t)value)->type;
+  switch (type) {
+    case TYPE_IWI:
+      return iwdp_iwi_timer(self, (iwdp_iwi_t)value);
+    case TYPE_IWS:
+      return iwdp_iws_timer(self, (iwdp_iws_t)value);
+    default:
+      return self->on_error(self, "Unexpected timer type %d", type);
+  }
+}
+
 //
 // websocket
 //
@@ -672,17 +948,30 @@ ws_status iwdp_send_data(ws_t ws, const char *data, size_t length) {
       WS_SUCCESS);
 }
 
+ws_status iwdp_send_datav(ws_t ws, const char *header, size_t header_length,
+    const char *payload, size_t payload_length) {
+  iwdp_iws_t iws = (iwdp_iws_t)ws->state;
+  iwdp_t self = iws->iport->self;
+  return (self->sendv(self, iws->ws_fd, header, header_length, payload,
+        payload_length, NULL) ?
+      ws->on_error(ws, "Unable to send %zd bytes of data",
+        header_length + payload_length) :
+      WS_SUCCESS);
+}
+
 ws_status iwdp_send_http(ws_t ws, bool is_head, const char *status,
     const char *resource, const char *content) {
+  bool is_keep_alive = ((iwdp_iws_t)ws->state)->is_keep_alive;
   char *ctype;
   iwdp_get_content_type(resource, false, &ctype);
   char *data;
   if (asprintf(&data,
       "HTTP/1.1 %s\r\n"
       "Content-length: %zd\r\n"
-      "Connection: close"
+      "Connection: %s"
       "%s%s\r\n\r\n%s",
       status, (content ? strlen(content) : 0),
+      (is_keep_alive ? "keep-alive" : "close"),
       (ctype ? "\r\nContent-Type: " : ""), (ctype ? ctype : ""),
       (content && !is_head ? content : "")) < 0) {
     return ws->on_error(ws, "asprintf failed");
@@ -897,9 +1186,10 @@ ws_status iwdp_on_static_request_for_file(ws_t ws, bool is_head,
   if (asprintf(&data,
       "HTTP/1.1 200 OK\r\n"
       "Content-length: %zd\r\n"
-      "Connection: close"
+      "Connection: %s"
       "%s%s\r\n\r\n",
-      length, (ctype ? "\r\nContent-Type: " : ""), (ctype ? ctype : "")) < 0) {
+      length, (iws->is_keep_alive ? "keep-alive" : "close"),
+      (ctype ? "\r\nContent-Type: " : ""), (ctype ? ctype : "")) < 0) {
     return self->on_error(self, "asprintf failed");
   }
   free(ctype);
@@ -965,8 +1255,11 @@ ws_status iwdp_on_static_request_for_http(ws_t ws, bool is_head,
   };
   free(port);
 
-  int fs_fd = self->connect(self, host_with_port);
+  iwdp_ifs_t ifs = iwdp_ifs_new();
+  ifs->iws = iws;
+  int fs_fd = self->connect(self, host_with_port, ifs);
   if (fs_fd < 0) {
+    iwdp_ifs_free(ifs);
     char *error;
     if (asprintf(&error, "Unable to connect to %s", host_with_port) < 0) {
       return self->on_error(self, "asprintf failed");
@@ -979,15 +1272,10 @@ ws_status iwdp_on_static_request_for_http(ws_t ws, bool is_head,
     free(error);
     return ret;
   }
-  iwdp_ifs_t ifs = iwdp_ifs_new();
-  ifs->iws = iws;
   ifs->fs_fd = fs_fd;
   iws->ifs = ifs;
-  if (self->add_fd(self, fs_fd, NULL, ifs, false)) {
-    free(host_with_port);
-    free(host);
-    free(path);
-    return self->on_error(self, "Unable to add fd %d", fs_fd);
+  if (self->set_fd_class) {
+    self->set_fd_class(self, fs_fd, IWDP_FD_FRONTEND);
   }
   char *data;
   if (asprintf(&data,
@@ -1005,6 +1293,10 @@ ws_status iwdp_on_static_request_for_http(ws_t ws, bool is_head,
   size_t length = strlen(data);
   iwdp_status ret = self->send(self, fs_fd, data, length);
   free(data);
+  // the frontend server closes after its response, which closes us, see
+  // iwdp_ifs_close.  Until then, ignore pipelined requests, since we can't
+  // answer them in the middle of the relayed response.
+  ws->discard_requests(ws);
   *to_keep_alive = true;
   return ret;
 
@@ -1051,6 +1343,9 @@ ws_status iwdp_on_http_request(ws_t ws,
     const char *method, const char *resource, const char *version,
     const char *host, const char *headers, size_t headers_length,
     bool is_websocket, bool *to_keep_alive) {
+  iwdp_iws_t iws = (iwdp_iws_t)ws->state;
+  iws->has_request = true;
+  iws->is_keep_alive = *to_keep_alive;
   bool is_get = !strcmp(method, "GET");
   bool is_head = !is_get && !strcmp(method, "HEAD");
   if (is_websocket) {
@@ -1082,6 +1377,13 @@ ws_status iwdp_on_http_request(ws_t ws,
 ws_status iwdp_on_upgrade(ws_t ws,
     const char *resource, const char *protocol,
     int version, const char *sec_key) {
+  iwdp_iws_t iws = (iwdp_iws_t)ws->state;
+  iwdp_t self = iws->iport->self;
+  if (iws->timer_id > 0) {
+    // devtools may be legitimately quiet, so don't reap upgraded clients
+    self->remove_timer(self, iws->timer_id);
+    iws->timer_id = 0;
+  }
   return ws->send_upgrade(ws);
 }
 
@@ -1159,16 +1461,46 @@ wi_status iwdp_send_packet(wi_t wi, const char *packet, size_t length) {
       WI_SUCCESS);
 }
 
+wi_status iwdp_send_packetv(wi_t wi, const char *header, size_t header_length,
+    char *data, size_t data_length) {
+  iwdp_iwi_t iwi = (iwdp_iwi_t)wi->state;
+  iwdp_t self = iwi->iport->self;
+  return (self->sendv(self, iwi->wi_fd, header, header_length, data,
+        data_length, free) ?
+      self->on_error(self, "Unable to send %zd bytes to inspector",
+        header_length + data_length) :
+      WI_SUCCESS);
+}
+
 wi_status iwdp_recv_plist(wi_t wi, const plist_t rpc_dict) {
   rpc_t rpc = ((iwdp_iwi_t)wi->state)->rpc;
   return rpc->recv_plist(rpc, rpc_dict);
 }
 
+wi_status iwdp_recv_bin(wi_t wi, const char *const *segments,
+    const size_t *segment_lengths, size_t num_segments) {
+  rpc_t rpc = ((iwdp_iwi_t)wi->state)->rpc;
+  return rpc->recv_bin(rpc, segments, segment_lengths, num_segments);
+}
+
+wi_status iwdp_recv_partial(wi_t wi, size_t rpc_offset,
+    const char *rpc_bin, size_t length,
+    size_t *to_skip_offset, size_t *to_skip_length) {
+  rpc_t rpc = ((iwdp_iwi_t)wi->state)->rpc;
+  return rpc->recv_partial(rpc, rpc_offset, rpc_bin, length,
+      to_skip_offset, to_skip_length);
+}
+
 rpc_status iwdp_send_plist(rpc_t rpc, const plist_t rpc_dict) {
   wi_t wi = ((iwdp_iwi_t)rpc->state)->wi;
   return wi->send_plist(wi, rpc_dict);
 }
 
+rpc_status iwdp_send_bin(rpc_t rpc, char *buf, size_t length) {
+  wi_t wi = ((iwdp_iwi_t)rpc->state)->wi;
+  return wi->send_bin(wi, buf, length);
+}
+
 rpc_status iwdp_on_reportSetup(rpc_t rpc) {
   iwdp_iwi_t iwi = (iwdp_iwi_t)rpc->state;
   iwi->connected = true;
@@ -1279,17 +1611,16 @@ rpc_status iwdp_remove_app_id(rpc_t rpc, const char *app_id) {
   ht_remove(app_id_ht, app_id);
   // remove pages with this app_id
   ht_t ipage_ht = iwi->page_num_to_ipage;
-  iwdp_ipage_t *ipages = (iwdp_ipage_t *)ht_values(ipage_ht);
-  iwdp_ipage_t *ipp;
-  for (ipp = ipages; *ipp; ipp++) {
-    iwdp_ipage_t ipage = *ipp;
+  size_t iter = 0;
+  void *value;
+  while (ht_next(ipage_ht, &iter, NULL, &value)) {
+    iwdp_ipage_t ipage = (iwdp_ipage_t)value;
     if (!strcmp(app_id, ipage->app_id)) {
       iwdp_stop_devtools(ipage);
       ht_remove(ipage_ht, HT_KEY(ipage->page_num));
       iwdp_ipage_free(ipage);
     }
   }
-  free(ipages);
   // free this last, in case old_app_id == app_id
   free(old_app_id);
   return RPC_SUCCESS;
@@ -1314,17 +1645,18 @@ rpc_status iwdp_on_reportConnectedApplicationList(rpc_t rpc, const rpc_app_t *ap
   }
 
   // remove old apps
-  char **old_app_ids = (char **)ht_keys(app_id_ht);
-  char **oa;
-  for (oa = old_app_ids; *oa; oa++) {
+  size_t iter = 0;
+  void *key;
+  while (ht_next(app_id_ht, &iter, &key, NULL)) {
+    const char *old_app_id = (const char *)key;
     const rpc_app_t *a;
-    for (a = apps; *a && strcmp((*a)->app_id, *oa); a++) {
+    for (a = apps; *a && strcmp((*a)->app_id, old_app_id); a++) {
     }
     if (!*a) {
-      iwdp_remove_app_id(rpc, *oa);
+      // removes (and frees) the current key
+      iwdp_remove_app_id(rpc, old_app_id);
     }
   }
-  free(old_app_ids);
 
   // add new apps
   const rpc_app_t *a;
@@ -1352,7 +1684,8 @@ rpc_status iwdp_on_applicationSentListing(rpc_t rpc,
     return self->on_error(self, "Unknown app_id %s", app_id);
   }
   ht_t ipage_ht = iwi->page_num_to_ipage;
-  iwdp_ipage_t *ipages = (iwdp_ipage_t *)ht_values(ipage_ht);
+  size_t iter;
+  void *value;
 
   // add new pages
   const rpc_page_t *pp;
@@ -1360,11 +1693,10 @@ rpc_status iwdp_on_applicationSentListing(rpc_t rpc,
     const rpc_page_t page = *pp;
     // find page with this app_id & page_id
     iwdp_ipage_t ipage = NULL;
-    iwdp_ipage_t *ipp;
-    for (ipp = ipages; *ipp; ipp++) {
-      if ((*ipp)->page_id == page->page_id &&
-          !strcmp(app_id, (*ipp)->app_id)) {
-        ipage = *ipp;
+    for (iter = 0; ht_next(ipage_ht, &iter, NULL, &value); ) {
+      iwdp_ipage_t ip = (iwdp_ipage_t)value;
+      if (ip->page_id == page->page_id && !strcmp(app_id, ip->app_id)) {
+        ipage = ip;
         break;
       }
     }
@@ -1394,9 +1726,8 @@ rpc_status iwdp_on_applicationSentListing(rpc_t rpc,
   }
 
   // remove old pages
-  iwdp_ipage_t *ipp;
-  for (ipp = ipages; *ipp; ipp++) {
-    iwdp_ipage_t ipage = *ipp;
+  for (iter = 0; ht_next(ipage_ht, &iter, NULL, &value); ) {
+    iwdp_ipage_t ipage = (iwdp_ipage_t)value;
     if (strcmp(ipage->app_id, app_id)) {
       continue;
     }
@@ -1409,7 +1740,6 @@ rpc_status iwdp_on_applicationSentListing(rpc_t rpc,
       iwdp_ipage_free(ipage);
     }
   }
-  free(ipages);
 
   return RPC_SUCCESS;
 }
@@ -1428,6 +1758,35 @@ rpc_status iwdp_on_applicationSentData(rpc_t rpc,
       data, length);
 }
 
+// Sends the pieces of a reassembled message as websocket fragments, instead
+// of joining them.
+rpc_status iwdp_on_applicationSentDataChunk(rpc_t rpc,
+    const char *app_id, const char *dest_id, bool is_fin,
+    const char *data, const size_t length) {
+  iwdp_iport_t iport = ((iwdp_iwi_t)rpc->state)->iport;
+  iwdp_iws_t iws = ht_get_value(iport->ws_id_to_iws, dest_id);
+  if (!iws) {
+    return RPC_SUCCESS;  // error but don't kill the inspector!
+  }
+  ws_t ws = iws->ws;
+  return ws->send_frame(ws,
+      is_fin, OPCODE_TEXT, false,
+      data, length);
+}
+
+// Closes the client of a streamed message that turned out to be invalid,
+// since we've already sent it some of the message.
+rpc_status iwdp_on_applicationSentDataAbort(rpc_t rpc,
+    const char *app_id, const char *dest_id) {
+  iwdp_iport_t iport = ((iwdp_iwi_t)rpc->state)->iport;
+  iwdp_iws_t iws = ht_get_value(iport->ws_id_to_iws, dest_id);
+  if (!iws) {
+    return RPC_SUCCESS;
+  }
+  ws_t ws = iws->ws;
+  return ws->send_close(ws, CLOSE_PROTOCOL_ERROR, "Invalid inspector message");
+}
+
 rpc_status iwdp_on_applicationUpdated(rpc_t rpc,
     const char *app_id, const char *dest_id) {
   return iwdp_add_app_id(rpc, dest_id);
@@ -1465,6 +1824,12 @@ iwdp_t iwdp_new(const char *frontend, const char *sim_wi_socket_addr) {
   self->on_accept = iwdp_on_accept;
   self->on_recv = iwdp_on_recv;
   self->on_close = iwdp_on_close;
+  self->on_timer = iwdp_on_timer;
+  self->on_connect = iwdp_on_connect;
+  self->on_attach = iwdp_attach_device;
+  self->on_attached = iwdp_on_attached;
+  self->on_detach = iwdp_detach_device;
+  self->on_publish = iwdp_on_publish;
   self->on_error = iwdp_on_error;
   self->private_state = my;
   my->frontend = (frontend ? strdup(frontend) : NULL);
@@ -1588,8 +1953,9 @@ char *iwdp_iports_to_text(iwdp_iport_t *iports, bool want_json,
     }
     // Escape/encode device_id & device_name?
     char *s = NULL;
+    bool is_attached = (iport->iwi || iport->is_published);
     if (want_json) {
-      if (iport->iwi) {
+      if (is_attached) {
         char* escaped_device_id = iwdp_escape_json_string_val(
             iport->device_id ? iport->device_id : "");
         char* escaped_device_name = iwdp_escape_json_string_val(
@@ -1622,7 +1988,7 @@ char *iwdp_iports_to_text(iwdp_iport_t *iports, bool want_json,
       // TODO use relative urls instead of "localhost", see:
       //   http://stackoverflow.com/questions/6016120
       char *href = NULL;
-      if (iport->iwi) {
+      if (is_attached) {
         if (asprintf(&href, " href=\"http://%s:%d/\"",
             (host ? host : "localhost"), iport->port) < 0) {
           free(items);
@@ -1704,12 +2070,19 @@ iwdp_iwi_t iwdp_iwi_new(bool partials_supported, bool *is_debug) {
   rpc->on_applicationDisconnected = iwdp_on_applicationDisconnected;
   rpc->on_applicationSentListing = iwdp_on_applicationSentListing;
   rpc->on_applicationSentData = iwdp_on_applicationSentData;
+  rpc->on_applicationSentDataChunk = iwdp_on_applicationSentDataChunk;
+  rpc->on_applicationSentDataAbort = iwdp_on_applicationSentDataAbort;
   rpc->on_applicationUpdated = iwdp_on_applicationUpdated;
   rpc->send_plist = iwdp_send_plist;
+  rpc->send_bin = iwdp_send_bin;
+  rpc->bin_head_length = WI_BIN_HEAD_LENGTH;
+  rpc->bin_tail_length = WI_BIN_TAIL_LENGTH;
   rpc->state = iwi;
   iwi->rpc = rpc;
   wi->send_packet = iwdp_send_packet;
   wi->recv_plist = iwdp_recv_plist;
+  wi->recv_bin = iwdp_recv_bin;
+  wi->recv_partial = iwdp_recv_partial;
   wi->state = iwi;
   wi->is_debug = is_debug;
   iwi->wi = wi;
@@ -1741,6 +2114,17 @@ iwdp_iws_t iwdp_iws_new(bool *is_debug) {
     ws->on_frame = iwdp_on_frame;
     ws->state = iws;
     ws->is_debug = is_debug;
+    // we only send text that the device sent us, in WIRMessageDataKey's
+    // data, which nothing validates.  We trust the device, and if it ever
+    // sends invalid UTF-8 then the browser will close the connection.
+    ws->utf8_check = WS_UTF8_CHECK_RECV;
+    // DevTools JSON compresses well, e.g. over a VPN
+    ws->deflate_window_bits = 15;
+    ws->deflate_min_length = 256;
+    ws->max_http_requests = IWDP_MAX_HTTP_REQUESTS;
+    // we relay whole messages, so we can't stream them with on_frame_chunk
+    ws->max_frame_length = IWDP_MAX_MESSAGE_LENGTH;
+    ws->max_message_length = IWDP_MAX_MESSAGE_LENGTH;
   }
 
   if (!iws->ws) {
@@ -1778,6 +2162,12 @@ void iwdp_ipage_free(iwdp_ipage_t ipage) {
   }
 }
 
+// ht_foreach callback
+int iwdp_ipage_free_cb(ht_t ht, void *key, void *value, void *arg) {
+  iwdp_ipage_free((iwdp_ipage_t)value);
+  return 0;
+}
+
 iwdp_ipage_t iwdp_ipage_new() {
   iwdp_ipage_t ipage = (iwdp_ipage_t)malloc(sizeof(struct iwdp_ipage_struct));
   if (ipage) {
@@ -13,11 +13,14 @@
 #define _GNU_SOURCE
 #include <getopt.h>
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifndef HAVE_REGEX_H
 #include <pcre.h>
@@ -30,6 +33,7 @@
 #include <winsock2.h>
 #endif
 
+#include "char_buffer.h"
 #include "device_listener.h"
 #include "hash_table.h"
 #include "ios_webkit_debug_proxy.h"
@@ -39,24 +43,91 @@
 #include "websocket.h"
 
 
+// Max concurrent device attaches, see iwdpm_attach_async
+#define IWDPM_MAX_ATTACHES 4
+
 struct iwdpm_struct {
   char *config;
   char *frontend;
   char *sim_wi_socket_addr;
+  enum sm_backend_type backend;
   bool is_debug;
+  int num_workers;
 
   pc_t pc;
   sm_t sm;
   iwdp_t iwdp;
+
+  // if num_workers > 0, our device listener's devices are dispatched to
+  // these worker threads, each with its own sm and iwdp
+  struct iwdpm_struct **workers;
+  // device_id to 1 + index into workers, so a reattached device goes back
+  // to the same worker and port
+  ht_t device_id_to_worker;
+
+  // set if we're a worker
+  struct iwdpm_struct *control;
+  pthread_t thread;
+  int num_devices;  // only accessed by the control thread
+  bool is_quit;
+
+  // the control's attach threads, shared by its workers, see
+  // iwdpm_attach_async
+  pthread_t attachers[IWDPM_MAX_ATTACHES];
+  int num_attachers;
+  pthread_mutex_t attach_lock;
+  pthread_cond_t attach_cond;
+  struct iwdpm_msg_struct *attaches;  // queued, oldest first
+  struct iwdpm_msg_struct *attaches_tail;
+  bool is_attach_quit;
 };
 typedef struct iwdpm_struct *iwdpm_t;
 iwdpm_t iwdpm_new();
 void iwdpm_free(iwdpm_t self);
 
+// Frontend and simulator connect timeout, see iwdpm_connect
+#define IWDPM_CONNECT_TIMEOUT_MS 5000
+
+// Max corked bytes per fd, see iwdpm_set_class_options
+#define IWDPM_CORK_LENGTH (16 * 1024)
+
+// A message between the control and worker threads, see iwdpm_on_post.  Once
+// sm->post has queued it, it's iwdpm_on_post's to free, else the poster's.
+#define IWDPM_ATTACH  1
+#define IWDPM_DETACH  2
+#define IWDPM_PUBLISH 3
+#define IWDPM_QUIT    4
+#define IWDPM_ATTACHED 5
+struct iwdpm_msg_struct {
+  int type;
+  char *device_id;
+  char *device_name;
+  int device_os_version;
+  int port;
+  bool is_attached;
+  // IWDPM_ATTACHED result, for the iwdpm that queued it
+  struct iwdpm_struct *from;
+  int wi_fd;
+  void *ssl_session;
+  uint64_t queue_ms;
+  uint64_t start_ms;
+  uint64_t end_ms;
+  struct iwdpm_msg_struct *next;  // in the control's attaches
+};
+typedef struct iwdpm_msg_struct *iwdpm_msg_t;
+iwdpm_msg_t iwdpm_msg_new(int type, const char *device_id);
+void iwdpm_msg_free(iwdpm_msg_t msg);
+
 int iwdpm_configure(iwdpm_t self, int argc, char **argv);
 
 void iwdpm_create_bridge(iwdpm_t self);
 
+int iwdpm_start_workers(iwdpm_t self);
+
+void iwdpm_stop_workers(iwdpm_t self);
+
+void iwdpm_stop_attachers(iwdpm_t self);
+
 static int quit_flag = 0;
 
 static void on_signal(int sig) {
@@ -84,6 +155,18 @@ int main(int argc, char** argv) {
   }
 
   iwdpm_create_bridge(self);
+  if (!self->sm) {
+    fprintf(stderr, "Unable to create the socket manager\n");
+    iwdpm_free(self);
+    return -1;
+  }
+
+  if (iwdpm_start_workers(self)) {
+    fprintf(stderr, "Unable to start the workers\n");
+    iwdpm_stop_workers(self);
+    iwdpm_free(self);
+    return -1;
+  }
 
   iwdp_t iwdp = self->iwdp;
   if (iwdp->start(iwdp)) {
@@ -97,6 +180,8 @@ int main(int argc, char** argv) {
       break;
     }
   }
+  iwdpm_stop_attachers(self);
+  iwdpm_stop_workers(self);
   sm->cleanup(sm);
   iwdpm_free(self);
 #ifdef WIN32
@@ -140,13 +225,27 @@ iwdp_status iwdpm_select_port(iwdp_t iwdp, const char *device_id,
 int iwdpm_listen(iwdp_t iwdp, int port) {
   return sm_listen(port);
 }
-int iwdpm_connect(iwdp_t iwdp, const char *socket_addr) {
-  return sm_connect(socket_addr);
+int iwdpm_connect(iwdp_t iwdp, const char *socket_addr, void *value) {
+  sm_t sm = ((iwdpm_t)iwdp->state)->sm;
+  return sm->connect(sm, socket_addr, IWDPM_CONNECT_TIMEOUT_MS, value);
 }
 iwdp_status iwdpm_send(iwdp_t iwdp, int fd, const char *data, size_t length) {
   sm_t sm = ((iwdpm_t)iwdp->state)->sm;
   return sm->send(sm, fd, data, length, NULL);
 }
+iwdp_status iwdpm_sendv(iwdp_t iwdp, int fd, const char *header,
+    size_t header_length, const char *data, size_t data_length,
+    void (*free_data)(void *data)) {
+  sm_t sm = ((iwdpm_t)iwdp->state)->sm;
+  struct sm_iovec iov[2];
+  iov[0].data = header;
+  iov[0].length = header_length;
+  iov[0].is_ref = false;
+  iov[1].data = data;
+  iov[1].length = data_length;
+  iov[1].is_ref = (free_data != NULL);
+  return sm->sendv(sm, fd, iov, 2, (void *)data, free_data);
+}
 iwdp_status iwdpm_add_fd(iwdp_t iwdp, int fd, void *ssl_session, void *value,
     bool is_server) {
   sm_t sm = ((iwdpm_t)iwdp->state)->sm;
@@ -156,6 +255,19 @@ iwdp_status iwdpm_remove_fd(iwdp_t iwdp, int fd) {
   sm_t sm = ((iwdpm_t)iwdp->state)->sm;
   return sm->remove_fd(sm, fd);
 }
+iwdp_status iwdpm_set_fd_class(iwdp_t iwdp, int fd, int fd_class) {
+  sm_t sm = ((iwdpm_t)iwdp->state)->sm;
+  return sm->set_fd_class(sm, fd, fd_class);
+}
+int iwdpm_add_timer(iwdp_t iwdp, int fd, unsigned int timeout_ms,
+    void *value) {
+  sm_t sm = ((iwdpm_t)iwdp->state)->sm;
+  return sm->add_timer(sm, fd, timeout_ms, value);
+}
+iwdp_status iwdpm_remove_timer(iwdp_t iwdp, int timer_id) {
+  sm_t sm = ((iwdpm_t)iwdp->state)->sm;
+  return sm->remove_timer(sm, timer_id);
+}
 sm_status iwdpm_on_accept(sm_t sm, int s_fd, void *s_value,
     int fd, void **to_value) {
   iwdp_t iwdp = ((iwdpm_t)sm->state)->iwdp;
@@ -174,9 +286,323 @@ sm_status iwdpm_on_close(sm_t sm, int fd, void *value, bool is_server) {
   iwdp_t iwdp = ((iwdpm_t)sm->state)->iwdp;
   return iwdp->on_close(iwdp, fd, value, is_server);
 }
+sm_status iwdpm_on_timer(sm_t sm, int timer_id, int fd, void *value) {
+  iwdp_t iwdp = ((iwdpm_t)sm->state)->iwdp;
+  return iwdp->on_timer(iwdp, fd, value);
+}
+sm_status iwdpm_on_connect(sm_t sm, int fd, void *value) {
+  iwdp_t iwdp = ((iwdpm_t)sm->state)->iwdp;
+  return iwdp->on_connect(iwdp, fd, value);
+}
+
+//
+// Attach threads:
+//
+// wi_connect's usbmuxd/lockdownd/SSL handshake can take hundreds of ms per
+// device, so a select loop's iwdp queues it for one of the control's
+// IWDPM_MAX_ATTACHES threads, which post the result back to that loop.
+//
+
+uint64_t iwdpm_now_ms() {
+#ifdef WIN32
+  return (uint64_t)GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+void iwdpm_close(int fd) {
+#ifdef WIN32
+  closesocket(fd);
+#else
+  close(fd);
+#endif
+}
+
+void *iwdpm_run_attacher(void *arg) {
+  iwdpm_t self = (iwdpm_t)arg;
+  pthread_mutex_lock(&self->attach_lock);
+  while (!self->is_attach_quit) {
+    iwdpm_msg_t msg = self->attaches;
+    if (!msg) {
+      pthread_cond_wait(&self->attach_cond, &self->attach_lock);
+      continue;
+    }
+    self->attaches = msg->next;
+    if (!self->attaches) {
+      self->attaches_tail = NULL;
+    }
+    msg->next = NULL;
+    pthread_mutex_unlock(&self->attach_lock);
+    msg->start_ms = iwdpm_now_ms();
+    msg->wi_fd = wi_connect(msg->device_id, NULL, &msg->device_name,
+        &msg->device_os_version, &msg->ssl_session, -1);
+    msg->end_ms = iwdpm_now_ms();
+    sm_t sm = msg->from->sm;
+    if (sm->post(sm, msg)) {
+      // not queued, so it's still ours
+      if (msg->wi_fd >= 0) {
+        iwdpm_close(msg->wi_fd);
+      }
+      iwdpm_msg_free(msg);
+    }
+    pthread_mutex_lock(&self->attach_lock);
+  }
+  pthread_mutex_unlock(&self->attach_lock);
+  return NULL;
+}
+
+iwdp_status iwdpm_attach_async(iwdp_t iwdp, const char *device_id) {
+  iwdpm_t from = (iwdpm_t)iwdp->state;
+  iwdpm_t self = (from->control ? from->control : from);
+  iwdpm_msg_t msg = iwdpm_msg_new(IWDPM_ATTACHED, device_id);
+  if (!msg) {
+    return IWDP_ERROR;
+  }
+  msg->from = from;
+  msg->wi_fd = -1;
+  msg->queue_ms = iwdpm_now_ms();
+  pthread_mutex_lock(&self->attach_lock);
+  if (self->num_attachers < IWDPM_MAX_ATTACHES && !self->is_attach_quit) {
+    // let the main thread handle SIGINT/etc
+    sigset_t mask;
+    sigset_t old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    while (self->num_attachers < IWDPM_MAX_ATTACHES && !pthread_create(
+          &self->attachers[self->num_attachers], NULL, iwdpm_run_attacher,
+          self)) {
+      self->num_attachers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  }
+  if (!self->num_attachers || self->is_attach_quit) {
+    pthread_mutex_unlock(&self->attach_lock);
+    iwdpm_msg_free(msg);
+    return IWDP_ERROR;
+  }
+  if (self->attaches_tail) {
+    self->attaches_tail->next = msg;
+  } else {
+    self->attaches = msg;
+  }
+  self->attaches_tail = msg;
+  pthread_cond_signal(&self->attach_cond);
+  pthread_mutex_unlock(&self->attach_lock);
+  return IWDP_SUCCESS;
+}
+
+// Wait for any in-progress attaches, then drop the queued ones.
+void iwdpm_stop_attachers(iwdpm_t self) {
+  pthread_mutex_lock(&self->attach_lock);
+  self->is_attach_quit = true;
+  pthread_cond_broadcast(&self->attach_cond);
+  pthread_mutex_unlock(&self->attach_lock);
+  int i;
+  for (i = 0; i < self->num_attachers; i++) {
+    pthread_join(self->attachers[i], NULL);
+  }
+  self->num_attachers = 0;
+  while (self->attaches) {
+    iwdpm_msg_t next = self->attaches->next;
+    iwdpm_msg_free(self->attaches);
+    self->attaches = next;
+  }
+  self->attaches_tail = NULL;
+}
+
+//
+// Worker threads:
+//
+
+iwdp_status iwdpm_dispatch(iwdp_t iwdp, const char *device_id,
+    bool is_attach) {
+  iwdpm_t self = (iwdpm_t)iwdp->state;
+  intptr_t index = (intptr_t)ht_get_value(self->device_id_to_worker,
+      device_id);
+  if (!index) {
+    if (!is_attach) {
+      return IWDP_SUCCESS;  // e.g. ignored by iwdp_listen
+    }
+    // pick the least busy worker, then stick to it
+    int i;
+    for (i = 0; i < self->num_workers; i++) {
+      if (!index || self->workers[i]->num_devices <
+          self->workers[index - 1]->num_devices) {
+        index = i + 1;
+      }
+    }
+    ht_put(self->device_id_to_worker, strdup(device_id), (void *)index);
+  }
+  iwdpm_t worker = self->workers[index - 1];
+  iwdpm_msg_t msg = iwdpm_msg_new((is_attach ? IWDPM_ATTACH : IWDPM_DETACH),
+      device_id);
+  if (!msg || worker->sm->post(worker->sm, msg)) {
+    // not queued, so it's still ours and the worker won't see it
+    iwdpm_msg_free(msg);
+    return iwdp->on_error(iwdp, "Unable to dispatch %s", device_id);
+  }
+  worker->num_devices += (is_attach ? 1 : -1);
+  return IWDP_SUCCESS;
+}
+
+iwdp_status iwdpm_publish(iwdp_t iwdp, const char *device_id,
+    const char *device_name, int device_os_version, int port,
+    bool is_attached) {
+  iwdpm_t self = (iwdpm_t)iwdp->state;
+  if (self->is_quit) {
+    return IWDP_SUCCESS;  // the control thread is exiting too
+  }
+  iwdpm_msg_t msg = iwdpm_msg_new(IWDPM_PUBLISH, device_id);
+  if (!msg) {
+    return IWDP_ERROR;
+  }
+  msg->device_name = (device_name ? strdup(device_name) : NULL);
+  msg->device_os_version = device_os_version;
+  msg->port = port;
+  msg->is_attached = is_attached;
+  sm_t control_sm = self->control->sm;
+  if (control_sm->post(control_sm, msg)) {
+    iwdpm_msg_free(msg);  // not queued
+    return IWDP_ERROR;
+  }
+  return IWDP_SUCCESS;
+}
+
+void iwdpm_on_post(sm_t sm, void *value) {
+  iwdpm_t self = (iwdpm_t)sm->state;
+  iwdp_t iwdp = self->iwdp;
+  iwdpm_msg_t msg = (iwdpm_msg_t)value;
+  switch (msg->type) {
+    case IWDPM_ATTACH:
+      iwdp->on_attach(iwdp, msg->device_id);
+      break;
+    case IWDPM_DETACH:
+      iwdp->on_detach(iwdp, msg->device_id);
+      break;
+    case IWDPM_PUBLISH:
+      iwdp->on_publish(iwdp, msg->device_id, msg->device_name,
+          msg->device_os_version, msg->port, msg->is_attached);
+      break;
+    case IWDPM_QUIT:
+      self->is_quit = true;
+      break;
+    case IWDPM_ATTACHED:
+      printf("%s %s in %llums (%llums queued)\n",
+          (msg->wi_fd < 0 ? "Unable to attach" : "Attached"), msg->device_id,
+          (unsigned long long)(msg->end_ms - msg->start_ms),
+          (unsigned long long)(msg->start_ms - msg->queue_ms));
+      if (iwdp->on_attached(iwdp, msg->device_id, msg->wi_fd,
+            msg->device_name, msg->device_os_version, msg->ssl_session) &&
+          msg->wi_fd >= 0) {
+        iwdpm_close(msg->wi_fd);
+      }
+      break;
+  }
+  iwdpm_msg_free(msg);
+}
+
+void *iwdpm_run_worker(void *arg) {
+  iwdpm_t self = (iwdpm_t)arg;
+#ifndef WIN32
+  // let the main thread handle SIGINT/etc
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+#endif
+  sm_t sm = self->sm;
+  while (!self->is_quit) {
+    if (sm->select(sm, 2) < 0) {
+      break;
+    }
+  }
+  sm->cleanup(sm);
+  cb_pool_trim();  // our thread's pool
+  return NULL;
+}
+
+int iwdpm_start_workers(iwdpm_t self) {
+  if (self->num_workers <= 0) {
+    return 0;
+  }
+  self->workers = (iwdpm_t *)calloc(self->num_workers, sizeof(iwdpm_t));
+  self->device_id_to_worker = ht_new(HT_STRING_KEYS);
+  if (!self->workers || !self->device_id_to_worker) {
+    return -1;
+  }
+  self->iwdp->dispatch = iwdpm_dispatch;
+  int i;
+  for (i = 0; i < self->num_workers; i++) {
+    iwdpm_t worker = iwdpm_new();
+    if (!worker) {
+      return -1;
+    }
+    self->workers[i] = worker;
+    worker->config = strdup(self->config);
+    worker->frontend = (self->frontend ? strdup(self->frontend) : NULL);
+    worker->sim_wi_socket_addr = strdup(self->sim_wi_socket_addr);
+    worker->backend = self->backend;
+    worker->is_debug = self->is_debug;
+    worker->control = self;
+    iwdpm_create_bridge(worker);
+    if (!worker->sm) {
+      return -1;
+    }
+    worker->iwdp->publish = iwdpm_publish;
+    if (pthread_create(&worker->thread, NULL, iwdpm_run_worker, worker)) {
+      worker->control = NULL;  // not running
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void iwdpm_stop_workers(iwdpm_t self) {
+  int i;
+  for (i = 0; i < self->num_workers && self->workers; i++) {
+    iwdpm_t worker = self->workers[i];
+    if (worker && worker->control) {
+      iwdpm_msg_t msg = iwdpm_msg_new(IWDPM_QUIT, NULL);
+      if (!msg || worker->sm->post(worker->sm, msg)) {
+        iwdpm_msg_free(msg);  // not queued
+        worker->is_quit = true;  // it'll see this within a select timeout
+      }
+      pthread_join(worker->thread, NULL);
+      worker->control = NULL;
+    }
+    iwdpm_free(worker);
+    self->workers[i] = NULL;
+  }
+}
+
+// Our iwdp's fd classes are sm classes.  A busy page sends its clients
+// bursts of small events, and they send their devices bursts of small
+// commands, so those sends are corked, i.e. written together at the end of
+// each select pass, and clients and frontends don't wait on Nagle.  The
+// cork length is one TLS record.  A send that would fill it, e.g. a big
+// devtools message, is written at once instead of being copied, and corked
+// bytes only count towards our watermarks if their flush blocks.
+void iwdpm_set_class_options(sm_t sm) {
+  struct sm_fd_options options;
+  memset(&options, 0, sizeof(options));
+  options.is_cork = true;
+  options.cork_length = IWDPM_CORK_LENGTH;
+  sm->set_class_options(sm, IWDP_FD_DEVICE, &options);
+  options.is_nodelay = true;
+  sm->set_class_options(sm, IWDP_FD_CLIENT, &options);
+  memset(&options, 0, sizeof(options));
+  options.is_nodelay = true;
+  sm->set_class_options(sm, IWDP_FD_FRONTEND, &options);
+}
 
 void iwdpm_create_bridge(iwdpm_t self) {
-  sm_t sm = sm_new(4096);
+  sm_t sm = sm_new_with_backend(4096, self->backend);
   iwdp_t iwdp = iwdp_new(self->frontend, self->sim_wi_socket_addr);
   if (!sm || !iwdp) {
     sm_free(sm);
@@ -184,20 +610,29 @@ void iwdpm_create_bridge(iwdpm_t self) {
   }
   self->sm = sm;
   self->iwdp = iwdp;
+  iwdpm_set_class_options(sm);
   iwdp->subscribe = iwdpm_subscribe;
   iwdp->attach = iwdpm_attach;
+  iwdp->attach_async = iwdpm_attach_async;
   iwdp->select_port = iwdpm_select_port;
   iwdp->listen = iwdpm_listen;
   iwdp->connect = iwdpm_connect;
   iwdp->send = iwdpm_send;
+  iwdp->sendv = iwdpm_sendv;
   iwdp->add_fd = iwdpm_add_fd;
   iwdp->remove_fd = iwdpm_remove_fd;
+  iwdp->set_fd_class = iwdpm_set_fd_class;
+  iwdp->add_timer = iwdpm_add_timer;
+  iwdp->remove_timer = iwdpm_remove_timer;
   iwdp->state = self;
   iwdp->is_debug = &self->is_debug;
   sm->on_accept = iwdpm_on_accept;
   sm->on_sent = iwdpm_on_sent;
   sm->on_recv = iwdpm_on_recv;
   sm->on_close = iwdpm_on_close;
+  sm->on_timer = iwdpm_on_timer;
+  sm->on_connect = iwdpm_on_connect;
+  sm->on_post = iwdpm_on_post;
   sm->state = self;
   sm->is_debug = &self->is_debug;
 }
@@ -205,9 +640,20 @@ void iwdpm_create_bridge(iwdpm_t self) {
 
 void iwdpm_free(iwdpm_t self) {
   if (self) {
+    if (self->device_id_to_worker) {
+      size_t iter = 0;
+      void *device_id;
+      while (ht_next(self->device_id_to_worker, &iter, &device_id, NULL)) {
+        free(device_id);
+      }
+      ht_free(self->device_id_to_worker);
+    }
+    free(self->workers);
     pc_free(self->pc);
     iwdp_free(self->iwdp);
     sm_free(self->sm);
+    pthread_cond_destroy(&self->attach_cond);
+    pthread_mutex_destroy(&self->attach_lock);
     free(self->config);
     free(self->frontend);
     free(self->sim_wi_socket_addr);
@@ -222,9 +668,31 @@ iwdpm_t iwdpm_new(int argc, char **argv, int *to_exit) {
     return NULL;
   }
   memset(self, 0, sizeof(struct iwdpm_struct));
+  pthread_mutex_init(&self->attach_lock, NULL);
+  pthread_cond_init(&self->attach_cond, NULL);
   return self;
 }
 
+void iwdpm_msg_free(iwdpm_msg_t msg) {
+  if (msg) {
+    free(msg->device_id);
+    free(msg->device_name);
+    memset(msg, 0, sizeof(struct iwdpm_msg_struct));
+    free(msg);
+  }
+}
+
+iwdpm_msg_t iwdpm_msg_new(int type, const char *device_id) {
+  iwdpm_msg_t msg = malloc(sizeof(struct iwdpm_msg_struct));
+  if (!msg) {
+    return NULL;
+  }
+  memset(msg, 0, sizeof(struct iwdpm_msg_struct));
+  msg->type = type;
+  msg->device_id = (device_id ? strdup(device_id) : NULL);
+  return msg;
+}
+
 int iwdpm_configure(iwdpm_t self, int argc, char **argv) {
 
   static struct option longopts[] = {
@@ -233,6 +701,8 @@ int iwdpm_configure(iwdpm_t self, int argc, char **argv) {
     {"frontend", 1, NULL, 'f'},
     {"no-frontend", 0, NULL, 'F'},
     {"simulator-webinspector", 1, NULL, 's'},
+    {"backend", 1, NULL, 'b'},
+    {"workers", 1, NULL, 'w'},
     {"debug", 0, NULL, 'd'},
     {"help", 0, NULL, 'h'},
     {"version", 0, NULL, 'V'},
@@ -250,7 +720,7 @@ int iwdpm_configure(iwdpm_t self, int argc, char **argv) {
 
   int ret = 0;
   while (!ret) {
-    int c = getopt_long(argc, argv, "hVu:c:f:Fs:d", longopts, (int *)0);
+    int c = getopt_long(argc, argv, "hVu:c:f:Fs:b:w:d", longopts, (int *)0);
     if (c == -1) {
       break;
     }
@@ -296,6 +766,22 @@ int iwdpm_configure(iwdpm_t self, int argc, char **argv) {
         free(self->sim_wi_socket_addr);
         self->sim_wi_socket_addr = strdup(optarg);
         break;
+      case 'b':
+        if (sm_parse_backend(optarg, &self->backend)) {
+          ret = 2;
+        }
+        break;
+      case 'w':
+        {
+          char *end;
+          long n = strtol(optarg, &end, 10);
+          if (*end || n < 0 || n > 256) {
+            ret = 2;
+          } else {
+            self->num_workers = (int)n;
+          }
+        }
+        break;
       case 'f':
       case 'F':
         free(self->frontend);
@@ -386,6 +872,14 @@ int iwdpm_configure(iwdpm_t self, int argc, char **argv) {
         "            unix:/private/tmp/com.apple.launchd.2j5k1TMh6i/"
         "com.apple.webinspectord_sim.socket\n"
         "\n"
+        "  -b, --backend NAME\tSocket I/O backend, one of:\n"
+        "          select, epoll, epoll-et, io_uring\n"
+        "        Defaults to epoll if supported, otherwise select.\n"
+        "\n"
+        "  -w, --workers N\tRun each device's port and inspector on one of N\n"
+        "        worker threads.  Defaults to 0, which runs everything on\n"
+        "        the main thread.\n"
+        "\n"
         "  -d, --debug\t\tEnable debug output.\n"
         "  -h, --help\t\tPrint this usage information.\n"
         "  -V, --version\t\tPrint version information and exit.\n"
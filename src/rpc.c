@@ -21,9 +21,37 @@
 #include <uuid/uuid.h>
 #endif
 
+#include "bplist_reader.h"
+#include "bplist_writer.h"
 #include "rpc.h"
 
 
+// An _rpc_applicationSentData: that's received in parts is streamed as it
+// arrives: we copy its head, i.e. its objects before its data, until we've
+// read its dest_id, then pass its data straight through.
+#define RPC_MAX_HEAD_LENGTH 4096
+#define RPC_MAX_HEAD_OBJECTS 64
+
+#define RPC_STREAM_SCAN 0  // reading its head
+#define RPC_STREAM_DATA 1  // streaming its data
+#define RPC_STREAM_DONE 2  // streamed, until recv_bin checks it
+#define RPC_STREAM_OFF  3  // not streamed, e.g. another message
+
+struct rpc_private {
+  uint8_t stream_state;
+  size_t rpc_length;  // received so far
+  char head[RPC_MAX_HEAD_LENGTH + BPR_HEAD_ROOM(RPC_MAX_HEAD_OBJECTS)];
+  size_t head_length;
+  size_t offsets[RPC_MAX_HEAD_OBJECTS];  // of the head's objects
+  size_t num_objects;
+  size_t scan_offset;  // of the next object
+  size_t data_offset;
+  size_t data_length;
+  size_t data_remaining;  // to stream
+  char app_id[256];  // or empty if it follows the data
+  char dest_id[256];
+};
+
 rpc_status rpc_parse_app(const plist_t node, rpc_app_t *app);
 void rpc_free_app(rpc_app_t app);
 
@@ -121,6 +149,17 @@ rpc_status rpc_send_msg(rpc_t self, const char *selector, plist_t args) {
   return ret;
 }
 
+// Writes the planned rpc_dict into a send_bin buffer.
+rpc_status rpc_send_bin(rpc_t self, const struct bpw_plan *plan) {
+  char *buf = (char *)malloc(self->bin_head_length + plan->length +
+      self->bin_tail_length);
+  if (!buf) {
+    return RPC_ERROR;
+  }
+  bpw_write(plan, buf + self->bin_head_length);
+  return self->send_bin(self, buf, plan->length);
+}
+
 /*
 _rpc_reportIdentifier:
 <key>WIRConnectionIdentifierKey</key>
@@ -252,6 +291,31 @@ rpc_status rpc_send_forwardSocketData(rpc_t self, const char *connection_id,
     return RPC_ERROR;
   }
   const char *selector = "_rpc_forwardSocketData:";
+  if (self->send_bin) {
+    // the same dict as below, but without the plist nodes and copies
+    struct bpw_node nodes[] = {
+      {BPW_DICT, NULL, 2, 0},
+      BPW_KEY_NODE("__selector"),
+      {BPW_STRING, selector, strlen(selector), 0},
+      BPW_KEY_NODE("__argument"),
+      {BPW_DICT, NULL, 5, 0},
+      BPW_KEY_NODE("WIRConnectionIdentifierKey"),
+      {BPW_STRING, connection_id, strlen(connection_id), 0},
+      BPW_KEY_NODE("WIRApplicationIdentifierKey"),
+      {BPW_STRING, app_id, strlen(app_id), 0},
+      BPW_KEY_NODE("WIRPageIdentifierKey"),
+      {BPW_UINT, NULL, 0, page_id},
+      BPW_KEY_NODE("WIRSenderKey"),
+      {BPW_STRING, sender_id, strlen(sender_id), 0},
+      BPW_KEY_NODE("WIRSocketDataKey"),
+      {BPW_DATA, data, length, 0},
+    };
+    struct bpw_plan plan;
+    if (!bpw_plan(&plan, nodes, sizeof(nodes) / sizeof(nodes[0]))) {
+      return rpc_send_bin(self, &plan);
+    }
+    // e.g. a non-ASCII app_id, which libplist writes as UTF-16
+  }
   plist_t args = rpc_new_args(connection_id);
   plist_dict_set_item(args, "WIRApplicationIdentifierKey",
       plist_new_string(app_id));
@@ -533,12 +597,291 @@ rpc_status rpc_recv_plist(rpc_t self, const plist_t rpc_dict) {
   return rpc_recv_msg(self, selector, args);
 }
 
+// Copies a short string, e.g. an id, from a bplist.
+static bool rpc_read_string(const struct bpr_plist *plist, uint64_t dict,
+    const char *key, char *to_value, size_t max_length) {
+  uint64_t index;
+  return (!bpr_dict_get(plist, dict, key, &index) &&
+      !bpr_copy_string(plist, index, to_value, max_length));
+}
+
+// Reads an _rpc_applicationSentData: message straight from its bplist, so
+// its data is a slice of the bplist instead of a copy.
+// @result false if it's another message, or not in the form we expect
+static bool rpc_read_applicationSentData(const struct bpr_plist *plist,
+    char *to_app_id, char *to_dest_id, size_t max_id_length,
+    size_t *to_offset, size_t *to_length) {
+  uint64_t args;
+  uint64_t index;
+  char selector[32];
+  return (!bpr_dict_get(plist, plist->root, "__selector", &index) &&
+      !bpr_copy_string(plist, index, selector, sizeof(selector)) &&
+      !strcmp(selector, "_rpc_applicationSentData:") &&
+      !bpr_dict_get(plist, plist->root, "__argument", &args) &&
+      rpc_read_string(plist, args, "WIRApplicationIdentifierKey",
+        to_app_id, max_id_length) &&
+      rpc_read_string(plist, args, "WIRDestinationKey",
+        to_dest_id, max_id_length) &&
+      !bpr_dict_get(plist, args, "WIRMessageDataKey", &index) &&
+      !bpr_get_data(plist, index, to_offset, to_length));
+}
+
+// Passes the data as a slice if it's in one segment, otherwise to
+// on_applicationSentDataChunk per segment or, if that isn't set, joined.
+rpc_status rpc_recv_applicationSentDataBin(rpc_t self,
+    const struct bpr_plist *plist, const char *app_id, const char *dest_id,
+    size_t offset, size_t length) {
+  size_t n;
+  const char *data = bpr_get_bytes(plist, offset, length, &n);
+  if (n == length) {
+    return self->on_applicationSentData(self, app_id, dest_id, data, length);
+  }
+  if (self->on_applicationSentDataChunk) {
+    while (length) {
+      data = bpr_get_bytes(plist, offset, length, &n);
+      if (self->on_applicationSentDataChunk(self, app_id, dest_id,
+            n == length, data, n)) {
+        return RPC_ERROR;
+      }
+      offset += n;
+      length -= n;
+    }
+    return RPC_SUCCESS;
+  }
+  char *joined = (char *)malloc(length);
+  if (!joined) {
+    return self->on_error(self, "Out of memory");
+  }
+  size_t i;
+  for (i = 0; i < length; i += n) {
+    data = bpr_get_bytes(plist, offset + i, length - i, &n);
+    memcpy(joined + i, data, n);
+  }
+  rpc_status ret = self->on_applicationSentData(self, app_id, dest_id,
+      joined, length);
+  free(joined);
+  return ret;
+}
+
+// Reads the dest_id of the data at the end of a head, if it's an
+// _rpc_applicationSentData:'s.  Its selector and app_id may follow its data,
+// in which case rpc_recv_bin checks them.
+static bool rpc_read_stream_dest(const struct bpr_plist *plist,
+    uint64_t data_index, char *to_app_id, char *to_dest_id,
+    size_t max_id_length) {
+  uint64_t args;
+  uint64_t index;
+  char selector[32];
+  if (!bpr_dict_get(plist, plist->root, "__selector", &index) &&
+      !bpr_copy_string(plist, index, selector, sizeof(selector)) &&
+      strcmp(selector, "_rpc_applicationSentData:")) {
+    return false;
+  }
+  if (bpr_dict_get(plist, plist->root, "__argument", &args) ||
+      bpr_dict_get(plist, args, "WIRMessageDataKey", &index) ||
+      index != data_index) {
+    return false;
+  }
+  if (bpr_dict_get(plist, args, "WIRApplicationIdentifierKey", &index)) {
+    *to_app_id = '\0';
+  } else if (bpr_copy_string(plist, index, to_app_id, max_id_length)) {
+    return false;
+  }
+  return rpc_read_string(plist, args, "WIRDestinationKey", to_dest_id,
+      max_id_length);
+}
+
+// Scans the head's objects up to the first data, then decides whether to
+// stream it.
+static void rpc_scan_head(rpc_t self) {
+  rpc_private_t my = self->private_state;
+  while (my->stream_state == RPC_STREAM_SCAN) {
+    size_t offset = my->scan_offset;
+    uint8_t type;
+    size_t marker_length;
+    size_t length;
+    int ret = (offset > my->head_length ? 1 :
+        bpr_scan_object(my->head + offset, my->head_length - offset, 1,
+          &type, &marker_length, &length));
+    if (ret > 0) {
+      return;  // wait for more
+    }
+    if (ret < 0 || my->num_objects >= RPC_MAX_HEAD_OBJECTS ||
+        (type != BPR_TYPE_DATA && length > RPC_MAX_HEAD_LENGTH)) {
+      my->stream_state = RPC_STREAM_OFF;
+      return;
+    }
+    my->offsets[my->num_objects++] = offset;
+    offset += marker_length;
+    if (type != BPR_TYPE_DATA) {
+      my->scan_offset = offset + length;
+      continue;
+    }
+    // the head ends at the data's bytes
+    struct bpr_plist plist;
+    if (length && !bpr_open_head(&plist, my->head, offset, my->offsets,
+          my->num_objects, 1) &&
+        rpc_read_stream_dest(&plist, my->num_objects - 1, my->app_id,
+          my->dest_id, sizeof(my->dest_id))) {
+      my->stream_state = RPC_STREAM_DATA;
+      my->data_offset = offset;
+      my->data_length = length;
+      my->data_remaining = length;
+    } else {
+      my->stream_state = RPC_STREAM_OFF;
+    }
+  }
+}
+
+rpc_status rpc_recv_partial(rpc_t self, size_t rpc_offset,
+    const char *rpc_bin, size_t length,
+    size_t *to_skip_offset, size_t *to_skip_length) {
+  rpc_private_t my = self->private_state;
+  *to_skip_offset = 0;
+  *to_skip_length = 0;
+  if (!rpc_offset) {
+    my->stream_state = (self->on_applicationSentDataChunk ?
+        RPC_STREAM_SCAN : RPC_STREAM_OFF);
+    my->head_length = 0;
+    my->num_objects = 0;
+    my->scan_offset = BPR_MAGIC_LENGTH;
+  } else if (rpc_offset != my->rpc_length) {
+    return self->on_error(self, "Expecting rpc offset %zd, not %zd",
+        my->rpc_length, rpc_offset);
+  }
+  my->rpc_length = rpc_offset + length;
+
+  size_t i = 0;  // the part's data starts here
+  if (my->stream_state == RPC_STREAM_SCAN) {
+    size_t n = RPC_MAX_HEAD_LENGTH - my->head_length;
+    if (n > length) {
+      n = length;
+    }
+    memcpy(my->head + my->head_length, rpc_bin, n);
+    my->head_length += n;
+    rpc_scan_head(self);
+    if (my->stream_state == RPC_STREAM_SCAN &&
+        my->head_length == RPC_MAX_HEAD_LENGTH) {
+      my->stream_state = RPC_STREAM_OFF;
+    }
+    if (my->stream_state != RPC_STREAM_DATA) {
+      return RPC_SUCCESS;
+    }
+    // we decide as soon as the data's marker arrives, so it's in this part
+    i = my->data_offset - rpc_offset;
+  }
+  if (my->stream_state != RPC_STREAM_DATA || i == length) {
+    return RPC_SUCCESS;
+  }
+  size_t n = length - i;
+  if (n > my->data_remaining) {
+    n = my->data_remaining;
+  }
+  my->data_remaining -= n;
+  if (!my->data_remaining) {
+    my->stream_state = RPC_STREAM_DONE;
+  }
+  *to_skip_offset = i;
+  *to_skip_length = n;
+  return self->on_applicationSentDataChunk(self, my->app_id, my->dest_id,
+      !my->data_remaining, rpc_bin + i, n);
+}
+
+// Checks that a streamed rpc, whose segments have a gap for its data, is the
+// _rpc_applicationSentData: that we thought it was.
+static rpc_status rpc_recv_streamed(rpc_t self, bool is_done,
+    const char *const *segments, const size_t *segment_lengths,
+    size_t num_segments) {
+  rpc_private_t my = self->private_state;
+  struct bpr_plist plist;
+  char app_id[256];
+  char dest_id[256];
+  size_t offset;
+  size_t length;
+  if (is_done &&
+      !bpr_open_segments(&plist, segments, segment_lengths, num_segments) &&
+      rpc_read_applicationSentData(&plist, app_id, dest_id, sizeof(app_id),
+        &offset, &length) &&
+      offset == my->data_offset && length == my->data_length &&
+      !strcmp(dest_id, my->dest_id) &&
+      (!*my->app_id || !strcmp(app_id, my->app_id))) {
+    return RPC_SUCCESS;
+  }
+  // don't end the streamed message, which its client would then parse as
+  // if it were valid
+  if (self->on_applicationSentDataAbort) {
+    self->on_applicationSentDataAbort(self, my->app_id, my->dest_id);
+  }
+  return self->on_error(self, "Invalid streamed rpc plist");
+}
+
+rpc_status rpc_recv_bin(rpc_t self, const char *const *segments,
+    const size_t *segment_lengths, size_t num_segments) {
+  rpc_private_t my = self->private_state;
+  struct bpr_plist plist;
+  char app_id[256];
+  char dest_id[256];
+  size_t offset;
+  size_t length;
+  uint8_t stream_state = my->stream_state;
+  my->stream_state = RPC_STREAM_OFF;
+  if (!num_segments) {
+    return self->on_error(self, "Invalid rpc plist");
+  }
+  size_t i;
+  for (i = 0; i < num_segments && segments[i]; i++) {
+  }
+  if (i < num_segments) {
+    // it has a gap, for the data that recv_partial streamed
+    if (stream_state != RPC_STREAM_DATA && stream_state != RPC_STREAM_DONE) {
+      return self->on_error(self, "Unexpected gap in rpc plist");
+    }
+    return rpc_recv_streamed(self, stream_state == RPC_STREAM_DONE,
+        segments, segment_lengths, num_segments);
+  }
+  if (!bpr_open_segments(&plist, segments, segment_lengths, num_segments) &&
+      rpc_read_applicationSentData(&plist, app_id, dest_id, sizeof(app_id),
+        &offset, &length)) {
+    return rpc_recv_applicationSentDataBin(self, &plist, app_id, dest_id,
+        offset, length);
+  }
+
+  // other messages are rare, so parse them as usual
+  char *joined = NULL;
+  const char *rpc_bin = segments[0];
+  size_t rpc_len = segment_lengths[0];
+  if (num_segments > 1) {
+    for (i = 1; i < num_segments; i++) {
+      rpc_len += segment_lengths[i];
+    }
+    joined = (char *)malloc(rpc_len);
+    if (!joined) {
+      return self->on_error(self, "Out of memory");
+    }
+    for (i = 0, rpc_len = 0; i < num_segments; i++) {
+      memcpy(joined + rpc_len, segments[i], segment_lengths[i]);
+      rpc_len += segment_lengths[i];
+    }
+    rpc_bin = joined;
+  }
+  plist_t rpc_dict = NULL;
+  plist_from_bin(rpc_bin, (uint32_t)rpc_len, &rpc_dict);
+  free(joined);
+  if (!rpc_dict) {
+    return self->on_error(self, "Invalid rpc plist");
+  }
+  rpc_status ret = rpc_recv_plist(self, rpc_dict);
+  plist_free(rpc_dict);
+  return ret;
+}
+
 //
 // STRUCTS
 //
 
 void rpc_free(rpc_t self) {
   if (self) {
+    free(self->private_state);
     memset(self, 0, sizeof(struct rpc_struct));
     free(self);
   }
@@ -558,7 +901,15 @@ rpc_t rpc_new() {
   self->send_forwardSocketData = rpc_send_forwardSocketData;
   self->send_forwardDidClose = rpc_send_forwardDidClose;
   self->recv_plist = rpc_recv_plist;
+  self->recv_bin = rpc_recv_bin;
+  self->recv_partial = rpc_recv_partial;
   self->on_error = rpc_on_error;
+  self->private_state = (rpc_private_t)malloc(sizeof(struct rpc_private));
+  if (!self->private_state) {
+    rpc_free(self);
+    return NULL;
+  }
+  memset(self->private_state, 0, sizeof(struct rpc_private));
   return self;
 }
 
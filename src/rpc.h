@@ -43,6 +43,9 @@ struct rpc_page_struct {
 };
 typedef struct rpc_page_struct *rpc_page_t;
 
+struct rpc_private;
+typedef struct rpc_private *rpc_private_t;
+
 struct rpc_struct;
 typedef struct rpc_struct *rpc_t;
 rpc_t rpc_new();
@@ -58,6 +61,25 @@ struct rpc_struct {
     // Calls on_*.
     rpc_status (*recv_plist)(rpc_t self, const plist_t rpc_dict);
 
+    // Like recv_plist, but for a serialized rpc_dict, which may be split
+    // into segments.  Our most common message, _rpc_applicationSentData:, is
+    // read without building a plist, and its data is passed to
+    // on_applicationSentData as a slice of the segments.
+    rpc_status (*recv_bin)(rpc_t self, const char *const *segments,
+        const size_t *segment_lengths, size_t num_segments);
+
+    // Optional, called with each part of a serialized rpc_dict as it
+    // arrives, before the whole rpc_dict is passed to recv_bin.  If it's an
+    // _rpc_applicationSentData: then its data is streamed to
+    // on_applicationSentDataChunk, so it's never held in memory, with an
+    // empty app_id if that follows the data in the plist.  Those bytes of
+    // the part are returned as to_skip_offset and to_skip_length, and must
+    // be passed to recv_bin as a NULL segment, i.e. a gap.
+    // @param rpc_offset the part's offset in the rpc_dict, 0 for a new one
+    rpc_status (*recv_partial)(rpc_t self, size_t rpc_offset,
+        const char *rpc_bin, size_t length,
+        size_t *to_skip_offset, size_t *to_skip_length);
+
     // Calls send_plist.
     rpc_status (*send_reportIdentifier)(rpc_t self,
             const char *connection_id);
@@ -93,6 +115,14 @@ struct rpc_struct {
 
     rpc_status (*send_plist)(rpc_t self, plist_t rpc_dict);
 
+    // Optional, sends an rpc_dict that we've serialized ourselves, e.g. in
+    // send_forwardSocketData, instead of building its plist for send_plist.
+    // The bplist is at buf + bin_head_length, followed by bin_tail_length
+    // free bytes, so it can be framed in place.  Takes ownership of the buf.
+    rpc_status (*send_bin)(rpc_t self, char *buf, size_t length);
+    size_t bin_head_length;
+    size_t bin_tail_length;
+
     rpc_status (*on_reportSetup)(rpc_t self);
 
     rpc_status (*on_reportConnectedApplicationList)(rpc_t self,
@@ -111,11 +141,26 @@ struct rpc_struct {
             const char *app_id, const char *dest_id,
             const char *data, size_t length);
 
+    // Optional, called instead of on_applicationSentData if recv_bin's data
+    // spans segments, once per segment, so we don't have to join them, or
+    // as recv_partial streams it.
+    rpc_status (*on_applicationSentDataChunk)(rpc_t self,
+            const char *app_id, const char *dest_id, bool is_fin,
+            const char *data, size_t length);
+
+    // Optional, called if a message that recv_partial streamed to
+    // on_applicationSentDataChunk turns out to be invalid, e.g. truncated,
+    // instead of finishing it.  Its client has already received some or all
+    // of its data, so it should be closed.
+    rpc_status (*on_applicationSentDataAbort)(rpc_t self,
+            const char *app_id, const char *dest_id);
+
     rpc_status (*on_applicationUpdated)(rpc_t self,
             const char *app_id, const char *dest_id);
 
     // For internal use only:
     rpc_status (*on_error)(rpc_t self, const char *format, ...);
+    rpc_private_t private_state;
 };
 
 
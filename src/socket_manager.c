@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef WIN32
 #include <winsock2.h>
@@ -22,11 +23,14 @@
 #else
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <pthread.h>
+#include <signal.h>
 #endif
 
 #include <openssl/ssl.h>
@@ -39,50 +43,234 @@
 #if defined(__MACH__) || defined(WIN32)
 #define SIZEOF_FD_SET sizeof(struct fd_set)
 #define RECV_FLAGS 0
+#define SEND_FLAGS 0
 #else
 #define SIZEOF_FD_SET sizeof(fd_set)
 #define RECV_FLAGS MSG_DONTWAIT
+// e.g. an accepted fd, which doesn't inherit its server's O_NONBLOCK
+#define SEND_FLAGS MSG_DONTWAIT
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+struct sm_fd;
+typedef struct sm_fd *sm_fd_t;
+
+// Readiness backend, e.g. select or epoll.
+//
+// The backend tracks each fd's interest incrementally:  update_fd is called
+// whenever an fd's sfd->is_recv or sfd->sendq changes, and wait dispatches
+// whatever is ready via sm_on_ready.
+struct sm_backend {
+  const char *name;
+  // only reports new input, so sm_recv must read each fd until it blocks
+  bool is_edge_triggered;
+  sm_status (*init)(sm_t self);
+  void (*free)(sm_t self);
+  sm_status (*add_fd)(sm_t self, sm_fd_t sfd);
+  void (*update_fd)(sm_t self, sm_fd_t sfd);
+  void (*remove_fd)(sm_t self, sm_fd_t sfd);
+  int (*wait)(sm_t self, int timeout_ms);
+  // Optional, submits sfd->sendq instead of the default send-until-blocked.
+  sm_status (*send)(sm_t self, sm_fd_t sfd);
+};
+typedef const struct sm_backend *sm_backend_t;
+
+struct sm_sendq;
+typedef struct sm_sendq *sm_sendq_t;
+
+struct sm_timer;
+typedef struct sm_timer *sm_timer_t;
+
+struct sm_post;
+typedef struct sm_post *sm_post_t;
+
+struct sm_resolve;
+typedef struct sm_resolve *sm_resolve_t;
+
+// Timer wheel resolution and size, see sm_timer_insert
+#define SM_TIMER_TICK_MS 10
+#define SM_TIMER_SLOT_BITS 6
+#define SM_TIMER_SLOTS (1 << SM_TIMER_SLOT_BITS)
+#define SM_TIMER_LEVELS 4
+
+// Resolver threads per sm, see sm_connect_async
+#define SM_RESOLVERS 2
+
+// Per-fd state, indexed by fd in my->fds
+struct sm_fd {
+  int fd;
+  void *value;        // for on_* callbacks
+  void *ssl_session;  // optional
+  bool is_server;     // can on_accept
+  bool is_recv;       // can recv, i.e. not blocked by another fd's sendq
+  bool is_post;       // our post_fds[0], which isn't in num_fds
+  // a connect fd, see sm_connect_async
+  bool is_connecting;   // until it's writable, so sends are queued
+  bool is_pending;      // not in the backend, e.g. while resolving
+  bool is_resolving;    // our resolve is owned by the resolver threads
+  sm_resolve_t resolve; // the addresses that we haven't tried yet
+  int connect_timer_id;
+  sm_sendq_t sendq;   // blocked sends, often NULL
+  size_t sendq_length;
+  // blocked sends that were made while receiving from this fd, linked by
+  // their recv_prev/recv_next.  Once their length exceeds high_watermark we
+  // stop receiving from this fd, until it drops back to low_watermark.
+  sm_sendq_t recv_sendqs;
+  size_t recv_sendqs_length;
+  size_t low_watermark;
+  size_t high_watermark;
+  sm_timer_t timers;  // linked by fd_prev/fd_next, cancelled by remove_fd
+  uint32_t events;    // backend-specific interest, e.g. EPOLLIN
+  void *backend_fd;   // backend-specific state
+  // the length of our next recv, see sm_recv
+  size_t recv_length;
+  // in my->backlog, since its last sm_recv stopped before it would block
+  bool is_backlog;
+  sm_fd_t backlog_prev;
+  sm_fd_t backlog_next;
+  unsigned int recv_pass;  // the my->recv_pass of its last sm_recv
+  int fd_class;       // its my->class_options, see set_fd_class
+  bool is_flush;      // has corked sends, in my->flush_fds, see sm_flush
+};
+
 struct sm_private {
-  struct timeval timeout;
-  // fds:
-  fd_set *all_fds;
-  int max_fd;  // max fd in all_fds
-  // subsets of all_fds:
-  fd_set *server_fds; // can on_accept, i.e. "is_server"
-  fd_set *send_fds;   // blocked sends, same as fd_to_sendq.keys
-  fd_set *recv_fds;   // can recv, same as all_fds - sendq.recv_fd's
-  // fd to ssl_session
-  ht_t fd_to_ssl;
-  // fd to on_* callback
-  ht_t fd_to_value;
-  // fd to blocked sm_sendq_t, often empty
-  ht_t fd_to_sendq;
-  // temp recv buffer, for use in sm_select:
+  sm_backend_t backend;
+  void *backend_state;
+  // fd to sm_fd_t, NULL if not added
+  sm_fd_t *fds;
+  int fds_length;
+  int num_fds;
+  // watermarks for newly added fds
+  size_t low_watermark;
+  size_t high_watermark;
+  // temp recv buffer, for use in sm_select, which grows to the largest
+  // sfd->recv_length:
   char *tmp_buf;
   size_t tmp_buf_length;
-  // temp fd sets, for use in sm_select:
-  fd_set *tmp_send_fds;
-  fd_set *tmp_recv_fds;
-  fd_set *tmp_fail_fds;
+  size_t min_recv_length;  // sm_new's buffer_length
+  // per-fd limits on each sm_recv, 0 if none
+  size_t recv_budget_length;
+  size_t recv_budget_reads;
+  // fds that still have input after their sm_recv, oldest first, which
+  // sm_select resumes once per pass, see sm_recv_backlog
+  sm_fd_t backlog;
+  sm_fd_t backlog_tail;
+  unsigned int recv_pass;  // sm_select count
+  struct sm_fd_options class_options[SM_MAX_FD_CLASSES];
+  // fds whose sends are corked until the end of our sm_select pass, maybe
+  // including removed fds
+  int *flush_fds;
+  size_t num_flush_fds;
+  size_t flush_fds_length;
   // current sm_select on_recv fd, only set when in sm_select loop
   int curr_recv_fd;
+  // timer wheel, see sm_timer_insert
+  sm_timer_t timer_slots[SM_TIMER_LEVELS][SM_TIMER_SLOTS];
+  uint64_t timer_bits[SM_TIMER_LEVELS];  // non-empty timer_slots
+  uint64_t timer_tick;  // the last expired tick
+  int num_timers;
+  int last_timer_id;
+  ht_t id_to_timer;
+  // values from other threads' sm_post calls, newest first, and the
+  // socketpair that wakes our select
+  sm_post_t posts;
+  int post_fds[2];
+#ifndef WIN32
+  // getaddrinfo threads for sm_connect_async, started on first use
+  pthread_t resolvers[SM_RESOLVERS];
+  int num_resolvers;
+  pthread_mutex_t resolve_lock;
+  pthread_cond_t resolve_cond;
+  sm_resolve_t resolves;  // queued, oldest first
+  sm_resolve_t resolves_tail;
+  bool is_resolve_quit;
+#endif
 };
 
-struct sm_sendq;
-typedef struct sm_sendq *sm_sendq_t;
+// A blocked segment of a send or sendv.
 struct sm_sendq {
   void *value;  // for on_sent
-  int recv_fd;  // the my->recv_fd that caused this blocked send
-  char *begin;  // sm_send data
-  char *head;
-  char *tail;   // begin + sm_send length
+  // the my->curr_recv_fd that caused this blocked send, NULL if none
+  sm_fd_t recv_sfd;
+  sm_sendq_t recv_prev;
+  sm_sendq_t recv_next;
+  // while it's corked, the my->curr_recv_fd to link if its flush blocks,
+  // else -1
+  int cork_recv_fd;
+  char *begin;  // our copy of the data, or NULL if queued by reference
+  const char *head;
+  const char *tail;
+  size_t length;  // tail - head when queued
+  // the send's last segment, which calls on_sent and release
+  bool is_last;
+  void (*release)(void *value);
   sm_sendq_t next;
 };
-sm_sendq_t sm_sendq_new(int recv_fd, void *value, const char *data,
-    size_t length);
+// @param data if NULL then allocates an uninitialized copy
+sm_sendq_t sm_sendq_new(void *value, const char *data, size_t length,
+    bool is_ref);
 void sm_sendq_free(sm_sendq_t sendq);
+void sm_sendq_link(sm_t self, sm_sendq_t sendq, sm_fd_t recv_sfd);
+void sm_sendq_unlink(sm_t self, sm_sendq_t sendq);
+void sm_sendq_link_corked(sm_t self, sm_fd_t sfd);
+void sm_check_high_watermark(sm_t self, sm_fd_t recv_sfd);
+
+static inline sm_fd_t sm_get_fd(sm_private_t my, int fd) {
+  return (fd >= 0 && fd < my->fds_length ? my->fds[fd] : NULL);
+}
+
+void sm_on_ready(sm_t self, int fd, bool can_recv, bool can_send,
+    bool is_fail);
+bool sm_on_recv_data(sm_t self, sm_fd_t sfd, const char *buf,
+    ssize_t length);
+bool sm_on_accept_fd(sm_t self, sm_fd_t sfd, int new_fd);
+bool sm_sendq_pop(sm_t self, sm_fd_t sfd);
+bool sm_sendq_sent(sm_t self, sm_fd_t sfd, size_t length);
+uint64_t sm_now_ms();
+void sm_timer_free(sm_t self, sm_timer_t t);
+int sm_timer_timeout(sm_t self);
+void sm_timer_run(sm_t self);
+void sm_on_posts(sm_t self);
+int sm_post_pair(int fds[2]);
+void sm_on_connect_ready(sm_t self, sm_fd_t sfd);
+void sm_resolve_free(sm_resolve_t r);
+void sm_backlog_link(sm_private_t my, sm_fd_t sfd);
+void sm_backlog_unlink(sm_private_t my, sm_fd_t sfd);
+void sm_backlog_pending(sm_t self, sm_fd_t sfd);
+size_t sm_sendq_iov(sm_fd_t sfd, struct sm_iovec *iov, size_t *to_length);
+ssize_t sm_writev(sm_t self, sm_fd_t sfd, const struct sm_iovec *iov,
+    size_t iov_count);
+void sm_apply_fd_options(sm_t self, sm_fd_t sfd);
+bool sm_flush_later(sm_private_t my, sm_fd_t sfd);
+int sm_flush(sm_t self, sm_fd_t sfd);
+
+// Max segments per sendmsg
+#define SM_MAX_IOV 64
+
+// Max TLS record payload, see sm_writev
+#define SM_SSL_RECORD_LENGTH (16 * 1024)
+
+// Default watermarks, see sm_fd
+#define SM_LOW_WATERMARK (16 * 1024)
+#define SM_HIGH_WATERMARK (64 * 1024)
+
+// Max sfd->recv_length, see sm_recv
+#define SM_MAX_RECV_LENGTH (256 * 1024)
+
+// Default recv budget, see sm_recv
+#define SM_RECV_BUDGET_LENGTH (1024 * 1024)
+#define SM_RECV_BUDGET_READS 64
 
 
 int sm_listen(int port) {
@@ -306,155 +494,425 @@ sm_status sm_on_debug(sm_t self, const char *format, ...) {
   return SM_SUCCESS;
 }
 
-sm_status sm_add_fd(sm_t self, int fd, void *ssl_session, void *value,
+
+// @result a new sfd, which the caller adds to the backend and my->fds
+sm_fd_t sm_fd_new(sm_t self, int fd, void *ssl_session, void *value,
     bool is_server) {
   sm_private_t my = self->private_state;
-  if (FD_ISSET(fd, my->all_fds)) {
-    return SM_ERROR;
+  if (fd < 0 || sm_get_fd(my, fd)) {
+    return NULL;
+  }
+  if (fd >= my->fds_length) {
+    int new_length = (my->fds_length ? my->fds_length : 64);
+    while (new_length <= fd) {
+      new_length *= 2;
+    }
+    sm_fd_t *new_fds = (sm_fd_t *)realloc(my->fds,
+        new_length * sizeof(sm_fd_t));
+    if (!new_fds) {
+      return NULL;
+    }
+    memset(new_fds + my->fds_length, 0,
+        (new_length - my->fds_length) * sizeof(sm_fd_t));
+    my->fds = new_fds;
+    my->fds_length = new_length;
+  }
+  sm_fd_t sfd = (sm_fd_t)malloc(sizeof(struct sm_fd));
+  if (!sfd) {
+    return NULL;
+  }
+  memset(sfd, 0, sizeof(struct sm_fd));
+  sfd->fd = fd;
+  sfd->value = value;
+  sfd->ssl_session = ssl_session;
+  sfd->is_server = is_server;
+  sfd->is_recv = true;
+  sfd->low_watermark = my->low_watermark;
+  sfd->high_watermark = my->high_watermark;
+  sfd->recv_length = my->min_recv_length;
+  if (ssl_session) {
+    // a blocked SSL_write is retried from our sendq, or from a fresh
+    // coalesced record buffer
+    SSL_set_mode((SSL *)ssl_session, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
   }
-  if (ht_put(my->fd_to_value, HT_KEY(fd), value)) {
-    // The above FD_ISSET(..master..) should prevent this
+  return sfd;
+}
+
+sm_status sm_add_fd(sm_t self, int fd, void *ssl_session, void *value,
+    bool is_server) {
+  sm_private_t my = self->private_state;
+  sm_fd_t sfd = sm_fd_new(self, fd, ssl_session, value, is_server);
+  if (!sfd) {
     return SM_ERROR;
   }
-  if (ssl_session != NULL && ht_put(my->fd_to_ssl, HT_KEY(fd), ssl_session)) {
+  if (my->backend->add_fd(self, sfd)) {
+    free(sfd);
     return SM_ERROR;
   }
   // is_server == getsockopt(..., SO_ACCEPTCONN, ...)?
   sm_on_debug(self, "ss.add%s_fd(%d)", (is_server ? "_server" : ""), fd);
-  FD_SET(fd, my->all_fds);
-  FD_CLR(fd, my->send_fds); // only set if blocked
-  FD_SET(fd, my->recv_fds);
-  FD_CLR(fd, my->tmp_send_fds);
-  FD_CLR(fd, my->tmp_recv_fds);
-  FD_CLR(fd, my->tmp_fail_fds);
-  if (is_server) {
-    FD_SET(fd, my->server_fds);
-  }
-  if (fd > my->max_fd) {
-    my->max_fd = fd;
-  }
+  my->fds[fd] = sfd;
+  my->num_fds++;
   return SM_SUCCESS;
 }
 
 sm_status sm_remove_fd(sm_t self, int fd) {
   sm_private_t my = self->private_state;
-  if (!FD_ISSET(fd, my->all_fds)) {
+  sm_fd_t sfd = sm_get_fd(my, fd);
+  if (!sfd) {
     return SM_ERROR;
   }
-  ht_put(my->fd_to_ssl, HT_KEY(fd), NULL);
-  void *value = ht_put(my->fd_to_value, HT_KEY(fd), NULL);
-  bool is_server = FD_ISSET(fd, my->server_fds);
+  bool is_server = sfd->is_server;
   sm_on_debug(self, "ss.remove%s_fd(%d)", (is_server ? "_server" : ""), fd);
-  sm_status ret = self->on_close(self, fd, value, is_server);
+  while (sfd->timers) {
+    sm_timer_free(self, sfd->timers);
+  }
+  sm_backlog_unlink(my, sfd);
+  if (sfd->is_flush) {
+    // try to send what we'd have sent if it wasn't corked, e.g. an error
+    // response that's followed by this remove_fd
+    struct sm_iovec iov[SM_MAX_IOV];
+    size_t length;
+    size_t n = sm_sendq_iov(sfd, iov, &length);
+    sm_writev(self, sfd, iov, n);
+  }
+  sm_sendq_t sendq;
+  while ((sendq = sfd->recv_sendqs)) {
+    // don't abort this blocked send, even though the "cause" has ended
+    sfd->recv_sendqs = sendq->recv_next;
+    sendq->recv_sfd = NULL;
+    sendq->recv_prev = NULL;
+    sendq->recv_next = NULL;
+  }
+  sfd->recv_sendqs_length = 0;
+  for (sendq = sfd->sendq; sendq; sendq = sendq->next) {
+    // may re-enable other recv_fds
+    sm_sendq_unlink(self, sendq);
+  }
+  // the backend may take the sendq, e.g. if it's still being sent
+  if (!sfd->is_pending) {
+    my->backend->remove_fd(self, sfd);
+  }
+  if (!sfd->is_resolving) {
+    sm_resolve_free(sfd->resolve);
+  }
+  my->fds[fd] = NULL;
+  sm_status ret = SM_SUCCESS;
+  if (sfd->is_post) {
+    my->post_fds[0] = -1;
+  } else {
+    my->num_fds--;
+    ret = self->on_close(self, fd, sfd->value, is_server);
+  }
 #ifdef WIN32
   closesocket(fd);
 #else
   close(fd);
 #endif
-  FD_CLR(fd, my->all_fds);
-  if (is_server) {
-    FD_CLR(fd, my->server_fds);
-  }
-  FD_CLR(fd, my->send_fds);
-  FD_CLR(fd, my->recv_fds);
-  FD_CLR(fd, my->tmp_send_fds);
-  FD_CLR(fd, my->tmp_recv_fds);
-  FD_CLR(fd, my->tmp_fail_fds);
-  if (fd == my->max_fd) {
-    while (my->max_fd >= 0 && !FD_ISSET(my->max_fd, my->all_fds)) {
-      my->max_fd--;
-    }
-  }
-  if (ht_size(my->fd_to_sendq)) {
-    sm_sendq_t *qs = (sm_sendq_t *)ht_values(my->fd_to_sendq);
-    sm_sendq_t *q;
-    for (q = qs; *q; q++) {
-      sm_sendq_t sendq = *q;
-      while (sendq) {
-        if (sendq->recv_fd == fd) {
-          sendq->recv_fd = 0;
-          // don't abort this blocked send, even though the "cause" has ended
-        }
-        sendq = sendq->next;
-      }
-    }
-    free(qs);
+  sendq = sfd->sendq;
+  while (sendq) {
+    sm_sendq_t nextq = sendq->next;
+    sm_sendq_free(sendq);
+    sendq = nextq;
   }
+  memset(sfd, 0, sizeof(struct sm_fd));
+  free(sfd);
   return ret;
 }
 
-sm_status sm_send(sm_t self, int fd, const char *data, size_t length,
-    void* value) {
-  sm_private_t my = self->private_state;
-  sm_sendq_t sendq = (sm_sendq_t)ht_get_value(my->fd_to_sendq, HT_KEY(fd));
-  const char *head = data;
-  const char *tail = data + length;
-  if (!sendq) {
-    void *ssl_session = ht_get_value(my->fd_to_ssl, HT_KEY(fd));
-    // send as much as we can without blocking
-    while (1) {
-      ssize_t sent_bytes;
-      if (ssl_session == NULL) {
-        sent_bytes = send(fd, (void*)head, (tail - head), 0);
-        if (sent_bytes <= 0) {
+// Send as much of the iov as we can without blocking.
+// @result the number of bytes sent, or -1 if the send failed
+ssize_t sm_writev(sm_t self, sm_fd_t sfd, const struct sm_iovec *iov,
+    size_t iov_count) {
+  int fd = sfd->fd;
+  void *ssl_session = sfd->ssl_session;
+  size_t sent = 0;
+  size_t i = 0;
+  size_t offset = 0;  // into iov[i]
+  while (i < iov_count) {
+    if (offset >= iov[i].length) {
+      i++;
+      offset = 0;
+      continue;
+    }
+    ssize_t sent_bytes;
+    if (ssl_session == NULL) {
 #ifdef WIN32
-          if (sent_bytes && WSAGetLastError() != WSAEWOULDBLOCK) {
+      sent_bytes = send(fd, (void*)(iov[i].data + offset),
+          (iov[i].length - offset), 0);
 #else
-          if (sent_bytes && errno != EWOULDBLOCK) {
+      struct iovec v[SM_MAX_IOV];
+      size_t n = 0;
+      size_t j;
+      for (j = i; j < iov_count && n < SM_MAX_IOV; j++) {
+        size_t skip = (j == i ? offset : 0);
+        v[n].iov_base = (void*)(iov[j].data + skip);
+        v[n].iov_len = iov[j].length - skip;
+        n++;
+      }
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = v;
+      msg.msg_iovlen = n;
+      sent_bytes = sendmsg(fd, &msg, SEND_FLAGS);
 #endif
-            sm_on_debug(self, "ss.failed fd=%d", fd);
-            perror("send failed");
-            return SM_ERROR;
-          }
-          break;
+      if (sent_bytes <= 0) {
+#ifdef WIN32
+        if (sent_bytes && WSAGetLastError() != WSAEWOULDBLOCK) {
+#else
+        if (sent_bytes && errno != EWOULDBLOCK) {
+#endif
+          sm_on_debug(self, "ss.failed fd=%d", fd);
+          perror("send failed");
+          return -1;
         }
-      } else {
-        sent_bytes = SSL_write((SSL *)ssl_session, (void*)head, tail - head);
-        if (sent_bytes <= 0) {
-          if (SSL_get_error(ssl_session, sent_bytes) != SSL_ERROR_WANT_READ &&
-              SSL_get_error(ssl_session, sent_bytes) != SSL_ERROR_WANT_WRITE) {
-            sm_on_debug(self, "ss.failed fd=%d", fd);
-            perror("ssl send failed");
-            return SM_ERROR;
+        break;
+      }
+    } else {
+      // coalesce small segments, so we don't write a TLS record per segment
+      char buf[SM_SSL_RECORD_LENGTH];
+      const char *head = iov[i].data + offset;
+      size_t length = iov[i].length - offset;
+      if (length < sizeof(buf) && i + 1 < iov_count) {
+        memcpy(buf, head, length);
+        size_t j;
+        for (j = i + 1; j < iov_count && length < sizeof(buf); j++) {
+          size_t n = sizeof(buf) - length;
+          if (n > iov[j].length) {
+            n = iov[j].length;
           }
-          break;
+          memcpy(buf + length, iov[j].data, n);
+          length += n;
+        }
+        head = buf;
+      }
+      sent_bytes = SSL_write((SSL *)ssl_session, (void*)head, length);
+      if (sent_bytes <= 0) {
+        if (SSL_get_error(ssl_session, sent_bytes) != SSL_ERROR_WANT_READ &&
+            SSL_get_error(ssl_session, sent_bytes) != SSL_ERROR_WANT_WRITE) {
+          sm_on_debug(self, "ss.failed fd=%d", fd);
+          perror("ssl send failed");
+          return -1;
+        }
+        break;
+      }
+    }
+    sent += sent_bytes;
+    size_t n = sent_bytes;
+    while (n > 0) {
+      size_t left = iov[i].length - offset;
+      if (n < left) {
+        offset += n;
+        break;
+      }
+      n -= left;
+      i++;
+      offset = 0;
+    }
+  }
+  return sent;
+}
+
+sm_status sm_sendv(sm_t self, int fd, const struct sm_iovec *iov,
+    size_t iov_count, void *value, void (*release)(void *value)) {
+  sm_private_t my = self->private_state;
+  sm_fd_t sfd = sm_get_fd(my, fd);
+  if (!sfd) {
+    if (release) {
+      release(value);
+    }
+    return SM_ERROR;
+  }
+  size_t length = 0;
+  size_t i;
+  for (i = 0; i < iov_count; i++) {
+    length += iov[i].length;
+  }
+  sm_sendq_t sendq = sfd->sendq;
+  size_t sent = 0;
+  // an async backend, e.g. io_uring, submits our sendq for us, but we try to
+  // write first, so a send that doesn't block isn't copied.  A connecting fd
+  // sends its sendq once it's connected.
+  bool is_async = (my->backend->send && !sfd->ssl_session &&
+      !sfd->is_connecting);
+  // a corked send is queued until sm_flush
+  const struct sm_fd_options *options = my->class_options + sfd->fd_class;
+  bool is_cork = (options->is_cork && !sfd->is_connecting);
+  if (is_cork && (!sendq || sfd->is_flush) &&
+      sfd->sendq_length + length >= options->cork_length) {
+    // don't copy a big send into our sendq, e.g. a devtools message, but
+    // write it now, after whatever's corked
+    is_cork = false;
+    if (sendq) {
+      int ret = sm_flush(self, sfd);
+      if (ret <= 0) {
+        if (release) {
+          release(value);
         }
+        return (ret < 0 ? SM_ERROR : SM_SUCCESS);
+      }
+      sendq = sfd->sendq;
+    }
+  }
+  if (!sendq && !sfd->is_connecting && !is_cork) {
+    ssize_t sent_bytes = sm_writev(self, sfd, iov, iov_count);
+    if (sent_bytes < 0) {
+      if (release) {
+        release(value);
       }
-      head += sent_bytes;
-      if (head >= tail) {
-        self->on_sent(self, fd, value, data, length);
-        return SM_SUCCESS; // this is the typical case
+      return SM_ERROR;
+    }
+    sent = sent_bytes;
+    if (sent >= length) {
+      self->on_sent(self, fd, value, (iov_count == 1 ? iov[0].data : NULL),
+          length);
+      if (release) {
+        release(value);
       }
+      return SM_SUCCESS; // this is the typical case
     }
   }
-  // we can't send this now, so queue it
+  // we can't send this now, so queue it.  Consecutive copied segments share
+  // a single copy.
   int curr_recv_fd = my->curr_recv_fd;
-  sm_sendq_t newq = sm_sendq_new(curr_recv_fd, value, head, tail - head);
+  sm_fd_t recv_sfd = sm_get_fd(my, curr_recv_fd);
+  sm_sendq_t newq = NULL;
+  sm_sendq_t lastq = NULL;
+  size_t offset = sent;  // into iov[i]
+  for (i = 0; i + 1 < iov_count && offset >= iov[i].length; i++) {
+    offset -= iov[i].length;
+  }
+  while (i < iov_count) {
+    const char *head = iov[i].data + offset;
+    size_t n = iov[i].length - offset;
+    offset = 0;
+    sm_sendq_t q;
+    if (iov[i].is_ref) {
+      q = sm_sendq_new(value, head, n, true);
+      i++;
+    } else {
+      size_t j;
+      size_t copy_length = n;
+      for (j = i + 1; j < iov_count && !iov[j].is_ref; j++) {
+        copy_length += iov[j].length;
+      }
+      q = sm_sendq_new(value, NULL, copy_length, false);
+      if (q) {
+        char *tail = q->begin;
+        memcpy(tail, head, n);
+        tail += n;
+        for (i++; i < j; i++) {
+          memcpy(tail, iov[i].data, iov[i].length);
+          tail += iov[i].length;
+        }
+      }
+    }
+    if (!q) {
+      while (newq) {
+        sm_sendq_t nextq = newq->next;
+        sm_sendq_free(newq);
+        newq = nextq;
+      }
+      if (release) {
+        release(value);
+      }
+      return SM_ERROR;
+    }
+    if (lastq) {
+      lastq->next = q;
+    } else {
+      newq = q;
+    }
+    lastq = q;
+  }
+  if (!lastq) {
+    // e.g. a zero-length send behind a blocked send
+    newq = lastq = sm_sendq_new(value, NULL, 0, false);
+    if (!newq) {
+      if (release) {
+        release(value);
+      }
+      return SM_ERROR;
+    }
+  }
+  lastq->is_last = true;
+  lastq->release = release;
+  // a corked send hasn't blocked, so it doesn't count towards our recv_fd's
+  // watermarks unless its flush blocks, see sm_sendq_link_corked
+  bool is_corked = (is_cork && (!sendq || sfd->is_flush));
+  sm_sendq_t q;
+  for (q = newq; q; q = q->next) {
+    if (is_corked) {
+      q->cork_recv_fd = curr_recv_fd;
+    } else {
+      sm_sendq_link(self, q, recv_sfd);
+    }
+  }
   if (sendq) {
     while (sendq->next) {
       sendq = sendq->next;
     }
     sendq->next = newq;
   } else {
-    ht_put(my->fd_to_sendq, HT_KEY(fd), newq);
-    FD_SET(fd, my->send_fds);
+    sfd->sendq = newq;
   }
+  sfd->sendq_length += length - sent;
   sm_on_debug(self, "ss.sendq<%p> new fd=%d recv_fd=%d length=%zd"
-      ", prev=<%p>", newq, fd, curr_recv_fd, tail - head, sendq);
-  if (curr_recv_fd && FD_ISSET(curr_recv_fd, my->recv_fds)) {
-    // block the current recv_fd, to prevent our sendq from growing too large.
-    // At worst our recv_fds are all trying to send to the same fd, in which
-    // case we'll eventually block all of them until the first blocked send
-    // succeeds.
-    sm_on_debug(self, "ss.sendq<%p> disable recv_fd=%d", newq, curr_recv_fd);
-    FD_CLR(curr_recv_fd, my->recv_fds);
-    FD_CLR(curr_recv_fd, my->tmp_recv_fds);
+      ", prev=<%p>", newq, fd, curr_recv_fd, length - sent, sendq);
+  if (!is_corked) {
+    sm_check_high_watermark(self, recv_sfd);
+  }
+  if (is_cork) {
+    if (!sendq && !sm_flush_later(my, sfd)) {
+      // don't remove the fd while our caller is using it, see sm_flush_all
+      return (sm_flush(self, sfd) < 0 ? SM_ERROR : SM_SUCCESS);
+    }
+    return SM_SUCCESS;
+  } else if (is_async) {
+    return my->backend->send(self, sfd);
+  } else if (!sendq && !sfd->is_pending) {
+    my->backend->update_fd(self, sfd);
   }
   return SM_SUCCESS;
 }
 
-void sm_accept(sm_t self, int fd) {
+sm_status sm_send(sm_t self, int fd, const char *data, size_t length,
+    void* value) {
+  struct sm_iovec iov;
+  iov.data = data;
+  iov.length = length;
+  iov.is_ref = false;
+  return sm_sendv(self, fd, &iov, 1, value, NULL);
+}
+
+bool sm_on_accept_fd(sm_t self, sm_fd_t sfd, int new_fd) {
   sm_private_t my = self->private_state;
+  int fd = sfd->fd;
+  sm_on_debug(self, "ss.accept server=%d new_client=%d",
+      fd, new_fd);
+  void *value = sfd->value;
+  void *new_value = NULL;
+  if (self->on_accept(self, fd, value, new_fd, &new_value)) {
+#ifdef WIN32
+   closesocket(new_fd);
+#else
+   close(new_fd);
+#endif
+  } else if (self->add_fd(self, new_fd, NULL, new_value, false)) {
+    self->on_close(self, new_fd, new_value, false);
+#ifdef WIN32
+   closesocket(new_fd);
+#else
+   close(new_fd);
+#endif
+  } else if (sfd->fd_class) {
+    self->set_fd_class(self, new_fd, sfd->fd_class);
+  }
+  return (sm_get_fd(my, fd) == sfd);
+}
+
+void sm_accept(sm_t self, sm_fd_t sfd) {
+  int fd = sfd->fd;
   while (1) {
     int new_fd = accept(fd, NULL, NULL);
     if (new_fd < 0) {
@@ -469,242 +927,2306 @@ void sm_accept(sm_t self, int fd) {
       }
       break;
     }
-    sm_on_debug(self, "ss.accept server=%d new_client=%d",
-        fd, new_fd);
-    void *value = ht_get_value(my->fd_to_value, HT_KEY(fd));
-    void *new_value = NULL;
-    if (self->on_accept(self, fd, value, new_fd, &new_value)) {
-#ifdef WIN32
-     closesocket(new_fd);
-#else
-     close(new_fd);
-#endif
-    } else if (self->add_fd(self, new_fd, NULL, new_value, false)) {
-      self->on_close(self, new_fd, new_value, false);
-#ifdef WIN32
-     closesocket(new_fd);
-#else
-     close(new_fd);
-#endif
+    if (!sm_on_accept_fd(self, sfd, new_fd)) {
+      break;
     }
   }
 }
 
-void sm_resend(sm_t self, int fd) {
+bool sm_sendq_pop(sm_t self, sm_fd_t sfd) {
   sm_private_t my = self->private_state;
-  sm_sendq_t sendq = ht_get_value(my->fd_to_sendq, HT_KEY(fd));
-  void *ssl_session = ht_get_value(my->fd_to_ssl, HT_KEY(fd));
-  while (sendq) {
-    char *head = sendq->head;
-    char *tail = sendq->tail;
-    // send as much as we can without blocking
-    sm_on_debug(self, "ss.sendq<%p> resume send to fd=%d len=%zd", sendq, fd,
-        (tail - head));
-    while (head < tail) {
-      ssize_t sent_bytes;
-      if (ssl_session == NULL) {
-        sent_bytes = send(fd, (void*)head, (tail - head), 0);
-        if (sent_bytes <= 0) {
-#ifdef WIN32
-          if (sent_bytes && WSAGetLastError() != WSAEWOULDBLOCK) {
-            fprintf(stderr, "sendq retry failed with error: %d\n",
-                WSAGetLastError());
-#else
-          if (sent_bytes && errno != EWOULDBLOCK) {
-            perror("sendq retry failed");
-#endif
-            self->remove_fd(self, fd);
-            return;
-          }
-          break;
-        }
-      } else {
-        sent_bytes = SSL_write((SSL *)ssl_session, (void*)head, tail - head);
-        if (sent_bytes <= 0) {
-          if (SSL_get_error(ssl_session, sent_bytes) != SSL_ERROR_WANT_READ &&
-              SSL_get_error(ssl_session, sent_bytes) != SSL_ERROR_WANT_WRITE) {
-            perror("ssl sendq retry failed");
-            self->remove_fd(self, fd);
-            return;
-          }
-          break;
-        }
-      }
-      head += sent_bytes;
-    }
-    sendq->head = head;
-    if (head < tail) {
-      // still have stuff to send
-      sm_on_debug(self, "ss.sendq<%p> defer len=%zd", sendq, (tail - head));
+  int fd = sfd->fd;
+  sm_sendq_t sendq = sfd->sendq;
+  sm_sendq_t nextq = sendq->next;
+  sfd->sendq = nextq;
+  sfd->sendq_length -= sendq->length;
+  if (!nextq) {
+    my->backend->update_fd(self, sfd);
+  }
+  sm_sendq_unlink(self, sendq);
+  if (sendq->is_last) {
+    self->on_sent(self, fd, sendq->value, sendq->begin, sendq->length);
+  }
+  sm_on_debug(self, "ss.sendq<%p> free, next=<%p>", sendq, nextq);
+  sm_sendq_free(sendq);
+  return (sm_get_fd(my, fd) == sfd);
+}
+
+// Advance the sendq by the number of bytes sent, popping whatever's done.
+// @result false if an on_sent callback removed this fd
+bool sm_sendq_sent(sm_t self, sm_fd_t sfd, size_t length) {
+  while (sfd->sendq) {
+    sm_sendq_t sendq = sfd->sendq;
+    size_t n = sendq->tail - sendq->head;
+    if (length < n) {
+      sendq->head += length;
+      sm_on_debug(self, "ss.sendq<%p> defer len=%zd", sendq, n - length);
       break;
     }
-    self->on_sent(self, fd, sendq->value, sendq->begin, tail - sendq->begin);
-    sm_sendq_t nextq = sendq->next;
-    ht_put(my->fd_to_sendq, HT_KEY(fd), nextq);
-    if (!nextq) {
-      FD_CLR(fd, my->send_fds);
-    }
-    int recv_fd = sendq->recv_fd;
-    if (recv_fd && FD_ISSET(recv_fd, my->all_fds)) {
-      // if no other sendq's match this blocked recv_fd, re-enable it
-      bool found = false;
-      if (ht_size(my->fd_to_sendq)) {
-        sm_sendq_t *qs = (sm_sendq_t *)ht_values(my->fd_to_sendq);
-        sm_sendq_t *q;
-        for (q = qs; *q && !found; q++) {
-          sm_sendq_t sq;
-          for (sq = *q; sq && !found; sq = sq->next) {
-            found |= (sq->recv_fd == recv_fd);
-          }
-        }
-        free(qs);
-      }
-      if (!found) {
-        sm_on_debug(self, "ss.sendq<%p> re-enable recv_fd=%d", sendq, recv_fd);
-        FD_SET(recv_fd, my->recv_fds);
-        // don't FD_SET(tmp_recv_fds), since maybe there was no input
-        // instead, let the next select loop pick it up
-      }
+    length -= n;
+    sendq->head = sendq->tail;
+    if (!sm_sendq_pop(self, sfd)) {
+      return false;
     }
-    sm_on_debug(self, "ss.sendq<%p> free, next=<%p>", sendq, nextq);
-    sm_sendq_free(sendq);
-    sendq = nextq;
   }
+  return true;
 }
 
-void sm_recv(sm_t self, int fd) {
-  sm_private_t my = self->private_state;
-  my->curr_recv_fd = fd;
-  void *ssl_session = ht_get_value(my->fd_to_ssl, HT_KEY(fd));
-  while (1) {
-    ssize_t read_bytes;
-    if (ssl_session == NULL) {
-      read_bytes = recv(fd, my->tmp_buf, my->tmp_buf_length, RECV_FLAGS);
-      if (read_bytes < 0) {
-#ifdef WIN32
-        if (WSAGetLastError() != WSAEWOULDBLOCK) {
-          fprintf(stderr, "recv failed with error %d\n", WSAGetLastError());
-#else
-        if (errno != EWOULDBLOCK) {
-          perror("recv failed");
-#endif
-          self->remove_fd(self, fd);
-        }
-        break;
-      }
-    } else {
-      read_bytes = SSL_read((SSL *)ssl_session, my->tmp_buf, my->tmp_buf_length);
-      if (read_bytes <= 0) {
-        if (SSL_get_error(ssl_session, read_bytes) != SSL_ERROR_WANT_READ &&
-            SSL_get_error(ssl_session, read_bytes) != SSL_ERROR_WANT_WRITE) {
-          perror("ssl recv failed");
-          self->remove_fd(self, fd);
-        }
-        break;
-      }
-    }
-    sm_on_debug(self, "ss.recv fd=%d len=%zd", fd, read_bytes);
-    void *value = ht_get_value(my->fd_to_value, HT_KEY(fd));
-    if (read_bytes == 0 ||
-        self->on_recv(self, fd, value, my->tmp_buf, read_bytes)) {
-      self->remove_fd(self, fd);
-      break;
+void sm_sendq_link(sm_t self, sm_sendq_t sendq, sm_fd_t recv_sfd) {
+  sendq->recv_sfd = recv_sfd;
+  if (recv_sfd) {
+    sendq->recv_next = recv_sfd->recv_sendqs;
+    if (recv_sfd->recv_sendqs) {
+      recv_sfd->recv_sendqs->recv_prev = sendq;
     }
+    recv_sfd->recv_sendqs = sendq;
+    recv_sfd->recv_sendqs_length += sendq->length;
   }
-  my->curr_recv_fd = 0;
 }
 
-int sm_select(sm_t self, int timeout_secs) {
-  sm_private_t my = self->private_state;
-
-  if (my->max_fd <= 0) {
-    return -1;
+// Blocks the recv_sfd if its blocked sends are over its high watermark.
+void sm_check_high_watermark(sm_t self, sm_fd_t recv_sfd) {
+  if (recv_sfd && recv_sfd->is_recv &&
+      recv_sfd->recv_sendqs_length > recv_sfd->high_watermark) {
+    // block the current recv_fd, to prevent our sendq from growing too large.
+    // At worst our recv_fds are all trying to send to the same fd, in which
+    // case we'll eventually block all of them until enough of the blocked
+    // sends succeed.
+    sm_on_debug(self, "ss.sendq disable recv_fd=%d length=%zd",
+        recv_sfd->fd, recv_sfd->recv_sendqs_length);
+    recv_sfd->is_recv = false;
+    self->private_state->backend->update_fd(self, recv_sfd);
   }
+}
 
-  my->timeout.tv_sec = timeout_secs;
-
-  // copy into tmp
-  memcpy(my->tmp_send_fds, my->send_fds, SIZEOF_FD_SET);
-  memcpy(my->tmp_recv_fds, my->recv_fds, SIZEOF_FD_SET);
-  memcpy(my->tmp_fail_fds, my->all_fds, SIZEOF_FD_SET);
-  int num_ready = select(my->max_fd + 1, my->tmp_recv_fds,
-      my->tmp_send_fds, my->tmp_fail_fds, &my->timeout);
-
-  // see if any sockets are readable
-  if (num_ready == 0) {
-    return 0; // timeout, select again
-  }
-  if (num_ready < 0) {
-#ifdef WIN32
-    int socket_err = WSAGetLastError();
-    if (socket_err != WSAEINTR && socket_err != WSAEWOULDBLOCK) {
-      fprintf(stderr, "socket_manager: select failed with\
-          error %d\n", WSAGetLastError());
-      return -socket_err;
-    }
-#else
-    if (errno != EINTR && errno != EAGAIN) {
-      // might want to sleep here?
-      perror("select failed");
-      return -errno;
+// Links sfd's corked sends to their recv_fds, e.g. because their flush
+// blocked.
+void sm_sendq_link_corked(sm_t self, sm_fd_t sfd) {
+  sm_private_t my = self->private_state;
+  sm_sendq_t sendq;
+  for (sendq = sfd->sendq; sendq; sendq = sendq->next) {
+    if (sendq->cork_recv_fd >= 0) {
+      // it may have been closed, or reused, since it corked this send
+      sm_fd_t recv_sfd = sm_get_fd(my, sendq->cork_recv_fd);
+      sendq->cork_recv_fd = -1;
+      sm_sendq_link(self, sendq, recv_sfd);
+      sm_check_high_watermark(self, recv_sfd);
     }
-#endif
-    return 0;
   }
+}
 
-  int num_left = num_ready;
-  int fd;
-  for (fd = 0; fd <= my->max_fd && num_left > 0; fd++) {
-    bool can_send = FD_ISSET(fd, my->tmp_send_fds);
-    bool can_recv = FD_ISSET(fd, my->tmp_recv_fds);
-    bool is_fail = FD_ISSET(fd, my->tmp_fail_fds);
-    if (!can_send && !can_recv && !is_fail) {
-      continue;
-    }
-    num_left--;
-    if (is_fail) {
-      self->remove_fd(self, fd);
-    } else if (FD_ISSET(fd, my->server_fds)) {
-      sm_accept(self, fd);
-    } else {
-      if (can_send) {
-        sm_resend(self, fd);
-      }
-      if (can_recv) {
-        sm_recv(self, fd);
-      }
-    }
+void sm_sendq_unlink(sm_t self, sm_sendq_t sendq) {
+  sm_fd_t recv_sfd = sendq->recv_sfd;
+  if (!recv_sfd) {
+    return;
+  }
+  if (sendq->recv_prev) {
+    sendq->recv_prev->recv_next = sendq->recv_next;
+  } else {
+    recv_sfd->recv_sendqs = sendq->recv_next;
+  }
+  if (sendq->recv_next) {
+    sendq->recv_next->recv_prev = sendq->recv_prev;
+  }
+  sendq->recv_sfd = NULL;
+  sendq->recv_prev = NULL;
+  sendq->recv_next = NULL;
+  recv_sfd->recv_sendqs_length -= sendq->length;
+  if (!recv_sfd->is_recv && (!recv_sfd->recv_sendqs ||
+        recv_sfd->recv_sendqs_length <= recv_sfd->low_watermark)) {
+    sm_on_debug(self, "ss.sendq<%p> re-enable recv_fd=%d length=%zd", sendq,
+        recv_sfd->fd, recv_sfd->recv_sendqs_length);
+    recv_sfd->is_recv = true;
+    self->private_state->backend->update_fd(self, recv_sfd);
+    // don't recv now, since maybe there was no input
+    sm_backlog_pending(self, recv_sfd);
+    // instead, let the next select loop pick it up
   }
-  return num_ready;
 }
 
-sm_status sm_cleanup(sm_t self) {
+sm_status sm_set_watermarks(sm_t self, int fd, size_t low_length,
+    size_t high_length) {
   sm_private_t my = self->private_state;
-  int fd;
-  for (fd = 0; fd <= my->max_fd; fd++) {
-    if (FD_ISSET(fd, my->all_fds)) {
-      self->remove_fd(self, fd);
-    }
+  if (low_length > high_length) {
+    return SM_ERROR;
+  }
+  if (fd < 0) {
+    my->low_watermark = low_length;
+    my->high_watermark = high_length;
+    return SM_SUCCESS;
+  }
+  sm_fd_t sfd = sm_get_fd(my, fd);
+  if (!sfd) {
+    return SM_ERROR;
+  }
+  sfd->low_watermark = low_length;
+  sfd->high_watermark = high_length;
+  if (!sfd->is_recv && sfd->recv_sendqs_length <= low_length) {
+    sfd->is_recv = true;
+    my->backend->update_fd(self, sfd);
+    sm_backlog_pending(self, sfd);
+  } else if (sfd->is_recv && sfd->recv_sendqs_length > high_length) {
+    sfd->is_recv = false;
+    my->backend->update_fd(self, sfd);
   }
   return SM_SUCCESS;
 }
 
+// @param iov SM_MAX_IOV segments, set to the head of sfd's sendq
+// @result the number of segments
+size_t sm_sendq_iov(sm_fd_t sfd, struct sm_iovec *iov, size_t *to_length) {
+  size_t n = 0;
+  size_t length = 0;
+  sm_sendq_t sendq;
+  for (sendq = sfd->sendq; sendq && n < SM_MAX_IOV; sendq = sendq->next) {
+    iov[n].data = sendq->head;
+    iov[n].length = sendq->tail - sendq->head;
+    iov[n].is_ref = true;
+    length += iov[n].length;
+    n++;
+  }
+  *to_length = length;
+  return n;
+}
+
+// Send as much of sfd's sendq as we can without blocking.
+// @result -1 if the send failed, 0 if an on_sent callback removed sfd,
+//   else 1
+int sm_send_sendq(sm_t self, sm_fd_t sfd) {
+  int fd = sfd->fd;
+  while (sfd->sendq) {
+    // gather the queued segments, to send as much as we can without blocking
+    struct sm_iovec iov[SM_MAX_IOV];
+    size_t length;
+    size_t n = sm_sendq_iov(sfd, iov, &length);
+    sm_on_debug(self, "ss.sendq<%p> resume send to fd=%d len=%zd",
+        sfd->sendq, fd, length);
+    ssize_t sent_bytes = sm_writev(self, sfd, iov, n);
+    if (sent_bytes < 0) {
+      return -1;
+    }
+    if (!sm_sendq_sent(self, sfd, sent_bytes)) {
+      return 0;  // on_sent removed this fd
+    }
+    if ((size_t)sent_bytes < length) {
+      break;  // still have stuff to send
+    }
+  }
+  return 1;
+}
+
+void sm_resend(sm_t self, sm_fd_t sfd) {
+  if (sm_send_sendq(self, sfd) < 0) {
+    self->remove_fd(self, sfd->fd);
+  }
+}
+
+//
+// CORK
+//
+// A corked fd's sends are queued on its sendq, as if they'd blocked, then
+// written together by sm_flush_all at the end of our sm_select pass.  E.g. a
+// burst of small websocket frames takes one sendmsg, or one SSL_write per
+// 16k, instead of one per frame.  A send that would bring the queue to
+// options->cork_length bytes flushes it and is written as usual, so big
+// sends aren't copied.  Until a flush blocks, the queued sends aren't linked
+// to their recv_fds, so they don't count towards its watermarks.
+//
+
+bool sm_flush_later(sm_private_t my, sm_fd_t sfd) {
+  if (sfd->is_flush) {
+    return true;
+  }
+  if (my->num_flush_fds >= my->flush_fds_length) {
+    size_t new_length = (my->flush_fds_length ? 2 * my->flush_fds_length :
+        64);
+    int *new_fds = (int *)realloc(my->flush_fds, new_length * sizeof(int));
+    if (!new_fds) {
+      return false;
+    }
+    my->flush_fds = new_fds;
+    my->flush_fds_length = new_length;
+  }
+  my->flush_fds[my->num_flush_fds++] = sfd->fd;
+  sfd->is_flush = true;
+  return true;
+}
+
+// Writes sfd's corked sends, and if they block then we'll resend them once
+// it's writable.  Unlike sm_resend, this doesn't remove sfd if the send
+// fails.
+// @result as sm_send_sendq
+int sm_flush(sm_t self, sm_fd_t sfd) {
+  sm_private_t my = self->private_state;
+  sfd->is_flush = false;
+  if (my->backend->send && !sfd->ssl_session) {
+    sm_sendq_link_corked(self, sfd);
+    return (my->backend->send(self, sfd) ? -1 : 1);
+  }
+  int ret = sm_send_sendq(self, sfd);
+  if (ret > 0 && sfd->sendq) {
+    sm_sendq_link_corked(self, sfd);
+    my->backend->update_fd(self, sfd);
+  }
+  return ret;
+}
+
+void sm_flush_all(sm_t self) {
+  sm_private_t my = self->private_state;
+  size_t i;
+  // our callbacks may cork more sends, which we'll append
+  for (i = 0; i < my->num_flush_fds; i++) {
+    sm_fd_t sfd = sm_get_fd(my, my->flush_fds[i]);
+    if (sfd && sfd->is_flush && sm_flush(self, sfd) < 0) {
+      self->remove_fd(self, sfd->fd);
+    }
+  }
+  my->num_flush_fds = 0;
+}
+
+void sm_apply_fd_options(sm_t self, sm_fd_t sfd) {
+  sm_private_t my = self->private_state;
+  const struct sm_fd_options *options = my->class_options + sfd->fd_class;
+  int fd = sfd->fd;
+  // these may fail, e.g. TCP_NODELAY on a unix socket, which is fine
+  if (options->is_nodelay) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+  }
+  if (options->send_buffer_length > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+        (char *)&options->send_buffer_length, sizeof(int));
+  }
+  if (options->recv_buffer_length > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+        (char *)&options->recv_buffer_length, sizeof(int));
+  }
+}
+
+sm_status sm_set_class_options(sm_t self, int fd_class,
+    const struct sm_fd_options *options) {
+  sm_private_t my = self->private_state;
+  if (fd_class <= 0 || fd_class >= SM_MAX_FD_CLASSES || !options) {
+    return SM_ERROR;
+  }
+  my->class_options[fd_class] = *options;
+  int fd;
+  for (fd = 0; fd < my->fds_length; fd++) {
+    sm_fd_t sfd = my->fds[fd];
+    if (sfd && sfd->fd_class == fd_class && !sfd->is_server &&
+        !sfd->is_pending) {
+      sm_apply_fd_options(self, sfd);
+    }
+  }
+  return SM_SUCCESS;
+}
+
+sm_status sm_set_fd_class(sm_t self, int fd, int fd_class) {
+  sm_private_t my = self->private_state;
+  sm_fd_t sfd = sm_get_fd(my, fd);
+  if (!sfd || fd_class < 0 || fd_class >= SM_MAX_FD_CLASSES) {
+    return SM_ERROR;
+  }
+  sfd->fd_class = fd_class;
+  if (!sfd->is_server && !sfd->is_pending) {
+    sm_apply_fd_options(self, sfd);
+  }
+  return SM_SUCCESS;
+}
+
+bool sm_on_recv_data(sm_t self, sm_fd_t sfd, const char *buf,
+    ssize_t length) {
+  sm_private_t my = self->private_state;
+  int fd = sfd->fd;
+  if (sfd->is_post) {
+    sm_on_posts(self);
+    return (sm_get_fd(my, fd) == sfd);
+  }
+  sm_on_debug(self, "ss.recv fd=%d len=%zd", fd, length);
+  my->curr_recv_fd = fd;
+  bool is_open = true;
+  if (length == 0 || self->on_recv(self, fd, sfd->value, buf, length)) {
+    self->remove_fd(self, fd);
+    is_open = false;
+  } else if (sm_get_fd(my, fd) != sfd) {
+    is_open = false;  // on_recv removed this fd
+  }
+  my->curr_recv_fd = -1;
+  return is_open;
+}
+
+sm_status sm_set_recv_budget(sm_t self, size_t max_length,
+    size_t max_reads) {
+  sm_private_t my = self->private_state;
+  my->recv_budget_length = max_length;
+  my->recv_budget_reads = max_reads;
+  return SM_SUCCESS;
+}
+
+void sm_backlog_link(sm_private_t my, sm_fd_t sfd) {
+  if (sfd->is_backlog) {
+    return;
+  }
+  sfd->is_backlog = true;
+  sfd->backlog_prev = my->backlog_tail;
+  sfd->backlog_next = NULL;
+  if (my->backlog_tail) {
+    my->backlog_tail->backlog_next = sfd;
+  } else {
+    my->backlog = sfd;
+  }
+  my->backlog_tail = sfd;
+}
+
+void sm_backlog_unlink(sm_private_t my, sm_fd_t sfd) {
+  if (!sfd->is_backlog) {
+    return;
+  }
+  if (sfd->backlog_prev) {
+    sfd->backlog_prev->backlog_next = sfd->backlog_next;
+  } else {
+    my->backlog = sfd->backlog_next;
+  }
+  if (sfd->backlog_next) {
+    sfd->backlog_next->backlog_prev = sfd->backlog_prev;
+  } else {
+    my->backlog_tail = sfd->backlog_prev;
+  }
+  sfd->is_backlog = false;
+  sfd->backlog_prev = NULL;
+  sfd->backlog_next = NULL;
+}
+
+// Backlog an fd whose input OpenSSL has already read, since the backend
+// won't report it as ready.
+void sm_backlog_pending(sm_t self, sm_fd_t sfd) {
+  if (sfd->is_recv && sfd->ssl_session &&
+      SSL_pending((SSL *)sfd->ssl_session) > 0) {
+    sm_backlog_link(self->private_state, sfd);
+  }
+}
+
+// Grows our tmp_buf to the sfd->recv_length, if we can.
+// @result the length to recv
+static size_t sm_recv_length(sm_private_t my, sm_fd_t sfd) {
+  if (sfd->recv_length > my->tmp_buf_length) {
+    char *new_buf = (char *)realloc(my->tmp_buf, sfd->recv_length);
+    if (!new_buf) {
+      sfd->recv_length = my->tmp_buf_length;
+    } else {
+      my->tmp_buf = new_buf;
+      my->tmp_buf_length = sfd->recv_length;
+    }
+  }
+  return sfd->recv_length;
+}
+
+// Receive from sfd until it would block, or until it's spent its recv
+// budget, in which case it's backlogged, so the other ready fds get their
+// turns before it continues.
+//
+// Each recv is sized by the fd's recent input:  a full recv doubles its
+// recv_length, up to SM_MAX_RECV_LENGTH, and a recv of less than a quarter
+// halves it, down to sm_new's buffer_length.  A short plain recv means that
+// we've read everything, so we don't recv again just to see it block, unless
+// the backend is edge-triggered.  SSL_read returns a record at a time, so we
+// read SSL until it blocks, and backlog it if OpenSSL has input left over.
+void sm_recv(sm_t self, sm_fd_t sfd) {
+  sm_private_t my = self->private_state;
+  int fd = sfd->fd;
+  void *ssl_session = sfd->ssl_session;
+  sm_backlog_unlink(my, sfd);
+  sfd->recv_pass = my->recv_pass;
+  size_t num_reads = 0;
+  size_t total_length = 0;
+  while (1) {
+    if (!sfd->is_recv) {
+      sm_backlog_pending(self, sfd);
+      break;  // blocked by our sendqs, see sm_sendq_unlink
+    }
+    if ((my->recv_budget_reads && num_reads >= my->recv_budget_reads) ||
+        (my->recv_budget_length &&
+         total_length >= my->recv_budget_length)) {
+      sm_on_debug(self, "ss.recv fd=%d budget spent, len=%zd", fd,
+          total_length);
+      sm_backlog_link(my, sfd);
+      break;
+    }
+    size_t length = sm_recv_length(my, sfd);
+    ssize_t read_bytes;
+    if (ssl_session == NULL) {
+      read_bytes = recv(fd, my->tmp_buf, length, RECV_FLAGS);
+      if (read_bytes < 0) {
+#ifdef WIN32
+        if (WSAGetLastError() != WSAEWOULDBLOCK) {
+          fprintf(stderr, "recv failed with error %d\n", WSAGetLastError());
+#else
+        if (errno != EWOULDBLOCK) {
+          perror("recv failed");
+#endif
+          self->remove_fd(self, fd);
+        }
+        break;
+      }
+    } else {
+      read_bytes = SSL_read((SSL *)ssl_session, my->tmp_buf, length);
+      if (read_bytes <= 0) {
+        if (SSL_get_error(ssl_session, read_bytes) != SSL_ERROR_WANT_READ &&
+            SSL_get_error(ssl_session, read_bytes) != SSL_ERROR_WANT_WRITE) {
+          perror("ssl recv failed");
+          self->remove_fd(self, fd);
+        }
+        break;
+      }
+    }
+    num_reads++;
+    total_length += read_bytes;
+    if ((size_t)read_bytes == length) {
+      if (length < SM_MAX_RECV_LENGTH) {
+        sfd->recv_length = length * 2;
+      }
+    } else if ((size_t)read_bytes < length / 4 &&
+        length > my->min_recv_length) {
+      sfd->recv_length = length / 2;
+    }
+    bool is_drained = (!ssl_session && (size_t)read_bytes < length &&
+        !my->backend->is_edge_triggered);
+    if (!sm_on_recv_data(self, sfd, my->tmp_buf, read_bytes) || is_drained) {
+      break;
+    }
+  }
+}
+
+// Give each backlogged fd a turn, unless it's already had one in this pass.
+void sm_recv_backlog(sm_t self) {
+  sm_private_t my = self->private_state;
+  while (1) {
+    // our callbacks may remove or backlog any fd, so rescan
+    sm_fd_t sfd;
+    for (sfd = my->backlog; sfd && sfd->recv_pass == my->recv_pass;
+        sfd = sfd->backlog_next) {
+    }
+    if (!sfd) {
+      break;
+    }
+    if (sfd->is_recv) {
+      sm_recv(self, sfd);
+    } else {
+      sm_backlog_unlink(my, sfd);
+    }
+  }
+}
+
+void sm_on_ready(sm_t self, int fd, bool can_recv, bool can_send,
+    bool is_fail) {
+  sm_private_t my = self->private_state;
+  sm_fd_t sfd = sm_get_fd(my, fd);
+  if (!sfd) {
+    return;  // removed by an earlier callback
+  }
+  if (sfd->is_connecting) {
+    sm_on_connect_ready(self, sfd);
+  } else if (is_fail) {
+    self->remove_fd(self, fd);
+  } else if (sfd->is_server) {
+    sm_accept(self, sfd);
+  } else {
+    if (can_send && sfd->sendq) {
+      sm_resend(self, sfd);
+      sfd = sm_get_fd(my, fd);
+    }
+    if (can_recv && sfd && sfd->is_recv) {
+      sm_recv(self, sfd);
+    }
+  }
+}
+
+int sm_select(sm_t self, int timeout_secs) {
+  sm_private_t my = self->private_state;
+  if (my->num_fds <= 0 && !self->on_post) {
+    return -1;
+  }
+  if (my->num_flush_fds) {
+    sm_flush_all(self);  // e.g. sent before our first pass
+  }
+  int timeout_ms = timeout_secs * 1000;
+  int timer_ms = sm_timer_timeout(self);
+  if (timer_ms >= 0 && timer_ms < timeout_ms) {
+    timeout_ms = timer_ms;
+  }
+  if (my->backlog) {
+    timeout_ms = 0;
+  }
+  my->recv_pass++;
+  int ret = my->backend->wait(self, timeout_ms);
+  if (ret >= 0 && my->backlog) {
+    sm_recv_backlog(self);
+  }
+  if (ret >= 0 && my->num_timers) {
+    sm_timer_run(self);
+  }
+  if (ret >= 0 && __atomic_load_n(&my->posts, __ATOMIC_RELAXED)) {
+    sm_on_posts(self);  // e.g. its wakeup byte was lost
+  }
+  if (my->num_flush_fds) {
+    sm_flush_all(self);
+  }
+  return ret;
+}
+
+sm_status sm_cleanup(sm_t self) {
+  sm_private_t my = self->private_state;
+  int fd;
+  for (fd = 0; fd < my->fds_length; fd++) {
+    if (my->fds[fd] && !my->fds[fd]->is_post) {
+      self->remove_fd(self, fd);
+    }
+  }
+  return SM_SUCCESS;
+}
+
+//
+// TIMERS
+//
+// A hierarchical timer wheel:  level 0 has a slot per tick for the next 64
+// ticks, level 1 a slot per 64 ticks for the next 64^2 ticks, etc.  Higher
+// level slots are cascaded down a level as the wheel reaches them, so adding,
+// removing and expiring a timer are all O(1).
+//
+
+struct sm_timer {
+  int id;
+  int fd;          // -1 if global
+  void *value;     // for on_timer
+  uint64_t expire; // in ticks
+  int level;
+  int slot;
+  sm_timer_t prev; // in its wheel slot
+  sm_timer_t next;
+  sm_timer_t fd_prev; // in its sfd->timers
+  sm_timer_t fd_next;
+};
+
+uint64_t sm_now_ms() {
+#ifdef WIN32
+  return (uint64_t)GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static inline uint64_t sm_timer_span(int level) {
+  return (uint64_t)1 << (level * SM_TIMER_SLOT_BITS);
+}
+
+void sm_timer_insert(sm_private_t my, sm_timer_t t) {
+  // the caller ensures that t->expire >= my->timer_tick
+  uint64_t delta = t->expire - my->timer_tick;
+  uint64_t expire = t->expire;
+  int level;
+  for (level = 0; level < SM_TIMER_LEVELS - 1; level++) {
+    if (delta < sm_timer_span(level + 1)) {
+      break;
+    }
+  }
+  if (delta >= sm_timer_span(SM_TIMER_LEVELS)) {
+    // re-cascaded from the top level until it's in range
+    expire = my->timer_tick + sm_timer_span(SM_TIMER_LEVELS) - 1;
+  }
+  int slot = (int)((expire >> (level * SM_TIMER_SLOT_BITS)) &
+      (SM_TIMER_SLOTS - 1));
+  sm_timer_t *head = &my->timer_slots[level][slot];
+  t->level = level;
+  t->slot = slot;
+  t->prev = NULL;
+  t->next = *head;
+  if (*head) {
+    (*head)->prev = t;
+  }
+  *head = t;
+  my->timer_bits[level] |= ((uint64_t)1 << slot);
+}
+
+void sm_timer_unlink(sm_private_t my, sm_timer_t t) {
+  if (t->prev) {
+    t->prev->next = t->next;
+  } else {
+    my->timer_slots[t->level][t->slot] = t->next;
+    if (!t->next) {
+      my->timer_bits[t->level] &= ~((uint64_t)1 << t->slot);
+    }
+  }
+  if (t->next) {
+    t->next->prev = t->prev;
+  }
+  t->prev = NULL;
+  t->next = NULL;
+}
+
+// Unlink from the wheel and the fd, and free.
+void sm_timer_free(sm_t self, sm_timer_t t) {
+  sm_private_t my = self->private_state;
+  sm_timer_unlink(my, t);
+  if (t->fd >= 0) {
+    sm_fd_t sfd = sm_get_fd(my, t->fd);
+    if (t->fd_prev) {
+      t->fd_prev->fd_next = t->fd_next;
+    } else if (sfd) {
+      sfd->timers = t->fd_next;
+    }
+    if (t->fd_next) {
+      t->fd_next->fd_prev = t->fd_prev;
+    }
+  }
+  ht_remove(my->id_to_timer, HT_KEY(t->id));
+  my->num_timers--;
+  memset(t, 0, sizeof(struct sm_timer));
+  free(t);
+}
+
+// Like add_timer, but also used for our own timers, see sm_timer_run.
+int sm_timer_add(sm_t self, int fd, unsigned int timeout_ms, void *value) {
+  sm_private_t my = self->private_state;
+  sm_fd_t sfd = NULL;
+  if (fd >= 0 && !(sfd = sm_get_fd(my, fd))) {
+    return -1;
+  }
+  sm_timer_t t = (sm_timer_t)malloc(sizeof(struct sm_timer));
+  if (!t) {
+    return -1;
+  }
+  memset(t, 0, sizeof(struct sm_timer));
+  do {
+    my->last_timer_id = (my->last_timer_id < INT32_MAX ?
+        my->last_timer_id + 1 : 1);
+  } while (ht_get_value(my->id_to_timer, HT_KEY(my->last_timer_id)));
+  t->id = my->last_timer_id;
+  t->fd = fd;
+  t->value = value;
+  // round up, and never into the current tick, which may be expiring
+  uint64_t expire = (sm_now_ms() + timeout_ms + SM_TIMER_TICK_MS - 1) /
+    SM_TIMER_TICK_MS;
+  t->expire = (expire > my->timer_tick ? expire : my->timer_tick + 1);
+  ht_put(my->id_to_timer, HT_KEY(t->id), t);
+  sm_timer_insert(my, t);
+  if (sfd) {
+    t->fd_next = sfd->timers;
+    if (sfd->timers) {
+      sfd->timers->fd_prev = t;
+    }
+    sfd->timers = t;
+  }
+  my->num_timers++;
+  return t->id;
+}
+
+int sm_add_timer(sm_t self, int fd, unsigned int timeout_ms, void *value) {
+  if (!self->on_timer) {
+    return -1;
+  }
+  return sm_timer_add(self, fd, timeout_ms, value);
+}
+
+sm_status sm_remove_timer(sm_t self, int timer_id) {
+  sm_private_t my = self->private_state;
+  sm_timer_t t = (sm_timer_t)ht_get_value(my->id_to_timer, HT_KEY(timer_id));
+  if (!t) {
+    return SM_ERROR;  // e.g. already expired
+  }
+  sm_timer_free(self, t);
+  return SM_SUCCESS;
+}
+
+// @result the next tick that has timers to expire or cascade, or UINT64_MAX
+uint64_t sm_timer_next_tick(sm_private_t my) {
+  uint64_t ret = UINT64_MAX;
+  int level;
+  for (level = 0; level < SM_TIMER_LEVELS; level++) {
+    uint64_t bits = my->timer_bits[level];
+    if (!bits) {
+      continue;
+    }
+    // find the first occupied slot after the current one, wrapping around
+    uint64_t base = my->timer_tick >> (level * SM_TIMER_SLOT_BITS);
+    unsigned shift = (unsigned)((base + 1) & (SM_TIMER_SLOTS - 1));
+    uint64_t rotated = (shift ? (bits >> shift) | (bits << (64 - shift)) :
+        bits);
+    uint64_t k = (uint64_t)__builtin_ctzll(rotated) + 1;
+    uint64_t tick = (base + k) << (level * SM_TIMER_SLOT_BITS);
+    if (tick < ret) {
+      ret = tick;
+    }
+  }
+  return ret;
+}
+
+// @result ms until the next timer, or -1 if none
+int sm_timer_timeout(sm_t self) {
+  sm_private_t my = self->private_state;
+  if (!my->num_timers) {
+    return -1;
+  }
+  uint64_t next_ms = sm_timer_next_tick(my) * SM_TIMER_TICK_MS;
+  uint64_t now_ms = sm_now_ms();
+  return (next_ms <= now_ms ? 0 :
+      next_ms - now_ms > INT32_MAX ? INT32_MAX : (int)(next_ms - now_ms));
+}
+
+// Expire all timers that are due.
+void sm_timer_run(sm_t self) {
+  sm_private_t my = self->private_state;
+  uint64_t now_tick = sm_now_ms() / SM_TIMER_TICK_MS;
+  while (my->timer_tick < now_tick) {
+    uint64_t tick = sm_timer_next_tick(my);
+    if (tick > now_tick) {
+      my->timer_tick = now_tick;
+      break;
+    }
+    my->timer_tick = tick;
+    // cascade the higher levels that this tick has reached, top down
+    int level;
+    for (level = SM_TIMER_LEVELS - 1; level > 0; level--) {
+      if (tick & (sm_timer_span(level) - 1)) {
+        continue;
+      }
+      int slot = (int)((tick >> (level * SM_TIMER_SLOT_BITS)) &
+          (SM_TIMER_SLOTS - 1));
+      sm_timer_t t;
+      while ((t = my->timer_slots[level][slot])) {
+        sm_timer_unlink(my, t);
+        sm_timer_insert(my, t);
+      }
+    }
+    // expire this tick's slot, whose callbacks can't add to it
+    int slot = (int)(tick & (SM_TIMER_SLOTS - 1));
+    sm_timer_t t;
+    while ((t = my->timer_slots[0][slot])) {
+      int id = t->id;
+      int fd = t->fd;
+      void *value = t->value;
+      sm_timer_free(self, t);
+      sm_on_debug(self, "ss.timer(%d) fd=%d", id, fd);
+      sm_fd_t sfd = sm_get_fd(my, fd);
+      if (sfd && sfd->connect_timer_id == id) {
+        sm_on_debug(self, "ss.connect timeout fd=%d", fd);
+        self->remove_fd(self, fd);
+      } else if (self->on_timer(self, id, fd, value) && fd >= 0 &&
+          sm_get_fd(my, fd)) {
+        self->remove_fd(self, fd);
+      }
+    }
+  }
+}
+
+//
+// POSTS
+//
+// Other threads push onto my->posts with a CAS, and the first push onto an
+// empty list writes a byte to our post_fds socket pair.  Our select thread
+// drains the socketpair, then takes the whole list with one exchange, so
+// there's no lock and no ABA problem.  Once a post is pushed it's ours, even
+// if its wakeup byte can't be written, so sm_select also checks the list
+// after each wait.
+//
+
+struct sm_post {
+  void *value;
+  // our own handler, e.g. sm_on_resolved, or NULL for on_post
+  void (*callback)(sm_t self, void *value);
+  sm_post_t next;
+};
+
+// Creates a non-blocking connected pair of sockets for our wakeup byte.
+// WIN32 has no socketpair, so it's a loopback TCP connection, and we check
+// that the peer that we accepted is our own socket, not some other local
+// process that connected to our listener first.
+int sm_post_pair(int fds[2]) {
+#ifdef WIN32
+  SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listener == INVALID_SOCKET) {
+    return -1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  int addr_len = sizeof(addr);
+  SOCKET fd0 = INVALID_SOCKET;
+  SOCKET fd1 = INVALID_SOCKET;
+  if (bind(listener, (SOCKADDR *)&addr, sizeof(addr)) != SOCKET_ERROR &&
+      getsockname(listener, (SOCKADDR *)&addr, &addr_len) != SOCKET_ERROR &&
+      listen(listener, 1) != SOCKET_ERROR &&
+      (fd1 = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) != INVALID_SOCKET &&
+      connect(fd1, (SOCKADDR *)&addr, sizeof(addr)) != SOCKET_ERROR) {
+    fd0 = accept(listener, NULL, NULL);
+  }
+  closesocket(listener);
+  struct sockaddr_in local;
+  struct sockaddr_in peer;
+  int local_len = sizeof(local);
+  int peer_len = sizeof(peer);
+  u_long nb = 1;
+  int nodelay = 1;
+  if (fd0 == INVALID_SOCKET ||
+      getsockname(fd1, (SOCKADDR *)&local, &local_len) == SOCKET_ERROR ||
+      getpeername(fd0, (SOCKADDR *)&peer, &peer_len) == SOCKET_ERROR ||
+      local.sin_port != peer.sin_port ||
+      local.sin_addr.s_addr != peer.sin_addr.s_addr ||
+      ioctlsocket(fd0, FIONBIO, &nb) || ioctlsocket(fd1, FIONBIO, &nb) ||
+      setsockopt(fd1, IPPROTO_TCP, TCP_NODELAY, (char *)&nodelay,
+        sizeof(nodelay)) == SOCKET_ERROR) {
+    fprintf(stderr, "socket_manager: post pair failed with error %d\n",
+        WSAGetLastError());
+    if (fd0 != INVALID_SOCKET) {
+      closesocket(fd0);
+    }
+    if (fd1 != INVALID_SOCKET) {
+      closesocket(fd1);
+    }
+    return -1;
+  }
+  fds[0] = (int)fd0;
+  fds[1] = (int)fd1;
+#else
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    perror("socketpair");
+    return -1;
+  }
+  int i;
+  for (i = 0; i < 2; i++) {
+    int opts = fcntl(fds[i], F_GETFL);
+    fcntl(fds[i], F_SETFL, (opts | O_NONBLOCK));
+  }
+#endif
+  return 0;
+}
+
+sm_status sm_post_init(sm_t self) {
+  sm_private_t my = self->private_state;
+  int fds[2];
+  if (sm_post_pair(fds)) {
+    return SM_ERROR;
+  }
+  if (self->add_fd(self, fds[0], NULL, NULL, false)) {
+#ifdef WIN32
+    closesocket(fds[0]);
+    closesocket(fds[1]);
+#else
+    close(fds[0]);
+    close(fds[1]);
+#endif
+    return SM_ERROR;
+  }
+  my->fds[fds[0]]->is_post = true;
+  my->num_fds--;
+  my->post_fds[0] = fds[0];
+  my->post_fds[1] = fds[1];
+  return SM_SUCCESS;
+}
+
+sm_status sm_post_callback(sm_t self, void (*callback)(sm_t self,
+      void *value), void *value) {
+  sm_private_t my = self->private_state;
+  if (my->post_fds[1] < 0) {
+    return SM_ERROR;
+  }
+  sm_post_t post = (sm_post_t)malloc(sizeof(struct sm_post));
+  if (!post) {
+    return SM_ERROR;
+  }
+  post->value = value;
+  post->callback = callback;
+  sm_post_t head = __atomic_load_n(&my->posts, __ATOMIC_RELAXED);
+  do {
+    post->next = head;
+  } while (!__atomic_compare_exchange_n(&my->posts, &head, post, true,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (!head) {
+    // otherwise the byte for the first post hasn't been drained yet
+    char c = 0;
+#ifdef WIN32
+    if (send(my->post_fds[1], &c, 1, 0) == SOCKET_ERROR &&
+        WSAGetLastError() != WSAEWOULDBLOCK) {
+      fprintf(stderr, "post wakeup failed with error %d\n",
+          WSAGetLastError());
+    }
+#else
+    if (send(my->post_fds[1], &c, 1, 0) < 0 && errno != EWOULDBLOCK) {
+      perror("post wakeup failed");
+    }
+#endif
+    // but it's queued, so it's no longer ours to free, and sm_select's
+    // next pass will see it anyway
+  }
+  return SM_SUCCESS;
+}
+
+sm_status sm_post(sm_t self, void *value) {
+  return sm_post_callback(self, NULL, value);
+}
+
+// Called by sm_on_recv_data after it's drained our post_fds.
+void sm_on_posts(sm_t self) {
+  sm_private_t my = self->private_state;
+  sm_post_t post = __atomic_exchange_n(&my->posts, NULL, __ATOMIC_ACQUIRE);
+  // reverse, to call on_post in post order
+  sm_post_t prev = NULL;
+  while (post) {
+    sm_post_t next = post->next;
+    post->next = prev;
+    prev = post;
+    post = next;
+  }
+  for (post = prev; post; post = prev) {
+    prev = post->next;
+    void *value = post->value;
+    void (*callback)(sm_t, void *) = post->callback;
+    free(post);
+    sm_on_debug(self, "ss.post<%p>", value);
+    if (callback) {
+      callback(self, value);
+    } else {
+      self->on_post(self, value);
+    }
+  }
+}
+
+//
+// CONNECT
+//
+// sm_connect_async adds its fd right away, so the caller can queue sends
+// while it's connecting.  A hostname is looked up by our resolver threads,
+// which post the addresses back to our select thread, so a slow DNS server
+// never stalls our select loop.  Until then the fd is a placeholder socket
+// that isn't in the backend.  Each address is tried on a fresh socket that's
+// dup2'ed onto the fd, until one connects.
+//
+// On WIN32 there are no resolver threads, nor dup2 for sockets, so there a
+// connect still resolves and connects in sm_connect, which blocks our loop
+// for the lookup plus up to 500ms per address.  Only our optional
+// --frontend and simulator connects go through here, so WIN32 users with a
+// slow DNS server should give those as IP addresses.
+//
+
+struct sm_resolve {
+  int fd;
+  char *host;
+  char *port;
+  struct addrinfo *res0;
+  struct addrinfo *res;  // the next address to try
+  sm_resolve_t next;     // in my->resolves
+};
+
+void sm_resolve_free(sm_resolve_t r) {
+  if (r) {
+    if (r->res0) {
+      freeaddrinfo(r->res0);
+    }
+    free(r->host);
+    free(r->port);
+    memset(r, 0, sizeof(struct sm_resolve));
+    free(r);
+  }
+}
+
+#ifndef WIN32
+// @param socket_addr a "host:port"
+sm_resolve_t sm_resolve_new(const char *socket_addr) {
+  const char *s_port = strrchr(socket_addr, ':');
+  int port = (s_port ? strtol(s_port + 1, NULL, 0) : 0);
+  if (port <= 0) {
+    return NULL;
+  }
+  sm_resolve_t r = (sm_resolve_t)malloc(sizeof(struct sm_resolve));
+  if (!r) {
+    return NULL;
+  }
+  memset(r, 0, sizeof(struct sm_resolve));
+  r->fd = -1;
+  r->host = strndup(socket_addr, s_port - socket_addr);
+  if (!r->host || asprintf(&r->port, "%d", port) < 0) {
+    r->port = NULL;
+    sm_resolve_free(r);
+    return NULL;
+  }
+  return r;
+}
+
+// @param flags e.g. AI_NUMERICHOST, to fail instead of a DNS lookup
+// @result 0 if resolved
+int sm_resolve_run(sm_resolve_t r, int flags) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  hints.ai_flags = flags;
+  int ret = getaddrinfo(r->host, r->port, &hints, &r->res0);
+  if (ret) {
+    r->res0 = NULL;
+  }
+  r->res = r->res0;
+  return ret;
+}
+
+// Try the remaining addresses until a connect is in progress.
+// @result SM_ERROR if none are left, in which case sfd is_pending
+sm_status sm_connect_next(sm_t self, sm_fd_t sfd) {
+  sm_private_t my = self->private_state;
+  sm_resolve_t r = sfd->resolve;
+  int fd = sfd->fd;
+  if (!sfd->is_pending) {
+    // the backend can't follow a dup2, so we re-add it below
+    my->backend->remove_fd(self, sfd);
+    sfd->is_pending = true;
+  }
+  while (r && r->res) {
+    struct addrinfo *res = r->res;
+    r->res = res->ai_next;
+    int new_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (new_fd < 0) {
+      continue;
+    }
+    int ret = dup2(new_fd, fd);
+    close(new_fd);
+    int opts = (ret < 0 ? -1 : fcntl(fd, F_GETFL));
+    if (opts < 0 ||
+        fcntl(fd, F_SETFL, (opts | O_NONBLOCK)) < 0) {
+      continue;
+    }
+    // a new socket, so it needs its class options, e.g. SO_RCVBUF, which
+    // must precede the connect
+    sm_apply_fd_options(self, sfd);
+    if (connect(fd, res->ai_addr, res->ai_addrlen) < 0 &&
+        errno != EINPROGRESS) {
+      continue;
+    }
+    if (my->backend->add_fd(self, sfd)) {
+      return SM_ERROR;
+    }
+    sfd->is_pending = false;
+    return SM_SUCCESS;
+  }
+  return SM_ERROR;
+}
+// Called via sm_post_callback once a resolver thread has looked up r.
+void sm_on_resolved(sm_t self, void *value) {
+  sm_private_t my = self->private_state;
+  sm_resolve_t r = (sm_resolve_t)value;
+  sm_fd_t sfd = sm_get_fd(my, r->fd);
+  if (!sfd || sfd->resolve != r) {
+    sm_resolve_free(r);  // removed, e.g. its connect timed out
+    return;
+  }
+  sfd->is_resolving = false;
+  if (!r->res0) {
+    fprintf(stderr, "Unknown host %s\n", r->host);
+  }
+  if (sm_connect_next(self, sfd)) {
+    self->remove_fd(self, sfd->fd);
+  }
+}
+
+void *sm_resolver_run(void *arg) {
+  sm_t self = (sm_t)arg;
+  sm_private_t my = self->private_state;
+  pthread_mutex_lock(&my->resolve_lock);
+  while (!my->is_resolve_quit) {
+    sm_resolve_t r = my->resolves;
+    if (!r) {
+      pthread_cond_wait(&my->resolve_cond, &my->resolve_lock);
+      continue;
+    }
+    my->resolves = r->next;
+    if (!my->resolves) {
+      my->resolves_tail = NULL;
+    }
+    r->next = NULL;
+    pthread_mutex_unlock(&my->resolve_lock);
+    sm_resolve_run(r, 0);
+    if (sm_post_callback(self, sm_on_resolved, r)) {
+      // not queued, so r is still ours, and our fd's connect timer, if any,
+      // will remove the fd.  Once queued, r is freed by sm_on_resolved, or
+      // by sm_private_free if it's never taken.
+      sm_resolve_free(r);
+    }
+    pthread_mutex_lock(&my->resolve_lock);
+  }
+  pthread_mutex_unlock(&my->resolve_lock);
+  return NULL;
+}
+
+// Queue r for our resolver threads, starting them if needed.
+sm_status sm_resolve_async(sm_t self, sm_resolve_t r) {
+  sm_private_t my = self->private_state;
+  if (my->post_fds[1] < 0) {
+    return SM_ERROR;  // they can't post the result
+  }
+  pthread_mutex_lock(&my->resolve_lock);
+  if (my->num_resolvers < SM_RESOLVERS) {
+    // our select thread handles the signals
+    sigset_t all_signals;
+    sigset_t old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    while (my->num_resolvers < SM_RESOLVERS && !pthread_create(
+          &my->resolvers[my->num_resolvers], NULL, sm_resolver_run, self)) {
+      my->num_resolvers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  }
+  if (!my->num_resolvers) {
+    pthread_mutex_unlock(&my->resolve_lock);
+    return SM_ERROR;
+  }
+  if (my->resolves_tail) {
+    my->resolves_tail->next = r;
+  } else {
+    my->resolves = r;
+  }
+  my->resolves_tail = r;
+  pthread_cond_signal(&my->resolve_cond);
+  pthread_mutex_unlock(&my->resolve_lock);
+  return SM_SUCCESS;
+}
+
+// Stop our resolver threads, after any lookups that they're blocked in.
+void sm_resolve_stop(sm_private_t my) {
+  pthread_mutex_lock(&my->resolve_lock);
+  my->is_resolve_quit = true;
+  pthread_cond_broadcast(&my->resolve_cond);
+  pthread_mutex_unlock(&my->resolve_lock);
+  int i;
+  for (i = 0; i < my->num_resolvers; i++) {
+    pthread_join(my->resolvers[i], NULL);
+  }
+  my->num_resolvers = 0;
+  while (my->resolves) {
+    sm_resolve_t next = my->resolves->next;
+    sm_resolve_free(my->resolves);
+    my->resolves = next;
+  }
+  my->resolves_tail = NULL;
+}
+
+#endif
+
+int sm_connect_async(sm_t self, const char *socket_addr,
+    unsigned int timeout_ms, void *value) {
+  sm_private_t my = self->private_state;
+  sm_resolve_t r = NULL;
+  int fd;
+#ifdef WIN32
+  // a platform limitation, see CONNECT above
+  fd = sm_connect(socket_addr);
+#else
+  if (strncmp(socket_addr, "unix:", 5) == 0) {
+    fd = sm_connect_unix(socket_addr + 5);
+  } else if ((r = sm_resolve_new(socket_addr))) {
+    // a placeholder, until we know the address family
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  } else {
+    fd = -1;
+  }
+#endif
+  sm_fd_t sfd = (fd < 0 ? NULL : sm_fd_new(self, fd, NULL, value, false));
+  if (!sfd) {
+    sm_resolve_free(r);
+    if (fd >= 0) {
+#ifdef WIN32
+      closesocket(fd);
+#else
+      close(fd);
+#endif
+    }
+    return -1;
+  }
+  sfd->is_connecting = true;
+  sfd->is_pending = true;
+  sfd->resolve = r;
+  bool is_ok;
+  if (!r) {
+    is_ok = !my->backend->add_fd(self, sfd);
+    sfd->is_pending = !is_ok;
+#ifndef WIN32
+  } else if (!sm_resolve_run(r, AI_NUMERICHOST)) {
+    r->fd = fd;
+    is_ok = !sm_connect_next(self, sfd);
+  } else {
+    r->fd = fd;
+    sfd->is_resolving = !sm_resolve_async(self, r);
+    // if we can't resolve it asynchronously, do it now
+    is_ok = (sfd->is_resolving ||
+        (!sm_resolve_run(r, 0) && !sm_connect_next(self, sfd)));
+#endif
+  }
+  if (!is_ok) {
+    // the caller will close it, so don't call on_close
+    sm_resolve_free(r);
+    free(sfd);
+#ifdef WIN32
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+    return -1;
+  }
+  sm_on_debug(self, "ss.connect(%d) %s", fd, socket_addr);
+  my->fds[fd] = sfd;
+  my->num_fds++;
+  if (timeout_ms) {
+    sfd->connect_timer_id = sm_timer_add(self, fd, timeout_ms, NULL);
+  }
+  return fd;
+}
+
+// Called when a connecting fd is writable or has failed.
+void sm_on_connect_ready(sm_t self, sm_fd_t sfd) {
+  sm_private_t my = self->private_state;
+  int fd = sfd->fd;
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *)&error, &length) < 0) {
+    error = errno;
+  }
+  if (error) {
+#ifndef WIN32
+    if (!sm_connect_next(self, sfd)) {
+      return;  // trying the next address
+    }
+#endif
+    // the caller's on_close reports it, if need be
+    sm_on_debug(self, "ss.connect failed fd=%d: %s", fd, strerror(error));
+    self->remove_fd(self, fd);
+    return;
+  }
+  sm_on_debug(self, "ss.connected fd=%d", fd);
+  sfd->is_connecting = false;
+  sm_resolve_free(sfd->resolve);
+  sfd->resolve = NULL;
+  if (sfd->connect_timer_id) {
+    sm_remove_timer(self, sfd->connect_timer_id);
+    sfd->connect_timer_id = 0;
+  }
+  // recv, and send whatever was queued while we were connecting
+  my->backend->update_fd(self, sfd);
+  if (self->on_connect && self->on_connect(self, fd, sfd->value)) {
+    if (sm_get_fd(my, fd) == sfd) {
+      self->remove_fd(self, fd);
+    }
+    return;
+  }
+  if (sm_get_fd(my, fd) == sfd && sfd->sendq && !my->backend->send) {
+    sm_resend(self, sfd);
+  }
+}
+
+//
+// SELECT BACKEND
+//
+
+struct sm_select {
+  struct timeval timeout;
+  // fds:
+  fd_set *all_fds;
+  int max_fd;  // max fd in all_fds
+  // subsets of all_fds:
+  fd_set *send_fds;   // blocked sends, i.e. sfd->sendq
+  fd_set *recv_fds;   // can recv, i.e. sfd->is_recv
+  // temp fd sets, for use in sm_select_wait:
+  fd_set *tmp_send_fds;
+  fd_set *tmp_recv_fds;
+  fd_set *tmp_fail_fds;
+};
+typedef struct sm_select *sm_select_t;
+
+void sm_select_free(sm_t self) {
+  sm_private_t my = self->private_state;
+  sm_select_t ss = my->backend_state;
+  if (ss) {
+    free(ss->all_fds);
+    free(ss->send_fds);
+    free(ss->recv_fds);
+    free(ss->tmp_send_fds);
+    free(ss->tmp_recv_fds);
+    free(ss->tmp_fail_fds);
+    memset(ss, 0, sizeof(struct sm_select));
+    free(ss);
+  }
+  my->backend_state = NULL;
+}
+
+sm_status sm_select_init(sm_t self) {
+  sm_private_t my = self->private_state;
+  sm_select_t ss = (sm_select_t)malloc(sizeof(struct sm_select));
+  if (!ss) {
+    return SM_ERROR;
+  }
+  memset(ss, 0, sizeof(struct sm_select));
+  my->backend_state = ss;
+  ss->all_fds = (fd_set *)malloc(SIZEOF_FD_SET);
+  ss->send_fds = (fd_set *)malloc(SIZEOF_FD_SET);
+  ss->recv_fds = (fd_set *)malloc(SIZEOF_FD_SET);
+  ss->tmp_send_fds = (fd_set *)malloc(SIZEOF_FD_SET);
+  ss->tmp_recv_fds = (fd_set *)malloc(SIZEOF_FD_SET);
+  ss->tmp_fail_fds = (fd_set *)malloc(SIZEOF_FD_SET);
+  if (!ss->all_fds || !ss->send_fds || !ss->recv_fds ||
+      !ss->tmp_send_fds || !ss->tmp_recv_fds || !ss->tmp_fail_fds) {
+    sm_select_free(self);
+    return SM_ERROR;
+  }
+  FD_ZERO(ss->all_fds);
+  FD_ZERO(ss->send_fds);
+  FD_ZERO(ss->recv_fds);
+  FD_ZERO(ss->tmp_send_fds);
+  FD_ZERO(ss->tmp_recv_fds);
+  FD_ZERO(ss->tmp_fail_fds);
+  ss->max_fd = -1;
+  return SM_SUCCESS;
+}
+
+sm_status sm_select_add_fd(sm_t self, sm_fd_t sfd) {
+  sm_select_t ss = self->private_state->backend_state;
+  int fd = sfd->fd;
+#ifndef WIN32
+  if (fd >= FD_SETSIZE) {
+    fprintf(stderr, "socket_manager: fd %d exceeds the select limit of %d,"
+        " try the epoll backend\n", fd, FD_SETSIZE);
+    return SM_ERROR;
+  }
+#endif
+  FD_SET(fd, ss->all_fds);
+  if (sfd->is_connecting) {
+    FD_SET(fd, ss->send_fds);
+  } else {
+    FD_CLR(fd, ss->send_fds); // only set if blocked
+  }
+  FD_SET(fd, ss->recv_fds);
+  FD_CLR(fd, ss->tmp_send_fds);
+  FD_CLR(fd, ss->tmp_recv_fds);
+  FD_CLR(fd, ss->tmp_fail_fds);
+  if (fd > ss->max_fd) {
+    ss->max_fd = fd;
+  }
+  return SM_SUCCESS;
+}
+
+void sm_select_update_fd(sm_t self, sm_fd_t sfd) {
+  sm_select_t ss = self->private_state->backend_state;
+  int fd = sfd->fd;
+  if (sfd->is_recv) {
+    // don't FD_SET(tmp_recv_fds), since maybe there was no input
+    FD_SET(fd, ss->recv_fds);
+  } else {
+    FD_CLR(fd, ss->recv_fds);
+    FD_CLR(fd, ss->tmp_recv_fds);
+  }
+  if (sfd->sendq || sfd->is_connecting) {
+    FD_SET(fd, ss->send_fds);
+  } else {
+    FD_CLR(fd, ss->send_fds);
+  }
+}
+
+void sm_select_remove_fd(sm_t self, sm_fd_t sfd) {
+  sm_select_t ss = self->private_state->backend_state;
+  int fd = sfd->fd;
+  FD_CLR(fd, ss->all_fds);
+  FD_CLR(fd, ss->send_fds);
+  FD_CLR(fd, ss->recv_fds);
+  FD_CLR(fd, ss->tmp_send_fds);
+  FD_CLR(fd, ss->tmp_recv_fds);
+  FD_CLR(fd, ss->tmp_fail_fds);
+  if (fd == ss->max_fd) {
+    while (ss->max_fd >= 0 && !FD_ISSET(ss->max_fd, ss->all_fds)) {
+      ss->max_fd--;
+    }
+  }
+}
+
+int sm_select_wait(sm_t self, int timeout_ms) {
+  sm_select_t ss = self->private_state->backend_state;
+
+  ss->timeout.tv_sec = timeout_ms / 1000;
+  ss->timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+  // copy into tmp
+  memcpy(ss->tmp_send_fds, ss->send_fds, SIZEOF_FD_SET);
+  memcpy(ss->tmp_recv_fds, ss->recv_fds, SIZEOF_FD_SET);
+  memcpy(ss->tmp_fail_fds, ss->all_fds, SIZEOF_FD_SET);
+  int num_ready = select(ss->max_fd + 1, ss->tmp_recv_fds,
+      ss->tmp_send_fds, ss->tmp_fail_fds, &ss->timeout);
+
+  // see if any sockets are readable
+  if (num_ready == 0) {
+    return 0; // timeout, select again
+  }
+  if (num_ready < 0) {
+#ifdef WIN32
+    int socket_err = WSAGetLastError();
+    if (socket_err != WSAEINTR && socket_err != WSAEWOULDBLOCK) {
+      fprintf(stderr, "socket_manager: select failed with\
+          error %d\n", WSAGetLastError());
+      return -socket_err;
+    }
+#else
+    if (errno != EINTR && errno != EAGAIN) {
+      // might want to sleep here?
+      perror("select failed");
+      return -errno;
+    }
+#endif
+    return 0;
+  }
+
+  int num_left = num_ready;
+  int fd;
+  for (fd = 0; fd <= ss->max_fd && num_left > 0; fd++) {
+    bool can_send = FD_ISSET(fd, ss->tmp_send_fds);
+    bool can_recv = FD_ISSET(fd, ss->tmp_recv_fds);
+    bool is_fail = FD_ISSET(fd, ss->tmp_fail_fds);
+    if (!can_send && !can_recv && !is_fail) {
+      continue;
+    }
+    num_left--;
+    sm_on_ready(self, fd, can_recv, can_send, is_fail);
+  }
+  return num_ready;
+}
+
+static const struct sm_backend sm_select_backend = {
+  "select",
+  false,
+  sm_select_init,
+  sm_select_free,
+  sm_select_add_fd,
+  sm_select_update_fd,
+  sm_select_remove_fd,
+  sm_select_wait,
+  NULL,
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+//
+// EPOLL BACKEND
+//
+
+#define SM_EPOLL_MAX_EVENTS 256
+
+struct sm_epoll {
+  int epoll_fd;
+  bool is_edge_triggered;
+  struct epoll_event events[SM_EPOLL_MAX_EVENTS];
+};
+typedef struct sm_epoll *sm_epoll_t;
+
+static const struct sm_backend sm_epoll_et_backend;
+
+void sm_epoll_free(sm_t self) {
+  sm_private_t my = self->private_state;
+  sm_epoll_t ep = my->backend_state;
+  if (ep) {
+    if (ep->epoll_fd >= 0) {
+      close(ep->epoll_fd);
+    }
+    memset(ep, 0, sizeof(struct sm_epoll));
+    free(ep);
+  }
+  my->backend_state = NULL;
+}
+
+sm_status sm_epoll_init(sm_t self) {
+  sm_private_t my = self->private_state;
+  sm_epoll_t ep = (sm_epoll_t)malloc(sizeof(struct sm_epoll));
+  if (!ep) {
+    return SM_ERROR;
+  }
+  memset(ep, 0, sizeof(struct sm_epoll));
+  my->backend_state = ep;
+  ep->is_edge_triggered = (my->backend == &sm_epoll_et_backend);
+  ep->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (ep->epoll_fd < 0) {
+    perror("epoll_create1 failed");
+    sm_epoll_free(self);
+    return SM_ERROR;
+  }
+  return SM_SUCCESS;
+}
+
+static uint32_t sm_epoll_get_events(sm_fd_t sfd) {
+  // If is_edge_triggered then an EPOLL_CTL_MOD that re-enables EPOLLIN will
+  // re-check the fd, so input that arrived while we were blocked isn't lost.
+  return ((sfd->is_server || sfd->is_recv ? EPOLLIN : 0) |
+      (sfd->sendq || sfd->is_connecting ? EPOLLOUT : 0));
+}
+
+sm_status sm_epoll_ctl(sm_t self, sm_fd_t sfd, int op) {
+  sm_epoll_t ep = self->private_state->backend_state;
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = sfd->events | (ep->is_edge_triggered ? EPOLLET : 0);
+  event.data.fd = sfd->fd;
+  if (epoll_ctl(ep->epoll_fd, op, sfd->fd, &event) < 0) {
+    perror("epoll_ctl failed");
+    return SM_ERROR;
+  }
+  return SM_SUCCESS;
+}
+
+sm_status sm_epoll_add_fd(sm_t self, sm_fd_t sfd) {
+  sfd->events = sm_epoll_get_events(sfd);
+  return sm_epoll_ctl(self, sfd, EPOLL_CTL_ADD);
+}
+
+void sm_epoll_update_fd(sm_t self, sm_fd_t sfd) {
+  uint32_t events = sm_epoll_get_events(sfd);
+  if (events != sfd->events) {
+    sfd->events = events;
+    sm_epoll_ctl(self, sfd, EPOLL_CTL_MOD);
+  }
+}
+
+void sm_epoll_remove_fd(sm_t self, sm_fd_t sfd) {
+  sm_epoll_t ep = self->private_state->backend_state;
+  // must precede the close, in case the fd has been dup'ed
+  epoll_ctl(ep->epoll_fd, EPOLL_CTL_DEL, sfd->fd, NULL);
+}
+
+int sm_epoll_wait(sm_t self, int timeout_ms) {
+  sm_private_t my = self->private_state;
+  sm_epoll_t ep = my->backend_state;
+  int num_ready = epoll_wait(ep->epoll_fd, ep->events, SM_EPOLL_MAX_EVENTS,
+      timeout_ms);
+  if (num_ready < 0) {
+    if (errno != EINTR) {
+      perror("epoll_wait failed");
+      return -errno;
+    }
+    return 0;
+  }
+  int i;
+  for (i = 0; i < num_ready; i++) {
+    int fd = ep->events[i].data.fd;
+    uint32_t events = ep->events[i].events;
+    sm_fd_t sfd = sm_get_fd(my, fd);
+    if (!sfd) {
+      continue;  // removed by an earlier callback
+    }
+    // EPOLLERR and EPOLLHUP are always reported, so if we're not reading or
+    // writing then we'd never notice the failure.
+    bool is_hup = (events & (EPOLLERR | EPOLLHUP));
+    bool can_recv = (events & EPOLLIN) || (is_hup && sfd->is_recv);
+    bool can_send = (events & EPOLLOUT) || (is_hup && sfd->sendq);
+    sm_on_ready(self, fd, can_recv, can_send,
+        is_hup && !can_recv && !can_send);
+  }
+  return num_ready;
+}
+
+static const struct sm_backend sm_epoll_backend = {
+  "epoll",
+  false,
+  sm_epoll_init,
+  sm_epoll_free,
+  sm_epoll_add_fd,
+  sm_epoll_update_fd,
+  sm_epoll_remove_fd,
+  sm_epoll_wait,
+  NULL,
+};
+
+static const struct sm_backend sm_epoll_et_backend = {
+  "epoll-et",
+  true,
+  sm_epoll_init,
+  sm_epoll_free,
+  sm_epoll_add_fd,
+  sm_epoll_update_fd,
+  sm_epoll_remove_fd,
+  sm_epoll_wait,
+  NULL,
+};
+#endif
+
+#ifdef HAVE_IO_URING
+//
+// IO_URING BACKEND
+//
+// Plain sockets are driven by submitted operations instead of readiness:
+// recvs land in a ring of provided buffers, sends that would block are
+// SENDMSGs of the queued sendq, and accepts are ACCEPTs, all batched into one
+// io_uring_enter per sm_select.  SSL sockets are polled instead, since
+// OpenSSL does its own I/O.
+//
+
+#define SM_URING_ENTRIES 256
+#define SM_URING_MAX_IOV 64
+#define SM_URING_MAX_BUFS 256
+#define SM_URING_BUFS_LENGTH (4 * 1024 * 1024)
+#define SM_URING_BGID 0
+// Max ms that sm_uring_free waits for its cancelled ops
+#define SM_URING_REAP_MS 1000
+
+// operation type, in the low bits of each sqe's user_data
+#define SM_URING_RECV 0
+#define SM_URING_SEND 1
+#define SM_URING_ACCEPT 2
+#define SM_URING_POLL_IN 3
+#define SM_URING_POLL_OUT 4
+#define SM_URING_CANCEL 5
+#define SM_URING_OP_MASK 7
+
+// Per-fd state, which outlives its sm_fd until all of its ops complete.
+struct sm_uring_fd;
+typedef struct sm_uring_fd *sm_uring_fd_t;
+struct sm_uring_fd {
+  sm_fd_t sfd;  // NULL once removed
+  int fd;
+  int num_ops;  // submitted but not yet completed
+  bool is_recv;
+  bool is_send;
+  bool is_accept;
+  bool is_poll_in;
+  bool is_poll_out;
+  // the in-flight send
+  struct msghdr msg;
+  struct iovec iov[SM_URING_MAX_IOV];
+  // taken from a removed sfd, freed once its send completes
+  sm_sendq_t sendq;
+  sm_uring_fd_t prev;
+  sm_uring_fd_t next;
+};
+
+struct sm_uring {
+  int ring_fd;
+  void *ring;
+  size_t ring_length;
+  // submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail;  // includes unsubmitted sqes
+  struct io_uring_sqe *sqes;
+  size_t sqes_length;
+  // completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  // provided recv buffers
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_length;
+  unsigned short buf_tail;
+  unsigned num_bufs;
+  char *bufs;
+  size_t buf_length;
+  // all sm_uring_fd's, including removed ones
+  sm_uring_fd_t ufds;
+};
+typedef struct sm_uring *sm_uring_t;
+
+static int sm_uring_enter(int ring_fd, unsigned to_submit,
+    unsigned min_complete, unsigned flags, void *arg, size_t arg_length) {
+  return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+      flags, arg, arg_length);
+}
+
+void sm_uring_fd_free(sm_uring_t ur, sm_uring_fd_t ufd) {
+  if (ufd->prev) {
+    ufd->prev->next = ufd->next;
+  } else {
+    ur->ufds = ufd->next;
+  }
+  if (ufd->next) {
+    ufd->next->prev = ufd->prev;
+  }
+  while (ufd->sendq) {
+    sm_sendq_t nextq = ufd->sendq->next;
+    sm_sendq_free(ufd->sendq);
+    ufd->sendq = nextq;
+  }
+  memset(ufd, 0, sizeof(struct sm_uring_fd));
+  free(ufd);
+}
+
+int sm_uring_submit(sm_uring_t ur, int timeout_ms);
+struct io_uring_sqe *sm_uring_get_sqe(sm_uring_t ur, sm_uring_fd_t ufd,
+    int op);
+
+// Cancels our in-flight ops, then reaps their cqes without calling back.
+// The ring's teardown after a close is asynchronous, so until then the
+// kernel may still be reading a sendq or writing a provided buffer.
+// @result true if all of them completed
+bool sm_uring_reap(sm_uring_t ur) {
+  sm_uring_fd_t ufd;
+  for (ufd = ur->ufds; ufd; ufd = ufd->next) {
+    if (ufd->num_ops) {
+      struct io_uring_sqe *sqe = sm_uring_get_sqe(ur, ufd, SM_URING_CANCEL);
+      if (!sqe) {
+        return false;
+      }
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+  }
+  uint64_t end_ms = sm_now_ms() + SM_URING_REAP_MS;
+  while (1) {
+    for (ufd = ur->ufds; ufd && !ufd->num_ops; ufd = ufd->next) {
+    }
+    if (!ufd) {
+      return true;
+    }
+    uint64_t now_ms = sm_now_ms();
+    if (now_ms >= end_ms || sm_uring_submit(ur, end_ms - now_ms) < 0) {
+      return false;
+    }
+    unsigned head = *ur->cq_head;
+    while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+      ufd = (sm_uring_fd_t)(uintptr_t)(cqe->user_data &
+          ~(uint64_t)SM_URING_OP_MASK);
+      ufd->num_ops--;
+      head++;
+    }
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+void sm_uring_free(sm_t self) {
+  sm_private_t my = self->private_state;
+  sm_uring_t ur = my->backend_state;
+  if (ur) {
+    // ufds only exist once the ring is set up
+    bool is_reaped = (!ur->ufds || sm_uring_reap(ur));
+    if (ur->ring_fd >= 0) {
+      close(ur->ring_fd);
+    }
+    sm_uring_fd_t ufd = ur->ufds;
+    while (ufd) {
+      sm_uring_fd_t next = ufd->next;
+      if (ufd->sfd) {
+        ufd->sfd->backend_fd = NULL;
+      }
+      if (ufd->num_ops) {
+        // still in flight, so leak its sendq, which sm_private_free would
+        // otherwise free
+        if (ufd->sfd && ufd->is_send) {
+          ufd->sfd->sendq = NULL;
+        }
+      } else {
+        sm_uring_fd_free(ur, ufd);
+      }
+      ufd = next;
+    }
+    if (!is_reaped) {
+      // and our provided buffers, which an in-flight recv may write
+      ur->bufs = NULL;
+    }
+    if (ur->ring && ur->ring != MAP_FAILED) {
+      munmap(ur->ring, ur->ring_length);
+    }
+    if (ur->sqes && ur->sqes != MAP_FAILED) {
+      munmap(ur->sqes, ur->sqes_length);
+    }
+    if (ur->buf_ring && ur->buf_ring != MAP_FAILED) {
+      munmap(ur->buf_ring, ur->buf_ring_length);
+    }
+    free(ur->bufs);
+    memset(ur, 0, sizeof(struct sm_uring));
+    free(ur);
+  }
+  my->backend_state = NULL;
+}
+
+void sm_uring_add_buf(sm_uring_t ur, unsigned short bid) {
+  struct io_uring_buf *buf =
+      &ur->buf_ring->bufs[ur->buf_tail & (ur->num_bufs - 1)];
+  buf->addr = (uintptr_t)(ur->bufs + bid * ur->buf_length);
+  buf->len = ur->buf_length;
+  buf->bid = bid;
+  ur->buf_tail++;
+  __atomic_store_n(&ur->buf_ring->tail, ur->buf_tail, __ATOMIC_RELEASE);
+}
+
+sm_status sm_uring_init(sm_t self) {
+  sm_private_t my = self->private_state;
+  sm_uring_t ur = (sm_uring_t)malloc(sizeof(struct sm_uring));
+  if (!ur) {
+    return SM_ERROR;
+  }
+  memset(ur, 0, sizeof(struct sm_uring));
+  my->backend_state = ur;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ur->ring_fd = (int)syscall(__NR_io_uring_setup, SM_URING_ENTRIES, &p);
+  if (ur->ring_fd < 0) {
+    perror("io_uring_setup failed");
+    sm_uring_free(self);
+    return SM_ERROR;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_EXT_ARG) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    fprintf(stderr, "socket_manager: io_uring is missing required features\n");
+    sm_uring_free(self);
+    return SM_ERROR;
+  }
+  size_t sq_length = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_length = p.cq_off.cqes +
+    p.cq_entries * sizeof(struct io_uring_cqe);
+  ur->ring_length = (sq_length > cq_length ? sq_length : cq_length);
+  ur->ring = mmap(NULL, ur->ring_length, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQ_RING);
+  ur->sqes_length = p.sq_entries * sizeof(struct io_uring_sqe);
+  ur->sqes = mmap(NULL, ur->sqes_length, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQES);
+  if (ur->ring == MAP_FAILED || ur->sqes == MAP_FAILED) {
+    perror("io_uring mmap failed");
+    sm_uring_free(self);
+    return SM_ERROR;
+  }
+  char *ring = (char *)ur->ring;
+  ur->sq_head = (unsigned *)(ring + p.sq_off.head);
+  ur->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+  ur->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+  ur->sq_entries = p.sq_entries;
+  ur->sq_local_tail = *ur->sq_tail;
+  unsigned *sq_array = (unsigned *)(ring + p.sq_off.array);
+  unsigned i;
+  for (i = 0; i < p.sq_entries; i++) {
+    sq_array[i] = i;
+  }
+  ur->cq_head = (unsigned *)(ring + p.cq_off.head);
+  ur->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+  ur->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+  // provided buffers, a power of two that fits within SM_URING_BUFS_LENGTH
+  ur->buf_length = my->min_recv_length;
+  ur->num_bufs = SM_URING_MAX_BUFS;
+  while (ur->num_bufs > 8 &&
+      ur->num_bufs * ur->buf_length > SM_URING_BUFS_LENGTH) {
+    ur->num_bufs /= 2;
+  }
+  ur->buf_ring_length = ur->num_bufs * sizeof(struct io_uring_buf);
+  ur->buf_ring = mmap(NULL, ur->buf_ring_length, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ur->bufs = (char *)malloc(ur->num_bufs * ur->buf_length);
+  if (ur->buf_ring == MAP_FAILED || !ur->bufs) {
+    sm_uring_free(self);
+    return SM_ERROR;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)ur->buf_ring;
+  reg.ring_entries = ur->num_bufs;
+  reg.bgid = SM_URING_BGID;
+  if (syscall(__NR_io_uring_register, ur->ring_fd,
+        IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    perror("io_uring buffer ring registration failed");
+    sm_uring_free(self);
+    return SM_ERROR;
+  }
+  for (i = 0; i < ur->num_bufs; i++) {
+    sm_uring_add_buf(ur, i);
+  }
+  return SM_SUCCESS;
+}
+
+// Submit all pending sqes, optionally waiting for a completion.
+int sm_uring_submit(sm_uring_t ur, int timeout_ms) {
+  unsigned to_submit = ur->sq_local_tail - *ur->sq_tail;
+  __atomic_store_n(ur->sq_tail, ur->sq_local_tail, __ATOMIC_RELEASE);
+  unsigned flags = 0;
+  unsigned min_complete = 0;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (timeout_ms != 0 && __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE) ==
+      *ur->cq_head) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    arg.ts = (uintptr_t)&ts;
+    arg.sigmask_sz = _NSIG / 8;
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    min_complete = 1;
+  } else if (!to_submit) {
+    return 0;
+  }
+  int ret = sm_uring_enter(ur->ring_fd, to_submit, min_complete, flags,
+      (flags ? &arg : NULL), (flags ? sizeof(arg) : 0));
+  if (ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+    perror("io_uring_enter failed");
+    return -errno;
+  }
+  return 0;
+}
+
+struct io_uring_sqe *sm_uring_get_sqe(sm_uring_t ur, sm_uring_fd_t ufd,
+    int op) {
+  while (ur->sq_local_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >=
+      ur->sq_entries) {
+    // full, so make room
+    if (sm_uring_submit(ur, 0) < 0) {
+      return NULL;
+    }
+  }
+  struct io_uring_sqe *sqe = &ur->sqes[ur->sq_local_tail & ur->sq_mask];
+  ur->sq_local_tail++;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->fd = ufd->fd;
+  sqe->user_data = (uintptr_t)ufd | op;
+  ufd->num_ops++;
+  return sqe;
+}
+
+sm_status sm_uring_submit_send(sm_uring_t ur, sm_uring_fd_t ufd) {
+  size_t n = 0;
+  sm_sendq_t sendq;
+  for (sendq = ufd->sfd->sendq; sendq && n < SM_URING_MAX_IOV;
+      sendq = sendq->next) {
+    ufd->iov[n].iov_base = (void *)sendq->head;
+    ufd->iov[n].iov_len = sendq->tail - sendq->head;
+    n++;
+  }
+  memset(&ufd->msg, 0, sizeof(struct msghdr));
+  ufd->msg.msg_iov = ufd->iov;
+  ufd->msg.msg_iovlen = n;
+  struct io_uring_sqe *sqe = sm_uring_get_sqe(ur, ufd, SM_URING_SEND);
+  if (!sqe) {
+    return SM_ERROR;
+  }
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->addr = (uintptr_t)&ufd->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  ufd->is_send = true;
+  return SM_SUCCESS;
+}
+
+// Arm whichever ops are needed for sfd's current interest.
+sm_status sm_uring_arm(sm_t self, sm_fd_t sfd) {
+  sm_uring_t ur = self->private_state->backend_state;
+  sm_uring_fd_t ufd = sfd->backend_fd;
+  struct io_uring_sqe *sqe;
+  if (sfd->is_server) {
+    if (!ufd->is_accept) {
+      if (!(sqe = sm_uring_get_sqe(ur, ufd, SM_URING_ACCEPT))) {
+        return SM_ERROR;
+      }
+      sqe->opcode = IORING_OP_ACCEPT;
+      ufd->is_accept = true;
+    }
+  } else if (sfd->ssl_session || sfd->is_connecting) {
+    // poll, since OpenSSL does its own I/O, or until we're connected
+    if (sfd->is_recv && !sfd->is_connecting && !ufd->is_poll_in) {
+      if (!(sqe = sm_uring_get_sqe(ur, ufd, SM_URING_POLL_IN))) {
+        return SM_ERROR;
+      }
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->poll32_events = POLLIN;
+      ufd->is_poll_in = true;
+    }
+    if ((sfd->sendq || sfd->is_connecting) && !ufd->is_poll_out) {
+      if (!(sqe = sm_uring_get_sqe(ur, ufd, SM_URING_POLL_OUT))) {
+        return SM_ERROR;
+      }
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->poll32_events = POLLOUT;
+      ufd->is_poll_out = true;
+    }
+  } else {
+    if (sfd->is_recv && !ufd->is_recv) {
+      if (!(sqe = sm_uring_get_sqe(ur, ufd, SM_URING_RECV))) {
+        return SM_ERROR;
+      }
+      sqe->opcode = IORING_OP_RECV;
+      sqe->len = ur->buf_length;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = SM_URING_BGID;
+      ufd->is_recv = true;
+    }
+    if (sfd->sendq && !ufd->is_send) {
+      return sm_uring_submit_send(ur, ufd);
+    }
+  }
+  return SM_SUCCESS;
+}
+
+sm_status sm_uring_add_fd(sm_t self, sm_fd_t sfd) {
+  sm_uring_t ur = self->private_state->backend_state;
+  sm_uring_fd_t ufd = (sm_uring_fd_t)malloc(sizeof(struct sm_uring_fd));
+  if (!ufd) {
+    return SM_ERROR;
+  }
+  memset(ufd, 0, sizeof(struct sm_uring_fd));
+  ufd->sfd = sfd;
+  ufd->fd = sfd->fd;
+  ufd->next = ur->ufds;
+  if (ur->ufds) {
+    ur->ufds->prev = ufd;
+  }
+  ur->ufds = ufd;
+  sfd->backend_fd = ufd;
+  return sm_uring_arm(self, sfd);
+}
+
+void sm_uring_update_fd(sm_t self, sm_fd_t sfd) {
+  // a disabled recv is simply not re-armed when it completes
+  sm_uring_arm(self, sfd);
+}
+
+sm_status sm_uring_send(sm_t self, sm_fd_t sfd) {
+  return sm_uring_arm(self, sfd);
+}
+
+void sm_uring_remove_fd(sm_t self, sm_fd_t sfd) {
+  sm_uring_t ur = self->private_state->backend_state;
+  sm_uring_fd_t ufd = sfd->backend_fd;
+  sfd->backend_fd = NULL;
+  ufd->sfd = NULL;
+  if (!ufd->num_ops) {
+    sm_uring_fd_free(ur, ufd);
+    return;
+  }
+  if (ufd->is_send) {
+    // the kernel may still be reading our sendq
+    ufd->sendq = sfd->sendq;
+    sfd->sendq = NULL;
+  }
+  struct io_uring_sqe *sqe = sm_uring_get_sqe(ur, ufd, SM_URING_CANCEL);
+  if (sqe) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    // submit now, so the caller's close isn't delayed by our in-flight ops
+    sm_uring_submit(ur, 0);
+  }
+}
+
+void sm_uring_on_cqe(sm_t self, uint64_t user_data, int res,
+    uint32_t flags) {
+  sm_private_t my = self->private_state;
+  sm_uring_t ur = my->backend_state;
+  sm_uring_fd_t ufd = (sm_uring_fd_t)(uintptr_t)(user_data &
+      ~(uint64_t)SM_URING_OP_MASK);
+  int op = (int)(user_data & SM_URING_OP_MASK);
+  ufd->num_ops--;
+  int bid = (op == SM_URING_RECV && (flags & IORING_CQE_F_BUFFER) ?
+      (int)(flags >> IORING_CQE_BUFFER_SHIFT) : -1);
+  switch (op) {
+    case SM_URING_RECV: ufd->is_recv = false; break;
+    case SM_URING_SEND: ufd->is_send = false; break;
+    case SM_URING_ACCEPT: ufd->is_accept = false; break;
+    case SM_URING_POLL_IN: ufd->is_poll_in = false; break;
+    case SM_URING_POLL_OUT: ufd->is_poll_out = false; break;
+    default: break;
+  }
+  sm_fd_t sfd = ufd->sfd;
+  if (!sfd) {
+    // removed, so just wait for any other ops to complete or cancel
+    if (bid >= 0) {
+      sm_uring_add_buf(ur, bid);
+    }
+    if (!ufd->num_ops) {
+      sm_uring_fd_free(ur, ufd);
+    }
+    return;
+  }
+  int fd = sfd->fd;
+  bool is_open = true;
+  switch (op) {
+    case SM_URING_RECV:
+      if (res > 0 && bid >= 0) {
+        is_open = sm_on_recv_data(self, sfd, ur->bufs + bid * ur->buf_length,
+            res);
+        sm_uring_add_buf(ur, bid);
+      } else if (res == 0) {
+        sm_on_recv_data(self, sfd, NULL, 0);
+        is_open = false;
+      } else if (res != -ENOBUFS && res != -EINTR && res != -EAGAIN) {
+        errno = -res;
+        perror("recv failed");
+        self->remove_fd(self, fd);
+        is_open = false;
+      }
+      break;
+    case SM_URING_SEND:
+      if (res >= 0) {
+        is_open = sm_sendq_sent(self, sfd, res);
+      } else if (res != -EINTR && res != -EAGAIN) {
+        errno = -res;
+        perror("sendq retry failed");
+        self->remove_fd(self, fd);
+        is_open = false;
+      }
+      break;
+    case SM_URING_ACCEPT:
+      if (res >= 0) {
+        is_open = sm_on_accept_fd(self, sfd, res);
+      } else if (res != -EINTR && res != -EAGAIN && res != -ECONNABORTED) {
+        errno = -res;
+        perror("accept failed");
+        self->remove_fd(self, fd);
+        is_open = false;
+      }
+      break;
+    case SM_URING_POLL_IN:
+    case SM_URING_POLL_OUT:
+      if (res < 0) {
+        break;
+      }
+      sm_on_ready(self, fd, (op == SM_URING_POLL_IN),
+          (op == SM_URING_POLL_OUT), false);
+      is_open = (sm_get_fd(my, fd) == sfd);
+      break;
+    default:
+      break;
+  }
+  if (is_open) {
+    sm_uring_arm(self, sfd);
+  }
+}
+
+int sm_uring_wait(sm_t self, int timeout_ms) {
+  sm_uring_t ur = self->private_state->backend_state;
+  int ret = sm_uring_submit(ur, timeout_ms);
+  if (ret < 0) {
+    return ret;
+  }
+  int num_ready = 0;
+  unsigned head = *ur->cq_head;
+  while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+    uint64_t user_data = cqe->user_data;
+    int res = cqe->res;
+    uint32_t flags = cqe->flags;
+    // release the cqe before the callbacks, which may submit more sqes
+    __atomic_store_n(ur->cq_head, ++head, __ATOMIC_RELEASE);
+    sm_uring_on_cqe(self, user_data, res, flags);
+    num_ready++;
+  }
+  return num_ready;
+}
+
+static const struct sm_backend sm_uring_backend = {
+  "io_uring",
+  false,
+  sm_uring_init,
+  sm_uring_free,
+  sm_uring_add_fd,
+  sm_uring_update_fd,
+  sm_uring_remove_fd,
+  sm_uring_wait,
+  sm_uring_send,
+};
+#endif
+
+sm_backend_t sm_get_backend(enum sm_backend_type type) {
+  switch (type) {
+    case SM_BACKEND_SELECT:
+      return &sm_select_backend;
+#ifdef HAVE_SYS_EPOLL_H
+    case SM_BACKEND_DEFAULT:
+    case SM_BACKEND_EPOLL:
+      return &sm_epoll_backend;
+    case SM_BACKEND_EPOLL_ET:
+      return &sm_epoll_et_backend;
+#else
+    case SM_BACKEND_DEFAULT:
+      return &sm_select_backend;
+#endif
+#ifdef HAVE_IO_URING
+    case SM_BACKEND_IO_URING:
+      return &sm_uring_backend;
+#endif
+    default:
+      return NULL;
+  }
+}
+
+int sm_parse_backend(const char *name, enum sm_backend_type *to_backend) {
+  static const char *names[] = {"default", "select", "epoll", "epoll-et",
+    "io_uring", NULL};
+  int i;
+  for (i = 0; names[i]; i++) {
+    if (!strcmp(name, names[i]) &&
+        sm_get_backend((enum sm_backend_type)i)) {
+      *to_backend = (enum sm_backend_type)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *sm_backend_name(sm_t self) {
+  return self->private_state->backend->name;
+}
+
 //
 // STRUCTS
 //
 
 void sm_private_free(sm_private_t my) {
   if (my) {
-    free(my->all_fds);
-    free(my->server_fds);
-    free(my->send_fds);
-    free(my->recv_fds);
-    free(my->tmp_send_fds);
-    free(my->tmp_recv_fds);
-    free(my->tmp_fail_fds);
-    ht_free(my->fd_to_ssl);
-    ht_free(my->fd_to_value);
-    ht_free(my->fd_to_sendq);
+    int level;
+    for (level = 0; level < SM_TIMER_LEVELS; level++) {
+      int slot;
+      for (slot = 0; slot < SM_TIMER_SLOTS; slot++) {
+        while (my->timer_slots[level][slot]) {
+          sm_timer_t t = my->timer_slots[level][slot];
+          my->timer_slots[level][slot] = t->next;
+          free(t);
+        }
+      }
+    }
+    ht_free(my->id_to_timer);
+#ifndef WIN32
+    // before our posts, since they may still be posting
+    sm_resolve_stop(my);
+    pthread_cond_destroy(&my->resolve_cond);
+    pthread_mutex_destroy(&my->resolve_lock);
+#endif
+    while (my->posts) {
+      sm_post_t next = my->posts->next;
+#ifndef WIN32
+      if (my->posts->callback == sm_on_resolved) {
+        sm_resolve_free((sm_resolve_t)my->posts->value);
+      }
+#endif
+      free(my->posts);  // the value is dropped
+      my->posts = next;
+    }
+    int i;
+    for (i = 0; i < 2; i++) {
+      if (my->post_fds[i] >= 0) {
+#ifdef WIN32
+        closesocket(my->post_fds[i]);
+#else
+        close(my->post_fds[i]);
+#endif
+      }
+    }
+    int fd;
+    for (fd = 0; fd < my->fds_length; fd++) {
+      sm_fd_t sfd = my->fds[fd];
+      if (sfd) {
+        while (sfd->sendq) {
+          sm_sendq_t nextq = sfd->sendq->next;
+          sm_sendq_free(sfd->sendq);
+          sfd->sendq = nextq;
+        }
+        if (!sfd->is_resolving) {
+          sm_resolve_free(sfd->resolve);
+        }
+        free(sfd);
+      }
+    }
+    free(my->fds);
+    free(my->flush_fds);
     free(my->tmp_buf);
     memset(my, 0, sizeof(struct sm_private));
     free(my);
@@ -717,60 +3239,72 @@ sm_private_t sm_private_new(size_t buf_length) {
     return NULL;
   }
   memset(my, 0, sizeof(struct sm_private));
-  my->all_fds = (fd_set *)malloc(SIZEOF_FD_SET);
-  my->server_fds = (fd_set *)malloc(SIZEOF_FD_SET);
-  my->send_fds = (fd_set *)malloc(SIZEOF_FD_SET);
-  my->recv_fds = (fd_set *)malloc(SIZEOF_FD_SET);
-  my->tmp_send_fds = (fd_set *)malloc(SIZEOF_FD_SET);
-  my->tmp_recv_fds = (fd_set *)malloc(SIZEOF_FD_SET);
-  my->tmp_fail_fds = (fd_set *)malloc(SIZEOF_FD_SET);
-  my->fd_to_ssl = ht_new(HT_INT_KEYS);
-  my->fd_to_value = ht_new(HT_INT_KEYS);
-  my->fd_to_sendq = ht_new(HT_INT_KEYS);
+#ifndef WIN32
+  pthread_mutex_init(&my->resolve_lock, NULL);
+  pthread_cond_init(&my->resolve_cond, NULL);
+#endif
   my->tmp_buf = (char *)calloc(buf_length, sizeof(char *));
-  if (!my->tmp_buf || !my->all_fds || !my->server_fds ||
-      !my->send_fds || !my->recv_fds ||
-      !my->tmp_send_fds || !my->tmp_recv_fds || !my->tmp_fail_fds ||
-      !my->fd_to_ssl || !my->fd_to_value || !my->fd_to_sendq) {
+  my->id_to_timer = ht_new(HT_INT_KEYS);
+  if (!my->tmp_buf || !my->id_to_timer) {
     sm_private_free(my);
     return NULL;
   }
-  FD_ZERO(my->all_fds);
-  FD_ZERO(my->server_fds);
-  FD_ZERO(my->send_fds);
-  FD_ZERO(my->recv_fds);
-  FD_ZERO(my->tmp_send_fds);
-  FD_ZERO(my->tmp_recv_fds);
-  FD_ZERO(my->tmp_fail_fds);
-  my->max_fd = -1;
-  my->timeout.tv_sec = 5;
-  my->timeout.tv_usec = 0;
   my->tmp_buf_length = buf_length;
+  my->min_recv_length = buf_length;
+  my->recv_budget_length = SM_RECV_BUDGET_LENGTH;
+  my->recv_budget_reads = SM_RECV_BUDGET_READS;
+  my->curr_recv_fd = -1;
+  my->low_watermark = SM_LOW_WATERMARK;
+  my->high_watermark = SM_HIGH_WATERMARK;
+  my->timer_tick = sm_now_ms() / SM_TIMER_TICK_MS;
+  my->post_fds[0] = -1;
+  my->post_fds[1] = -1;
   return my;
 }
 
-sm_sendq_t sm_sendq_new(int recv_fd, void *value, const char *data,
-    size_t length) {
+sm_sendq_t sm_sendq_new(void *value, const char *data, size_t length,
+    bool is_ref) {
   sm_sendq_t ret = (sm_sendq_t)malloc(sizeof(struct sm_sendq));
+  if (!ret) {
+    return NULL;
+  }
   memset(ret, 0, sizeof(struct sm_sendq));
-  ret->recv_fd = recv_fd;
   ret->value = value;
-  ret->begin = (char *)malloc(length);
-  memcpy(ret->begin, data, length);
-  ret->head = ret->begin;
-  ret->tail = ret->begin + length;
+  ret->cork_recv_fd = -1;
+  if (is_ref) {
+    ret->head = data;
+  } else {
+    ret->begin = (char *)malloc(length ? length : 1);
+    if (!ret->begin) {
+      free(ret);
+      return NULL;
+    }
+    if (data) {
+      memcpy(ret->begin, data, length);
+    }
+    ret->head = ret->begin;
+  }
+  ret->tail = ret->head + length;
+  ret->length = length;
   return ret;
 }
 
 void sm_sendq_free(sm_sendq_t sendq) {
   if (sendq) {
+    if (sendq->is_last && sendq->release) {
+      sendq->release(sendq->value);
+    }
     free(sendq->begin);
     memset(sendq, 0, sizeof(struct sm_sendq));
     free(sendq);
   }
 }
 
-sm_t sm_new(size_t buf_length) {
+sm_t sm_new_with_backend(size_t buf_length, enum sm_backend_type backend) {
+  sm_backend_t b = sm_get_backend(backend);
+  if (!b) {
+    return NULL;
+  }
   sm_private_t my = sm_private_new(buf_length);
   if (!my) {
     return NULL;
@@ -784,16 +3318,49 @@ sm_t sm_new(size_t buf_length) {
   self->add_fd = sm_add_fd;
   self->remove_fd = sm_remove_fd;
   self->send = sm_send;
+  self->sendv = sm_sendv;
+  self->set_watermarks = sm_set_watermarks;
+  self->set_recv_budget = sm_set_recv_budget;
+  self->set_class_options = sm_set_class_options;
+  self->set_fd_class = sm_set_fd_class;
+  self->add_timer = sm_add_timer;
+  self->remove_timer = sm_remove_timer;
+  self->post = sm_post;
+  self->connect = sm_connect_async;
   self->select = sm_select;
   self->cleanup = sm_cleanup;
   self->private_state = my;
+  my->backend = b;
+  if (b->init(self)) {
+    if (backend != SM_BACKEND_DEFAULT || b == &sm_select_backend) {
+      sm_free(self);
+      return NULL;
+    }
+    // e.g. epoll is disabled, so fall back to select
+    my->backend = &sm_select_backend;
+    if (my->backend->init(self)) {
+      sm_free(self);
+      return NULL;
+    }
+  }
+  if (sm_post_init(self)) {
+    // okay, post isn't supported
+  }
   return self;
 }
 
+sm_t sm_new(size_t buf_length) {
+  return sm_new_with_backend(buf_length, SM_BACKEND_DEFAULT);
+}
+
 void sm_free(sm_t self) {
   if (self) {
-    sm_private_free(self->private_state);
+    sm_private_t my = self->private_state;
+    if (my && my->backend_state) {
+      my->backend->free(self);
+    }
+    sm_private_free(my);
     memset(self, 0, sizeof(struct sm_struct));
     free(self);
   }
-}
\ No newline at end of file
+}
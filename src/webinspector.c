@@ -29,6 +29,8 @@
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 
+#include "bplist_reader.h"
+#include "bplist_writer.h"
 #include "char_buffer.h"
 #include "webinspector.h"
 
@@ -41,10 +43,22 @@
 // some arbitrarly limit, to catch bad packets
 #define MAX_BODY_LENGTH 1<<26
 
+// Partial messages are copied into a list of blocks, which double in size
+// up to the max, so a big rpc is never realloc'd or moved.
+#define MIN_PARTIAL_BLOCK_LENGTH (1 << 14)
+#define MAX_PARTIAL_BLOCK_LENGTH (1 << 20)
+
 struct wi_private {
   bool partials_supported;
   cb_t in;
-  cb_t partial;
+  // the blocks of our partial rpc, which we free once it's received
+  char **partials;
+  size_t *partial_lengths;
+  size_t num_partials;
+  size_t max_partials;
+  size_t partial_avail;  // in the last block
+  size_t partial_length;  // of all blocks
+  size_t partial_gap_length;  // of the NULL gaps between them
   bool has_length;
   size_t body_length;
 };
@@ -258,6 +272,87 @@ wi_status wi_on_debug(wi_t self, const char *message,
   return WI_SUCCESS;
 }
 
+// Sends a packet's data, which we own, after its 4-byte length header.
+wi_status wi_send_data(wi_t self, char *data, size_t data_len) {
+  if (self->send_packetv) {
+    // send the header and data as-is, instead of copying them into a packet
+    char header[4];
+    header[0] = ((data_len >> 24) & 0xFF);
+    header[1] = ((data_len >> 16) & 0xFF);
+    header[2] = ((data_len >> 8) & 0xFF);
+    header[3] = (data_len & 0xFF);
+    wi_on_debug(self, "wi.send_packet", data, data_len);
+    return self->send_packetv(self, header, 4, data, data_len);
+  }
+
+  size_t length = data_len + 4;
+  char *out_head = (char*)malloc(length * sizeof(char));
+  if (!out_head) {
+    free(data);
+    return WI_ERROR;
+  }
+  char *out_tail = out_head;
+
+  // write big-endian int
+  *out_tail++ = ((data_len >> 24) & 0xFF);
+  *out_tail++ = ((data_len >> 16) & 0xFF);
+  *out_tail++ = ((data_len >> 8) & 0xFF);
+  *out_tail++ = (data_len & 0xFF);
+
+  // write data
+  memcpy(out_tail, data, data_len);
+  free(data);
+
+  wi_on_debug(self, "wi.send_packet", out_head, length);
+  wi_status ret = self->send_packet(self, out_head, length);
+  free(out_head);
+  return ret;
+}
+
+// Lays out the {WIRPartialMessageKey or WIRFinalMessageKey: data} plist that
+// wraps each <8k "chunk" of an rpc plist.
+static int wi_plan_chunk(struct bpw_plan *plan, struct bpw_node *nodes,
+    const char *chunk, size_t length, bool is_partial) {
+  static const struct bpw_node partial_key =
+    BPW_KEY_NODE("WIRPartialMessageKey");
+  static const struct bpw_node final_key =
+    BPW_KEY_NODE("WIRFinalMessageKey");
+  nodes[0].type = BPW_DICT;
+  nodes[0].data = NULL;
+  nodes[0].length = 1;
+  nodes[1] = (is_partial ? partial_key : final_key);
+  nodes[2].type = BPW_DATA;
+  nodes[2].data = chunk;
+  nodes[2].length = length;
+  return bpw_plan(plan, nodes, 3);
+}
+
+// If our message is <8k, we'll send a single final_msg,
+// otherwise we'll send <8k partial_msg "chunks" then a final_msg "chunk"
+wi_status wi_send_chunks(wi_t self, const char *rpc_bin, size_t rpc_len) {
+  size_t i;
+  for (i = 0; ; i += MAX_RPC_LEN) {
+    bool is_partial = (rpc_len - i > MAX_RPC_LEN);
+    struct bpw_node nodes[3];
+    struct bpw_plan plan;
+    if (wi_plan_chunk(&plan, nodes, rpc_bin + i,
+          (is_partial ? MAX_RPC_LEN : rpc_len - i), is_partial)) {
+      return WI_ERROR;
+    }
+    char *data = (char *)malloc(plan.length);
+    if (!data) {
+      return WI_ERROR;
+    }
+    bpw_write(&plan, data);
+    if (wi_send_data(self, data, plan.length)) {
+      return WI_ERROR;
+    }
+    if (!is_partial) {
+      return WI_SUCCESS;
+    }
+  }
+}
+
 /*
    WIRFinalMessageKey
    __selector
@@ -268,67 +363,53 @@ wi_status wi_send_plist(wi_t self, plist_t rpc_dict) {
   char *rpc_bin = NULL;
   uint32_t rpc_len = 0;
   plist_to_bin(rpc_dict, &rpc_bin, &rpc_len);
-  // if our message is <8k, we'll send a single final_msg,
-  // otherwise we'll send <8k partial_msg "chunks" then a final_msg "chunk"
-  wi_status ret = WI_ERROR;
-  uint32_t i;
-  for (i = 0; ; i += MAX_RPC_LEN) {
-    bool is_partial = false;
-    char *data = NULL;
-    uint32_t data_len = 0;
-    if (!my->partials_supported) {
-      data = rpc_bin;
-      data_len = rpc_len;
-      rpc_bin = NULL;
-    } else {
-      is_partial = (rpc_len - i > MAX_RPC_LEN);
-      plist_t wi_dict = plist_new_dict();
-      plist_t wi_rpc = plist_new_data(rpc_bin + i,
-          (is_partial ? MAX_RPC_LEN : rpc_len - i));
-      plist_dict_set_item(wi_dict,
-          (is_partial ? "WIRPartialMessageKey" : "WIRFinalMessageKey"), wi_rpc);
-      plist_to_bin(wi_dict, &data, &data_len);
-      plist_free(wi_dict);
-      wi_dict = NULL;
-      wi_rpc = NULL; // freed by wi_dict
-      if (!data) {
-        break;
-      }
-    }
+  if (!rpc_bin) {
+    return WI_ERROR;
+  }
+  if (!my->partials_supported) {
+    return wi_send_data(self, rpc_bin, rpc_len);
+  }
+  wi_status ret = wi_send_chunks(self, rpc_bin, rpc_len);
+  free(rpc_bin);
+  return ret;
+}
 
-    size_t length = data_len + 4;
-    char *out_head = (char*)malloc(length * sizeof(char));
-    if (!out_head) {
-      if (my->partials_supported) {
-        free(data);
+wi_status wi_send_bin(wi_t self, char *buf, size_t length) {
+  wi_private_t my = self->private_state;
+  char *rpc_bin = buf + WI_BIN_HEAD_LENGTH;
+  char *packet = NULL;
+  size_t packet_length = 0;
+  if (!my->partials_supported) {
+    packet = rpc_bin - 4;
+    packet_length = length + 4;
+  } else if (length <= MAX_RPC_LEN) {
+    // wrap the rpc plist in the space around it, instead of copying it
+    struct bpw_node nodes[3];
+    struct bpw_plan plan;
+    if (!wi_plan_chunk(&plan, nodes, rpc_bin, length, false)) {
+      size_t head_length = bpw_data_offset(&plan, 2);
+      if (head_length + 4 <= WI_BIN_HEAD_LENGTH &&
+          plan.length - head_length - length <= WI_BIN_TAIL_LENGTH) {
+        packet = rpc_bin - head_length - 4;
+        packet_length = plan.length + 4;
+        bpw_write(&plan, packet + 4);
       }
-      break;
-    }
-    char *out_tail = out_head;
-
-    // write big-endian int
-    *out_tail++ = ((data_len >> 24) & 0xFF);
-    *out_tail++ = ((data_len >> 16) & 0xFF);
-    *out_tail++ = ((data_len >> 8) & 0xFF);
-    *out_tail++ = (data_len & 0xFF);
-
-    // write data
-    memcpy(out_tail, data, data_len);
-    free(data);
-
-    wi_on_debug(self, "wi.send_packet", out_head, length);
-    wi_status not_sent = self->send_packet(self, out_head, length);
-    free(out_head);
-    if (not_sent) {
-      break;
     }
+  }
 
-    if (!is_partial) {
-      ret = WI_SUCCESS;
-      break;
-    }
+  wi_status ret;
+  if (packet) {
+    size_t data_len = packet_length - 4;
+    packet[0] = ((data_len >> 24) & 0xFF);
+    packet[1] = ((data_len >> 16) & 0xFF);
+    packet[2] = ((data_len >> 8) & 0xFF);
+    packet[3] = (data_len & 0xFF);
+    wi_on_debug(self, "wi.send_packet", packet, packet_length);
+    ret = self->send_packet(self, packet, packet_length);
+  } else {
+    ret = wi_send_chunks(self, rpc_bin, length);
   }
-  free(rpc_bin);
+  free(buf);
   return ret;
 }
 
@@ -357,73 +438,163 @@ wi_status wi_parse_length(wi_t self, const char *buf, size_t *to_length) {
   return WI_SUCCESS;
 }
 
-wi_status wi_parse_plist(wi_t self, const char *from_buf, size_t length,
-    plist_t *to_rpc_dict, bool *to_is_partial) {
+// make room for another block or gap
+wi_status wi_reserve_partial(wi_t self) {
   wi_private_t my = self->private_state;
-  *to_is_partial = false;
-  *to_rpc_dict = NULL;
-
-  if (!my->partials_supported) {
-    plist_from_bin(from_buf, length, to_rpc_dict);
-  } else {
-    plist_t wi_dict = NULL;
-    plist_from_bin(from_buf, length, &wi_dict);
-    if (!wi_dict) {
-      return WI_ERROR;
+  if (my->num_partials >= my->max_partials) {
+    size_t max_partials = (my->max_partials ? 2 * my->max_partials : 16);
+    char **partials = (char **)realloc(my->partials,
+        max_partials * sizeof(char *));
+    if (!partials) {
+      return self->on_error(self, "Out of memory");
     }
-    plist_t wi_rpc = plist_dict_get_item(wi_dict, "WIRFinalMessageKey");
-    if (!wi_rpc) {
-      wi_rpc = plist_dict_get_item(wi_dict, "WIRPartialMessageKey");
-      if (!wi_rpc) {
+    my->partials = partials;
+    size_t *partial_lengths = (size_t *)realloc(my->partial_lengths,
+        max_partials * sizeof(size_t));
+    if (!partial_lengths) {
+      return self->on_error(self, "Out of memory");
+    }
+    my->partial_lengths = partial_lengths;
+    my->max_partials = max_partials;
+  }
+  return WI_SUCCESS;
+}
+
+wi_status wi_append_partial(wi_t self, const char *data, size_t length) {
+  wi_private_t my = self->private_state;
+  while (length) {
+    if (!my->partial_avail) {
+      if (wi_reserve_partial(self)) {
         return WI_ERROR;
       }
-      *to_is_partial = true;
+      size_t block_length = my->partial_length;
+      if (block_length < MIN_PARTIAL_BLOCK_LENGTH) {
+        block_length = MIN_PARTIAL_BLOCK_LENGTH;
+      } else if (block_length > MAX_PARTIAL_BLOCK_LENGTH) {
+        block_length = MAX_PARTIAL_BLOCK_LENGTH;
+      }
+      char *block = (char *)malloc(block_length);
+      if (!block) {
+        return self->on_error(self, "Out of memory");
+      }
+      my->partials[my->num_partials] = block;
+      my->partial_lengths[my->num_partials] = 0;
+      my->num_partials++;
+      my->partial_avail = block_length;
     }
+    size_t i = my->num_partials - 1;
+    size_t n = (length < my->partial_avail ? length : my->partial_avail);
+    memcpy(my->partials[i] + my->partial_lengths[i], data, n);
+    my->partial_lengths[i] += n;
+    my->partial_avail -= n;
+    my->partial_length += n;
+    data += n;
+    length -= n;
+  }
+  return WI_SUCCESS;
+}
 
-    uint64_t rpc_len = 0;
-    char *rpc_bin = NULL;
-    plist_get_data_val(wi_rpc, &rpc_bin, &rpc_len);
-    plist_free(wi_dict); // also frees wi_rpc
-    if (!rpc_bin) {
+// Appends a gap for bytes that recv_partial has consumed, which is merged
+// with the previous gap, e.g. as a big data is streamed.
+wi_status wi_append_partial_gap(wi_t self, size_t length) {
+  wi_private_t my = self->private_state;
+  if (!length) {
+    return WI_SUCCESS;
+  }
+  size_t i = my->num_partials;
+  if (!i || my->partials[i - 1]) {
+    if (wi_reserve_partial(self)) {
       return WI_ERROR;
     }
-    // assert rpc_len < MAX_RPC_LEN?
+    my->partials[i] = NULL;
+    my->partial_lengths[i] = 0;
+    my->num_partials++;
+    my->partial_avail = 0;
+  }
+  my->partial_lengths[my->num_partials - 1] += length;
+  my->partial_gap_length += length;
+  return WI_SUCCESS;
+}
 
-    size_t p_length = my->partial->tail - my->partial->head;
-    if (*to_is_partial || p_length) {
-      if (cb_ensure_capacity(my->partial, rpc_len)) {
-        return self->on_error(self, "Out of memory");
-      }
-      memcpy(my->partial->tail, rpc_bin, rpc_len);
-      my->partial->tail += rpc_len;
-      p_length += rpc_len;
-      free(rpc_bin);
-      if (*to_is_partial) {
-        return WI_SUCCESS;
-      }
-    }
+void wi_free_partials(wi_private_t my) {
+  size_t i;
+  for (i = 0; i < my->num_partials; i++) {
+    free(my->partials[i]);
+  }
+  my->num_partials = 0;
+  my->partial_avail = 0;
+  my->partial_length = 0;
+  my->partial_gap_length = 0;
+}
 
-    if (p_length) {
-      plist_from_bin(my->partial->head, (uint32_t)p_length, to_rpc_dict);
-      cb_clear(my->partial);
-    } else {
-      plist_from_bin(rpc_bin, (uint32_t)rpc_len, to_rpc_dict);
-      free(rpc_bin);
+// Unwraps the rpc plist from a packet's body, which, if partials are
+// supported, is a {WIRPartialMessageKey or WIRFinalMessageKey: data} plist.
+// If there are partials then the data, less any bytes that recv_partial
+// consumes, is appended to them, otherwise
+// @param to_rpc_bin is a slice of the body.
+wi_status wi_parse_bin(wi_t self, const char *from_buf, size_t length,
+    const char **to_rpc_bin, size_t *to_rpc_len, bool *to_is_partial) {
+  wi_private_t my = self->private_state;
+  *to_is_partial = false;
+  *to_rpc_bin = NULL;
+  *to_rpc_len = 0;
+
+  if (!my->partials_supported) {
+    *to_rpc_bin = from_buf;
+    *to_rpc_len = length;
+    return WI_SUCCESS;
+  }
+
+  struct bpr_plist wi_dict;
+  uint64_t wi_rpc;
+  if (bpr_open(&wi_dict, from_buf, length)) {
+    return WI_ERROR;
+  }
+  if (bpr_dict_get(&wi_dict, wi_dict.root, "WIRFinalMessageKey", &wi_rpc)) {
+    if (bpr_dict_get(&wi_dict, wi_dict.root, "WIRPartialMessageKey",
+          &wi_rpc)) {
+      return WI_ERROR;
     }
+    *to_is_partial = true;
+  }
+  size_t rpc_offset = 0;
+  size_t rpc_len = 0;
+  if (bpr_get_data(&wi_dict, wi_rpc, &rpc_offset, &rpc_len)) {
+    return WI_ERROR;
   }
+  // assert rpc_len < MAX_RPC_LEN?
+  const char *rpc_bin = from_buf + rpc_offset;
 
-  return (*to_rpc_dict ? WI_SUCCESS : WI_ERROR);
+  if (*to_is_partial || my->num_partials) {
+    size_t skip_offset = 0;
+    size_t skip_length = 0;
+    if (self->recv_partial && self->recv_bin &&
+        self->recv_partial(self, my->partial_length + my->partial_gap_length,
+          rpc_bin, rpc_len, &skip_offset, &skip_length)) {
+      return WI_ERROR;
+    }
+    size_t skip_end = skip_offset + skip_length;
+    return (wi_append_partial(self, rpc_bin, skip_offset) ||
+        wi_append_partial_gap(self, skip_length) ||
+        wi_append_partial(self, rpc_bin + skip_end, rpc_len - skip_end));
+  }
+  *to_rpc_bin = rpc_bin;
+  *to_rpc_len = rpc_len;
+  return WI_SUCCESS;
 }
 
 wi_status wi_recv_packet(wi_t self, const char *packet, ssize_t length) {
+  wi_private_t my = self->private_state;
   wi_on_debug(self, "wi.recv_packet", packet, length);
 
   size_t body_length = 0;
-  plist_t rpc_dict = NULL;
+  const char *rpc_bin = NULL;
+  size_t rpc_len = 0;
   bool is_partial = false;
   if (!packet || length < 4 || wi_parse_length(self, packet, &body_length) ||
       //TODO (body_length != length - 4) ||
-      wi_parse_plist(self, packet + 4, body_length, &rpc_dict, &is_partial)) {
+      wi_parse_bin(self, packet + 4, body_length, &rpc_bin, &rpc_len,
+        &is_partial)) {
     // invalid packet
     char *text = NULL;
     if (body_length != length - 4) {
@@ -441,8 +612,38 @@ wi_status wi_recv_packet(wi_t self, const char *packet, ssize_t length) {
   if (is_partial) {
     return WI_SUCCESS;
   }
-  wi_status ret = self->recv_plist(self, rpc_dict);
-  plist_free(rpc_dict);
+  wi_status ret;
+  if (self->recv_bin) {
+    if (my->num_partials) {
+      ret = self->recv_bin(self, (const char *const *)my->partials,
+          my->partial_lengths, my->num_partials);
+    } else {
+      ret = self->recv_bin(self, &rpc_bin, &rpc_len, 1);
+    }
+  } else {
+    char *joined = NULL;
+    if (my->num_partials) {
+      // libplist needs the rpc in one buffer
+      joined = (char *)malloc(my->partial_length);
+      if (!joined) {
+        wi_free_partials(my);
+        return self->on_error(self, "Out of memory");
+      }
+      size_t i;
+      for (i = 0, rpc_len = 0; i < my->num_partials; i++) {
+        memcpy(joined + rpc_len, my->partials[i], my->partial_lengths[i]);
+        rpc_len += my->partial_lengths[i];
+      }
+      rpc_bin = joined;
+    }
+    plist_t rpc_dict = NULL;
+    plist_from_bin(rpc_bin, (uint32_t)rpc_len, &rpc_dict);
+    ret = (rpc_dict ? self->recv_plist(self, rpc_dict) :
+        self->on_error(self, "Invalid rpc plist"));
+    plist_free(rpc_dict);
+    free(joined);
+  }
+  wi_free_partials(my);
   return ret;
 }
 
@@ -498,6 +699,7 @@ wi_status wi_on_recv(wi_t self, const char *buf, ssize_t length) {
   if (cb_end_input(my->in)) {
     return self->on_error(self, "end_input buffer error");
   }
+  cb_shrink(my->in);
   return ret;
 }
 
@@ -508,7 +710,9 @@ wi_status wi_on_recv(wi_t self, const char *buf, ssize_t length) {
 void wi_private_free(wi_private_t my) {
   if (my) {
     cb_free(my->in);
-    cb_free(my->partial);
+    wi_free_partials(my);
+    free(my->partials);
+    free(my->partial_lengths);
     memset(my, 0, sizeof(struct wi_private));
     free(my);
   }
@@ -518,9 +722,8 @@ wi_private_t wi_private_new() {
         struct wi_private));
   if (my) {
     memset(my, 0, sizeof(struct wi_private));
-    my->in = cb_new();
-    my->partial = cb_new();
-    if (!my->in || !my->partial) {
+    my->in = cb_new_ring();
+    if (!my->in) {
       wi_private_free(my);
       return NULL;
     }
@@ -544,6 +747,7 @@ wi_t wi_new(bool partials_supported) {
   memset(self, 0, sizeof(struct wi_struct));
   self->on_recv = wi_on_recv;
   self->send_plist = wi_send_plist;
+  self->send_bin = wi_send_bin;
   self->recv_packet = wi_recv_packet;
   self->on_error = wi_on_error;
   self->private_state = wi_private_new();
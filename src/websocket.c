@@ -7,11 +7,18 @@
 #endif
 
 #define _GNU_SOURCE
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <zlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WS_X86_SIMD
+#include <immintrin.h>
+#endif
 
 #include "websocket.h"
 #include "char_buffer.h"
@@ -20,17 +27,34 @@
 #include "sha1.h"
 
 #include "validate_utf8.h"
-#include "strndup.h"
-#include "strcasestr.h"
+
+struct ws_http_header {
+  const char *key;
+  size_t key_length;
+  const char *value;
+  size_t value_length;
+};
 
 typedef int8_t ws_state;
 #define STATE_ERROR 1
 #define STATE_READ_HTTP_REQUEST 2
-#define STATE_READ_HTTP_HEADERS 3
 #define STATE_KEEP_ALIVE 4
 #define STATE_READ_FRAME_LENGTH 5
 #define STATE_READ_FRAME 6
 #define STATE_CLOSED 7
+#define STATE_READ_HTTP_BODY 8
+#define STATE_READ_FRAME_CHUNK 9
+
+// Min payload length for send_datav, below which we copy into one send_data
+#define WS_MIN_GATHER_LENGTH 1024
+
+// Max HTTP request head, i.e. the request line and headers, and its max
+// number of headers
+#define WS_MAX_HTTP_HEAD_LENGTH 16384
+#define WS_MAX_HTTP_HEADERS 64
+
+// permessage-deflate frame flag, aka "RSV1"
+#define WS_DEFLATE_FLAG 0x40
 
 
 struct ws_private {
@@ -40,6 +64,10 @@ struct ws_private {
   cb_t out;
   cb_t data;
 
+  // the request head is scanned up to here, see ws_find_http_head_end
+  size_t http_scanned;
+  // the request fields that we keep, as strings in http_strings
+  cb_t http_strings;
   char *method;
   char *resource;
   char *http_version;
@@ -49,6 +77,10 @@ struct ws_private {
   int version;
   char *sec_key;
   bool is_websocket;
+  bool is_keep_alive;     // the client asked for a persistent connection
+  bool is_discarding;     // see ws_discard_requests
+  size_t content_length;  // of the request body, which we skip
+  unsigned int num_http_requests;
 
   char *sec_answer;
 
@@ -56,7 +88,33 @@ struct ws_private {
   size_t frame_length;
 
   uint8_t continued_opcode;
+  unsigned int utf8_state;  // of the received text message
+  size_t message_length;    // of the received message, after inflating
   bool sent_close;
+  uint8_t sent_continued_opcode;
+  unsigned int sent_utf8_state;
+
+  // the client's Sec-WebSocket-Extensions offers
+  char *extensions;
+
+  // permessage-deflate, if negotiated by ws_send_upgrade
+  bool is_deflate;
+  bool deflate_no_takeover;
+  z_stream deflater;
+  z_stream inflater;
+  bool is_deflating;  // the sent message is compressed
+  bool is_inflating;  // the received message is compressed
+  cb_t deflated;
+  cb_t inflated;
+  struct ws_deflate_stats stats;
+
+  // the data frame that we're passing to on_frame_chunk as it arrives
+  bool chunk_is_fin;
+  uint8_t chunk_opcode;
+  bool chunk_is_masking;
+  unsigned char chunk_mask[4];
+  size_t chunk_offset;     // of the next byte in the payload
+  size_t chunk_remaining;  // payload bytes
 };
 
 
@@ -81,6 +139,15 @@ ws_status ws_on_debug(ws_t self, const char *message,
   return WS_SUCCESS;
 }
 
+// Closes a connection whose frame or message exceeds our max length.  We
+// don't wait for the rest of it, since that's what the limit is for.
+ws_status ws_on_size_error(ws_t self, const char *what,
+    unsigned long long length, size_t max_length) {
+  self->send_close(self, CLOSE_SIZE_ERROR, "Message too big");
+  return self->on_error(self, "%s length %llu exceeds %zd",
+      what, length, max_length);
+}
+
 //
 // SEND
 //
@@ -140,6 +207,616 @@ void ws_random_buf(char *buf, size_t len) {
 #endif
 }
 
+//
+// MASKING
+//
+// Each ws_mask* copies length bytes from src to dst, xor'ed with the 4-byte
+// mask starting at mask[0].  The src and dst may be the same, to mask in
+// place.  The SIMD versions are compiled for their target regardless of our
+// CFLAGS and picked at runtime, then finish with the scalar version, which
+// is in phase since they step by multiples of 4.
+//
+
+void ws_mask_scalar(char *dst, const char *src, size_t length,
+    const unsigned char *mask) {
+  unsigned char mask8[8];
+  memcpy(mask8, mask, 4);
+  memcpy(mask8 + 4, mask, 4);
+  uint64_t mask64;
+  memcpy(&mask64, mask8, 8);
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t v;
+    memcpy(&v, src + i, 8);
+    v ^= mask64;
+    memcpy(dst + i, &v, 8);
+  }
+  for (; i < length; i++) {
+    dst[i] = src[i] ^ mask[i & 3];
+  }
+}
+
+#ifdef WS_X86_SIMD
+__attribute__((target("sse2")))
+void ws_mask_sse2(char *dst, const char *src, size_t length,
+    const unsigned char *mask) {
+  int32_t mask32;
+  memcpy(&mask32, mask, 4);
+  __m128i m = _mm_set1_epi32(mask32);
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(v, m));
+  }
+  ws_mask_scalar(dst + i, src + i, length - i, mask);
+}
+
+__attribute__((target("avx2")))
+void ws_mask_avx2(char *dst, const char *src, size_t length,
+    const unsigned char *mask) {
+  int32_t mask32;
+  memcpy(&mask32, mask, 4);
+  __m256i m = _mm256_set1_epi32(mask32);
+  size_t i = 0;
+  for (; i + 64 <= length; i += 64) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(v0, m));
+    _mm256_storeu_si256((__m256i *)(dst + i + 32), _mm256_xor_si256(v1, m));
+  }
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(v, m));
+  }
+  // gcc tail-calls the scalar version without this, which makes its SSE
+  // code pay the AVX to SSE transition penalty, ~150ns per call
+  _mm256_zeroupper();
+  ws_mask_scalar(dst + i, src + i, length - i, mask);
+}
+#endif
+
+void ws_mask(char *dst, const char *src, size_t length,
+    const unsigned char *mask) {
+#ifdef WS_X86_SIMD
+  if (length >= 32 && __builtin_cpu_supports("avx2")) {
+    ws_mask_avx2(dst, src, length, mask);
+    return;
+  }
+  if (length >= 16 && __builtin_cpu_supports("sse2")) {
+    ws_mask_sse2(dst, src, length, mask);
+    return;
+  }
+#endif
+  ws_mask_scalar(dst, src, length, mask);
+}
+
+//
+// UTF-8
+//
+// ws_validate_utf8 runs the validate_utf8 DFA from *state, so it can check a
+// text message a fragment at a time, but it only steps byte-by-byte through
+// a code point that's split from the previous fragment, the last few bytes,
+// and runs of ASCII on non-x86.  Everything in between is checked 16 or 32
+// bytes at a time by the lookup-table validator from Keiser & Lemire,
+// "Validating UTF-8 In Less Than One Instruction Per Byte" (2021).
+//
+
+#ifdef WS_X86_SIMD
+// error bits for (byte 1 high nibble, byte 1 low nibble, byte 2 high nibble)
+#define U8_TOO_SHORT   0x01  // 11______ 0_______, 11______ 11______
+#define U8_TOO_LONG    0x02  // 0_______ 10______
+#define U8_OVERLONG_3  0x04  // 11100000 100_____
+#define U8_TOO_LARGE   0x08  // 11110100 1001____, etc
+#define U8_SURROGATE   0x10  // 11101101 101_____
+#define U8_OVERLONG_2  0x20  // 1100000_ 10______
+#define U8_TOO_LARGE_1000 0x40  // 11110101 1000____, etc
+#define U8_OVERLONG_4  0x40  // 11110000 1000____
+#define U8_TWO_CONTS   0x80  // 10______ 10______
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+#define U8_BYTE_1_HIGH \
+  U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, \
+  U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, \
+  U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, \
+  U8_TOO_SHORT | U8_OVERLONG_2, \
+  U8_TOO_SHORT, \
+  U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE, \
+  U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4
+#define U8_BYTE_1_LOW \
+  U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4, \
+  U8_CARRY | U8_OVERLONG_2, \
+  U8_CARRY, \
+  U8_CARRY, \
+  U8_CARRY | U8_TOO_LARGE, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000
+#define U8_BYTE_2_HIGH \
+  U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, \
+  U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, \
+  U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | \
+    U8_TOO_LARGE_1000 | U8_OVERLONG_4, \
+  U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE, \
+  U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE, \
+  U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE, \
+  U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT
+// the last 3 bytes of a block can't start a sequence that's longer than that
+#define U8_MAX_TAIL (char)0xEF, (char)0xDF, (char)0xBF
+
+// @param s must start and end on code point boundaries
+__attribute__((target("sse4.1")))
+bool ws_is_utf8_sse4(const unsigned char *s, size_t length) {
+  const __m128i byte_1_high = _mm_setr_epi8(U8_BYTE_1_HIGH);
+  const __m128i byte_1_low = _mm_setr_epi8(U8_BYTE_1_LOW);
+  const __m128i byte_2_high = _mm_setr_epi8(U8_BYTE_2_HIGH);
+  const __m128i max_value = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, U8_MAX_TAIL);
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  const __m128i high_bit = _mm_set1_epi8((char)0x80);
+  __m128i prev = _mm_setzero_si128();
+  __m128i prev_incomplete = _mm_setzero_si128();
+  __m128i error = _mm_setzero_si128();
+  size_t i;
+  for (i = 0; i < length; i += 16) {
+    __m128i in;
+    if (i + 16 <= length) {
+      in = _mm_loadu_si128((const __m128i *)(s + i));
+    } else {
+      // pad with ASCII, which is an error after an incomplete code point
+      unsigned char buf[16] = {0};
+      memcpy(buf, s + i, length - i);
+      in = _mm_loadu_si128((const __m128i *)buf);
+    }
+    if (_mm_testz_si128(in, high_bit)) {
+      error = _mm_or_si128(error, prev_incomplete);
+      prev_incomplete = _mm_setzero_si128();
+      prev = in;
+      continue;
+    }
+    __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+    __m128i sc = _mm_and_si128(_mm_and_si128(
+        _mm_shuffle_epi8(byte_1_high,
+          _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+        _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+        _mm_shuffle_epi8(byte_2_high,
+          _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+    // the 3rd and 4th bytes of 3 and 4 byte sequences must be continuations
+    __m128i is_third = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 14),
+        _mm_set1_epi8((char)(0xE0 - 0x80)));
+    __m128i is_fourth = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 13),
+        _mm_set1_epi8((char)(0xF0 - 0x80)));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(is_third, is_fourth),
+        high_bit);
+    error = _mm_or_si128(error, _mm_xor_si128(must23, sc));
+    prev_incomplete = _mm_subs_epu8(in, max_value);
+    prev = in;
+  }
+  error = _mm_or_si128(error, prev_incomplete);
+  return _mm_testz_si128(error, error);
+}
+
+// @param s must start and end on code point boundaries
+__attribute__((target("avx2")))
+bool ws_is_utf8_avx2(const unsigned char *s, size_t length) {
+  const __m256i byte_1_high = _mm256_setr_epi8(U8_BYTE_1_HIGH,
+      U8_BYTE_1_HIGH);
+  const __m256i byte_1_low = _mm256_setr_epi8(U8_BYTE_1_LOW, U8_BYTE_1_LOW);
+  const __m256i byte_2_high = _mm256_setr_epi8(U8_BYTE_2_HIGH,
+      U8_BYTE_2_HIGH);
+  const __m256i max_value = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, U8_MAX_TAIL);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  const __m256i high_bit = _mm256_set1_epi8((char)0x80);
+  __m256i prev = _mm256_setzero_si256();
+  __m256i prev_incomplete = _mm256_setzero_si256();
+  __m256i error = _mm256_setzero_si256();
+  size_t i;
+  for (i = 0; i < length; i += 32) {
+    __m256i in;
+    if (i + 32 <= length) {
+      in = _mm256_loadu_si256((const __m256i *)(s + i));
+    } else {
+      unsigned char buf[32] = {0};
+      memcpy(buf, s + i, length - i);
+      in = _mm256_loadu_si256((const __m256i *)buf);
+    }
+    if (_mm256_testz_si256(in, high_bit)) {
+      error = _mm256_or_si256(error, prev_incomplete);
+      prev_incomplete = _mm256_setzero_si256();
+      prev = in;
+      continue;
+    }
+    // the lanes are 16 bytes, so shift in the end of prev across the middle
+    __m256i prev_in = _mm256_permute2x128_si256(prev, in, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(in, prev_in, 15);
+    __m256i sc = _mm256_and_si256(_mm256_and_si256(
+        _mm256_shuffle_epi8(byte_1_high,
+          _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+        _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+        _mm256_shuffle_epi8(byte_2_high,
+          _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+    __m256i is_third = _mm256_subs_epu8(_mm256_alignr_epi8(in, prev_in, 14),
+        _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i is_fourth = _mm256_subs_epu8(_mm256_alignr_epi8(in, prev_in, 13),
+        _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth),
+        high_bit);
+    error = _mm256_or_si256(error, _mm256_xor_si256(must23, sc));
+    prev_incomplete = _mm256_subs_epu8(in, max_value);
+    prev = in;
+  }
+  error = _mm256_or_si256(error, prev_incomplete);
+  bool ret = _mm256_testz_si256(error, error);
+  _mm256_zeroupper();
+  return ret;
+}
+#endif
+
+// @param state UTF8_VALID at the start of a message, and on return must be
+// UTF8_VALID at the end of the message, else it ended mid-code point
+// @result the offset of the first invalid byte, else length
+size_t ws_validate_utf8(unsigned int *state, const char *data,
+    size_t length) {
+  const unsigned char *s = (const unsigned char *)data;
+  unsigned int utf8_state = *state;
+  size_t i = 0;
+  // finish a code point that was split from the previous fragment
+  for (; i < length && utf8_state != UTF8_VALID; i++) {
+    utf8_state = validate_utf8[utf8_state + s[i]];
+    if (utf8_state == UTF8_INVALID) {
+      *state = utf8_state;
+      return i;
+    }
+  }
+#ifdef WS_X86_SIMD
+  if (length - i >= 32) {
+    // stop before the last code point, which may continue in the next
+    // fragment
+    size_t end = length;
+    size_t j;
+    for (j = 1; j <= 3; j++) {
+      if ((s[length - j] & 0xC0) != 0x80) {
+        if (s[length - j] >= 0xC0) {
+          end = length - j;
+        }
+        break;
+      }
+    }
+    // if it fails then we'll find the error below
+    if (__builtin_cpu_supports("avx2") ? ws_is_utf8_avx2(s + i, end - i) :
+        __builtin_cpu_supports("sse4.1") && ws_is_utf8_sse4(s + i, end - i)) {
+      i = end;
+    }
+  }
+#endif
+  while (i < length) {
+    if (utf8_state == UTF8_VALID && i + 8 <= length) {
+      uint64_t word;
+      memcpy(&word, s + i, 8);
+      if (!(word & 0x8080808080808080ULL)) {
+        i += 8;
+        continue;
+      }
+    }
+    utf8_state = validate_utf8[utf8_state + s[i]];
+    if (utf8_state == UTF8_INVALID) {
+      break;
+    }
+    i++;
+  }
+  *state = utf8_state;
+  return i;
+}
+
+//
+// DEFLATE
+//
+// permessage-deflate (RFC 7692) compresses each data message as part of
+// one raw deflate stream per direction, sync-flushed at the end of each
+// message with the trailing 00 00 FF FF removed.  The first frame of a
+// compressed message has the WS_DEFLATE_FLAG set.
+//
+
+// Parses a window bits param value, e.g. "10", which may be quoted.
+// @result false if it's not within 8..15
+static bool ws_read_window_bits(const char *s, const char *end,
+    int *to_bits) {
+  if (end - s >= 2 && *s == '"' && end[-1] == '"') {
+    s++;
+    end--;
+  }
+  int bits = 0;
+  if (s == end || end - s > 2) {
+    return false;
+  }
+  for (; s < end; s++) {
+    if (*s < '0' || *s > '9') {
+      return false;
+    }
+    bits = bits * 10 + (*s - '0');
+  }
+  *to_bits = bits;
+  return (bits >= 8 && bits <= 15);
+}
+
+// Parses one offer from the extensions list, e.g.:
+//   permessage-deflate; client_max_window_bits; server_max_window_bits=10
+// The to_client_bits is 0 if the client didn't offer to limit its window.
+// @result false if it's some other extension or has params we can't honor
+static bool ws_read_deflate_offer(const char *s, const char *end,
+    int *to_server_bits, int *to_client_bits,
+    bool *to_server_no_takeover, bool *to_client_no_takeover) {
+  *to_server_bits = 15;
+  *to_client_bits = 0;
+  *to_server_no_takeover = false;
+  *to_client_no_takeover = false;
+  uint8_t seen = 0;
+  bool is_name = true;
+  while (s < end) {
+    const char *param_end = memchr(s, ';', end - s);
+    if (!param_end) {
+      param_end = end;
+    }
+    const char *k_start = s;
+    const char *v_end = param_end;
+    while (k_start < v_end && (*k_start == ' ' || *k_start == '\t')) {
+      k_start++;
+    }
+    while (v_end > k_start && (v_end[-1] == ' ' || v_end[-1] == '\t')) {
+      v_end--;
+    }
+    const char *k_end = memchr(k_start, '=', v_end - k_start);
+    const char *v_start = (k_end ? k_end + 1 : NULL);
+    if (!k_end) {
+      k_end = v_end;
+    }
+    while (k_end > k_start && (k_end[-1] == ' ' || k_end[-1] == '\t')) {
+      k_end--;
+    }
+    while (v_start && v_start < v_end &&
+        (*v_start == ' ' || *v_start == '\t')) {
+      v_start++;
+    }
+    size_t k_length = k_end - k_start;
+#define WS_IS_KEY(k) (k_length == strlen(k) && !strncasecmp(k_start, k, \
+      k_length))
+    uint8_t flag;
+    if (is_name) {
+      if (!WS_IS_KEY("permessage-deflate") || v_start) {
+        return false;
+      }
+      is_name = false;
+      flag = 0;
+    } else if (WS_IS_KEY("server_no_context_takeover") && !v_start) {
+      *to_server_no_takeover = true;
+      flag = 0x1;
+    } else if (WS_IS_KEY("client_no_context_takeover") && !v_start) {
+      *to_client_no_takeover = true;
+      flag = 0x2;
+    } else if (WS_IS_KEY("server_max_window_bits") && v_start) {
+      if (!ws_read_window_bits(v_start, v_end, to_server_bits)) {
+        return false;
+      }
+      flag = 0x4;
+    } else if (WS_IS_KEY("client_max_window_bits")) {
+      *to_client_bits = 15;
+      if (v_start && !ws_read_window_bits(v_start, v_end, to_client_bits)) {
+        return false;
+      }
+      flag = 0x8;
+    } else {
+      return false;
+    }
+#undef WS_IS_KEY
+    if (seen & flag) {
+      return false;
+    }
+    seen |= flag;
+    s = param_end + 1;
+  }
+  return !is_name;
+}
+
+// Accepts the first permessage-deflate offer that we can honor, if any, and
+// writes our response params to to_params, e.g. "; server_max_window_bits=10".
+ws_status ws_negotiate_deflate(ws_t self, char *to_params) {
+  ws_private_t my = self->private_state;
+  *to_params = '\0';
+  if (!self->deflate_window_bits || !my->extensions || my->is_deflate) {
+    return WS_SUCCESS;
+  }
+  // zlib's raw deflate doesn't support an 8-bit window
+  int max_bits = self->deflate_window_bits;
+  max_bits = (max_bits < 9 ? 9 : max_bits > 15 ? 15 : max_bits);
+
+  const char *s = my->extensions;
+  const char *end = s + strlen(s);
+  while (s < end) {
+    const char *offer_end = memchr(s, ',', end - s);
+    if (!offer_end) {
+      offer_end = end;
+    }
+    int server_bits;
+    int client_bits;
+    bool server_no_takeover;
+    bool client_no_takeover;
+    if (ws_read_deflate_offer(s, offer_end, &server_bits, &client_bits,
+          &server_no_takeover, &client_no_takeover) && server_bits >= 9) {
+      if (server_bits > max_bits) {
+        server_bits = max_bits;
+      }
+      if (client_bits > max_bits) {
+        client_bits = max_bits;
+      }
+      server_no_takeover |= self->deflate_no_context_takeover;
+
+      memset(&my->deflater, 0, sizeof(z_stream));
+      memset(&my->inflater, 0, sizeof(z_stream));
+      if (deflateInit2(&my->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+            -server_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return self->on_error(self, "deflateInit2 failed");
+      }
+      if (inflateInit2(&my->inflater,
+            -(client_bits ? client_bits : 15)) != Z_OK) {
+        deflateEnd(&my->deflater);
+        return self->on_error(self, "inflateInit2 failed");
+      }
+      my->is_deflate = true;
+      my->deflate_no_takeover = server_no_takeover;
+
+      char *t = to_params;
+      if (server_no_takeover) {
+        t += sprintf(t, "; server_no_context_takeover");
+      }
+      if (client_no_takeover) {
+        t += sprintf(t, "; client_no_context_takeover");
+      }
+      if (server_bits < 15) {
+        t += sprintf(t, "; server_max_window_bits=%d", server_bits);
+      }
+      if (client_bits && client_bits < 15) {
+        t += sprintf(t, "; client_max_window_bits=%d", client_bits);
+      }
+      return WS_SUCCESS;
+    }
+    s = offer_end + 1;
+  }
+  return WS_SUCCESS;
+}
+
+// Compresses the payload of a message's frame into my->deflated.
+ws_status ws_deflate(ws_t self, const char *data, size_t length,
+    bool is_fin) {
+  ws_private_t my = self->private_state;
+  z_stream *zs = &my->deflater;
+  cb_t out = my->deflated;
+  cb_clear(out);
+  zs->next_in = (Bytef *)data;
+  zs->avail_in = 0;
+  size_t in_left = length;
+  do {
+    if (!zs->avail_in && in_left) {
+      zs->avail_in = (in_left < UINT_MAX ? in_left : UINT_MAX);
+      in_left -= zs->avail_in;
+    }
+    // incompressible input grows by ~5 bytes per 16K block
+    if (cb_ensure_capacity(out, (zs->avail_in >> 1) + 64)) {
+      return self->on_error(self, "Out of memory");
+    }
+    size_t avail_out = out->end - out->tail;
+    zs->next_out = (Bytef *)out->tail;
+    zs->avail_out = (avail_out < UINT_MAX ? avail_out : UINT_MAX);
+    int ret = deflate(zs, (in_left ? Z_NO_FLUSH : Z_SYNC_FLUSH));
+    out->tail = (char *)zs->next_out;
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      return self->on_error(self, "deflate error %d", ret);
+    }
+  } while (zs->avail_in || in_left || !zs->avail_out);
+
+  if (is_fin) {
+    // remove the sync flush's empty block, which the receiver restores
+    if (out->tail - out->head >= 4 && !memcmp(out->tail - 4,
+          "\x00\x00\xff\xff", 4)) {
+      out->tail -= 4;
+    }
+    if (out->tail == out->head) {
+      *out->tail++ = '\0';
+    }
+    if (my->deflate_no_takeover && deflateReset(zs) != Z_OK) {
+      return self->on_error(self, "deflateReset failed");
+    }
+  }
+  return WS_SUCCESS;
+}
+
+// Decompresses onto my->inflated.
+// @param to_is_end set if the data ended with a final deflate block
+ws_status ws_inflate_buf(ws_t self, const char *data, size_t length,
+    bool *to_is_end) {
+  ws_private_t my = self->private_state;
+  z_stream *zs = &my->inflater;
+  cb_t out = my->inflated;
+  size_t out_length = out->tail - out->begin;
+  size_t max_length = (self->max_message_length ?
+      self->max_message_length - my->message_length : SIZE_MAX);
+  zs->next_in = (Bytef *)data;
+  zs->avail_in = 0;
+  size_t in_left = length;
+  bool is_end = false;
+  do {
+    if (!zs->avail_in && in_left) {
+      zs->avail_in = (in_left < UINT_MAX ? in_left : UINT_MAX);
+      in_left -= zs->avail_in;
+    }
+    size_t needed = (zs->avail_in < (1 << 16) ? zs->avail_in << 2 :
+        1 << 18);
+    if (cb_ensure_capacity(out, needed + 1024)) {
+      return self->on_error(self, "Out of memory");
+    }
+    size_t avail_out = out->end - out->tail;
+    zs->next_out = (Bytef *)out->tail;
+    zs->avail_out = (avail_out < UINT_MAX ? avail_out : UINT_MAX);
+    int ret = inflate(zs, Z_SYNC_FLUSH);
+    out->tail = (char *)zs->next_out;
+    if (out->tail - out->begin - out_length > max_length) {
+      // e.g. a "zip bomb", so stop before we inflate all of it
+      return ws_on_size_error(self, "Inflated message",
+          my->message_length + (out->tail - out->begin - out_length),
+          self->max_message_length);
+    }
+    if (ret == Z_STREAM_END) {
+      // the sender may end the stream, in which case the next message
+      // starts a new one
+      is_end = true;
+      if (inflateReset(zs) != Z_OK) {
+        return self->on_error(self, "inflateReset failed");
+      }
+    } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+      is_end = (is_end && ret == Z_BUF_ERROR);
+    } else {
+      return self->on_error(self, "Invalid deflate data: %s",
+          (zs->msg ? zs->msg : "?"));
+    }
+  } while (zs->avail_in || in_left || !zs->avail_out);
+  my->message_length += out->tail - out->begin - out_length;
+  *to_is_end = is_end;
+  return WS_SUCCESS;
+}
+
+// Decompresses the payload of a message's frame onto my->inflated.
+ws_status ws_inflate(ws_t self, const char *data, size_t length,
+    bool is_fin) {
+  bool is_end;
+  if (ws_inflate_buf(self, data, length, &is_end)) {
+    return WS_ERROR;
+  }
+  if (is_fin && !is_end) {
+    // restore the sync flush's empty block
+    return ws_inflate_buf(self, "\x00\x00\xff\xff", 4, &is_end);
+  }
+  return WS_SUCCESS;
+}
+
+void ws_get_deflate_stats(ws_t self, struct ws_deflate_stats *to_stats) {
+  ws_private_t my = self->private_state;
+  *to_stats = my->stats;
+  to_stats->is_enabled = my->is_deflate;
+}
+
+void ws_discard_requests(ws_t self) {
+  ws_private_t my = self->private_state;
+  my->is_discarding = true;
+}
+
 ws_status ws_send_connect(ws_t self,
     const char *resource, const char *protocol,
     const char *host, const char *origin) {
@@ -215,6 +892,11 @@ ws_status ws_send_upgrade(ws_t self) {
         my->sec_key);
   }
 
+  char deflate_params[128];
+  if (ws_negotiate_deflate(self, deflate_params)) {
+    return WS_ERROR;
+  }
+
   size_t needed = (1024 + strlen(my->sec_answer) +
       (my->protocol ? strlen(my->protocol) : 0));
   cb_clear(my->out);
@@ -233,6 +915,11 @@ ws_status ws_send_upgrade(ws_t self) {
   }
   out_tail += sprintf(out_tail, "Sec-WebSocket-Accept: %s\r\n",
       my->sec_answer);
+  if (my->is_deflate) {
+    out_tail += sprintf(out_tail,
+        "Sec-WebSocket-Extensions: permessage-deflate%s\r\n",
+        deflate_params);
+  }
   out_tail += sprintf(out_tail, "\r\n");
 
   size_t out_length = out_tail - my->out->tail;
@@ -272,42 +959,68 @@ ws_status ws_send_frame(ws_t self,
   }
 
   uint8_t opcode2 = opcode;
-  if (!is_control && my->continued_opcode) {
-    if (my->continued_opcode != opcode) {
+  if (!is_control && my->sent_continued_opcode) {
+    if (my->sent_continued_opcode != opcode) {
       return self->on_error(self, "Expecting continue of 0x%x not 0x%x",
-          my->continued_opcode, opcode);
+          my->sent_continued_opcode, opcode);
     }
     opcode2 = OPCODE_CONTINUATION;
   }
 
-  size_t i;
-  bool is_utf8 = (opcode2 == OPCODE_TEXT ? true : false);
+  bool is_utf8 = (opcode == OPCODE_TEXT &&
+      (self->utf8_check & WS_UTF8_CHECK_SEND));
   if (is_utf8) {
-    unsigned int utf8_state = UTF8_VALID;
-    const char *payload_head = payload_data;
-    for (i = 0; i < payload_length; i++) {
-      unsigned char ch = *payload_head++;
-      utf8_state = validate_utf8[utf8_state + ch];
-      if (utf8_state == UTF8_INVALID) {
-        return self->on_error(self,
-            "Invalid %sUTF8 character 0x%x at %zd",
-            (is_masking ? "masked " :""), ch,
-            payload_head-1 - payload_data);
+    unsigned int utf8_state = (opcode2 == OPCODE_CONTINUATION ?
+        my->sent_utf8_state : UTF8_VALID);
+    size_t i = ws_validate_utf8(&utf8_state, payload_data, payload_length);
+    if (i < payload_length) {
+      return self->on_error(self,
+          "Invalid %sUTF8 character 0x%x at %zd",
+          (is_masking ? "masked " :""), (unsigned char)payload_data[i], i);
+    }
+    if (is_fin && utf8_state != UTF8_VALID) {
+      return self->on_error(self, "Incomplete UTF8 character at end");
+    }
+    my->sent_utf8_state = utf8_state;
+  }
+
+  bool is_deflate_flag = false;
+  if (!is_control) {
+    my->stats.sent_raw_length += payload_length;
+    if (my->is_deflate) {
+      // compress the whole message or none of it, based on its first frame
+      if (opcode2 != OPCODE_CONTINUATION) {
+        my->is_deflating = (payload_length >= self->deflate_min_length);
+        is_deflate_flag = my->is_deflating;
+      }
+      if (my->is_deflating) {
+        if (ws_deflate(self, payload_data, payload_length, is_fin)) {
+          return WS_ERROR;
+        }
+        payload_data = my->deflated->head;
+        payload_length = my->deflated->tail - my->deflated->head;
       }
     }
+    my->stats.sent_wire_length += payload_length;
   }
 
   int8_t payload_n = (payload_length < 126 ? 0 :
       payload_length < UINT16_MAX ? 2 : 8);
 
-  size_t needed = (2 + payload_n + (is_masking ? 4 : 0) + payload_length);
+  // if we can send the payload as-is then only buffer the header, unless the
+  // payload is so small that copying it is cheaper than a gathered write
+  bool is_gather = (!is_masking && self->send_datav &&
+      payload_length >= WS_MIN_GATHER_LENGTH);
+  size_t needed = (2 + payload_n + (is_masking ? 4 : 0) +
+      (is_gather ? 0 : payload_length));
   cb_clear(my->out);
   if (cb_ensure_capacity(my->out, needed)) {
     return self->on_error(self, "Out of memory");
   }
   char *out_tail = my->out->tail;
 
-  *out_tail++ = ((is_fin ? 0x80 : 0) | (opcode2 & 0x0F));
+  *out_tail++ = ((is_fin ? 0x80 : 0) |
+      (is_deflate_flag ? WS_DEFLATE_FLAG : 0) | (opcode2 & 0x0F));
 
   *out_tail++ = ((is_masking ? 0x80 : 0) | (!payload_n ? payload_length :
         payload_n == 2 ? 126: 127));
@@ -320,34 +1033,42 @@ ws_status ws_send_frame(ws_t self,
   }
 
   if (is_masking) {
-    char mask[4];
-    ws_random_buf(mask, 4);
-    for (i = 0; i < 4; i++) {
-      *out_tail++ = (is_masking ? mask[i] : 0);
-    }
-    const char *payload_head = payload_data;
-    uint32_t mask_offset = 0;
-    for (i = 0; i < payload_length; i++) {
-      unsigned char ch = *payload_head++;
-      ch = (ch ^ mask[mask_offset++ & 3]);
-      *out_tail++ = ch;
-    }
-  } else {
+    unsigned char mask[4];
+    ws_random_buf((char *)mask, 4);
+    memcpy(out_tail, mask, 4);
+    out_tail += 4;
+    ws_mask(out_tail, payload_data, payload_length, mask);
+    out_tail += payload_length;
+  } else if (!is_gather) {
     memcpy(out_tail, payload_data, payload_length);
     out_tail += payload_length;
   }
 
-  if (!is_fin && !my->continued_opcode) {
-    my->continued_opcode = opcode;
+  if (!is_control) {
+    my->sent_continued_opcode = (is_fin ? 0 : opcode);
   }
 
   size_t out_length = out_tail - my->out->tail;
-  ws_on_debug(self, "ws.sending_frame", my->out->tail, out_length);
-  ws_status ret = self->send_data(self, my->out->tail, out_length);
+  ws_status ret;
+  if (is_gather) {
+    ws_on_debug(self, "ws.sending_frame_header", my->out->tail, out_length);
+    ret = self->send_datav(self, my->out->tail, out_length, payload_data,
+        payload_length);
+  } else {
+    ws_on_debug(self, "ws.sending_frame", my->out->tail, out_length);
+    ret = self->send_data(self, my->out->tail, out_length);
+  }
   if (!ret && opcode == OPCODE_CLOSE) {
     my->sent_close = true;
   }
   my->out->tail = out_tail;
+  if (is_fin) {
+    // the message is sent, so don't pin a big one's buffers
+    cb_clear(my->out);
+    cb_clear(my->deflated);
+    cb_shrink(my->out);
+    cb_shrink(my->deflated);
+  }
   return ret;
 }
 
@@ -374,112 +1095,208 @@ ws_status ws_send_close(ws_t self, ws_close close_code, const char *reason) {
 // RECV
 //
 
-ws_status ws_read_http_request(ws_t self) {
+// Finds the blank line that ends the request head, resuming the scan where
+// the previous recv left off, so a trickled-in head is only scanned once.
+// @result the length of the head, including the blank line, else 0
+size_t ws_find_http_head_end(ws_t self) {
   ws_private_t my = self->private_state;
   const char *in_head = my->in->in_head;
   size_t in_length = my->in->in_tail - in_head;
 
-  char *line_end = strnstr(in_head, "\r\n", in_length);
-  if (!line_end) {
-    return self->on_error(self, "Missing \\r\\n");
+  // back up in case the "\r\n\r\n" is split across recvs
+  size_t i = (my->http_scanned > 3 ? my->http_scanned - 3 : 0);
+  while (i < in_length) {
+    // memchr is vectorized by libc, so this skips a line at a time
+    const char *nl = memchr(in_head + i, '\n', in_length - i);
+    if (!nl) {
+      break;
+    }
+    i = nl + 1 - in_head;
+    if (i >= 4 && !memcmp(nl - 3, "\r\n\r\n", 4)) {
+      my->http_scanned = 0;
+      return i;
+    }
   }
+  my->http_scanned = in_length;
+  return 0;
+}
 
-  char *trio[3];
+// Splits the request head into the request line's method, resource and
+// version, and a table of header views into the input.
+ws_status ws_read_http_request(ws_t self, const char *head, size_t length,
+    const char **to_trio, size_t *trio_lengths,
+    struct ws_http_header *headers, size_t *to_num_headers) {
+  const char *end = head + length - 2;  // the blank line
+  const char *line_end = memchr(head, '\r', end - head);
+
+  const char *s = head;
   size_t i;
   for (i = 0; i < 3; i++) {
-    while (in_head < line_end && *in_head == ' ') {
-      in_head++;
+    while (s < line_end && *s == ' ') {
+      s++;
     }
-    const char *s = in_head;
-    while (in_head < line_end && *in_head != ' ') {
-      in_head++;
+    to_trio[i] = s;
+    while (s < line_end && *s != ' ') {
+      s++;
     }
-    trio[i] = (s < in_head ? strndup(s, in_head - s) : NULL);
+    trio_lengths[i] = s - to_trio[i];
   }
-  my->method = trio[0];
-  my->resource = trio[1];
-  my->http_version = trio[2];
-
-  // Keep the request tail '\r\n', in case our client doesn't send
-  // any headers, so ws_recv_headers can simply check for "\r\n\r\n".
-  my->in->in_head = line_end;
-  if (!my->http_version) {
+  if (!trio_lengths[2]) {
     return self->on_error(self, "Invalid HTTP header");
   }
-  return WS_SUCCESS;
-}
 
-ws_status ws_read_http_header(ws_t self,
-    char **to_key, char **to_val) {
-  ws_private_t my = self->private_state;
-  const char *in_head = my->in->in_head;
-  size_t in_length = my->in->in_tail - in_head;
-
-  *to_key = NULL;
-  *to_val = NULL;
-  char *line_end = strnstr(in_head, "\r\n", in_length);
-  if (!line_end) {
-    return self->on_error(self, "Missing \\r\\n");
-  }
-  if (in_head < line_end) {
-    const char *k_start = in_head;
-    if (*k_start == ' ') {
-      return self->on_error(self, "TODO header continuation");
+  size_t num_headers = 0;
+  for (s = line_end + 2; s < end; s = line_end + 2) {
+    line_end = memchr(s, '\r', end - s);
+    if (!line_end) {
+      line_end = end;
+    }
+    if (*s == ' ' || *s == '\t') {
+      return self->on_error(self, "Unsupported header continuation");
+    }
+    if (num_headers >= WS_MAX_HTTP_HEADERS) {
+      return self->on_error(self, "Over %d headers", WS_MAX_HTTP_HEADERS);
     }
-    const char *k_end = k_start;
-    while (++k_end < line_end && *k_end != ':') {
+    const char *k_end = memchr(s, ':', line_end - s);
+    const char *v_start = (k_end ? k_end + 1 : line_end);
+    if (!k_end) {
+      k_end = line_end;
     }
-    const char *v_start = k_end;
-    while (++v_start < line_end && *v_start == ' ') {
+    while (v_start < line_end && *v_start == ' ') {
+      v_start++;
     }
     const char *v_end = line_end;
     while (v_end > v_start && v_end[-1] == ' ') {
       v_end--;
     }
-    *to_key = strndup(k_start, k_end - k_start);
-    *to_val = strndup(v_start, v_end - v_start);
+    struct ws_http_header *h = headers + num_headers++;
+    h->key = s;
+    h->key_length = k_end - s;
+    h->value = v_start;
+    h->value_length = v_end - v_start;
   }
-  my->in->in_head = line_end + 2;
+  *to_num_headers = num_headers;
   return WS_SUCCESS;
 }
 
-ws_status ws_read_headers(ws_t self) {
+// Copies a field that we keep past the input, e.g. for send_upgrade.  The
+// caller has reserved room for the whole head, so this never moves.
+char *ws_keep_string(ws_t self, const char *s, size_t length) {
+  ws_private_t my = self->private_state;
+  char *ret = my->http_strings->tail;
+  memcpy(ret, s, length);
+  ret[length] = '\0';
+  my->http_strings->tail += length + 1;
+  return ret;
+}
+
+static bool ws_header_is(const struct ws_http_header *h, const char *key) {
+  return (h->key_length == strlen(key) &&
+      !strncasecmp(h->key, key, h->key_length));
+}
+
+static bool ws_value_is(const struct ws_http_header *h, const char *value) {
+  return (h->value_length == strlen(value) &&
+      !strncasecmp(h->value, value, h->value_length));
+}
+
+// @result true if the value contains the token, e.g. "Upgrade" in
+// firefox's "keep-alive, Upgrade"
+static bool ws_value_has(const struct ws_http_header *h, const char *token) {
+  size_t n = strlen(token);
+  const char *s = h->value;
+  const char *end = h->value + h->value_length;
+  for (; s + n <= end; s++) {
+    if (!strncasecmp(s, token, n)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+ws_status ws_read_headers(ws_t self, const struct ws_http_header *headers,
+    size_t num_headers) {
   ws_private_t my = self->private_state;
 
   bool is_connection = false;
   bool is_upgrade = false;
-  while (1) {
-    char *key;
-    char *val;
-    if (ws_read_http_header(self, &key, &val) || !key) {
-      break;
-    }
-    if (!strcasecmp(key, "Connection")) {
-      // firefox uses "keep-alive, Upgrade"
-      is_connection = (strcasestr(val, "Upgrade") ? 1 : 0);
-    } else if (!strcasecmp(key, "Upgrade")) {
-      is_upgrade = !strcasecmp(val, "WebSocket");
-    } else if (!strcasecmp(key, "Sec-WebSocket-Protocol")) {
-      free(my->protocol);
-      my->protocol = strdup(val);
-    } else if (!strcasecmp(key, "Sec-WebSocket-Version")) {
-      my->version = strtol(val, NULL, 0);
-    } else if (!strcasecmp(key, "Sec-WebSocket-Key")) {
-      free(my->sec_key);
-      my->sec_key = strdup(val);
-    } else if (!strcasecmp(key, "Host")) {
-      free(my->req_host);
-      char *p = strrchr(val, ':');
+  // HTTP/1.1 defaults to keep-alive, HTTP/1.0 to close
+  bool is_keep_alive = (strcasecmp(my->http_version, "HTTP/1.0") ?
+      true : false);
+  bool is_chunked = false;
+  size_t extensions_length = 0;
+  size_t i;
+  for (i = 0; i < num_headers; i++) {
+    const struct ws_http_header *h = headers + i;
+    if (ws_header_is(h, "Connection")) {
+      is_connection = ws_value_has(h, "Upgrade");
+      if (ws_value_has(h, "close")) {
+        is_keep_alive = false;
+      } else if (ws_value_has(h, "keep-alive")) {
+        is_keep_alive = true;
+      }
+    } else if (ws_header_is(h, "Upgrade")) {
+      is_upgrade = ws_value_is(h, "WebSocket");
+    } else if (ws_header_is(h, "Sec-WebSocket-Protocol")) {
+      my->protocol = ws_keep_string(self, h->value, h->value_length);
+    } else if (ws_header_is(h, "Sec-WebSocket-Version")) {
+      my->version = 0;
+      const char *s;
+      for (s = h->value; s < h->value + h->value_length &&
+          *s >= '0' && *s <= '9'; s++) {
+        my->version = my->version * 10 + (*s - '0');
+      }
+    } else if (ws_header_is(h, "Sec-WebSocket-Key")) {
+      my->sec_key = ws_keep_string(self, h->value, h->value_length);
+    } else if (ws_header_is(h, "Sec-WebSocket-Extensions")) {
+      extensions_length += h->value_length + 2;
+    } else if (ws_header_is(h, "Host")) {
+      my->req_host = ws_keep_string(self, h->value, h->value_length);
+      char *p = strrchr(my->req_host, ':');
       if (p) {
         *p = 0;
       }
-      my->req_host = strdup(val);
+    } else if (ws_header_is(h, "Content-Length")) {
+      const char *s = h->value;
+      const char *end = h->value + h->value_length;
+      size_t length = 0;
+      for (; s < end && *s >= '0' && *s <= '9'; s++) {
+        if (length > (SIZE_MAX - 9) / 10) {
+          break;
+        }
+        length = length * 10 + (*s - '0');
+      }
+      if (s == h->value || s < end) {
+        return self->on_error(self, "Invalid Content-Length");
+      }
+      my->content_length = length;
+    } else if (ws_header_is(h, "Transfer-Encoding")) {
+      is_chunked = !ws_value_is(h, "identity");
+    }
+  }
+
+  if (extensions_length) {
+    // may be repeated, which is the same as one comma-separated list
+    char *s = my->http_strings->tail;
+    my->extensions = s;
+    for (i = 0; i < num_headers; i++) {
+      const struct ws_http_header *h = headers + i;
+      if (ws_header_is(h, "Sec-WebSocket-Extensions")) {
+        if (s > my->extensions) {
+          memcpy(s, ", ", 2);
+          s += 2;
+        }
+        memcpy(s, h->value, h->value_length);
+        s += h->value_length;
+      }
     }
-    free(key);
-    free(val);
+    *s++ = '\0';
+    my->http_strings->tail = s;
   }
 
   my->is_websocket = (is_connection && is_upgrade && my->sec_key);
+  // we don't parse chunked bodies, so we can't find the next request
+  my->is_keep_alive = (is_keep_alive && !is_chunked);
   return WS_SUCCESS;
 }
 
@@ -500,6 +1317,10 @@ ws_status ws_read_frame_length(ws_t self) {
   uint8_t reserved_flags = (*in_head & 0x70);
   uint8_t opcode = (*in_head & 0x0F);
   bool is_control = (opcode >= OPCODE_CLOSE ? true : false);
+  if (my->is_deflate && (opcode == OPCODE_TEXT || opcode == OPCODE_BINARY)) {
+    // only the first frame of a data message may be compressed
+    reserved_flags &= ~WS_DEFLATE_FLAG;
+  }
 
   // error check
   if (reserved_flags) {
@@ -543,10 +1364,34 @@ ws_status ws_read_frame_length(ws_t self) {
   }
   if (payload_n > 0) {
     uint8_t j;
-    payload_length = 0;
+    unsigned long long length = 0;
     for (j = 0; j < payload_n; j++) {
-      payload_length <<= 8;
-      payload_length |= (unsigned char)*in_head++;
+      length <<= 8;
+      length |= (unsigned char)*in_head++;
+    }
+    if (length >> 63) {
+      return self->on_error(self, "Payload length 0x%llx has its MSB set",
+          length);
+    }
+    if (length > SIZE_MAX - 14) {
+      return ws_on_size_error(self, "Frame", length, SIZE_MAX - 14);
+    }
+    payload_length = length;
+  }
+
+  // check the limits before we buffer (or stream) any of the payload
+  if (!is_control) {
+    if (self->max_frame_length && payload_length > self->max_frame_length) {
+      return ws_on_size_error(self, "Frame", payload_length,
+          self->max_frame_length);
+    }
+    size_t message_length = (opcode == OPCODE_CONTINUATION ?
+        my->message_length : 0);
+    if (self->max_message_length &&
+        payload_length > self->max_message_length - message_length) {
+      return ws_on_size_error(self, "Message",
+          (unsigned long long)message_length + payload_length,
+          self->max_message_length);
     }
   }
   my->frame_length = 2 + payload_n + (is_masking ? 4 : 0) + payload_length;
@@ -556,7 +1401,8 @@ ws_status ws_read_frame_length(ws_t self) {
 }
 
 ws_status ws_read_frame(ws_t self,
-    bool *to_is_fin, uint8_t *to_opcode, bool *to_is_masking) {
+    bool *to_is_fin, uint8_t *to_opcode, bool *to_is_masking,
+    const char **to_payload, size_t *to_payload_length) {
   ws_private_t my = self->private_state;
   const char *in_head = my->in->in_head;
   size_t in_length = my->in->in_tail - in_head;
@@ -572,10 +1418,15 @@ ws_status ws_read_frame(ws_t self,
 
   bool is_fin = ((*in_head & 0x80) ? true : false);
   uint8_t opcode = (*in_head & 0x0F);
-  //bool is_control = (opcode >= OPCODE_CLOSE ? true : false);
+  bool is_control = (opcode >= OPCODE_CLOSE ? true : false);
 
   bool is_continue = (opcode == OPCODE_CONTINUATION ? true : false);
   uint8_t opcode2 = (is_continue ? my->continued_opcode : opcode);
+  if (!is_control && !is_continue) {
+    my->is_inflating = ((*in_head & WS_DEFLATE_FLAG) ? true : false);
+    my->message_length = 0;
+  }
+  bool is_inflate = (!is_control && my->is_inflating);
   in_head++;
 
   bool is_masking = ((*in_head & 0x80) ? true : false);
@@ -601,47 +1452,87 @@ ws_status ws_read_frame(ws_t self,
     }
   }
 
-  if (cb_ensure_capacity(my->data, payload_length)) {
-    return self->on_error(self,
-        "Payload %zd exceeds buffer capacity", payload_length);
-  }
-  char *data_tail = my->data->tail;
-
   // no extension, so no extension data
 
-  if (is_masking) {
-    uint32_t mask_offset = 0;
-    for (i = 0; i < payload_length; i++) {
-      unsigned char ch = *in_head++;
-      ch = (ch ^ mask[mask_offset++ & 3]);
-      *data_tail++ = ch;
-    }
+  // An unfragmented message or control frame is passed to "on_frame"
+  // straight from the input, so only fragments are copied into my->data.
+  // Compressed frames are inflated into my->inflated instead.
+  bool is_whole = (is_fin && !is_continue);
+  bool is_direct = (is_whole || is_inflate);
+  char *payload;
+  if (is_direct && !is_masking) {
+    payload = (char *)in_head;
+  } else if (is_direct && !cb_is_input_shared(my->in)) {
+    // the input is in our own buffer, so unmask it in place
+    payload = my->in->head + (in_head - my->in->head);
+    ws_mask(payload, payload, payload_length, mask);
   } else {
-    memcpy(data_tail, in_head, payload_length);
-    data_tail += payload_length;
+    // unmask into my->data, past any fragments that we've already read.
+    // A direct frame only borrows this space, so the data's tail stays put.
+    if (cb_ensure_capacity(my->data, payload_length)) {
+      return self->on_error(self,
+          "Payload %zd exceeds buffer capacity", payload_length);
+    }
+    payload = my->data->tail;
+    if (is_masking) {
+      ws_mask(payload, in_head, payload_length, mask);
+    } else {
+      memcpy(payload, in_head, payload_length);
+    }
   }
+  in_head += payload_length;
   my->in->in_head = in_head;
 
-  bool is_utf8 = (opcode2 == OPCODE_TEXT ? true : false);
+  // the newly received part of the message
+  const char *text = payload;
+  size_t text_length = payload_length;
+  if (is_inflate) {
+    size_t inflated_length = my->inflated->tail - my->inflated->begin;
+    if (ws_inflate(self, payload, payload_length, is_fin)) {
+      return WS_ERROR;
+    }
+    text = my->inflated->begin + inflated_length;
+    text_length = my->inflated->tail - text;
+  } else if (!is_control) {
+    my->message_length += payload_length;
+  }
+  if (!is_control) {
+    my->stats.recv_wire_length += payload_length;
+    my->stats.recv_raw_length += text_length;
+  }
+
+  bool is_utf8 = (opcode2 == OPCODE_TEXT &&
+      (self->utf8_check & WS_UTF8_CHECK_RECV));
   if (is_utf8) {
-    unsigned int utf8_state = UTF8_VALID;
-    char *dt = my->data->tail;
-    for (i = 0; i < payload_length; i++) {
-      unsigned char ch = *dt++;
-      utf8_state = validate_utf8[utf8_state + ch];
-      if (utf8_state == UTF8_INVALID) {
-        return self->on_error(self,
-            "Invalid %sUTF8 character 0x%x at %zd",
-            (is_masking ? "masked " :""), ch,
-            dt-1 - my->data->tail);
-      }
+    // a code point may be split across continuation frames
+    if (!is_continue) {
+      my->utf8_state = UTF8_VALID;
+    }
+    i = ws_validate_utf8(&my->utf8_state, text, text_length);
+    if (i < text_length) {
+      return self->on_error(self,
+          "Invalid %sUTF8 character 0x%x at %zd",
+          (is_masking ? "masked " :""), (unsigned char)text[i], i);
+    }
+    if (is_fin && my->utf8_state != UTF8_VALID) {
+      return self->on_error(self, "Incomplete UTF8 character at end");
     }
   }
 
   *to_is_fin = is_fin;
   *to_opcode = opcode2;
   *to_is_masking = is_masking;
-  my->data->tail = data_tail;
+  if (is_inflate) {
+    *to_payload = my->inflated->begin;
+    *to_payload_length = my->inflated->tail - my->inflated->begin;
+  } else if (is_whole) {
+    *to_payload = payload;
+    *to_payload_length = payload_length;
+  } else {
+    my->data->tail = payload + payload_length;
+    *to_payload = my->data->begin;
+    *to_payload_length = my->data->tail - my->data->begin;
+  }
   return WS_SUCCESS;
 }
 
@@ -649,43 +1540,70 @@ ws_status ws_read_frame(ws_t self,
 ws_state ws_recv_request(ws_t self) {
   ws_private_t my = self->private_state;
   const char *in_head = my->in->in_head;
-  size_t in_length = my->in->in_tail - in_head;
 
-  if (!strnstr(in_head, "\r\n", in_length)) {
-    // still waiting for header
+  size_t head_length = ws_find_http_head_end(self);
+  // a whole head can arrive in one recv, so check it too
+  if ((head_length ? head_length : my->http_scanned) >
+      WS_MAX_HTTP_HEAD_LENGTH) {
+    self->on_error(self, "HTTP request head exceeds %d bytes",
+        WS_MAX_HTTP_HEAD_LENGTH);
+    return STATE_ERROR;
+  }
+  if (!head_length) {
+    // still waiting for the rest of the head
     return -1;
   }
 
-  if (ws_read_http_request(self)) {
+  const char *trio[3];
+  size_t trio_lengths[3];
+  struct ws_http_header headers[WS_MAX_HTTP_HEADERS];
+  size_t num_headers;
+  if (ws_read_http_request(self, in_head, head_length, trio, trio_lengths,
+        headers, &num_headers)) {
     return STATE_ERROR;
   }
 
-  return STATE_READ_HTTP_HEADERS;
-}
-
-ws_state ws_recv_headers(ws_t self) {
-  ws_private_t my = self->private_state;
-  const char *in_head = my->in->in_head;
-  size_t in_length = my->in->in_tail - in_head;
-
-  if (!strnstr(in_head, "\r\n\r\n", in_length)) {
-    return -1;
+  // clear the previous keep-alive request's fields, then make room to keep
+  // this request's fields, which are at most the size of its head
+  cb_t strings = my->http_strings;
+  cb_clear(strings);
+  if (cb_ensure_capacity(strings, head_length + 2 * WS_MAX_HTTP_HEADERS)) {
+    self->on_error(self, "Out of memory");
+    return STATE_ERROR;
   }
-  my->in->in_head += 2; // skip the request tail
-
-  if (ws_read_headers(self)) {
+  my->method = ws_keep_string(self, trio[0], trio_lengths[0]);
+  my->resource = ws_keep_string(self, trio[1], trio_lengths[1]);
+  my->http_version = ws_keep_string(self, trio[2], trio_lengths[2]);
+  my->protocol = NULL;
+  my->sec_key = NULL;
+  my->req_host = NULL;
+  my->extensions = NULL;
+  my->version = 0;
+  my->content_length = 0;
+  if (ws_read_headers(self, headers, num_headers)) {
     return STATE_ERROR;
   }
+  my->in->in_head += head_length;
 
-  bool keep_alive = false;
+  my->num_http_requests++;
+  bool keep_alive = (my->is_keep_alive && (!self->max_http_requests ||
+        my->num_http_requests < self->max_http_requests));
+  const char *headers_begin = (num_headers ? headers[0].key : in_head);
   if (self->on_http_request(self, my->method, my->resource,
-        my->http_version, my->req_host, in_head, my->in->head - in_head,
+        my->http_version, my->req_host, headers_begin,
+        in_head + head_length - 2 - headers_begin,
         my->is_websocket, &keep_alive)) {
     return STATE_ERROR;
   }
+  if (my->is_discarding) {
+    return STATE_KEEP_ALIVE;
+  }
   if (!my->is_websocket) {
-    // keep-alive assumes no content-length!
-    return (keep_alive ? STATE_READ_HTTP_REQUEST : STATE_CLOSED);
+    if (!keep_alive) {
+      return STATE_CLOSED;
+    }
+    return (my->content_length ? STATE_READ_HTTP_BODY :
+        STATE_READ_HTTP_REQUEST);
   }
 
   if (self->on_upgrade(self,
@@ -697,6 +1615,147 @@ ws_state ws_recv_headers(ws_t self) {
   return STATE_READ_FRAME_LENGTH;
 }
 
+ws_state ws_recv_body(ws_t self) {
+  ws_private_t my = self->private_state;
+  size_t in_length = my->in->in_tail - my->in->in_head;
+
+  // none of our requests have a body, so skip it
+  size_t length = (in_length < my->content_length ? in_length :
+      my->content_length);
+  my->in->in_head += length;
+  my->content_length -= length;
+  return (my->content_length ? -1 : STATE_READ_HTTP_REQUEST);
+}
+
+ws_state ws_recv_frame_chunk(ws_t self) {
+  ws_private_t my = self->private_state;
+  const char *in_head = my->in->in_head;
+  size_t in_length = my->in->in_tail - in_head;
+
+  size_t length = (in_length < my->chunk_remaining ? in_length :
+      my->chunk_remaining);
+  bool is_end = (length == my->chunk_remaining);
+  if (!length && !is_end) {
+    return -1;
+  }
+  ws_on_debug(self, "ws.recv_frame_chunk", in_head, length);
+
+  char *payload;
+  if (!my->chunk_is_masking) {
+    payload = (char *)in_head;
+  } else {
+    // the mask continues from where the previous chunk left off
+    unsigned char mask[4];
+    size_t i;
+    for (i = 0; i < 4; i++) {
+      mask[i] = my->chunk_mask[(my->chunk_offset + i) & 3];
+    }
+    if (!cb_is_input_shared(my->in)) {
+      payload = my->in->head + (in_head - my->in->head);
+      ws_mask(payload, payload, length, mask);
+    } else {
+      // my->data is unused while we stream, so borrow it
+      if (cb_ensure_capacity(my->data, length)) {
+        return self->on_error(self, "Out of memory");
+      }
+      payload = my->data->tail;
+      ws_mask(payload, in_head, length, mask);
+    }
+  }
+  my->in->in_head = in_head + length;
+  my->chunk_offset += length;
+  my->chunk_remaining -= length;
+
+  bool is_fin = (is_end && my->chunk_is_fin);
+  const char *text = payload;
+  size_t text_length = length;
+  if (my->is_inflating) {
+    cb_clear(my->inflated);
+    if (ws_inflate(self, payload, length, is_fin)) {
+      return STATE_ERROR;
+    }
+    text = my->inflated->begin;
+    text_length = my->inflated->tail - text;
+  } else {
+    my->message_length += length;
+  }
+  my->stats.recv_wire_length += length;
+  my->stats.recv_raw_length += text_length;
+
+  uint8_t opcode = my->chunk_opcode;
+  if (opcode == OPCODE_TEXT && (self->utf8_check & WS_UTF8_CHECK_RECV)) {
+    size_t i = ws_validate_utf8(&my->utf8_state, text, text_length);
+    if (i < text_length) {
+      self->on_error(self, "Invalid UTF8 character 0x%x at %zd",
+          (unsigned char)text[i], my->message_length - text_length + i);
+      return STATE_ERROR;
+    }
+    if (is_fin && my->utf8_state != UTF8_VALID) {
+      self->on_error(self, "Incomplete UTF8 character at end");
+      return STATE_ERROR;
+    }
+  }
+
+  // skip empty chunks, e.g. if the inflater buffered the input, but not
+  // empty frames
+  if ((text_length || is_end) && self->on_frame_chunk(self, is_fin,
+        opcode, my->chunk_is_masking, text, text_length)) {
+    return STATE_ERROR;
+  }
+  if (!is_end) {
+    return -1;
+  }
+  my->continued_opcode = (my->chunk_is_fin ? 0 : opcode);
+  if (is_fin) {
+    cb_clear(my->inflated);
+  }
+  return STATE_READ_FRAME_LENGTH;
+}
+
+// Reads the header of a data frame, which we then pass to on_frame_chunk
+// as it arrives, instead of waiting for the whole frame.
+ws_state ws_recv_frame_header(ws_t self) {
+  ws_private_t my = self->private_state;
+  const char *in_head = my->in->in_head;
+  size_t in_length = my->in->in_tail - in_head;
+
+  // the above "ws_read_frame_length" checks the opcode, length, etc
+  bool is_masking = ((in_head[1] & 0x80) ? true : false);
+  size_t payload_n = (in_head[1] & 0x7f);
+  payload_n = (payload_n < 126 ? 0 : payload_n < 127 ? 2 : 8);
+  size_t header_length = 2 + payload_n + (is_masking ? 4 : 0);
+  if (in_length < header_length) {
+    return -1;
+  }
+
+  bool is_fin = ((*in_head & 0x80) ? true : false);
+  uint8_t opcode = (*in_head & 0x0F);
+  if (opcode != OPCODE_CONTINUATION) {
+    my->is_inflating = ((*in_head & WS_DEFLATE_FLAG) ? true : false);
+    my->message_length = 0;
+    my->utf8_state = UTF8_VALID;
+  }
+  my->chunk_is_fin = is_fin;
+  my->chunk_opcode = (opcode ? opcode : my->continued_opcode);
+  my->chunk_is_masking = false;
+  if (is_masking) {
+    size_t i;
+    for (i = 0; i < 4; i++) {
+      my->chunk_mask[i] = in_head[header_length - 4 + i];
+      if (my->chunk_mask[i]) {
+        my->chunk_is_masking = true;
+      }
+    }
+  }
+  my->chunk_offset = 0;
+  my->chunk_remaining = my->frame_length - header_length;
+  my->in->in_head += header_length;
+
+  // pass an empty frame now, since no more input may arrive for it
+  return (my->chunk_remaining ? STATE_READ_FRAME_CHUNK :
+      ws_recv_frame_chunk(self));
+}
+
 ws_state ws_recv_frame_length(ws_t self) {
   ws_private_t my = self->private_state;
 
@@ -706,6 +1765,10 @@ ws_state ws_recv_frame_length(ws_t self) {
   if (my->needed_length || !my->frame_length) {
     return -1;
   }
+  uint8_t opcode = (*my->in->in_head & 0x0F);
+  if (self->on_frame_chunk && opcode < OPCODE_CLOSE) {
+    return ws_recv_frame_header(self);
+  }
   return STATE_READ_FRAME;
 }
 
@@ -720,24 +1783,30 @@ ws_state ws_recv_frame(ws_t self) {
   bool is_fin;
   uint8_t opcode;
   bool is_masking;
-  if (ws_read_frame(self, &is_fin, &opcode, &is_masking)) {
+  const char *payload;
+  size_t payload_length;
+  if (ws_read_frame(self, &is_fin, &opcode, &is_masking,
+        &payload, &payload_length)) {
     return STATE_ERROR;
   }
 
   bool should_keep = 1;
   if (self->on_frame(self, is_fin, opcode, is_masking,
-        my->data->begin, my->data->tail - my->data->begin,
-        &should_keep)) {
+        payload, payload_length, &should_keep)) {
     return STATE_ERROR;
   }
-  if (is_fin || !should_keep) {
-    cb_clear(my->data);
-  }
 
-  if (is_fin) {
-    my->continued_opcode = 0;
-  } else if (opcode != OPCODE_CONTINUATION) {
-    my->continued_opcode = opcode;
+  // a control frame may be interleaved with a fragmented message, so it
+  // must not touch the fragments or the continued opcode
+  bool is_control = (opcode >= OPCODE_CLOSE ? true : false);
+  if (!is_control) {
+    if (is_fin || !should_keep) {
+      cb_clear(my->data);
+      cb_clear(my->inflated);
+      cb_shrink(my->data);
+      cb_shrink(my->inflated);
+    }
+    my->continued_opcode = (is_fin ? 0 : opcode);
   }
 
   if (opcode == OPCODE_CLOSE) {
@@ -755,12 +1824,12 @@ ws_status ws_recv_loop(ws_t self) {
         new_state = ws_recv_request(self);
         break;
 
-      case STATE_READ_HTTP_HEADERS:
-        new_state = ws_recv_headers(self);
+      case STATE_READ_HTTP_BODY:
+        new_state = ws_recv_body(self);
         break;
 
       case STATE_KEEP_ALIVE:
-        // discard non-ws content
+        // discard the input, e.g. pipelined requests, see discard_requests
         my->in->in_tail = my->in->in_head;
         new_state = -1;
         break;
@@ -773,6 +1842,10 @@ ws_status ws_recv_loop(ws_t self) {
         new_state = ws_recv_frame(self);
         break;
 
+      case STATE_READ_FRAME_CHUNK:
+        new_state = ws_recv_frame_chunk(self);
+        break;
+
       case STATE_CLOSED:
       case STATE_ERROR:
       default:
@@ -806,6 +1879,17 @@ ws_status ws_on_recv(ws_t self, const char *buf, ssize_t length) {
   if (cb_end_input(my->in)) {
     return self->on_error(self, "end_input buffer error");
   }
+  cb_shrink(my->in);
+  if (!ret && my->state == STATE_READ_FRAME) {
+    // we've read the header of a partial frame, so make room for the rest
+    // now, instead of growing 1.5x per recv as it trickles in
+    size_t used = my->in->tail - my->in->head;
+    if (my->frame_length > used &&
+        cb_ensure_capacity(my->in, my->frame_length - used)) {
+      return self->on_error(self,
+          "Frame %zd exceeds buffer capacity", my->frame_length);
+    }
+  }
   return ret;
 }
 
@@ -818,9 +1902,12 @@ ws_private_t ws_private_new() {
   ws_private_t my = (ws_private_t)malloc(sizeof(struct ws_private));
   if (my) {
     memset(my, 0, sizeof(struct ws_private));
-    my->in = cb_new();
+    my->in = cb_new_ring();
     my->out = cb_new();
     my->data = cb_new();
+    my->http_strings = cb_new();
+    my->deflated = cb_new();
+    my->inflated = cb_new();
     my->state = STATE_READ_HTTP_REQUEST;
   }
   return my;
@@ -830,13 +1917,14 @@ void ws_private_free(ws_private_t my) {
     cb_free(my->in);
     cb_free(my->out);
     cb_free(my->data);
-    free(my->method);
-    free(my->resource);
-    free(my->http_version);
-    free(my->protocol);
-    free(my->sec_key);
+    cb_free(my->deflated);
+    cb_free(my->inflated);
+    if (my->is_deflate) {
+      deflateEnd(&my->deflater);
+      inflateEnd(&my->inflater);
+    }
+    cb_free(my->http_strings);
     free(my->sec_answer);
-    free(my->req_host);
     memset(my, 0, sizeof(struct ws_private));
     free(my);
   }
@@ -857,8 +1945,11 @@ ws_t ws_new() {
   self->send_upgrade = ws_send_upgrade;
   self->send_frame = ws_send_frame;
   self->send_close = ws_send_close;
+  self->get_deflate_stats = ws_get_deflate_stats;
+  self->discard_requests = ws_discard_requests;
   self->on_recv = ws_on_recv;
   self->on_error = ws_on_error;
+  self->utf8_check = WS_UTF8_CHECK_RECV | WS_UTF8_CHECK_SEND;
   self->private_state = my;
   return self;
 }